@@ -18,9 +18,21 @@ PB_BIND(VentParams, VentParams, AUTO)
 PB_BIND(SensorReadings, SensorReadings, AUTO)
 
 
+PB_BIND(StageTiming, StageTiming, AUTO)
+
+
+PB_BIND(LoopTiming, LoopTiming, AUTO)
+
+
 PB_BIND(Alarm, Alarm, AUTO)
 
 
+PB_BIND(ScopeChunk, ScopeChunk, AUTO)
+
+
+PB_BIND(PressureLoopTuning, PressureLoopTuning, AUTO)
+
+
 
 
 
@@ -26,12 +26,44 @@ typedef enum _AlarmKind {
     AlarmKind_TIDAL_VOLUME_TOO_HIGH = 4
 } AlarmKind;
 
+typedef enum _ScopeTrigger {
+    ScopeTrigger_SCOPE_NONE = 0,
+    ScopeTrigger_SCOPE_REQUEST = 1,
+    ScopeTrigger_SCOPE_ALARM = 2,
+    ScopeTrigger_SCOPE_THRESHOLD = 3
+} ScopeTrigger;
+
+typedef enum _AutotuneState {
+    AutotuneState_AUTOTUNE_IDLE = 0,
+    AutotuneState_AUTOTUNE_RUNNING = 1,
+    AutotuneState_AUTOTUNE_DONE = 2,
+    AutotuneState_AUTOTUNE_FAILED = 3
+} AutotuneState;
+
 /* Struct definitions */
 typedef struct _Alarm {
     uint64_t start_time;
     AlarmKind kind;
 } Alarm;
 
+typedef struct _PressureLoopTuning {
+    AutotuneState autotune_state;
+    float ultimate_gain;
+    float ultimate_period_s;
+} PressureLoopTuning;
+
+typedef PB_BYTES_ARRAY_T(60) ScopeChunk_data_t;
+typedef struct _ScopeChunk {
+    uint32_t capture_id;
+    ScopeTrigger trigger;
+    uint32_t total_scans;
+    uint32_t trigger_scan;
+    uint32_t first_scan;
+    float scan_period_us;
+    float volts_per_count;
+    ScopeChunk_data_t data;
+} ScopeChunk;
+
 typedef struct _SensorReadings {
     float patient_pressure_cm_h2o;
     float volume_ml;
@@ -40,6 +72,11 @@ typedef struct _SensorReadings {
     float outflow_pressure_diff_cm_h2o;
 } SensorReadings;
 
+typedef struct _StageTiming {
+    float mean_us;
+    float max_us;
+} StageTiming;
+
 typedef struct _VentParams {
     VentMode mode;
     uint32_t peep_cm_h2o;
@@ -55,6 +92,17 @@ typedef struct _VentParams {
     uint32_t alarm_hi_breaths_per_min;
 } VentParams;
 
+typedef struct _LoopTiming {
+    StageTiming sensors;
+    StageTiming controller;
+    StageTiming actuators;
+    StageTiming watchdog;
+    StageTiming fast_group;
+    StageTiming pressure_group;
+    StageTiming alarms_group;
+    StageTiming snapshot;
+} LoopTiming;
+
 typedef struct _ControllerStatus {
     uint64_t uptime_ms;
     VentParams active_params;
@@ -63,6 +111,11 @@ typedef struct _ControllerStatus {
     Alarm controller_alarms[4];
     float fan_setpoint_cm_h2o;
     float fan_power;
+    LoopTiming loop_timing;
+    float cpu_load_percent;
+    float idle_percent;
+    ScopeChunk scope;
+    PressureLoopTuning pressure_tuning;
 } ControllerStatus;
 
 typedef struct _GuiStatus {
@@ -70,6 +123,9 @@ typedef struct _GuiStatus {
     VentParams desired_params;
     pb_size_t acked_alarms_count;
     Alarm acked_alarms[4];
+    uint32_t scope_request_id;
+    float scope_trigger_cm_h2o;
+    uint32_t autotune_request_id;
 } GuiStatus;
 
 
@@ -82,27 +138,56 @@ typedef struct _GuiStatus {
 #define _AlarmKind_MAX AlarmKind_TIDAL_VOLUME_TOO_HIGH
 #define _AlarmKind_ARRAYSIZE ((AlarmKind)(AlarmKind_TIDAL_VOLUME_TOO_HIGH+1))
 
+#define _ScopeTrigger_MIN ScopeTrigger_SCOPE_NONE
+#define _ScopeTrigger_MAX ScopeTrigger_SCOPE_THRESHOLD
+#define _ScopeTrigger_ARRAYSIZE ((ScopeTrigger)(ScopeTrigger_SCOPE_THRESHOLD+1))
+
+#define _AutotuneState_MIN AutotuneState_AUTOTUNE_IDLE
+#define _AutotuneState_MAX AutotuneState_AUTOTUNE_FAILED
+#define _AutotuneState_ARRAYSIZE ((AutotuneState)(AutotuneState_AUTOTUNE_FAILED+1))
+
 
 /* Initializer values for message structs */
-#define GuiStatus_init_default                   {0, VentParams_init_default, 0, {Alarm_init_default, Alarm_init_default, Alarm_init_default, Alarm_init_default}}
-#define ControllerStatus_init_default            {0, VentParams_init_default, SensorReadings_init_default, 0, {Alarm_init_default, Alarm_init_default, Alarm_init_default, Alarm_init_default}, 0, 0}
+#define GuiStatus_init_default                   {0, VentParams_init_default, 0, {Alarm_init_default, Alarm_init_default, Alarm_init_default, Alarm_init_default}, 0, 0, 0}
+#define ControllerStatus_init_default            {0, VentParams_init_default, SensorReadings_init_default, 0, {Alarm_init_default, Alarm_init_default, Alarm_init_default, Alarm_init_default}, 0, 0, LoopTiming_init_default, 0, 0, ScopeChunk_init_default, PressureLoopTuning_init_default}
 #define VentParams_init_default                  {_VentMode_MIN, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
 #define SensorReadings_init_default              {0, 0, 0, 0, 0}
+#define StageTiming_init_default                 {0, 0}
+#define LoopTiming_init_default                  {StageTiming_init_default, StageTiming_init_default, StageTiming_init_default, StageTiming_init_default, StageTiming_init_default, StageTiming_init_default, StageTiming_init_default, StageTiming_init_default}
 #define Alarm_init_default                       {0, _AlarmKind_MIN}
-#define GuiStatus_init_zero                      {0, VentParams_init_zero, 0, {Alarm_init_zero, Alarm_init_zero, Alarm_init_zero, Alarm_init_zero}}
-#define ControllerStatus_init_zero               {0, VentParams_init_zero, SensorReadings_init_zero, 0, {Alarm_init_zero, Alarm_init_zero, Alarm_init_zero, Alarm_init_zero}, 0, 0}
+#define ScopeChunk_init_default                  {0, _ScopeTrigger_MIN, 0, 0, 0, 0, 0, {0, {0}}}
+#define PressureLoopTuning_init_default          {_AutotuneState_MIN, 0, 0}
+#define GuiStatus_init_zero                      {0, VentParams_init_zero, 0, {Alarm_init_zero, Alarm_init_zero, Alarm_init_zero, Alarm_init_zero}, 0, 0, 0}
+#define ControllerStatus_init_zero               {0, VentParams_init_zero, SensorReadings_init_zero, 0, {Alarm_init_zero, Alarm_init_zero, Alarm_init_zero, Alarm_init_zero}, 0, 0, LoopTiming_init_zero, 0, 0, ScopeChunk_init_zero, PressureLoopTuning_init_zero}
 #define VentParams_init_zero                     {_VentMode_MIN, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
 #define SensorReadings_init_zero                 {0, 0, 0, 0, 0}
+#define StageTiming_init_zero                    {0, 0}
+#define LoopTiming_init_zero                     {StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero, StageTiming_init_zero}
 #define Alarm_init_zero                          {0, _AlarmKind_MIN}
+#define ScopeChunk_init_zero                     {0, _ScopeTrigger_MIN, 0, 0, 0, 0, 0, {0, {0}}}
+#define PressureLoopTuning_init_zero             {_AutotuneState_MIN, 0, 0}
 
 /* Field tags (for use in manual encoding/decoding) */
 #define Alarm_start_time_tag                     1
 #define Alarm_kind_tag                           2
+#define ScopeChunk_capture_id_tag                1
+#define ScopeChunk_trigger_tag                   2
+#define ScopeChunk_total_scans_tag               3
+#define ScopeChunk_trigger_scan_tag              4
+#define ScopeChunk_first_scan_tag                5
+#define ScopeChunk_scan_period_us_tag            6
+#define ScopeChunk_volts_per_count_tag           7
+#define ScopeChunk_data_tag                      8
+#define PressureLoopTuning_autotune_state_tag    1
+#define PressureLoopTuning_ultimate_gain_tag     2
+#define PressureLoopTuning_ultimate_period_s_tag 3
 #define SensorReadings_patient_pressure_cm_h2o_tag 1
 #define SensorReadings_inflow_pressure_diff_cm_h2o_tag 4
 #define SensorReadings_outflow_pressure_diff_cm_h2o_tag 5
 #define SensorReadings_volume_ml_tag             2
 #define SensorReadings_flow_ml_per_min_tag       3
+#define StageTiming_mean_us_tag                  1
+#define StageTiming_max_us_tag                   2
 #define VentParams_mode_tag                      1
 #define VentParams_peep_cm_h2o_tag               3
 #define VentParams_breaths_per_min_tag           4
@@ -115,21 +200,40 @@ typedef struct _GuiStatus {
 #define VentParams_alarm_hi_tidal_volume_ml_tag  11
 #define VentParams_alarm_lo_breaths_per_min_tag  12
 #define VentParams_alarm_hi_breaths_per_min_tag  13
+#define LoopTiming_sensors_tag                   1
+#define LoopTiming_controller_tag                2
+#define LoopTiming_actuators_tag                 3
+#define LoopTiming_watchdog_tag                  4
+#define LoopTiming_fast_group_tag                5
+#define LoopTiming_pressure_group_tag            6
+#define LoopTiming_alarms_group_tag              7
+#define LoopTiming_snapshot_tag                  8
 #define ControllerStatus_uptime_ms_tag           1
 #define ControllerStatus_active_params_tag       2
 #define ControllerStatus_sensor_readings_tag     3
 #define ControllerStatus_controller_alarms_tag   4
 #define ControllerStatus_fan_setpoint_cm_h2o_tag 5
 #define ControllerStatus_fan_power_tag           6
+#define ControllerStatus_loop_timing_tag         7
+#define ControllerStatus_cpu_load_percent_tag    8
+#define ControllerStatus_idle_percent_tag        9
+#define ControllerStatus_scope_tag               10
+#define ControllerStatus_pressure_tuning_tag     11
 #define GuiStatus_uptime_ms_tag                  1
 #define GuiStatus_desired_params_tag             2
 #define GuiStatus_acked_alarms_tag               3
+#define GuiStatus_scope_request_id_tag           4
+#define GuiStatus_scope_trigger_cm_h2o_tag       5
+#define GuiStatus_autotune_request_id_tag        6
 
 /* Struct field encoding specification for nanopb */
 #define GuiStatus_FIELDLIST(X, a) \
 X(a, STATIC,   REQUIRED, UINT64,   uptime_ms,         1) \
 X(a, STATIC,   REQUIRED, MESSAGE,  desired_params,    2) \
-X(a, STATIC,   REPEATED, MESSAGE,  acked_alarms,      3)
+X(a, STATIC,   REPEATED, MESSAGE,  acked_alarms,      3) \
+X(a, STATIC,   REQUIRED, UINT32,   scope_request_id,   4) \
+X(a, STATIC,   REQUIRED, FLOAT,    scope_trigger_cm_h2o,   5) \
+X(a, STATIC,   REQUIRED, UINT32,   autotune_request_id,   6)
 #define GuiStatus_CALLBACK NULL
 #define GuiStatus_DEFAULT NULL
 #define GuiStatus_desired_params_MSGTYPE VentParams
@@ -141,12 +245,20 @@ X(a, STATIC,   REQUIRED, MESSAGE,  active_params,     2) \
 X(a, STATIC,   REQUIRED, MESSAGE,  sensor_readings,   3) \
 X(a, STATIC,   REPEATED, MESSAGE,  controller_alarms,   4) \
 X(a, STATIC,   REQUIRED, FLOAT,    fan_setpoint_cm_h2o,   5) \
-X(a, STATIC,   REQUIRED, FLOAT,    fan_power,         6)
+X(a, STATIC,   REQUIRED, FLOAT,    fan_power,         6) \
+X(a, STATIC,   REQUIRED, MESSAGE,  loop_timing,       7) \
+X(a, STATIC,   REQUIRED, FLOAT,    cpu_load_percent,   8) \
+X(a, STATIC,   REQUIRED, FLOAT,    idle_percent,      9) \
+X(a, STATIC,   REQUIRED, MESSAGE,  scope,            10) \
+X(a, STATIC,   REQUIRED, MESSAGE,  pressure_tuning,  11)
 #define ControllerStatus_CALLBACK NULL
 #define ControllerStatus_DEFAULT NULL
 #define ControllerStatus_active_params_MSGTYPE VentParams
 #define ControllerStatus_sensor_readings_MSGTYPE SensorReadings
 #define ControllerStatus_controller_alarms_MSGTYPE Alarm
+#define ControllerStatus_loop_timing_MSGTYPE LoopTiming
+#define ControllerStatus_scope_MSGTYPE ScopeChunk
+#define ControllerStatus_pressure_tuning_MSGTYPE PressureLoopTuning
 
 #define VentParams_FIELDLIST(X, a) \
 X(a, STATIC,   REQUIRED, UENUM,    mode,              1) \
@@ -173,31 +285,88 @@ X(a, STATIC,   REQUIRED, FLOAT,    outflow_pressure_diff_cm_h2o,   5)
 #define SensorReadings_CALLBACK NULL
 #define SensorReadings_DEFAULT NULL
 
+#define StageTiming_FIELDLIST(X, a) \
+X(a, STATIC,   REQUIRED, FLOAT,    mean_us,           1) \
+X(a, STATIC,   REQUIRED, FLOAT,    max_us,            2)
+#define StageTiming_CALLBACK NULL
+#define StageTiming_DEFAULT NULL
+
+#define LoopTiming_FIELDLIST(X, a) \
+X(a, STATIC,   REQUIRED, MESSAGE,  sensors,           1) \
+X(a, STATIC,   REQUIRED, MESSAGE,  controller,        2) \
+X(a, STATIC,   REQUIRED, MESSAGE,  actuators,         3) \
+X(a, STATIC,   REQUIRED, MESSAGE,  watchdog,          4) \
+X(a, STATIC,   REQUIRED, MESSAGE,  fast_group,        5) \
+X(a, STATIC,   REQUIRED, MESSAGE,  pressure_group,    6) \
+X(a, STATIC,   REQUIRED, MESSAGE,  alarms_group,      7) \
+X(a, STATIC,   REQUIRED, MESSAGE,  snapshot,          8)
+#define LoopTiming_CALLBACK NULL
+#define LoopTiming_DEFAULT NULL
+#define LoopTiming_sensors_MSGTYPE StageTiming
+#define LoopTiming_controller_MSGTYPE StageTiming
+#define LoopTiming_actuators_MSGTYPE StageTiming
+#define LoopTiming_watchdog_MSGTYPE StageTiming
+#define LoopTiming_fast_group_MSGTYPE StageTiming
+#define LoopTiming_pressure_group_MSGTYPE StageTiming
+#define LoopTiming_alarms_group_MSGTYPE StageTiming
+#define LoopTiming_snapshot_MSGTYPE StageTiming
+
 #define Alarm_FIELDLIST(X, a) \
 X(a, STATIC,   REQUIRED, UINT64,   start_time,        1) \
 X(a, STATIC,   REQUIRED, UENUM,    kind,              2)
 #define Alarm_CALLBACK NULL
 #define Alarm_DEFAULT NULL
 
+#define ScopeChunk_FIELDLIST(X, a) \
+X(a, STATIC,   REQUIRED, UINT32,   capture_id,        1) \
+X(a, STATIC,   REQUIRED, UENUM,    trigger,           2) \
+X(a, STATIC,   REQUIRED, UINT32,   total_scans,       3) \
+X(a, STATIC,   REQUIRED, UINT32,   trigger_scan,      4) \
+X(a, STATIC,   REQUIRED, UINT32,   first_scan,        5) \
+X(a, STATIC,   REQUIRED, FLOAT,    scan_period_us,    6) \
+X(a, STATIC,   REQUIRED, FLOAT,    volts_per_count,   7) \
+X(a, STATIC,   REQUIRED, BYTES,    data,              8)
+#define ScopeChunk_CALLBACK NULL
+#define ScopeChunk_DEFAULT NULL
+
+#define PressureLoopTuning_FIELDLIST(X, a) \
+X(a, STATIC,   REQUIRED, UENUM,    autotune_state,    1) \
+X(a, STATIC,   REQUIRED, FLOAT,    ultimate_gain,     2) \
+X(a, STATIC,   REQUIRED, FLOAT,    ultimate_period_s,   3)
+#define PressureLoopTuning_CALLBACK NULL
+#define PressureLoopTuning_DEFAULT NULL
+
 extern const pb_msgdesc_t GuiStatus_msg;
 extern const pb_msgdesc_t ControllerStatus_msg;
 extern const pb_msgdesc_t VentParams_msg;
 extern const pb_msgdesc_t SensorReadings_msg;
+extern const pb_msgdesc_t StageTiming_msg;
+extern const pb_msgdesc_t LoopTiming_msg;
 extern const pb_msgdesc_t Alarm_msg;
+extern const pb_msgdesc_t ScopeChunk_msg;
+extern const pb_msgdesc_t PressureLoopTuning_msg;
 
 /* Defines for backwards compatibility with code written before nanopb-0.4.0 */
 #define GuiStatus_fields &GuiStatus_msg
 #define ControllerStatus_fields &ControllerStatus_msg
 #define VentParams_fields &VentParams_msg
 #define SensorReadings_fields &SensorReadings_msg
+#define StageTiming_fields &StageTiming_msg
+#define LoopTiming_fields &LoopTiming_msg
 #define Alarm_fields &Alarm_msg
+#define ScopeChunk_fields &ScopeChunk_msg
+#define PressureLoopTuning_fields &PressureLoopTuning_msg
 
 /* Maximum encoded size of messages (where known) */
-#define GuiStatus_size                           140
-#define ControllerStatus_size                    177
+#define GuiStatus_size                           157
+#define ControllerStatus_size                    399
 #define VentParams_size                          67
 #define SensorReadings_size                      25
+#define StageTiming_size                         10
+#define LoopTiming_size                          96
 #define Alarm_size                               13
+#define ScopeChunk_size                          98
+#define PressureLoopTuning_size                  12
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -15,6 +15,7 @@ limitations under the License.
 
 #include "checksum.h"
 #include <stdint.h>
+#include <string.h>
 
 uint16_t checksum_fletcher16(const char *data, uint8_t count,
                              uint16_t state /*=0*/) {
@@ -70,3 +71,16 @@ uint32_t soft_crc32(const char *data, uint32_t count) {
   }
   return crc;
 }
+
+uint32_t checksum_words32(const void *data, uint32_t count) {
+  const char *bytes = static_cast<const char *>(data);
+  uint32_t hash = 2166136261;
+  for (uint32_t i = 0; i < count; i++) {
+    // memcpy, rather than a cast, is how to load a possibly unaligned word
+    // without breaking aliasing rules; it compiles to a plain load.
+    uint32_t word;
+    memcpy(&word, bytes + 4 * i, sizeof(word));
+    hash = (hash ^ word) * 16777619;
+  }
+  return hash;
+}
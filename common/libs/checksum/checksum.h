@@ -39,6 +39,16 @@ constexpr uint32_t CRC32_POLYNOMIAL = 0x741B8CD7;
 
 uint32_t soft_crc32(const char *data, uint32_t count);
 
+// Checksums `count` 32-bit words starting at `data`, which needn't be aligned.
+//
+// This is FNV-1a taken a word at a time: an xor and a multiply per word,
+// rather than the dozens of cycles per byte soft_crc32() takes.  It's weaker
+// than a CRC, but any single-bit error still changes the result.  Use it to
+// check data which never leaves the controller, e.g. RAM which should have
+// survived a reset, where it has to be cheap enough to run from the control
+// loop.
+uint32_t checksum_words32(const void *data, uint32_t count);
+
 // Computes check bytes for a fletcher16 checksum.
 //
 // Given a packet p and checksum(p) == c, check_bytes_fletcher16(c) returns two
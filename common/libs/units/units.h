@@ -35,8 +35,8 @@ limitations under the License.
 //   - Volumetric flow (e.g. m^3/s)
 //   - Volume (e.g. m^3)
 //   - Voltage (volts)
-//   - Elapsed time since startup (ms)
-//   - Duration, aka time interval (ms)
+//   - Elapsed time since startup (us)
+//   - Duration, aka time interval (us)
 //
 // Feel free to add new ones!
 //
@@ -62,7 +62,9 @@ limitations under the License.
 //   Voltage          volts(float)
 //   Duration         seconds(float)
 //   Duration         milliseconds(int64_t)
+//   Duration         microseconds(int64_t)
 //   Time             millisSinceStartup(int64_t)
+//   Time             microsSinceStartup(int64_t)
 //
 // Values support addition and subtraction.  The laws for Duration and Time are
 // different than the other units:
@@ -263,7 +265,9 @@ constexpr Voltage volts(float v) { return Voltage(v); }
 // - Time represents a point in time, relative to when the device started up,
 //   e.g. "1000 seconds after startup".
 //
-// Both classes have millisecond resolution.
+// Both classes have microsecond resolution.  That's fine enough to integrate
+// flow at the control loop's fastest rates, where a loop period is only a
+// few milliseconds and being off by a millisecond would be a big error.
 //
 // You can add and subtract Times and Durations in the natural way.
 //
@@ -275,18 +279,21 @@ class Time;
 
 // Represents a length of time.
 //
-// Precision: 1ms
+// Precision: 1us
 //
 // Units:
 //  - seconds
 //  - milliseconds
+//  - microseconds
 //
-// Native unit (implementation detail): int64_t miliseconds
+// Native unit (implementation detail): int64_t microseconds
 class Duration : public units_detail::Scalar<Duration, int64_t> {
 public:
-  [[nodiscard]] constexpr int64_t milliseconds() const { return val_; }
+  // Rounds towards zero to a whole number of milliseconds.
+  [[nodiscard]] constexpr int64_t milliseconds() const { return val_ / 1000; }
+  [[nodiscard]] constexpr int64_t microseconds() const { return val_; }
   [[nodiscard]] constexpr float seconds() const {
-    return static_cast<float>(val_) / 1000;
+    return static_cast<float>(val_) / (1000 * 1000);
   }
   [[nodiscard]] constexpr float minutes() const { return seconds() / 60; }
 
@@ -299,35 +306,48 @@ public:
 
 private:
   constexpr friend Duration milliseconds(int64_t millis);
+  constexpr friend Duration microseconds(int64_t micros);
   constexpr friend Duration seconds(float secs);
 
   using units_detail::Scalar<Duration, int64_t>::Scalar;
 };
 
-constexpr Duration milliseconds(int64_t millis) { return Duration(millis); }
+constexpr Duration milliseconds(int64_t millis) {
+  return Duration(millis * 1000);
+}
+constexpr Duration microseconds(int64_t micros) { return Duration(micros); }
+// Rounds to the nearest microsecond.  This is computed in float, since it's
+// called at runtime and the STM32 has no double-precision FPU; the result is
+// as precise as `secs` itself.
 constexpr Duration seconds(float secs) {
-  return Duration(static_cast<int64_t>(1000 * secs));
+  return Duration(
+      static_cast<int64_t>(secs * 1e6f + (secs < 0 ? -0.5f : 0.5f)));
 }
 constexpr Duration minutes(float mins) { return seconds(mins * 60); }
 constexpr Duration operator*(int n, Duration d) {
-  return milliseconds(static_cast<int64_t>(n) * d.milliseconds());
+  return microseconds(static_cast<int64_t>(n) * d.microseconds());
 }
 constexpr Duration operator*(Duration d, int n) {
-  return milliseconds(static_cast<int64_t>(n) * d.milliseconds());
+  return microseconds(static_cast<int64_t>(n) * d.microseconds());
 }
 
 // Represents a point in time, relative to when the device started up.  See
 // details above.
 //
-// Precision: 1ms
+// Precision: 1us
 //
 // Units:
 //  - milliseconds
+//  - microseconds
 //
-// Native unit (implementation detail): uint64_t miliseconds
+// Native unit (implementation detail): uint64_t microseconds
 class Time : public units_detail::Scalar<Time, uint64_t> {
 public:
-  [[nodiscard]] uint64_t millisSinceStartup() const { return val_; }
+  // Rounds down to a whole number of milliseconds.
+  [[nodiscard]] constexpr uint64_t millisSinceStartup() const {
+    return val_ / 1000;
+  }
+  [[nodiscard]] constexpr uint64_t microsSinceStartup() const { return val_; }
 
   constexpr friend Time operator+(const Time &a, const Duration &b);
   constexpr friend Time operator+(const Duration &a, const Time &b);
@@ -338,11 +358,15 @@ public:
 
 private:
   constexpr friend Time millisSinceStartup(uint64_t millis);
+  constexpr friend Time microsSinceStartup(uint64_t micros);
 
   using units_detail::Scalar<Time, uint64_t>::Scalar;
 };
 
-constexpr Time millisSinceStartup(uint64_t millis) { return Time(millis); }
+constexpr Time millisSinceStartup(uint64_t millis) {
+  return Time(millis * 1000);
+}
+constexpr Time microsSinceStartup(uint64_t micros) { return Time(micros); }
 
 constexpr inline Duration operator+(const Duration &a, const Duration &b) {
   return Duration(a.val_ + b.val_);
@@ -0,0 +1,86 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "alloc_counter.h"
+#include <errno.h>
+#include <stddef.h>
+
+// A plain integer, so reading or bumping it can't itself allocate.
+static thread_local int64_t thread_allocations = 0;
+
+int64_t ThreadAllocations() { return thread_allocations; }
+
+#if defined(__SANITIZE_ADDRESS__)
+
+// AddressSanitizer replaces malloc and operator new with its own allocator,
+// so interposing on them ourselves would break it.  Instead it lets us
+// register a callback for every allocation.
+extern "C" int __sanitizer_install_malloc_and_free_hooks(
+    void (*malloc_hook)(const volatile void *, size_t),
+    void (*free_hook)(const volatile void *));
+
+static void OnMalloc(const volatile void *, size_t) { thread_allocations++; }
+// ASan insists on both hooks.
+static void OnFree(const volatile void *) {}
+
+static const int hooks_installed =
+    __sanitizer_install_malloc_and_free_hooks(OnMalloc, OnFree);
+
+#elif defined(__GLIBC__)
+
+// Our definitions take precedence over libc's, including for the calls
+// libstdc++'s operator new makes.  glibc exports the real implementations
+// under these names.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+  thread_allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  thread_allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  thread_allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  thread_allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  thread_allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  thread_allocations++;
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr == nullptr ? ENOMEM : 0;
+}
+} // extern "C"
+
+#else
+#error "Don't know how to count heap allocations on this platform"
+#endif
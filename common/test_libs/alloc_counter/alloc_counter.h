@@ -0,0 +1,50 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <stdint.h>
+
+// Counts heap allocations, for tests which check that code doesn't allocate.
+//
+// The control loop runs in an interrupt handler and the STM32 build doesn't
+// have a heap at all, so anything it calls must stay off the heap.  On the
+// device that's enforced at link time (see boards/stm32_ldscript.ld), but
+// only for code which ends up in the firmware; a test such as
+//
+//   EXPECT_EQ(CountAllocations([&] { pid.Compute(now, input, setpoint); }),
+//             0);
+//
+// catches a stray std::function or std::vector as soon as it's written, and
+// points at the function responsible.
+//
+// Every allocation counts, whether it comes from malloc() and friends or from
+// operator new: under AddressSanitizer we use its allocator hooks, otherwise
+// we interpose on glibc's malloc.  Only the calling thread's allocations are
+// counted, and frees are ignored -- allocating and freeing again in the hot
+// path is still a bug.
+
+// Total number of heap allocations made by this thread so far.
+int64_t ThreadAllocations();
+
+// Runs fn() and returns the number of heap allocations it made.
+template <class Fn> int64_t CountAllocations(Fn fn) {
+  int64_t start = ThreadAllocations();
+  fn();
+  return ThreadAllocations() - start;
+}
+
+#endif // ALLOC_COUNTER_H
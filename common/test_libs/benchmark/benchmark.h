@@ -0,0 +1,74 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <chrono>
+#include <cstdio>
+
+// A tiny microbenchmark helper for use in (native) tests.
+//
+// We don't have Google Benchmark available, and our needs are simple: time
+// a function over many iterations and print the result next to the gtest
+// output, so that regressions are visible in the test logs.  For example:
+//
+//   double ns = RunBenchmark("analogRead", 10000, [&] {
+//     DoNotOptimize(Hal.analogRead(AnalogPin::PATIENT_PRESSURE));
+//   });
+//
+// Timings are of the host we're running the tests on (and include any
+// sanitizer overhead), so compare them against each other or against generous
+// bounds; they don't tell you how fast the code is on the STM32.
+
+// Whether we're built with the sanitizers, as the native env is.  Their
+// checks slow down some code far more than other code, so gate assertions
+// which compare timings on !SANITIZED; the native-bench env runs them.
+#if defined(__SANITIZE_ADDRESS__)
+inline constexpr bool SANITIZED = true;
+#else
+inline constexpr bool SANITIZED = false;
+#endif
+
+// Prevents the compiler from optimizing away the computation of `val`.
+template <class T> inline void DoNotOptimize(const T &val) {
+  asm volatile("" : : "r,m"(val) : "memory");
+}
+
+// Runs fn() `iterations` times, repeats that a few times, and returns the
+// fastest mean time per iteration in nanoseconds.  Taking the fastest
+// repetition filters out noise from the rest of the system.
+template <class Fn>
+double RunBenchmark(const char *name, int iterations, Fn fn) {
+  constexpr int REPETITIONS = 5;
+  double best_ns = 0;
+  for (int r = 0; r < REPETITIONS; r++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns =
+        std::chrono::duration<double, std::nano>(end - start).count() /
+        iterations;
+    if (r == 0 || ns < best_ns) {
+      best_ns = ns;
+    }
+  }
+  printf("[ BENCH    ] %-40s %10.1f ns/iter\n", name, best_ns);
+  return best_ns;
+}
+
+#endif // BENCHMARK_H
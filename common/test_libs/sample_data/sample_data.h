@@ -0,0 +1,106 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SAMPLE_DATA_H
+#define SAMPLE_DATA_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// Loads the recordings in sample-data/ so that (native) tests can replay
+// them.  For example:
+//
+//   std::vector<SampleDataRow> rows =
+//       LoadSampleData("2020-05-14-pip15-peep5-rr12-ie23.csv");
+//   for (const SampleDataRow &row : rows) {
+//     integrator.AddFlow(t, ml_per_min(row.flow_ml_per_min));
+//     t += SAMPLE_DATA_PERIOD;
+//   }
+//
+// The files have one row per control loop cycle, see the comments at the top
+// of each.  If the file can't be read, this fails the current test, naming
+// the file, and returns an empty vector.
+//
+// The native envs in platformio.ini define SAMPLE_DATA_DIR as the absolute
+// path of sample-data/, so the tests can run from anywhere.  Without it, the
+// directory is found from this header's path.
+
+// Samples in the recordings are taken every 10ms.
+inline constexpr int SAMPLE_DATA_PERIOD_MS = 10;
+
+struct SampleDataRow {
+  float fan_setpoint_cm_h2o;
+  float patient_pressure_cm_h2o;
+  float inflow_pressure_diff_cm_h2o;
+  float outflow_pressure_diff_cm_h2o;
+  float flow_ml_per_min;
+  float volume_ml;
+};
+
+// The path to sample-data/`name`.
+inline std::string SampleDataPath(const char *name) {
+#ifdef SAMPLE_DATA_DIR
+  return std::string(SAMPLE_DATA_DIR) + "/" + name;
+#else
+  // This header is common/test_libs/sample_data/sample_data.h, so the
+  // repository root is four path components up from __FILE__.  If __FILE__
+  // is relative to the root, so is the result.
+  std::string root = __FILE__;
+  for (int i = 0; i < 4; i++) {
+    size_t slash = root.find_last_of('/');
+    root = slash == std::string::npos ? "" : root.substr(0, slash);
+  }
+  return (root.empty() ? "" : root + "/") + "sample-data/" + name;
+#endif
+}
+
+inline std::vector<SampleDataRow> LoadSampleData(const char *name) {
+  std::vector<SampleDataRow> rows;
+  std::string path = SampleDataPath(name);
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    ADD_FAILURE() << "Can't read sample data " << path << ": "
+                  << strerror(errno);
+    return rows;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (line[0] == '#') {
+      continue;
+    }
+    // The files record flow in l/min and volume in units of 10ml.
+    float flow_l_per_min;
+    float volume_cl;
+    SampleDataRow row;
+    if (sscanf(line, "%f, %f, %f, %f, %f, %f", &row.fan_setpoint_cm_h2o,
+               &row.patient_pressure_cm_h2o, &row.inflow_pressure_diff_cm_h2o,
+               &row.outflow_pressure_diff_cm_h2o, &flow_l_per_min,
+               &volume_cl) != 6) {
+      continue;
+    }
+    row.flow_ml_per_min = flow_l_per_min * 1000;
+    row.volume_ml = volume_cl * 10;
+    rows.push_back(row);
+  }
+  fclose(f);
+  return rows;
+}
+
+#endif // SAMPLE_DATA_H
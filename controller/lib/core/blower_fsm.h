@@ -55,6 +55,18 @@ enum class ValveState {
   CLOSED,
 };
 
+// Where we are in the breath.
+enum class BreathPhase {
+  // Ventilation is off.
+  OFF,
+  // The exhale valve is closed and the blower drives the pressure up to PIP.
+  INSPIRATION,
+  // The exhale valve is open and the blower holds PEEP.  Once the patient has
+  // breathed out, no air flows to or from them: the blower's flow goes
+  // straight out through the exhale valve.
+  EXPIRATION,
+};
+
 // Represents a state that the blower FSM wants us to achieve at a given point
 // in time.
 struct BlowerSystemState {
@@ -70,6 +82,7 @@ struct BlowerSystemState {
 
   Pressure setpoint_pressure;
   ValveState expire_valve_state;
+  BreathPhase phase;
 };
 
 // A "breath finite state machine" where the blower is always off.
@@ -93,7 +106,8 @@ public:
   OffFsm() = default;
   explicit OffFsm(Time now, const VentParams &) {}
   BlowerSystemState desired_state(Time now) {
-    return {.blower_enabled = false, kPa(0), ValveState::OPEN};
+    return {.blower_enabled = false, kPa(0), ValveState::OPEN,
+            BreathPhase::OFF};
   }
   bool finished(Time now) { return true; }
 };
@@ -115,9 +129,11 @@ public:
 
   BlowerSystemState desired_state(Time now) {
     if (now < inspire_end_) {
-      return {.blower_enabled = true, inspire_pressure_, ValveState::CLOSED};
+      return {.blower_enabled = true, inspire_pressure_, ValveState::CLOSED,
+              BreathPhase::INSPIRATION};
     }
-    return {.blower_enabled = true, expire_pressure_, ValveState::OPEN};
+    return {.blower_enabled = true, expire_pressure_, ValveState::OPEN,
+            BreathPhase::EXPIRATION};
   }
 
   bool finished(Time now) { return now > expire_end_; }
@@ -164,21 +180,49 @@ public:
     // wait until the end of a cycle before implementing the mode change.
     if (params.mode == VentMode_OFF ||
         std::visit([&](auto &fsm) { return fsm.finished(now); }, fsm_)) {
-      switch (params.mode) {
-      case VentMode_OFF:
-        fsm_.emplace<OffFsm>(now, params);
-        break;
-      case VentMode_PRESSURE_CONTROL:
-        fsm_.emplace<PressureControlFsm>(now, params);
-        break;
-      }
+      StartBreath(now, params);
     }
 
     return std::visit([&](auto &fsm) { return fsm.desired_state(now); }, fsm_);
   }
 
+  // Where we are in the current breath, so that we can pick up in the same
+  // place after a warm restart.  The breath FSMs are a function of their
+  // params and start time, so that's all we need.
+  //
+  // Times are stored relative to the time the state was taken, because the
+  // clock starts over after a reset.
+  struct State {
+    VentParams breath_params;
+    Duration breath_elapsed;
+  };
+
+  State GetState(Time now) const {
+    return {.breath_params = breath_params_,
+            .breath_elapsed = now - breath_start_};
+  }
+
+  void RestoreState(Time now, const State &state) {
+    StartBreath(now - state.breath_elapsed, state.breath_params);
+  }
+
 private:
+  void StartBreath(Time now, const VentParams &params) {
+    breath_params_ = params;
+    breath_start_ = now;
+    switch (params.mode) {
+    case VentMode_OFF:
+      fsm_.emplace<OffFsm>(now, params);
+      break;
+    case VentMode_PRESSURE_CONTROL:
+      fsm_.emplace<PressureControlFsm>(now, params);
+      break;
+    }
+  }
+
   std::variant<OffFsm, PressureControlFsm> fsm_;
+  VentParams breath_params_ = VentParams_init_zero;
+  Time breath_start_ = millisSinceStartup(0);
 };
 
 #endif // BLOWER_FSM_H
@@ -0,0 +1,122 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "breath_tv_integrator.h"
+#include "algorithm.h"
+
+void BreathTVIntegrator::AddFlow(Time now, VolumetricFlow flow) {
+  Duration dt = now - last_sample_time_;
+  if (dt <= microseconds(0)) {
+    return;
+  }
+  last_sample_time_ = now;
+
+  VolumetricFlow corrected = flow - offset_;
+  Volume last_volume = integrator_.GetTV();
+  integrator_.AddFlow(now, corrected);
+  Volume volume = integrator_.GetTV();
+
+  // Where the flow crosses zero going up, interpolating linearly between the
+  // samples.  The volume there is the last sample's plus the triangle of
+  // flow between it and the crossing.
+  float last_m3_per_sec = last_corrected_flow_.cubic_m_per_sec();
+  float corrected_m3_per_sec = corrected.cubic_m_per_sec();
+  if (!inhaling_ && last_m3_per_sec <= 0 && corrected_m3_per_sec > 0) {
+    float fraction =
+        -last_m3_per_sec / (corrected_m3_per_sec - last_m3_per_sec);
+    Duration before_crossing = seconds(fraction * dt.seconds());
+    crossed_zero_ = true;
+    zero_crossing_time_ = now - dt + before_crossing;
+    volume_at_zero_crossing_ =
+        last_volume +
+        cubic_m(last_m3_per_sec * before_crossing.seconds() / 2);
+  }
+  last_corrected_flow_ = corrected;
+  if (volume > peak_volume_) {
+    peak_volume_ = volume;
+  }
+
+  // One-pole low-pass filter.  alpha = dt / (tau + dt) is exact for a
+  // first-order lag with time constant tau, whatever the sample period.
+  float alpha =
+      dt.seconds() / (DETECTION_TIME_CONSTANT.seconds() + dt.seconds());
+  smoothed_flow_ =
+      cubic_m_per_sec(smoothed_flow_.cubic_m_per_sec() +
+                      alpha * (corrected - smoothed_flow_).cubic_m_per_sec());
+
+  Duration breath_duration = now - breath_start_;
+  if (!inhaling_ && smoothed_flow_ > INSPIRATION_START_FLOW &&
+      breath_duration >= MIN_BREATH_DURATION) {
+    inhaling_ = true;
+    breath_count_++;
+    if (crossed_zero_ && zero_crossing_time_ > breath_start_) {
+      EndBreath(zero_crossing_time_, volume_at_zero_crossing_);
+    } else {
+      EndBreath(now, volume);
+    }
+  } else if (inhaling_ && smoothed_flow_ < EXPIRATION_START_FLOW &&
+             volume.ml() < EXHALED_FRACTION * peak_volume_.ml()) {
+    inhaling_ = false;
+  } else if (breath_duration >= MAX_BREATH_DURATION) {
+    EndBreath(now, volume);
+  }
+}
+
+void BreathTVIntegrator::EndBreath(Time boundary, Volume residual) {
+  float residual_m3_per_sec =
+      residual.cubic_m() / (boundary - breath_start_).seconds();
+  float max_offset = VolumetricFlow(MAX_FLOW_OFFSET).cubic_m_per_sec();
+  offset_ = cubic_m_per_sec(
+      std::clamp(offset_.cubic_m_per_sec() + OFFSET_GAIN * residual_m3_per_sec,
+                 -max_offset, max_offset));
+
+  last_residual_ = residual;
+  // What came after the boundary belongs to the new breath.
+  Volume carried_over = integrator_.GetTV() - residual;
+  integrator_.ResetVolume(carried_over);
+  peak_volume_ = std::max(carried_over, ml(0));
+  breath_start_ = boundary;
+  crossed_zero_ = false;
+}
+
+BreathTVIntegrator::State BreathTVIntegrator::GetState(Time now) const {
+  return {.integrator = integrator_.GetState(now),
+          .since_breath_start = now - breath_start_,
+          .since_last_sample = now - last_sample_time_,
+          .offset = offset_,
+          .smoothed_flow = smoothed_flow_,
+          .peak_volume = peak_volume_,
+          .inhaling = inhaling_,
+          .breath_count = breath_count_,
+          .last_corrected_flow = last_corrected_flow_,
+          .crossed_zero = crossed_zero_,
+          .since_zero_crossing = now - zero_crossing_time_,
+          .volume_at_zero_crossing = volume_at_zero_crossing_};
+}
+
+void BreathTVIntegrator::RestoreState(Time now, const State &state) {
+  integrator_.RestoreState(now, state.integrator);
+  breath_start_ = now - state.since_breath_start;
+  last_sample_time_ = now - state.since_last_sample;
+  offset_ = state.offset;
+  smoothed_flow_ = state.smoothed_flow;
+  peak_volume_ = state.peak_volume;
+  inhaling_ = state.inhaling;
+  breath_count_ = state.breath_count;
+  last_corrected_flow_ = state.last_corrected_flow;
+  crossed_zero_ = state.crossed_zero;
+  zero_crossing_time_ = now - state.since_zero_crossing;
+  volume_at_zero_crossing_ = state.volume_at_zero_crossing;
+}
@@ -0,0 +1,150 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef BREATH_TV_INTEGRATOR_H
+#define BREATH_TV_INTEGRATOR_H
+
+#include "hal.h"
+#include "tv_integrator.h"
+#include "units.h"
+#include <stdint.h>
+
+// Integrates tidal volume (TV) one breath at a time, correcting for an offset
+// in the flow sensors.
+//
+// A plain TVIntegrator accumulates forever, so the smallest offset in the
+// measured flow makes the volume drift without bound; the recordings in
+// sample-data/ drift by tens of ml per breath.  This class fixes that in two
+// ways:
+//
+//  - It finds the start of each breath from the flow itself, and re-zeroes
+//    the volume there.  So the volume is always relative to the end of the
+//    last exhalation, and an error in one breath doesn't carry into the next.
+//
+//  - Over a whole breath the patient breathes out what they breathed in, so
+//    whatever volume is left when the next breath starts is due to an offset
+//    in the flow.  We divide it by the breath's length to get the offset's
+//    residual, and move our estimate of the offset part of the way towards
+//    it.  That's an exponential moving average of the per-breath mean flow,
+//    and it costs a handful of operations once per breath.  The estimate is
+//    subtracted from every flow sample before it's integrated.
+//
+// A leak looks just like an offset, so over time this hides it from the
+// volume.  MAX_FLOW_OFFSET bounds how much it can hide.
+//
+// Breaths are detected with hysteresis on a low-passed copy of the corrected
+// flow: a breath starts when the flow rises above INSPIRATION_START_FLOW,
+// and we look for the next one only once the patient is breathing out again,
+// i.e. the flow has dropped below EXPIRATION_START_FLOW and the volume has
+// dropped below EXHALED_FRACTION of its peak.  The volume condition keeps
+// the flow's ringing at the end of inspiration (as in the PIP 25 recording)
+// from looking like a new breath.
+//
+// The filter and the threshold make us notice a breath tens of ms after it
+// really started, by which time the patient has breathed in a few ml.  Those
+// belong to the new breath, not to the last one's residual, where they'd
+// bias the offset estimate upwards.  So the boundary between breaths is
+// back-dated to where the corrected flow last crossed zero going up, found
+// by linear interpolation between samples, and the volume since then is
+// carried over into the new breath.
+//
+// If we don't see a breath for MAX_BREATH_DURATION (e.g. because the patient
+// isn't breathing or the circuit is disconnected), we re-zero and update the
+// offset anyway; with no net flow the residual still measures the offset.
+//
+// Everything here is O(1) per sample and allocation-free, so it's cheap
+// enough to run from the control loop interrupt.
+class BreathTVIntegrator {
+public:
+  inline constexpr static VolumetricFlow INSPIRATION_START_FLOW =
+      ml_per_min(3000);
+  inline constexpr static VolumetricFlow EXPIRATION_START_FLOW =
+      ml_per_min(-5000);
+  // Time constant of the low-pass filter we detect breaths on.  Short enough
+  // not to delay the start of a breath noticeably, long enough to keep noise
+  // in the flow from crossing the thresholds.
+  inline constexpr static Duration DETECTION_TIME_CONSTANT = milliseconds(50);
+  // A breath shorter than this (i.e. faster than 120 breaths/min) is noise,
+  // not a breath.
+  inline constexpr static Duration MIN_BREATH_DURATION = milliseconds(500);
+  inline constexpr static Duration MAX_BREATH_DURATION = seconds(10);
+  inline constexpr static float EXHALED_FRACTION = 0.5f;
+  // Fraction of each breath's residual offset that we add to the estimate.
+  // Per-breath residuals are noisy (the sensors' noise integrates to a few
+  // tens of ml over a breath), so we average over ~5 breaths.
+  inline constexpr static float OFFSET_GAIN = 0.2f;
+  inline constexpr static VolumetricFlow MAX_FLOW_OFFSET = ml_per_min(5000);
+
+  void AddFlow(Time now, VolumetricFlow flow);
+
+  // Volume since the start of the current breath.
+  Volume GetTV() const { return integrator_.GetTV(); }
+
+  // Current estimate of the offset in the flow that's passed to AddFlow().
+  VolumetricFlow GetFlowOffset() const { return offset_; }
+
+  // Number of breaths detected so far.
+  uint32_t GetBreathCount() const { return breath_count_; }
+
+  // Volume that was left over when we last re-zeroed.  Ideally this is 0.
+  Volume GetLastResidual() const { return last_residual_; }
+
+  // The integrator's state, for carrying it over a warm restart.  Times are
+  // relative to when the state was taken.
+  struct State {
+    TVIntegrator::State integrator;
+    Duration since_breath_start;
+    Duration since_last_sample;
+    VolumetricFlow offset;
+    VolumetricFlow smoothed_flow;
+    Volume peak_volume;
+    bool inhaling;
+    uint32_t breath_count;
+    VolumetricFlow last_corrected_flow;
+    bool crossed_zero;
+    Duration since_zero_crossing;
+    Volume volume_at_zero_crossing;
+  };
+
+  State GetState(Time now) const;
+  void RestoreState(Time now, const State &state);
+
+private:
+  // Ends the current breath at `boundary`, when the volume was `residual`:
+  // re-zeroes the volume there and updates the offset from what was left
+  // over.
+  void EndBreath(Time boundary, Volume residual);
+
+  TVIntegrator integrator_;
+  Time breath_start_ = Hal.now();
+  Time last_sample_time_ = Hal.now();
+  VolumetricFlow offset_ = cubic_m_per_sec(0);
+  // Corrected flow, low-passed, for detecting breaths.
+  VolumetricFlow smoothed_flow_ = cubic_m_per_sec(0);
+  // Largest volume so far in this breath.
+  Volume peak_volume_ = ml(0);
+  bool inhaling_ = false;
+  uint32_t breath_count_ = 0;
+  Volume last_residual_ = ml(0);
+
+  // The corrected flow's last sample, and where it last crossed zero going
+  // up since the current breath started, if it has.
+  VolumetricFlow last_corrected_flow_ = cubic_m_per_sec(0);
+  bool crossed_zero_ = false;
+  Time zero_crossing_time_ = Hal.now();
+  Volume volume_at_zero_crossing_ = ml(0);
+};
+
+#endif // BREATH_TV_INTEGRATOR_H
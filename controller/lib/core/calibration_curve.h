@@ -0,0 +1,121 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef CALIBRATION_CURVE_H
+#define CALIBRATION_CURVE_H
+
+// A sensor's calibration curve: a piecewise-linear map from the sensor's
+// output (e.g. volts) to the quantity it measures (e.g. kPa).
+//
+// The curve is stored as its values at N points, equally spaced between
+// x_min and x_max.  Equal spacing means that finding the segment an input
+// falls in is a multiply and a float-to-int conversion rather than a search,
+// so Evaluate() has no data-dependent branches and takes the same time for
+// every input:
+//
+//   pos = (x - x_min) / step         // computed as a multiply
+//   i   = int(clamp(pos, 0, N - 2))  // compiles to conditional selects
+//   y   = y[i] + (pos - i) * (y[i+1] - y[i])
+//
+// Inputs outside [x_min, x_max] extrapolate along the first or last
+// segment, since only the segment index is clamped.
+//
+// Curves are literal types, so default curves can be computed at compile
+// time from a sensor's datasheet transfer function with FromFunction().
+// FromPoints() resamples measured (x, y) pairs, which needn't be equally
+// spaced, onto the grid; that's for calibrations done at runtime.
+template <int N> class CalibrationCurve {
+  static_assert(N >= 2, "A curve needs at least one segment");
+
+public:
+  // The identity on [0, 1].
+  constexpr CalibrationCurve() : x_min_(0), inv_step_(N - 1), y_() {
+    for (int i = 0; i < N; i++) {
+      y_[i] = static_cast<float>(i) / (N - 1);
+    }
+  }
+
+  // Samples fn at N equally-spaced points in [x_min, x_max].  fn must be
+  // constexpr if the curve is.
+  template <class Fn>
+  static constexpr CalibrationCurve FromFunction(float x_min, float x_max,
+                                                 Fn fn) {
+    CalibrationCurve c;
+    c.x_min_ = x_min;
+    c.inv_step_ = (N - 1) / (x_max - x_min);
+    for (int i = 0; i < N; i++) {
+      c.y_[i] = fn(c.X(i));
+    }
+    return c;
+  }
+
+  // Resamples the piecewise-linear curve through the `n` points
+  // (xs[i], ys[i]) onto N equally-spaced points in [x_min, x_max].  xs must
+  // be increasing and n >= 2.  Outside [xs[0], xs[n-1]] the curve
+  // extrapolates along the end segments.
+  //
+  // If the measured points aren't on the grid, resampling smooths out some
+  // detail between them; use enough grid points that this doesn't matter.
+  static constexpr CalibrationCurve FromPoints(float x_min, float x_max,
+                                               const float *xs,
+                                               const float *ys, int n) {
+    return FromFunction(x_min, x_max, [&](float x) {
+      int seg = 0;
+      while (seg < n - 2 && x > xs[seg + 1]) {
+        seg++;
+      }
+      return ys[seg] + (x - xs[seg]) * (ys[seg + 1] - ys[seg]) /
+                           (xs[seg + 1] - xs[seg]);
+    });
+  }
+
+  constexpr float Evaluate(float x) const {
+    float pos = (x - x_min_) * inv_step_;
+    // Clamp before converting to int, so that far-out inputs can't overflow
+    // the conversion.  frac is computed from the unclamped pos, which is
+    // what makes us extrapolate.
+    float clamped = pos < 0 ? 0 : pos;
+    clamped = clamped > N - 2 ? N - 2 : clamped;
+    int i = static_cast<int>(clamped);
+    float frac = pos - static_cast<float>(i);
+    return y_[i] + frac * (y_[i + 1] - y_[i]);
+  }
+
+  // The x for which Evaluate(x) == y, for an increasing curve.  Like
+  // Evaluate(), this extrapolates along the end segments.  It's a linear
+  // search, so unlike Evaluate() its time depends on y.
+  constexpr float Invert(float y) const {
+    int i = 0;
+    while (i < N - 2 && y > y_[i + 1]) {
+      i++;
+    }
+    return X(i) + (y - y_[i]) / (y_[i + 1] - y_[i]) / inv_step_;
+  }
+
+  // The curve's grid.
+  constexpr float X(int i) const {
+    return x_min_ + static_cast<float>(i) / inv_step_;
+  }
+  constexpr float Y(int i) const { return y_[i]; }
+
+private:
+  float x_min_;
+  // 1 / (distance between grid points), so that Evaluate() multiplies
+  // rather than divides.
+  float inv_step_;
+  float y_[N];
+};
+
+#endif // CALIBRATION_CURVE_H
@@ -16,27 +16,45 @@ limitations under the License.
 #ifndef CIRCULAR_BUFFER_H_
 #define CIRCULAR_BUFFER_H_
 
-#include "hal.h"
+#include <atomic>
 #include <optional>
 #include <stdint.h>
 
 // This class is a generic circular buffer with fixed size.
 //
-// Note that this class is used from both the main line of code
-// and the interrupt handlers, so it needs to be thread safe.
-// I'm disabling interrupts during the critical sections to
-// ensure that's the case.
+// Note that this class is used from both the main line of code and the
+// interrupt handlers, so it needs to be thread safe.  Rather than disabling
+// interrupts around each operation (which would delay every other interrupt,
+// including the control loop) this is a lock-free single-producer,
+// single-consumer queue:
+//
+//  - Only one context may call Put() (the producer) and only one context may
+//    call Get() and Flush() (the consumer).  For example, for a UART receive
+//    buffer the UART ISR is the producer and the main loop is the consumer.
+//
+//  - The producer only ever writes head, and the consumer only ever writes
+//    tail.  Each side publishes its index with a release store after it's
+//    done with the element, and reads the other side's index with an acquire
+//    load, so the element is always fully written before it can be read.
+//
+// On the Cortex-M4 these atomics are plain loads and stores of an aligned
+// word plus a memory barrier.
 template <class T, int N> class CircBuff {
-  volatile T buff[N];
-  volatile int head, tail;
+  T buff[N];
+  std::atomic<int> head{0};
+  std::atomic<int> tail{0};
 
-public:
-  CircBuff() { head = tail = 0; }
+  static_assert(std::atomic<int>::is_always_lock_free);
 
+public:
   // Return number of elements available in the buffer to read.
-  int FullCt() {
-    BlockInterrupts block;
-    int ct = head - tail;
+  //
+  // If called concurrently with Put() or Get() this is a snapshot, which
+  // may be immediately out of date -- but never by more than the other side
+  // has done.
+  int FullCt() const {
+    int ct = head.load(std::memory_order_acquire) -
+             tail.load(std::memory_order_acquire);
     if (ct < 0)
       ct += N;
     return ct;
@@ -44,45 +62,53 @@ public:
 
   // Return number of free spaces in the buffer where more
   // elements can be written.
-  int FreeCt() { return N - 1 - FullCt(); }
+  int FreeCt() const { return N - 1 - FullCt(); }
 
   // Get the oldest element from the buffer, popping it from the buffer.
+  //
+  // Consumer only.
   std::optional<T> Get() {
-    BlockInterrupts block;
-
-    if (head == tail) {
+    int t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) {
       return std::nullopt;
     }
 
-    T val = std::move(buff[tail++]);
-    if (tail >= N) {
-      tail = 0;
+    T val = std::move(buff[t++]);
+    if (t >= N) {
+      t = 0;
     }
+    tail.store(t, std::memory_order_release);
     return val;
   }
 
   // Add an element to the buffer.
   //
   // Returns false if the buffer is full.
+  //
+  // Producer only.
   [[nodiscard]] bool Put(T dat) {
-    BlockInterrupts block;
-    int h = head + 1;
-    if (h >= N) {
-      h = 0;
+    int h = head.load(std::memory_order_relaxed);
+    int next = h + 1;
+    if (next >= N) {
+      next = 0;
     }
 
-    if (h == tail) {
+    if (next == tail.load(std::memory_order_acquire)) {
       return false;
     }
 
-    buff[head] = std::move(dat);
-    head = h;
+    buff[h] = std::move(dat);
+    head.store(next, std::memory_order_release);
     return true;
   }
 
+  // Discard everything currently in the buffer.
+  //
+  // Consumer only.  Elements the producer adds concurrently with this call
+  // may or may not be discarded.
   void Flush() {
-    BlockInterrupts block;
-    head = tail = 0;
+    tail.store(head.load(std::memory_order_acquire),
+               std::memory_order_release);
   }
 };
 
@@ -23,7 +23,7 @@ static uint16_t tx_bytes_remaining = 0;
 // Time when we started sending the last ControllerStatus.
 // TODO: Change this to std::optional<Time> once that's available; then we
 // don't need this "clever" initialization.
-constexpr Time kInvalidTime = millisSinceStartup(0xFFFF'FFFF'FFFF'FFFFUL);
+constexpr Time kInvalidTime = microsSinceStartup(0xFFFF'FFFF'FFFF'FFFFUL);
 static Time last_tx = kInvalidTime;
 
 // Our incoming (serialized) GuiStatus proto is incrementally buffered in
@@ -62,12 +62,15 @@ static bool is_time_to_process_packet() {
 // TODO add CRC to whole packet
 
 // TODO run this via DMA to free up resources for control loops
-static void process_tx(const ControllerStatus &controller_status) {
+//
+// Returns true if we started sending controller_status.
+static bool process_tx(const ControllerStatus &controller_status) {
   auto bytes_avail = Hal.serialBytesAvailableForWrite();
   if (bytes_avail == 0) {
-    return;
+    return false;
   }
 
+  bool started = false;
   // Serialize our current state into the buffer if
   //  - we're not currently transmitting,
   //  - we can transmit at least one byte now, and
@@ -87,11 +90,12 @@ static void process_tx(const ControllerStatus &controller_status) {
     pb_ostream_t stream = pb_ostream_from_buffer(tx_buffer, sizeof(tx_buffer));
     if (!pb_encode(&stream, ControllerStatus_fields, &controller_status)) {
       // TODO: Serialization failure; log an error or raise an alert.
-      return;
+      return false;
     }
     tx_idx = 0;
     tx_bytes_remaining = static_cast<uint16_t>(stream.bytes_written);
     last_tx = Hal.now();
+    started = true;
   }
 
   // TODO: Alarm if we haven't been able to send a status in a certain amount
@@ -110,6 +114,7 @@ static void process_tx(const ControllerStatus &controller_status) {
         static_cast<uint16_t>(tx_bytes_remaining - bytes_written);
     tx_idx = static_cast<uint16_t>(tx_idx + bytes_written);
   }
+  return started;
 }
 
 static void process_rx(GuiStatus *gui_status) {
@@ -142,8 +147,9 @@ static void process_rx(GuiStatus *gui_status) {
   }
 }
 
-void comms_handler(const ControllerStatus &controller_status,
+bool comms_handler(const ControllerStatus &controller_status,
                    GuiStatus *gui_status) {
-  process_tx(controller_status);
+  bool started = process_tx(controller_status);
   process_rx(gui_status);
+  return started;
 }
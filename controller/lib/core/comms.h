@@ -28,7 +28,10 @@ void comms_init();
 // `controller_status` should be the controller's current status.  It's sent
 // periodically to the GUI.  When we receive a message from the GUI, we update
 // gui_status accordingly.
-void comms_handler(const ControllerStatus &controller_status,
+//
+// Returns true if this call started sending `controller_status`, as opposed
+// to carrying on with an earlier one or waiting until it's time to send.
+bool comms_handler(const ControllerStatus &controller_status,
                    GuiStatus *gui_status);
 
 #endif // COMMS_H
@@ -0,0 +1,210 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "control_loop.h"
+#include "scope.h"
+
+// Groups run in this order within a tick, so the pressure loop sees the
+// sensor readings from the same tick.  The fast group's period is no longer
+// than any loop period, so it runs on every tick.  At 250Hz the pressure loop
+// runs every 2 ticks, i.e. at 125Hz; the controller is told so.
+//
+// Keep this in sync with the ControlGroup enum!
+const RateGroup ControlLoop::GROUPS[] = {
+    {.name = "fast",
+     .run = [](void *loop) { static_cast<ControlLoop *>(loop)->FastGroup(); },
+     .period = milliseconds(1)},
+    {.name = "pressure",
+     .run =
+         [](void *loop) { static_cast<ControlLoop *>(loop)->PressureGroup(); },
+     .period = PRESSURE_LOOP_PERIOD},
+    {.name = "alarms",
+     .run = [](void *loop) { static_cast<ControlLoop *>(loop)->AlarmsGroup(); },
+     .period = milliseconds(100)},
+    {.name = "snapshot",
+     .run =
+         [](void *loop) { static_cast<ControlLoop *>(loop)->SnapshotGroup(); },
+     .period = PRESSURE_LOOP_PERIOD},
+};
+
+ControlLoop::ControlLoop(LoopRate rate, ControlLoopIO *io,
+                         WarmRestartSnapshot<ControlLoopSnapshot> *snapshot,
+                         void (*signal_alarms)())
+    : io_(io), snapshot_(snapshot), signal_alarms_(signal_alarms),
+      loop_period_(LoopPeriod(rate)), rate_groups_(GROUPS),
+      controller_(RateGroupPeriod(PRESSURE_LOOP_PERIOD, loop_period_)),
+      sensors_(rate) {}
+
+void ControlLoop::Restore(const ControlLoopSnapshot &snapshot) {
+  Time now = Hal.now();
+  controller_.RestoreState(now, snapshot.controller);
+  sensors_.RestoreState(now, snapshot.sensors);
+  actuators_state_ = snapshot.actuators_state;
+  warm_restarts_ = snapshot.warm_restarts + 1;
+
+  // Keep using the last params we got from the GUI until it sends new ones.
+  io_->active_params.Publish(snapshot.active_params);
+}
+
+void ControlLoop::Start() { rate_groups_.Start(loop_period_); }
+
+void ControlLoop::Tick() {
+  // This is the buffer we'll publish at the end of the cycle.  Note that it
+  // holds an older snapshot, so every field we own must be filled in each
+  // cycle.
+  ControllerStatus &controller_status = io_->controller_status.WriteBuffer();
+  controller_status.active_params = io_->active_params.Read();
+
+  rate_groups_.Tick(this);
+
+  // TODO update pb library to replace fan_power in ControllerStatus with
+  // actuators_state, and remove fan_setpoint_cm_h2o from ControllerStatus
+
+  // Update the outputs.  We do this every tick, even though they only change
+  // when the pressure loop runs; it's cheap, and means the hardware is
+  // brought back in line quickly if something else touches it.
+  {
+    LoopStageTimer timer(LoopStage::ACTUATORS);
+    actuators_execute(actuators_state_);
+  }
+
+  // Update some status info
+  controller_status.fan_power = actuators_state_.fan_power;
+  controller_status.fan_setpoint_cm_h2o = actuators_state_.fan_setpoint_cm_h2o;
+  controller_status.pressure_tuning = controller_.GetTuning();
+
+  // Pet the watchdog
+  {
+    LoopStageTimer timer(LoopStage::WATCHDOG);
+    Hal.watchdog_handler();
+  }
+
+  io_->controller_status.Publish();
+}
+
+// Reads the sensors.  This runs at the loop rate, so that the volume
+// integration and the flow readings use the freshest data we have.
+void ControlLoop::FastGroup() {
+  LoopStageTimer timer(LoopStage::SENSORS);
+  io_->controller_status.WriteBuffer().sensor_readings =
+      sensors_.GetSensorReadings();
+
+  // The pneumatics are at rest when the blower is off and the exhale valve
+  // open: when ventilation is off, and during expiration if PEEP is low
+  // enough that the pressure loop turns the blower off.  Otherwise, all
+  // through expiration the blower holds PEEP with the valve open.
+  Sensors::PneumaticState pneumatics = Sensors::PneumaticState::ACTIVE;
+  if (actuators_state_.fan_power == 0 &&
+      actuators_state_.expire_valve_state == ValveState::OPEN) {
+    pneumatics = Sensors::PneumaticState::AT_REST;
+  } else if (controller_.GetBreathPhase() == BreathPhase::EXPIRATION) {
+    pneumatics = Sensors::PneumaticState::EXPIRATORY_HOLD;
+  }
+  sensors_.AutoZero(Hal.now(), pneumatics);
+}
+
+// Runs the blower FSM and the pressure PID.
+void ControlLoop::PressureGroup() {
+  LoopStageTimer timer(LoopStage::CONTROLLER);
+  const ControllerStatus &status = io_->controller_status.WriteBuffer();
+  if (io_->autotune_requested.exchange(false)) {
+    controller_.StartAutotune(Hal.now());
+  }
+  // An autotune can't tell a faulty pressure sensor from the plant, and
+  // would drive the blower on bad readings.
+  if (sensors_.GetFaults(AnalogPin::PATIENT_PRESSURE) != 0) {
+    controller_.AbortAutotune();
+  }
+  actuators_state_ = controller_.Run(Hal.now(), status.active_params,
+                                     status.sensor_readings);
+}
+
+// Checks for alarm conditions.  Reporting an alarm isn't safe from an
+// interrupt, so this hands it to the background loop.  Each new alarm also
+// triggers a scope capture, so we can see what the sensors were doing just
+// before.
+void ControlLoop::AlarmsGroup() {
+  // Raise an alarm when the loop starts overrunning its period too often.
+  // The monitor latches for a whole window, so only report the rising edge.
+  bool overrunning = Hal.loopMonitor().AlarmActive();
+  if (overrunning && !overrun_alarm_) {
+    io_->overrun_alarm_raised = true;
+    signal_alarms_();
+    Hal.adcCapture().Trigger(CaptureCause::ALARM);
+  }
+  overrun_alarm_ = overrunning;
+
+  // Likewise, report each sensor fault when it starts.
+  uint32_t faults = 0;
+  for (int i = 0; i < NUM_MONITORED_SENSORS; i++) {
+    faults |= sensors_.GetFaults(MONITORED_SENSORS[i])
+              << (i * NUM_SENSOR_FAULTS);
+  }
+  uint32_t new_faults = faults & ~sensor_faults_;
+  if (new_faults != 0) {
+    io_->sensor_faults_raised |= new_faults;
+    signal_alarms_();
+    Hal.adcCapture().Trigger(CaptureCause::ALARM);
+  }
+  sensor_faults_ = faults;
+
+  // Keep the scope's pressure threshold in step with the GUI's setting and
+  // the sensor's zero, which drifts.
+  float trigger_cm_h2o = io_->scope_trigger_cm_h2o;
+  if (trigger_cm_h2o == 0) {
+    Hal.adcCapture().ClearThreshold();
+  } else {
+    Hal.adcCapture().SetThreshold(
+        static_cast<int>(AnalogPin::PATIENT_PRESSURE),
+        ScopeStreamer::Counts(sensors_.VoltageAt(AnalogPin::PATIENT_PRESSURE,
+                                                 cmH2O(trigger_cm_h2o))));
+  }
+}
+
+// Saves our state, in case the watchdog bites.  A pressure loop period's
+// worth of sensor history is all a warm restart can lose by not doing this
+// every tick, and the checksum isn't free.
+void ControlLoop::SnapshotGroup() {
+  LoopStageTimer timer(LoopStage::SNAPSHOT);
+  Time now = Hal.now();
+  if (warm_restarts_ > 0 &&
+      now > millisSinceStartup(0) + WARM_RESTART_FORGET_TIME) {
+    warm_restarts_ = 0;
+  }
+  snapshot_->Save({
+      .controller = controller_.GetState(now),
+      .sensors = sensors_.GetState(now),
+      .active_params = io_->controller_status.WriteBuffer().active_params,
+      .actuators_state = actuators_state_,
+      .warm_restarts = warm_restarts_,
+  });
+}
+
+bool AutotuneRequests::OnGuiStatus(const GuiStatus &gui_status) {
+  // The GUI's uptime is nonzero once we've heard from it.
+  if (gui_status.uptime_ms == 0) {
+    return false;
+  }
+  uint32_t id = gui_status.autotune_request_id;
+  bool baseline = !heard_from_gui_ || gui_status.uptime_ms < last_uptime_ms_;
+  bool request = !baseline && id > last_request_id_;
+
+  heard_from_gui_ = true;
+  last_uptime_ms_ = gui_status.uptime_ms;
+  if (baseline || request) {
+    last_request_id_ = id;
+  }
+  return request;
+}
@@ -0,0 +1,202 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef CONTROL_LOOP_H_
+#define CONTROL_LOOP_H_
+
+#include "actuators.h"
+#include "controller.h"
+#include "hal.h"
+#include "network_protocol.pb.h"
+#include "rate_groups.h"
+#include "sensor_health.h"
+#include "sensors.h"
+#include "triple_buffer.h"
+#include "units.h"
+#include "warm_restart.h"
+#include <atomic>
+#include <stdint.h>
+
+// The blower pressure loop runs at (about) this period, whatever the loop rate
+// is.  The PID gains were tuned at 100Hz, and the pressure in the system
+// doesn't change fast enough for running it faster to help.
+inline constexpr Duration PRESSURE_LOOP_PERIOD = milliseconds(10);
+
+// The sensors the health monitors watch, and the alarm each of their faults
+// raises, in SensorFault bit order.  alarm_add() takes 8 bytes, so each name
+// is 7 characters.
+inline constexpr AnalogPin MONITORED_SENSORS[] = {
+    AnalogPin::PATIENT_PRESSURE,
+    AnalogPin::INFLOW_PRESSURE_DIFF,
+    AnalogPin::OUTFLOW_PRESSURE_DIFF,
+};
+inline constexpr const char *SENSOR_FAULT_ALARMS[][NUM_SENSOR_FAULTS] = {
+    {"PP_STCK", "PP_RAIL", "PP_RATE"},
+    {"IF_STCK", "IF_RAIL", "IF_RATE"},
+    {"OF_STCK", "OF_RAIL", "OF_RATE"},
+};
+inline constexpr int NUM_MONITORED_SENSORS =
+    sizeof(MONITORED_SENSORS) / sizeof(MONITORED_SENSORS[0]);
+static_assert(NUM_MONITORED_SENSORS * NUM_SENSOR_FAULTS <= 32);
+
+// Data shared between the control loop and the background loop.  These are
+// wait-free, so neither side has to mask interrupts to get a consistent
+// snapshot.
+struct ControlLoopIO {
+  // The control loop publishes its status every cycle.  The background loop
+  // adds the fields it owns (uptime, etc) to its own copy before sending it
+  // to the GUI.
+  TripleBuffer<ControllerStatus> controller_status;
+  // The background loop publishes the latest parameters it received from the
+  // GUI; the control loop picks them up at the start of its next cycle.
+  TripleBuffer<VentParams> active_params;
+
+  // Set by the control loop when the overrun alarm goes off, and cleared by
+  // the background loop once it's been reported.
+  std::atomic<bool> overrun_alarm_raised{false};
+
+  // Set by the control loop when sensor faults start, one bit per
+  // SENSOR_FAULT_ALARMS entry, and cleared by the background loop once
+  // they've been reported.
+  std::atomic<uint32_t> sensor_faults_raised{0};
+
+  // Patient pressure at which the GUI wants a scope capture, or 0 for none.
+  // Set by the background loop; the control loop turns it into a threshold
+  // on the raw A/D readings, since that depends on the sensor's calibration.
+  std::atomic<float> scope_trigger_cm_h2o{0};
+
+  // Set by the background loop when the GUI asks to autotune the pressure
+  // loop (see AutotuneRequests), and cleared by the control loop when it
+  // starts.
+  std::atomic<bool> autotune_requested{false};
+};
+
+// Decides when the GUI asks to autotune the pressure loop, see
+// GuiStatus.autotune_request_id.  Autotuning pressurizes whatever is
+// attached, so we take care not to mistake anything else for a request:
+//
+//  - A request is an id bigger than any we've seen.  0 never is.
+//  - The first id we hear is where the GUI is at, not a request: after we
+//    reboot, the GUI carries on sending the id of its last request.
+//  - Likewise after the GUI restarts, which we tell by its uptime going
+//    backwards, since it may start counting from anywhere.
+class AutotuneRequests {
+public:
+  // Returns true if `gui_status` asks for a new autotune.  Call this with the
+  // latest status from the GUI, which is all zeros until we've heard from it.
+  bool OnGuiStatus(const GuiStatus &gui_status);
+
+private:
+  bool heard_from_gui_ = false;
+  uint64_t last_uptime_ms_ = 0;
+  uint32_t last_request_id_ = 0;
+};
+
+// Everything the control loop needs to carry on where it left off after a
+// watchdog reset.  The loop saves this every pressure loop period.
+struct ControlLoopSnapshot {
+  Controller::State controller;
+  Sensors::State sensors;
+  VentParams active_params;
+  ActuatorsState actuators_state;
+  uint32_t warm_restarts;
+};
+
+// The control loop's rate groups.  See ControlLoop::GROUPS for their rates.
+enum class ControlGroup { FAST, PRESSURE, ALARMS, SNAPSHOT };
+
+// The work the control loop does on each tick of the loop timer, and the
+// state it keeps from one tick to the next.
+//
+// The work is split into rate groups, see ControlLoop::GROUPS.  Each group
+// is timed, and so is each stage of the work, see LoopStageTimer.  The
+// statistics are sent to the GUI as part of ControllerStatus.loop_timing.
+class ControlLoop {
+public:
+  // If the state we restore is what made us hang in the first place, warm
+  // restarting would just hang again.  So we give up and cold start after
+  // this many warm restarts in a row, i.e. without the loop running for at
+  // least WARM_RESTART_FORGET_TIME in between.
+  inline constexpr static uint32_t MAX_WARM_RESTARTS = 3;
+  inline constexpr static Duration WARM_RESTART_FORGET_TIME = seconds(10);
+
+  // The loop talks to the background loop through `io`, and saves its state
+  // to `snapshot` for a warm restart.  It calls `signal_alarms` (from the
+  // loop timer interrupt) when it raises an alarm in `io` which the
+  // background loop should report.  The pointers must outlive the loop.
+  ControlLoop(LoopRate rate, ControlLoopIO *io,
+              WarmRestartSnapshot<ControlLoopSnapshot> *snapshot,
+              void (*signal_alarms)());
+
+  // Picks up where a previous boot left off, from a snapshot it saved.
+  void Restore(const ControlLoopSnapshot &snapshot);
+
+  // Calibrates the sensors, on a cold start.  This needs to be done before
+  // the sensors are used.
+  void Calibrate() { sensors_.Calibrate(); }
+
+  // Works out the rate groups' rates.  Call this before starting the loop
+  // timer.
+  void Start();
+
+  // Runs one tick of the control loop.  The HAL calls this from the loop
+  // timer interrupt, at the loop rate.
+  //
+  // NOTE - it's important that anything being called from here executes
+  // quickly.  No busy waiting here.
+  void Tick();
+
+  // Execution time stats of a rate group, in ticks of HalApi::cycleCount(),
+  // and how many loop periods apart it runs.
+  StageTimingStats GroupStats(ControlGroup group) const {
+    return rate_groups_.Stats(static_cast<int>(group));
+  }
+  int GroupDivider(ControlGroup group) const {
+    return rate_groups_.Divider(static_cast<int>(group));
+  }
+
+private:
+  // The rate groups, in the order they run within a tick.
+  static const RateGroup GROUPS[];
+
+  void FastGroup();
+  void PressureGroup();
+  void AlarmsGroup();
+  void SnapshotGroup();
+
+  ControlLoopIO *const io_;
+  WarmRestartSnapshot<ControlLoopSnapshot> *const snapshot_;
+  void (*const signal_alarms_)();
+  const Duration loop_period_;
+
+  RateGroups rate_groups_;
+  Controller controller_;
+  Sensors sensors_;
+
+  // Latest outputs of the pressure loop.  These are applied every tick.
+  ActuatorsState actuators_state_;
+
+  // Was the overrun alarm active the last time the alarms group ran?
+  bool overrun_alarm_ = false;
+
+  // Sensor faults that were active the last time the alarms group ran, one
+  // bit per SENSOR_FAULT_ALARMS entry.
+  uint32_t sensor_faults_ = 0;
+
+  // How many times in a row we've warm restarted, see MAX_WARM_RESTARTS.
+  uint32_t warm_restarts_ = 0;
+};
+
+#endif // CONTROL_LOOP_H_
@@ -18,34 +18,99 @@ limitations under the License.
 #include "pid.h"
 #include <math.h>
 
-// PID-tuning were chosen by following the Ziegler-Nichols method,
-// https://en.wikipedia.org/wiki/Ziegler%E2%80%93Nichols_method
+// Our output is an 8-bit PWM.
+static constexpr float OUTPUT_MAX = 255;
+
+// The relay swings the fan power by about a fifth of its range either side
+// of the power which holds AUTOTUNE_SETPOINT.  The ramp which finds that power
+// is slow compared to the blower and tubing, which respond in about a second.
+// The hysteresis is a few times the pressure sensor's noise.
 //
-// Note that Ku and Tu only seem to work with this particular sample time.
-static constexpr Duration PID_SAMPLE_PERIOD = milliseconds(10);
-static constexpr float Ku = 200;
-static constexpr Duration Tu = seconds(1.5f);
-
-// "No overshoot" settings from the Ziegler-Nichols Wikipedia page.  This
-// avoids overpressurizing the patient's lungs.
-static constexpr float Kp = 0.2f * Ku;
-static constexpr float Ki = 0.4f * Ku / Tu.seconds();
-static constexpr float Kd = Ku * Tu.seconds() / 15;
-
-Controller::Controller()
-    : pid_(Kp, Ki, Kd, ProportionalTerm::ON_ERROR,
+// Units differ from the prototype, but not by much: a Ku or Tu far from
+// DEFAULT_TUNING is more likely a bad measurement than a real difference, and
+// tuning the PID from it could make the loop unstable.
+static constexpr RelayAutotuneConfig AUTOTUNE_CONFIG = {
+    .setpoint = Controller::AUTOTUNE_SETPOINT.kPa(),
+    .hysteresis = cmH2O(0.5f).kPa(),
+    .amplitude = 50,
+    .output_min = 0,
+    .output_max = OUTPUT_MAX,
+    .ramp_time = seconds(20),
+    .input_limit = Controller::AUTOTUNE_PRESSURE_LIMIT.kPa(),
+    .timeout = Controller::AUTOTUNE_TIMEOUT,
+    .min_ultimate_gain = Controller::DEFAULT_TUNING.ku / 3,
+    .max_ultimate_gain = Controller::DEFAULT_TUNING.ku * 3,
+    .min_ultimate_period = milliseconds(500),
+    .max_ultimate_period = seconds(5),
+};
+
+Controller::Controller(Duration period)
+    : loop_period_(period),
+      pid_(/*kp=*/0, /*ki=*/0, /*kd=*/0, ProportionalTerm::ON_ERROR,
            DifferentialTerm::ON_MEASUREMENT,
            // Increases in the blower fan speed should result in increased
            // pressure.
-           ControlDirection::DIRECT,
-           // Our output is an 8-bit PWM.
-           /*output_min=*/0.f, /*output_max=*/255.f, PID_SAMPLE_PERIOD) {}
+           ControlDirection::DIRECT, /*output_min=*/0.f, OUTPUT_MAX,
+           loop_period_),
+      autotuner_(AUTOTUNE_CONFIG) {
+  SetTuning(tuning_);
+}
+
+Duration Controller::GetLoopPeriod() { return loop_period_; }
+
+// PID-tuning follows the Ziegler-Nichols method,
+// https://en.wikipedia.org/wiki/Ziegler%E2%80%93Nichols_method
+//
+// The PID runs once per call to Run(), and scales its integral and
+// derivative terms by the sample period, so these gains carry over to other
+// loop rates.  Note though that Ku and Tu depend a little on the sample time
+// they were measured with.
+//
+// We use the "no overshoot" settings from the Ziegler-Nichols Wikipedia page.
+// This avoids overpressurizing the patient's lungs.
+void Controller::SetTuning(const Tuning &tuning) {
+  tuning_ = tuning;
+  float tu_s = tuning.tu.seconds();
+  pid_.SetTunings(/*kp=*/0.2f * tuning.ku, /*ki=*/0.4f * tuning.ku / tu_s,
+                  /*kd=*/tuning.ku * tu_s / 15);
+}
+
+void Controller::StartAutotune(Time now) { autotuner_.Start(now); }
 
-Duration Controller::GetLoopPeriod() { return PID_SAMPLE_PERIOD; }
+void Controller::AbortAutotune() { autotuner_.Abort(); }
+
+static AutotuneState ToProto(RelayAutotuner::Status status) {
+  switch (status) {
+  case RelayAutotuner::Status::IDLE:
+    return AutotuneState_AUTOTUNE_IDLE;
+  case RelayAutotuner::Status::RUNNING:
+    return AutotuneState_AUTOTUNE_RUNNING;
+  case RelayAutotuner::Status::DONE:
+    return AutotuneState_AUTOTUNE_DONE;
+  case RelayAutotuner::Status::FAILED:
+    return AutotuneState_AUTOTUNE_FAILED;
+  }
+  // All cases covered above (and GCC checks this).
+  __builtin_unreachable();
+}
+
+PressureLoopTuning Controller::GetTuning() const {
+  return {.autotune_state = ToProto(autotuner_.GetStatus()),
+          .ultimate_gain = tuning_.ku / OUTPUT_MAX * cmH2O(1).kPa(),
+          .ultimate_period_s = tuning_.tu.seconds()};
+}
 
 ActuatorsState Controller::Run(Time now, const VentParams &params,
                                const SensorReadings &readings) {
   BlowerSystemState desired_state = fsm_.DesiredState(now, params);
+  breath_phase_ = desired_state.phase;
+
+  if (autotuner_.GetStatus() == RelayAutotuner::Status::RUNNING) {
+    if (params.mode == VentMode_OFF) {
+      return RunAutotune(now, readings);
+    }
+    autotuner_.Abort();
+  }
 
   return {.fan_setpoint_cm_h2o = desired_state.setpoint_pressure.cmH2O(),
           .expire_valve_state = desired_state.expire_valve_state,
@@ -72,5 +137,21 @@ float Controller::ComputeFanPower(Time now,
   }
 
   // fan_power is in range [0, 1].
-  return output / 255.f;
+  return output / OUTPUT_MAX;
+}
+
+ActuatorsState Controller::RunAutotune(Time now,
+                                       const SensorReadings &readings) {
+  float pressure_kpa = cmH2O(readings.patient_pressure_cm_h2o).kPa();
+  float output = autotuner_.Step(now, pressure_kpa);
+  // Keep the PID in step with what the relay's doing, so that it takes over
+  // smoothly once we're done.
+  pid_.Observe(now, pressure_kpa, AUTOTUNE_SETPOINT.kPa(), output);
+  if (autotuner_.GetStatus() == RelayAutotuner::Status::DONE) {
+    SetTuning({.ku = autotuner_.UltimateGain(),
+               .tu = autotuner_.UltimatePeriod()});
+  }
+  return {.fan_setpoint_cm_h2o = AUTOTUNE_SETPOINT.cmH2O(),
+          .expire_valve_state = ValveState::CLOSED,
+          .fan_power = output / OUTPUT_MAX};
 }
@@ -3,21 +3,84 @@
 
 #include "actuators.h"
 #include "blower_fsm.h"
+#include "hal.h"
 #include "network_protocol.pb.h"
 #include "pid.h"
+#include "relay_autotuner.h"
 #include "units.h"
 
 // This class is here to allow integration of our controller into Modelica
 // software and run closed-loop tests in a simulated physical environment
 class Controller {
 public:
-  Controller();
+  // `period` is how often Run() will be called.
+  explicit Controller(Duration period = LoopPeriod(DEFAULT_LOOP_RATE));
 
   ActuatorsState Run(Time now, const VentParams &params,
                      const SensorReadings &readings);
 
   Duration GetLoopPeriod();
 
+  // The blower FSM's breath phase as of the last call to Run().  An autotune
+  // only runs while ventilation is off, so it's BreathPhase::OFF then.
+  BreathPhase GetBreathPhase() const { return breath_phase_; }
+
+  // The blower pressure loop's ultimate gain, in PID output units (8-bit fan
+  // PWM) per kPa, and ultimate period.  We derive the PID gains from these;
+  // see controller.cpp.
+  struct Tuning {
+    float ku;
+    Duration tu;
+  };
+
+  // Measured on a prototype with a 10ms sample time (i.e. a 100Hz loop).
+  inline constexpr static Tuning DEFAULT_TUNING = {.ku = 200,
+                                                   .tu = seconds(1.5f)};
+
+  // Starts measuring the tuning of this unit's blower and tubing by relay
+  // feedback, see RelayAutotuner.  Run() then holds the pressure around
+  // AUTOTUNE_SETPOINT with the exhale valve closed, and switches to the
+  // measured tuning once it's done.
+  //
+  // This needs a test lung in place of the patient, and the ventilator off:
+  // it fails right away if params.mode isn't OFF at the next Run(), and if
+  // ventilation starts while it's going.  It also fails if the pressure goes
+  // over AUTOTUNE_PRESSURE_LIMIT, if the oscillation doesn't settle, if the
+  // tuning it measures is implausibly far from DEFAULT_TUNING, or if it takes
+  // longer than AUTOTUNE_TIMEOUT.  Failing leaves the tuning as it was.
+  void StartAutotune(Time now);
+
+  // Fails the autotune in progress, if any, e.g. because the pressure sensor
+  // it relies on is faulty.
+  void AbortAutotune();
+
+  inline constexpr static Pressure AUTOTUNE_SETPOINT = cmH2O(15);
+  inline constexpr static Pressure AUTOTUNE_PRESSURE_LIMIT = cmH2O(30);
+  inline constexpr static Duration AUTOTUNE_TIMEOUT = seconds(60);
+
+  // The tuning in use, and how the last autotune went, for the GUI.
+  PressureLoopTuning GetTuning() const;
+
+  // Everything the controller remembers from one call to Run() to the next,
+  // so that it can pick up where it left off after a warm restart.  An
+  // autotune in progress isn't included; it's abandoned.
+  struct State {
+    BlowerFsm::State fsm;
+    PIDState pid;
+    Tuning tuning;
+  };
+
+  State GetState(Time now) const {
+    return {.fsm = fsm_.GetState(now), .pid = pid_.GetState(),
+            .tuning = tuning_};
+  }
+
+  void RestoreState(Time now, const State &state) {
+    fsm_.RestoreState(now, state.fsm);
+    pid_.RestoreState(state.pid);
+    SetTuning(state.tuning);
+  }
+
 private:
   // Computes the fan power necessary to match pressure setpoint in desired
   // state by running the necessary step of the pid with input = current
@@ -26,8 +89,17 @@ private:
   float ComputeFanPower(Time now, const BlowerSystemState &desired_state,
                         const SensorReadings &sensor_readings);
 
+  // One step of an autotune in progress, in place of the FSM and PID.
+  ActuatorsState RunAutotune(Time now, const SensorReadings &readings);
+
+  void SetTuning(const Tuning &tuning);
+
+  const Duration loop_period_;
   BlowerFsm fsm_;
   PID pid_;
+  BreathPhase breath_phase_ = BreathPhase::OFF;
+  Tuning tuning_ = DEFAULT_TUNING;
+  RelayAutotuner autotuner_;
 };
 
 #endif // CONTROLLER_H_
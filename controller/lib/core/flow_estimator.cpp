@@ -0,0 +1,73 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "flow_estimator.h"
+#include "algorithm.h"
+#include <cmath>
+
+// Until the first reading, we know nothing: a flow anywhere in +/-2 l/s and
+// a pressure anywhere in +/-30 cmH2O.
+static constexpr KalmanFilter<2>::Matrix INITIAL_COVARIANCE = {
+    {{4, 0}, {0, 900}}};
+
+FlowEstimator::FlowEstimator(const Venturi &inflow, const Venturi &outflow,
+                             float compliance_ml_per_cm_h2o)
+    : inflow_(inflow), outflow_(outflow),
+      elastance_(1000 / compliance_ml_per_cm_h2o),
+      filter_({{0, 0}}, INITIAL_COVARIANCE) {}
+
+/*static*/ float FlowEstimator::VenturiFlowVariance(const Venturi &venturi,
+                                                    Pressure delta) {
+  // Q = K sqrt(dp), so dQ/d(dp) = K / (2 sqrt(dp)), and the variance of Q is
+  // K^2 sigma^2 / (4 dp).  That blows up at dp = 0, where the linearization
+  // stops making sense, so don't let dp go below the noise.
+  float sigma_pa = DIFF_PRESSURE_NOISE.kPa() * 1000;
+  float dp_pa = std::max(std::abs(delta.kPa() * 1000), sigma_pa);
+  // K is in m^3/s per sqrt(Pa); we want l/s.
+  float k = venturi.Coefficient() * 1000;
+  return k * k * sigma_pa * sigma_pa / (4 * dp_pa);
+}
+
+VolumetricFlow FlowEstimator::Update(Time now, Pressure inflow_delta,
+                                     Pressure outflow_delta,
+                                     Pressure patient_pressure) {
+  VolumetricFlow measured =
+      inflow_.Flow(inflow_delta) - outflow_.Flow(outflow_delta);
+  float flow_variance = VenturiFlowVariance(inflow_, inflow_delta) +
+                        VenturiFlowVariance(outflow_, outflow_delta);
+  float pressure_sigma = PATIENT_PRESSURE_NOISE.cmH2O();
+
+  if (!primed_) {
+    primed_ = true;
+    last_time_ = now;
+    filter_ = KalmanFilter<2>({{measured.liters_per_sec(),
+                                patient_pressure.cmH2O()}},
+                              INITIAL_COVARIANCE);
+  } else {
+    float dt = (now - last_time_).seconds();
+    last_time_ = now;
+    if (dt > 0) {
+      filter_.Predict(
+          {{{1, 0}, {dt * elastance_, 1}}},
+          {{{FLOW_PROCESS_NOISE_L2_PER_S3 * dt, 0},
+            {0, PRESSURE_PROCESS_NOISE_CM_H2O2_PER_S * dt}}});
+    }
+  }
+
+  filter_.Update({{1, 0}}, measured.liters_per_sec(), flow_variance);
+  filter_.Update({{0, 1}}, patient_pressure.cmH2O(),
+                 pressure_sigma * pressure_sigma);
+  return GetFlow();
+}
@@ -0,0 +1,104 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef FLOW_ESTIMATOR_H
+#define FLOW_ESTIMATOR_H
+
+#include "hal.h"
+#include "kalman_filter.h"
+#include "units.h"
+#include "venturi.h"
+
+// Estimates the flow into the patient by fusing both venturis with the
+// patient pressure, using a two-state Kalman filter.
+//
+// The plain estimate is the inflow venturi's flow minus the outflow
+// venturi's.  A venturi's flow goes as the square root of its pressure drop,
+// so near zero flow the slope is steep.  There, the differential sensors'
+// noise becomes large noise in the flow.  E.g. during an inspiratory pause,
+// when the exhale valve is closed and little air moves through either
+// venturi, the plain flow jumps by several l/min from one reading to the
+// next.
+//
+// The filter's states are the patient flow Q and the patient pressure P.
+// They're related through the lung's compliance C: the flow goes into the
+// lung and raises its pressure, so P changes by Q dt / C per step.  Q itself
+// is a random walk.  Each step we apply two measurements:
+//
+//  - Q, from the venturis.  Its variance is each venturi's flow variance at
+//    its current pressure drop, i.e. (dQ/d(dp))^2 * DIFF_PRESSURE_NOISE^2,
+//    summed.  So we trust the venturis when they're in their accurate range,
+//    and lean on the model and the pressure when they're not.
+//
+//  - P, from the patient pressure sensor.  Its noise doesn't depend on the
+//    operating point.  Through the model, its rate of change is a second
+//    measurement of the flow.
+//
+// The compliance is the patient's, so we can only guess it.  We allow for a
+// bad guess, and for the airway's resistance, which the model leaves out, with
+// generous process noise on P.  So the pressure mostly sharpens steps in the
+// flow, and the venturis set its level.  The default compliance is fit to the
+// test lung in sample-data/.
+//
+// Tuning (see test/flow_estimator): replaying those recordings, this reduces
+// the flow's noise during inspiratory pauses by 60-65%, and follows steps in
+// flow to within a sample.  A one-pole low-pass filter that's as late removes
+// only about 60%.
+class FlowEstimator {
+public:
+  inline constexpr static float DEFAULT_COMPLIANCE_ML_PER_CM_H2O = 25;
+  // How fast the flow can wander, as variance per second of a random walk.
+  // Larger values track steps faster, smaller ones smooth more.
+  inline constexpr static float FLOW_PROCESS_NOISE_L2_PER_S3 = 0.09f;
+  // Pressure changes the model doesn't explain, see above.
+  inline constexpr static float PRESSURE_PROCESS_NOISE_CM_H2O2_PER_S = 1;
+  // Noise in one reading of a differential or patient pressure sensor.
+  inline constexpr static Pressure DIFF_PRESSURE_NOISE = cmH2O(0.1f);
+  inline constexpr static Pressure PATIENT_PRESSURE_NOISE = cmH2O(0.1f);
+
+  FlowEstimator(const Venturi &inflow, const Venturi &outflow,
+                float compliance_ml_per_cm_h2o =
+                    DEFAULT_COMPLIANCE_ML_PER_CM_H2O);
+
+  // Adds a set of readings and returns the new estimate of the flow into the
+  // patient.  The first call just initializes the filter from the readings.
+  VolumetricFlow Update(Time now, Pressure inflow_delta,
+                        Pressure outflow_delta, Pressure patient_pressure);
+
+  // Forgets the readings so far; the next Update() initializes the filter.
+  void Reset() { primed_ = false; }
+
+  VolumetricFlow GetFlow() const {
+    return liters_per_sec(filter_.State().v[FLOW]);
+  }
+
+  // Variance, in (l/s)^2, of the flow `venturi` reports for a pressure drop
+  // of `delta`, if the drop is measured with DIFF_PRESSURE_NOISE.
+  static float VenturiFlowVariance(const Venturi &venturi, Pressure delta);
+
+private:
+  enum StateIndex { FLOW, PRESSURE };
+
+  Venturi inflow_;
+  Venturi outflow_;
+  // 1/C, in cmH2O per liter.
+  float elastance_;
+  // Flow in l/s, pressure in cmH2O.
+  KalmanFilter<2> filter_;
+  bool primed_ = false;
+  Time last_time_ = Hal.now();
+};
+
+#endif // FLOW_ESTIMATOR_H
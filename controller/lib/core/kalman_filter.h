@@ -0,0 +1,151 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef KALMAN_FILTER_H
+#define KALMAN_FILTER_H
+
+#include <type_traits>
+#include <utility>
+
+namespace kalman_detail {
+
+// Calls fn(i) for i = 0, ..., N-1, where each i is a std::integral_constant.
+// The calls are expanded at compile time, so there's no loop left for the
+// compiler to decide whether to unroll; at -Os it often wouldn't.
+template <class Fn, int... Is>
+constexpr void ForEach(Fn &&fn, std::integer_sequence<int, Is...>) {
+  (fn(std::integral_constant<int, Is>{}), ...);
+}
+template <int N, class Fn> constexpr void ForEach(Fn &&fn) {
+  ForEach(fn, std::make_integer_sequence<int, N>{});
+}
+
+// fn(0) + fn(1) + ... + fn(N-1), expanded at compile time.
+template <class Fn, int... Is>
+constexpr float Sum(Fn &&fn, std::integer_sequence<int, Is...>) {
+  return (fn(std::integral_constant<int, Is>{}) + ...);
+}
+template <int N, class Fn> constexpr float Sum(Fn &&fn) {
+  return Sum(fn, std::make_integer_sequence<int, N>{});
+}
+
+} // namespace kalman_detail
+
+// A linear Kalman filter with N states, for small N.
+//
+// Every matrix operation is written out element by element at compile time,
+// so e.g. a 2-state filter's Predict() is a couple of dozen multiply-adds
+// with no loops or indexing.  Measurements are scalar and applied one at a
+// time with Update(), which needs one divide and no matrix inverse; with
+// independent measurement noise that's equivalent to a joint update.
+//
+// The caller supplies the model: the state transition F and process noise Q
+// for each Predict(), and the measurement row h and noise variance r for each
+// Update().  These may change from step to step, e.g. with the time since the
+// last step or with a sensor's operating point.
+template <int N> class KalmanFilter {
+  static_assert(N >= 1);
+
+public:
+  struct Vector {
+    float v[N];
+  };
+  struct Matrix {
+    float m[N][N];
+  };
+
+  constexpr KalmanFilter(const Vector &x, const Matrix &p) : x_(x), p_(p) {}
+
+  // x = F x,  P = F P F' + Q.
+  void Predict(const Matrix &f, const Matrix &q) {
+    using kalman_detail::ForEach;
+    using kalman_detail::Sum;
+
+    Vector x;
+    ForEach<N>([&](auto i) {
+      x.v[i] = Sum<N>([&](auto j) { return f.m[i][j] * x_.v[j]; });
+    });
+    x_ = x;
+
+    Matrix fp;
+    ForEach<N>([&](auto i) {
+      ForEach<N>([&](auto j) {
+        fp.m[i][j] = Sum<N>([&](auto k) { return f.m[i][k] * p_.m[k][j]; });
+      });
+    });
+    ForEach<N>([&](auto i) {
+      ForEach<N>([&](auto j) {
+        p_.m[i][j] =
+            Sum<N>([&](auto k) { return fp.m[i][k] * f.m[j][k]; }) +
+            q.m[i][j];
+      });
+    });
+  }
+
+  // Applies the measurement z = h x + noise, where the noise has variance r.
+  // r must be positive.
+  void Update(const Vector &h, float z, float r) {
+    using kalman_detail::ForEach;
+    using kalman_detail::Sum;
+
+    // P h' and the innovation's variance, h P h' + r.
+    Vector ph;
+    ForEach<N>([&](auto i) {
+      ph.v[i] = Sum<N>([&](auto j) { return p_.m[i][j] * h.v[j]; });
+    });
+    float inv_s = 1 / (Sum<N>([&](auto i) { return h.v[i] * ph.v[i]; }) + r);
+    float innovation = z - Sum<N>([&](auto i) { return h.v[i] * x_.v[i]; });
+
+    // Gain k = P h' / s; x += k (z - h x).
+    Vector k;
+    ForEach<N>([&](auto i) {
+      k.v[i] = ph.v[i] * inv_s;
+      x_.v[i] += k.v[i] * innovation;
+    });
+
+    // P = (I - k h) P (I - k h)' + k r k', the Joseph form.  The textbook
+    // P -= k h P is cheaper, but in float its rounding errors leave P a
+    // little asymmetric, and eventually not positive definite, after which
+    // the filter diverges.  This keeps P symmetric positive definite.
+    Matrix a;
+    ForEach<N>([&](auto i) {
+      ForEach<N>([&](auto j) {
+        a.m[i][j] = (i == j ? 1.f : 0.f) - k.v[i] * h.v[j];
+      });
+    });
+    Matrix ap;
+    ForEach<N>([&](auto i) {
+      ForEach<N>([&](auto j) {
+        ap.m[i][j] = Sum<N>([&](auto l) { return a.m[i][l] * p_.m[l][j]; });
+      });
+    });
+    ForEach<N>([&](auto i) {
+      ForEach<N>([&](auto j) {
+        p_.m[i][j] =
+            Sum<N>([&](auto l) { return ap.m[i][l] * a.m[j][l]; }) +
+            k.v[i] * r * k.v[j];
+      });
+    });
+  }
+
+  const Vector &State() const { return x_; }
+  const Matrix &Covariance() const { return p_; }
+
+private:
+  Vector x_;
+  Matrix p_;
+};
+
+#endif // KALMAN_FILTER_H
@@ -0,0 +1,45 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "rate_groups.h"
+
+RateGroups::RateGroups(const RateGroup *groups, int num_groups)
+    : groups_(groups), num_groups_(num_groups) {}
+
+void RateGroups::Start(Duration loop_period) {
+  MaskInterrupts mask(IntPriority::LOW);
+  for (int i = 0; i < num_groups_; i++) {
+    divider_[i] = RateGroupDivider(groups_[i].period, loop_period);
+
+    // Stagger the groups: group i first runs on tick i (mod its divider).
+    // Groups that run every tick are unaffected.
+    countdown_[i] = i % divider_[i];
+    stats_[i].Reset();
+  }
+}
+
+void RateGroups::Tick(void *arg) {
+  for (int i = 0; i < num_groups_; i++) {
+    if (countdown_[i] > 0) {
+      countdown_[i]--;
+      continue;
+    }
+    countdown_[i] = divider_[i] - 1;
+
+    uint32_t start = Hal.cycleCount();
+    groups_[i].run(arg);
+    stats_[i].Record(Hal.cycleCount() - start);
+  }
+}
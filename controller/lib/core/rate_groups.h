@@ -0,0 +1,106 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef RATE_GROUPS_H_
+#define RATE_GROUPS_H_
+
+#include "hal.h"
+#include "stage_timing.h"
+#include "units.h"
+
+// One entry in the control loop's rate group table.
+//
+// `run` is called from the loop timer interrupt roughly every `period`, with
+// the argument that was passed to RateGroups::Tick().  See
+// RateGroupDivider() for how the period is rounded to a whole number of loop
+// periods.
+struct RateGroup {
+  const char *name;
+  void (*run)(void *arg);
+  Duration period;
+};
+
+// Number of loop periods between runs of a group which wants to run every
+// `period`.
+//
+// If `period` isn't a whole multiple of the loop period, we round down, i.e.
+// the group runs a bit faster than asked rather than slower.  A group whose
+// period is shorter than the loop period runs every tick.
+constexpr int RateGroupDivider(Duration period, Duration loop_period) {
+  int64_t divider = period.microseconds() / loop_period.microseconds();
+  return divider < 1 ? 1 : static_cast<int>(divider);
+}
+
+// How often a group which wants to run every `period` actually runs.  Code
+// which depends on its own rate, e.g. a PID, should use this.
+constexpr Duration RateGroupPeriod(Duration period, Duration loop_period) {
+  return RateGroupDivider(period, loop_period) * loop_period;
+}
+
+// Runs the groups of work in the control loop at different rates.
+//
+// The loop timer fires at the loop rate, and calls Tick() each time.  A
+// group with a period of N loop periods runs on every Nth tick, so e.g. the
+// pressure loop can run at 100Hz while the sensors are read at 1kHz, and
+// doesn't cost 10 times as much as it needs to.  The ratios are worked out
+// once in Start() and don't change while the loop is running.
+//
+// Groups which don't run every tick are staggered, so that slow groups don't
+// all land on the same tick and make it much longer than the others.  Within
+// a tick, groups run in the order of the table.
+//
+// Each group keeps its own execution time stats, in ticks of
+// HalApi::cycleCount().
+class RateGroups {
+public:
+  static constexpr int MAX_GROUPS = 4;
+
+  // `groups` must outlive this object.
+  template <int N> explicit RateGroups(const RateGroup (&groups)[N])
+      : RateGroups(groups, N) {
+    static_assert(N <= MAX_GROUPS, "Increase RateGroups::MAX_GROUPS");
+  }
+
+  // Works out how many ticks apart each group runs (see RateGroupDivider()),
+  // for a loop running every `loop_period`.  Call this before starting the
+  // loop timer.
+  void Start(Duration loop_period);
+
+  // Runs the groups which are due this tick.  Call this from the loop timer
+  // interrupt.
+  void Tick(void *arg);
+
+  // Number of ticks between runs of `group`.
+  int Divider(int group) const { return divider_[group]; }
+
+  // Returns a consistent copy of the execution time stats for `group`.
+  StageTimingStats Stats(int group) const {
+    MaskInterrupts mask(IntPriority::LOW);
+    return stats_[group];
+  }
+
+private:
+  RateGroups(const RateGroup *groups, int num_groups);
+
+  const RateGroup *const groups_;
+  const int num_groups_;
+
+  int divider_[MAX_GROUPS] = {};
+  // Ticks until each group next runs.  The group runs when this hits 0.
+  int countdown_[MAX_GROUPS] = {};
+  StageTimingStats stats_[MAX_GROUPS];
+};
+
+#endif // RATE_GROUPS_H_
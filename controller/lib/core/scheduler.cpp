@@ -0,0 +1,141 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "scheduler.h"
+#include "hal.h"
+
+Scheduler::Scheduler(const SchedulerTask *tasks, int num_tasks, IdleHook idle)
+    : tasks_(tasks), num_tasks_(num_tasks), idle_(idle) {}
+
+void Scheduler::Start() {
+  Time now = Hal.now();
+  for (int i = 0; i < num_tasks_; i++) {
+    release_[i] = now;
+  }
+  window_start_ = now;
+  window_idle_start_ = Hal.idleTime();
+}
+
+// Is `task` ready to run at `now`?
+bool Scheduler::Released(int task, Time now) {
+  if (tasks_[task].period > milliseconds(0)) {
+    return release_[task] <= now;
+  }
+  if (!released_[task] && pending_[task].exchange(false)) {
+    released_[task] = true;
+    release_[task] = now;
+  }
+  return released_[task];
+}
+
+Duration Scheduler::Deadline(int task) const {
+  const SchedulerTask &t = tasks_[task];
+  if (t.deadline > milliseconds(0)) {
+    return t.deadline;
+  }
+  return t.period > milliseconds(0) ? t.period : DEFAULT_EVENT_DEADLINE;
+}
+
+bool Scheduler::RunOnce() {
+  Time now = Hal.now();
+
+  // Earliest deadline first.  Ties go to whichever task comes first in the
+  // table.
+  int next = -1;
+  Time next_deadline;
+  for (int i = 0; i < num_tasks_; i++) {
+    if (!Released(i, now)) {
+      continue;
+    }
+    Time deadline = release_[i] + Deadline(i);
+    if (next < 0 || deadline < next_deadline) {
+      next = i;
+      next_deadline = deadline;
+    }
+  }
+
+  if (next < 0) {
+    if (idle_ != nullptr) {
+      idle_(NextRelease());
+    }
+    UpdateLoad(Hal.now());
+    return false;
+  }
+
+  tasks_[next].run();
+  Time end = Hal.now();
+
+  SchedulerTaskStats &stats = stats_[next];
+  Duration runtime = end - now;
+  stats.runs++;
+  stats.total_runtime = stats.total_runtime + runtime;
+  if (runtime > stats.max_runtime) {
+    stats.max_runtime = runtime;
+  }
+  if (end > next_deadline) {
+    stats.deadline_misses++;
+  }
+
+  Duration period = tasks_[next].period;
+  if (period > milliseconds(0)) {
+    // If we fell so far behind that we missed whole releases, skip them
+    // rather than running the task back to back to catch up.
+    release_[next] += period;
+    while (release_[next] + period <= end) {
+      release_[next] += period;
+    }
+  } else {
+    released_[next] = false;
+  }
+
+  window_busy_ = window_busy_ + runtime;
+  UpdateLoad(end);
+  return true;
+}
+
+Time Scheduler::NextRelease() const {
+  Time next = microsSinceStartup(UINT64_MAX);
+  for (int i = 0; i < num_tasks_; i++) {
+    if (tasks_[i].period > milliseconds(0)) {
+      if (release_[i] < next) {
+        next = release_[i];
+      }
+    } else if (released_[i] || pending_[i].load()) {
+      // Don't sleep (or, in test mode, skip the clock ahead) past an event
+      // which is already waiting, e.g. one signaled by an interrupt after
+      // RunOnce() looked for released tasks.
+      return Hal.now();
+    }
+  }
+  return next;
+}
+
+void Scheduler::UpdateLoad(Time now) {
+  Duration elapsed = now - window_start_;
+  if (elapsed < LOAD_WINDOW) {
+    return;
+  }
+  float window_us = static_cast<float>(elapsed.microseconds());
+  Duration idle_time = Hal.idleTime();
+  cpu_load_percent_ =
+      100.0f * static_cast<float>(window_busy_.microseconds()) / window_us;
+  idle_percent_ =
+      100.0f *
+      static_cast<float>((idle_time - window_idle_start_).microseconds()) /
+      window_us;
+  window_start_ = now;
+  window_busy_ = milliseconds(0);
+  window_idle_start_ = idle_time;
+}
@@ -0,0 +1,134 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "units.h"
+#include <atomic>
+#include <stdint.h>
+
+// One entry in the scheduler's task table.
+//
+// A task with a nonzero period is periodic: it's released every `period`,
+// starting when the scheduler starts.  A task with a zero period is
+// event-driven: it's released whenever someone calls Scheduler::Signal() on
+// it.
+//
+// A task should finish within `deadline` of being released.  A zero deadline
+// means "by the next release", i.e. the period, or for an event-driven task,
+// Scheduler::DEFAULT_EVENT_DEADLINE.
+struct SchedulerTask {
+  const char *name;
+  void (*run)();
+  Duration period;
+  Duration deadline;
+};
+
+// Per-task runtime accounting.
+struct SchedulerTaskStats {
+  uint32_t runs = 0;
+  uint32_t deadline_misses = 0;
+  Duration total_runtime = milliseconds(0);
+  Duration max_runtime = milliseconds(0);
+};
+
+// Cooperative earliest-deadline-first scheduler for the background loop.
+//
+// The tasks are given as a static table when the scheduler is constructed.
+// Each call to RunOnce() picks the released task whose deadline is
+// soonest, runs it to completion and does the bookkeeping.  If no task is
+// released, it calls the idle hook instead, which would normally put the CPU
+// to sleep with Hal.idle().  Tasks can't preempt one another -- anything
+// which can't wait belongs in the control loop ISR.
+//
+// All times come from Hal.now(), so in test mode the scheduler follows the
+// fake clock and is completely deterministic.  A task "takes" whatever time
+// it spends in Hal.delay().
+class Scheduler {
+public:
+  static constexpr int MAX_TASKS = 8;
+
+  // CPU load is measured over windows of this length.
+  static constexpr Duration LOAD_WINDOW = seconds(1);
+
+  // Deadline of an event-driven task which doesn't give one.
+  static constexpr Duration DEFAULT_EVENT_DEADLINE = milliseconds(100);
+
+  // Called with the time of the next periodic release when no task is
+  // ready to run.  It may return early, e.g. because an event arrived.
+  using IdleHook = void (*)(Time next_release);
+
+  // `tasks` must outlive the scheduler.
+  template <int N>
+  explicit Scheduler(const SchedulerTask (&tasks)[N],
+                     IdleHook idle = nullptr)
+      : Scheduler(tasks, N, idle) {
+    static_assert(N <= MAX_TASKS, "Increase Scheduler::MAX_TASKS");
+  }
+
+  // Releases every periodic task.  Call this once before RunOnce().
+  void Start();
+
+  // Runs the most urgent released task, or the idle hook if there isn't one.
+  // Returns true if a task ran.
+  bool RunOnce();
+
+  // Releases event-driven task number `task`.  Signaling a task which is
+  // already released has no effect.  Safe to call from an interrupt handler.
+  void Signal(int task) { pending_[task].store(true); }
+
+  // Earliest time at which a task will be released.  If an event-driven task
+  // has been signaled but hasn't run yet, that's now.
+  Time NextRelease() const;
+
+  const SchedulerTaskStats &Stats(int task) const { return stats_[task]; }
+
+  // Percentage of time spent running tasks (as opposed to idling) during the
+  // last complete LOAD_WINDOW.
+  float CpuLoadPercent() const { return cpu_load_percent_; }
+
+  // Percentage of time the CPU spent asleep in Hal.idle() during the last
+  // complete LOAD_WINDOW.  Unlike CpuLoadPercent() this takes into account
+  // time spent in interrupt handlers (e.g. the control loop), so it's the
+  // true headroom we have left -- provided the idle hook calls Hal.idle().
+  float IdlePercent() const { return idle_percent_; }
+
+private:
+  Scheduler(const SchedulerTask *tasks, int num_tasks, IdleHook idle);
+
+  bool Released(int task, Time now);
+  Duration Deadline(int task) const;
+  void UpdateLoad(Time now);
+
+  const SchedulerTask *const tasks_;
+  const int num_tasks_;
+  const IdleHook idle_;
+
+  // For periodic tasks, when they're next released.  For event-driven tasks,
+  // when we noticed they were signaled.
+  Time release_[MAX_TASKS];
+  std::atomic<bool> pending_[MAX_TASKS] = {};
+  bool released_[MAX_TASKS] = {};
+  SchedulerTaskStats stats_[MAX_TASKS];
+
+  Time window_start_ = millisSinceStartup(0);
+  Duration window_busy_ = milliseconds(0);
+  Duration window_idle_start_ = milliseconds(0);
+  float cpu_load_percent_ = 0;
+  float idle_percent_ = 0;
+};
+
+#endif // SCHEDULER_H_
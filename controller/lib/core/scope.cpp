@@ -0,0 +1,86 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "scope.h"
+#include "algorithm.h"
+
+static ScopeTrigger ToProto(CaptureCause cause) {
+  switch (cause) {
+  case CaptureCause::NONE:
+    return ScopeTrigger_SCOPE_NONE;
+  case CaptureCause::REQUEST:
+    return ScopeTrigger_SCOPE_REQUEST;
+  case CaptureCause::ALARM:
+    return ScopeTrigger_SCOPE_ALARM;
+  case CaptureCause::THRESHOLD:
+    return ScopeTrigger_SCOPE_THRESHOLD;
+  }
+  // All cases covered above (and GCC checks this).
+  __builtin_unreachable();
+}
+
+void ScopeStreamer::FillChunk(ScopeChunk *chunk) {
+  *chunk = ScopeChunk_init_zero;
+  if (!sending_) {
+    if (!capture_.Frozen()) {
+      return;
+    }
+    sending_ = true;
+    capture_id_++;
+    next_scan_ = 0;
+  }
+
+  chunk->capture_id = capture_id_;
+  chunk->trigger = ToProto(capture_.Cause());
+  chunk->total_scans = ADC_CAPTURE_SCANS;
+  chunk->trigger_scan = AdcCaptureBuffer::TriggerScan();
+  chunk->first_scan = next_scan_;
+  chunk->scan_period_us = static_cast<float>(ADC_SCAN_PERIOD.microseconds());
+  chunk->volts_per_count = ADC_VOLTS_PER_COUNT.volts();
+
+  int scans = std::min(SCANS_PER_CHUNK, ADC_CAPTURE_SCANS - next_scan_);
+  pb_size_t n = 0;
+  for (int s = next_scan_; s < next_scan_ + scans; s++) {
+    for (int c = 0; c < NUM_ANALOG_PINS; c++) {
+      uint16_t reading = capture_.Reading(s, c);
+      chunk->data.bytes[n++] = static_cast<pb_byte_t>(reading);
+      chunk->data.bytes[n++] = static_cast<pb_byte_t>(reading >> 8);
+    }
+  }
+  chunk->data.size = n;
+}
+
+void ScopeStreamer::ChunkSent() {
+  if (!sending_) {
+    return;
+  }
+  next_scan_ += SCANS_PER_CHUNK;
+  if (next_scan_ >= ADC_CAPTURE_SCANS) {
+    sending_ = false;
+    capture_.Release();
+  }
+}
+
+void ScopeStreamer::OnGuiStatus(const GuiStatus &gui_status) {
+  if (gui_status.scope_request_id != last_request_id_) {
+    last_request_id_ = gui_status.scope_request_id;
+    capture_.Trigger(CaptureCause::REQUEST);
+  }
+}
+
+/*static*/ uint16_t ScopeStreamer::Counts(Voltage v) {
+  float counts = v.volts() / ADC_VOLTS_PER_COUNT.volts();
+  return static_cast<uint16_t>(std::clamp(counts, 0.f, 65535.f));
+}
@@ -0,0 +1,74 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include "hal.h"
+#include "network_protocol.pb.h"
+#include <stdint.h>
+
+// Sends oscilloscope-style captures of the raw A/D readings (see
+// HalApi::adcCapture()) to the GUI.
+//
+// A capture is far bigger than a ControllerStatus, so we send it a
+// ScopeChunk at a time, one in each ControllerStatus, in the background.
+// While a capture is being sent it stays frozen, so nothing else can trigger;
+// once the last chunk has gone out, we release it to capture again.
+//
+// Call these from the background loop, in this order, each time it talks to
+// the GUI:
+//
+//   streamer.FillChunk(&controller_status.scope);
+//   if (comms_handler(controller_status, &gui_status)) {
+//     streamer.ChunkSent();
+//   }
+//   streamer.OnGuiStatus(gui_status);
+class ScopeStreamer {
+public:
+  // Each chunk holds this many scans, i.e. 60 bytes of readings.
+  inline constexpr static int SCANS_PER_CHUNK = 10;
+  static_assert(sizeof(ScopeChunk_data_t::bytes) ==
+                SCANS_PER_CHUNK * NUM_ANALOG_PINS * sizeof(uint16_t));
+
+  explicit ScopeStreamer(AdcCaptureBuffer &capture) : capture_(capture) {}
+
+  // Sets `chunk` to the next chunk of the capture we're sending, or to an
+  // empty chunk (capture_id 0) if there's nothing to send.
+  void FillChunk(ScopeChunk *chunk);
+
+  // The chunk from the last FillChunk() is on its way; move on to the next.
+  void ChunkSent();
+
+  // Triggers a capture when the GUI's scope_request_id changes.
+  void OnGuiStatus(const GuiStatus &gui_status);
+
+  // The raw A/D reading the capture sees for a voltage `v` on an analog
+  // input, e.g. for AdcCapture::SetThreshold().  Saturates at the ends of the
+  // A/D's range.
+  static uint16_t Counts(Voltage v);
+
+private:
+  AdcCaptureBuffer &capture_;
+
+  // The capture we're sending, if any, and the first scan of the next chunk.
+  bool sending_ = false;
+  uint32_t capture_id_ = 0;
+  int next_scan_ = 0;
+
+  uint32_t last_request_id_ = 0;
+};
+
+#endif // SCOPE_H
@@ -0,0 +1,76 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "sensor_health.h"
+#include "algorithm.h"
+#include <cmath>
+
+void SensorHealthMonitor::AddSample(Time now, Voltage reading) {
+  float x = reading.volts();
+
+  if (!primed_) {
+    primed_ = true;
+    window_start_ = now;
+  } else {
+    Duration dt = now - last_time_;
+    if (dt <= microseconds(0)) {
+      return;
+    }
+    float step = std::abs(x - last_volts_);
+    if (step > std::min(MAX_RATE_VOLTS_PER_SEC * dt.seconds(),
+                        MAX_STEP.volts())) {
+      rate_exceeded_in_window_ = true;
+      faults_ |= SENSOR_RATE_EXCEEDED;
+    }
+    // Exactly equal: the same A/D codes.
+    if (x != last_volts_) {
+      changed_in_window_ = true;
+    }
+  }
+  last_time_ = now;
+  last_volts_ = x;
+
+  if (x > RAIL_LOW.volts() && x < RAIL_HIGH.volts()) {
+    on_rail_ = false;
+    faults_ &= ~SENSOR_RAILED;
+  } else {
+    if (!on_rail_) {
+      on_rail_ = true;
+      rail_start_ = now;
+    }
+    if (now - rail_start_ >= RAIL_TIME) {
+      faults_ |= SENSOR_RAILED;
+    }
+  }
+
+  if (now - window_start_ >= WINDOW) {
+    EndWindow(now);
+  }
+}
+
+void SensorHealthMonitor::EndWindow(Time now) {
+  if (changed_in_window_) {
+    faults_ &= ~SENSOR_STUCK;
+  } else {
+    faults_ |= SENSOR_STUCK;
+  }
+  if (!rate_exceeded_in_window_) {
+    faults_ &= ~SENSOR_RATE_EXCEEDED;
+  }
+
+  window_start_ = now;
+  changed_in_window_ = false;
+  rate_exceeded_in_window_ = false;
+}
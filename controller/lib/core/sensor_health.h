@@ -0,0 +1,94 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SENSOR_HEALTH_H
+#define SENSOR_HEALTH_H
+
+#include "hal.h"
+#include "units.h"
+#include <stdint.h>
+
+// Faults SensorHealthMonitor detects, as bits of Faults().
+enum SensorFault : uint32_t {
+  // The readings haven't changed for a whole window, i.e. the sensor or its
+  // ADC channel is stuck.  A live sensor always has some noise.
+  SENSOR_STUCK = 1 << 0,
+  // The readings are pinned at one end of the ADC's range, e.g. because the
+  // sensor is disconnected or saturated.
+  SENSOR_RAILED = 1 << 1,
+  // The readings changed faster than any pressure in the system can, e.g.
+  // because of a loose connection.
+  SENSOR_RATE_EXCEEDED = 1 << 2,
+};
+inline constexpr int NUM_SENSOR_FAULTS = 3;
+
+// Watches one analog sensor's raw readings for signs that the sensor, rather
+// than the patient, is what's changing.  Call AddSample() with every reading,
+// before any filtering.
+//
+//  - SENSOR_STUCK is set at the end of a WINDOW in which the reading never
+//    changed at all, and cleared at the end of one in which it did.  Each
+//    reading is the mean of a fixed number of A/D conversions, so it only
+//    takes one conversion's noise moving by an LSB to change it.  A live
+//    sensor, however quiet, does that many times a second, whereas a
+//    threshold on the readings' variance can't tell a quiet sensor from a
+//    stuck one.
+//  - SENSOR_RAILED is set once the reading has been within RAIL_LOW or
+//    RAIL_HIGH of the ADC's limits for RAIL_TIME, and cleared as soon as it
+//    isn't.
+//  - SENSOR_RATE_EXCEEDED is set as soon as two consecutive readings differ
+//    by more than MAX_RATE_VOLTS_PER_SEC allows for the time between them,
+//    or by more than MAX_STEP however long that was, and cleared at the end
+//    of the first window that passes without that happening.  MAX_STEP is
+//    what catches a jump at the slower loop rates.
+//
+// Nothing here allocates, so this is safe to run from the control loop.
+class SensorHealthMonitor {
+public:
+  inline constexpr static Duration WINDOW = seconds(1);
+  // The ADC reads 0-3.3V.  The pressure sensors' outputs stay at least this
+  // far from either end over their rated range.
+  inline constexpr static Voltage RAIL_LOW = volts(0.03f);
+  inline constexpr static Voltage RAIL_HIGH = volts(3.27f);
+  inline constexpr static Duration RAIL_TIME = milliseconds(50);
+  // The fastest real change is the patient pressure dropping when the exhale
+  // valve opens at PIP, which is under 100V/s, i.e. 1V between readings at
+  // 100Hz.
+  inline constexpr static float MAX_RATE_VOLTS_PER_SEC = 250;
+  inline constexpr static Voltage MAX_STEP = volts(1.5f);
+
+  void AddSample(Time now, Voltage reading);
+
+  // Bitwise OR of the SensorFaults that are currently active.
+  uint32_t Faults() const { return faults_; }
+
+private:
+  void EndWindow(Time now);
+
+  bool primed_ = false;
+  Time last_time_ = Hal.now();
+  float last_volts_ = 0;
+
+  Time window_start_ = Hal.now();
+  bool changed_in_window_ = false;
+  bool rate_exceeded_in_window_ = false;
+
+  bool on_rail_ = false;
+  Time rail_start_ = Hal.now();
+
+  uint32_t faults_ = 0;
+};
+
+#endif // SENSOR_HEALTH_H
@@ -21,26 +21,9 @@ Arduino Nano and the MPXV5004GP and MPXV7002DP pressure sensors.
 #include "hal.h"
 
 #include "sensors.h"
+#include "algorithm.h"
 #include <cmath>
 
-//@TODO: Potential Caution: Density of air slightly varies over temperature and
-// altitude - need mechanism to adjust based on delivery? Constant involving
-// density of air. Density assumed at 15 deg. Celsius and 1 atm of pressure.
-// Sourced from https://en.wikipedia.org/wiki/Density_of_air
-static const float DENSITY_OF_AIR_KG_PER_CUBIC_METER = 1.225f; // kg/m^3
-
-// Diameters relating to Ethan's Alpha Venturi - II
-// (https://docs.google.com/spreadsheets/d/1G9Kb-ImlluK8MOx-ce2rlHUBnTOtAFQvKjjs1bEhlpM/edit#gid=963553579)
-// Port diameter must be larger than choke diameter
-constexpr static Length DEFAULT_VENTURI_PORT_DIAM = millimeters(14);
-constexpr static Length DEFAULT_VENTURI_CHOKE_DIAM = millimeters(5.5f);
-
-static_assert(DEFAULT_VENTURI_PORT_DIAM > DEFAULT_VENTURI_CHOKE_DIAM);
-static_assert(DEFAULT_VENTURI_CHOKE_DIAM > meters(0));
-
-// TODO: VOLUME_INTEGRAL_INTERVAL was not chosen carefully.
-static constexpr Duration VOLUME_INTEGRAL_INTERVAL = milliseconds(5);
-
 /*static*/ AnalogPin Sensors::PinFor(Sensor s) {
   switch (s) {
   case PATIENT_PRESSURE:
@@ -54,7 +37,56 @@ static constexpr Duration VOLUME_INTEGRAL_INTERVAL = milliseconds(5);
   __builtin_unreachable();
 }
 
-Sensors::Sensors() {}
+Sensors::Sensors(LoopRate rate) {
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    filters_[s] = DefaultFilterChain(PinFor(s), rate);
+  }
+  for (PressureCurve &curve : calibration_curves_) {
+    curve = DefaultCalibrationCurve();
+  }
+}
+
+void Sensors::SetCalibrationCurve(AnalogPin pin,
+                                  const PressureCurve &curve) {
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    if (PinFor(s) == pin) {
+      calibration_curves_[s] = curve;
+    }
+  }
+}
+
+uint32_t Sensors::GetFaults(AnalogPin pin) const {
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    if (PinFor(s) == pin) {
+      return health_monitors_[s].Faults();
+    }
+  }
+  return 0;
+}
+
+Voltage Sensors::VoltageAt(AnalogPin pin, Pressure p) const {
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    if (PinFor(s) == pin) {
+      return volts(sensors_zero_vals_[s].volts() +
+                   calibration_curves_[s].Invert(p.kPa()));
+    }
+  }
+  return volts(0);
+}
+
+void Sensors::SetFilterChain(AnalogPin pin, const FilterChain &chain) {
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    if (PinFor(s) == pin) {
+      filters_[s] = chain;
+      filters_primed_[s] = false;
+    }
+  }
+}
 
 // NOTE - I can't do this in the constructor now because it gets called before
 // the HAL is set up, so the busy wait never finishes.
@@ -77,70 +109,175 @@ void Sensors::Calibrate() {
   // open any necessary valves, and recalibrate.
   Hal.delay(milliseconds(20));
 
+  AnalogReadings readings = Hal.analogReadAll();
   for (Sensor s :
        {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
-    sensors_zero_vals_[s] = Hal.analogRead(PinFor(s));
+    sensors_zero_vals_[s] = readings[PinFor(s)];
+    calibrated_zero_vals_[s] = readings[PinFor(s)];
   }
+  window_samples_ = 0;
 }
 
-// Reads a sensor, returning its value in kPa.
-//
-// @TODO: Add alarms if sensor value is out of expected range?
-Pressure Sensors::ReadPressureSensor(Sensor s) {
-  // The pressure sensors output 1-5V, and each additional 1V of output
-  // corresponds to an additional 1kPa of pressure difference.
-  // https://www.nxp.com/docs/en/data-sheet/MPXV5004G.pdf.
-  //
-  // The pressure sensor is scaled to 0-3.3V, which is the range captured by
-  // our ADC.  Therefore, if we multiply the received voltage by 5/3.3, we get
-  // a pressure in kPa.
-  static const float TRANSFER_FN_COEFF = 5.f / 3.3f;
-  return kPa(TRANSFER_FN_COEFF *
-             (Hal.analogRead(PinFor(s)) - sensors_zero_vals_[s]).volts());
+void Sensors::AutoZero(Time now, PneumaticState state) {
+  if (state != pneumatic_state_) {
+    pneumatic_state_ = state;
+    state_start_ = now;
+    window_samples_ = 0;
+  }
+  if (state == PneumaticState::ACTIVE ||
+      now - state_start_ < AUTO_ZERO_SETTLE_TIME) {
+    return;
+  }
+
+  float mismatch =
+      (last_readings_[INFLOW_PRESSURE_DIFF] -
+       sensors_zero_vals_[INFLOW_PRESSURE_DIFF])
+          .volts() -
+      (last_readings_[OUTFLOW_PRESSURE_DIFF] -
+       sensors_zero_vals_[OUTFLOW_PRESSURE_DIFF])
+          .volts();
+  if (window_samples_ == 0) {
+    window_start_ = now;
+    for (int i = 0; i < NUM_SENSORS; i++) {
+      float v = last_readings_[i].volts();
+      window_sum_[i] = 0;
+      window_min_[i] = v;
+      window_max_[i] = v;
+    }
+    window_mismatch_min_ = mismatch;
+    window_mismatch_max_ = mismatch;
+  }
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    float v = last_readings_[i].volts();
+    window_sum_[i] += v;
+    window_min_[i] = std::min(window_min_[i], v);
+    window_max_[i] = std::max(window_max_[i], v);
+  }
+  window_mismatch_min_ = std::min(window_mismatch_min_, mismatch);
+  window_mismatch_max_ = std::max(window_mismatch_max_, mismatch);
+  window_samples_++;
+
+  if (now - window_start_ >= AUTO_ZERO_WINDOW) {
+    EndAutoZeroWindow();
+  }
 }
 
-/*static*/ VolumetricFlow Sensors::PressureDeltaToFlow(Pressure delta) {
-  auto pow2 = [](float f) { return f * f; };
+void Sensors::EndAutoZeroWindow() {
+  float means[NUM_SENSORS];
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    means[i] = window_sum_[i] / static_cast<float>(window_samples_);
+  }
+  window_samples_ = 0;
 
-  // Returns an area in meters squared.
-  auto diameter_to_area_m2 = [&](Length diameter) {
-    return static_cast<float>(M_PI) / 4.0f * pow2(diameter.meters());
-  };
+  // The zero each sensor should have, going by this window.
+  float targets[NUM_SENSORS];
+  bool accept;
+  if (pneumatic_state_ == PneumaticState::AT_REST) {
+    accept = true;
+    for (int i = 0; i < NUM_SENSORS; i++) {
+      targets[i] = means[i];
+      accept = accept &&
+               window_max_[i] - window_min_[i] <= AUTO_ZERO_STABLE_BAND.volts();
+    }
+  } else {
+    // Both venturis should read the pressure halfway between what they read
+    // now.  This works in pressure rather than volts in case their
+    // calibration curves differ.
+    accept = window_mismatch_max_ - window_mismatch_min_ <=
+             AUTO_ZERO_STABLE_BAND.volts();
+    float kpa = 0;
+    for (Sensor s : {INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+      kpa += calibration_curves_[s].Evaluate(means[s] -
+                                             sensors_zero_vals_[s].volts()) /
+             2;
+    }
+    for (Sensor s : {INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+      targets[s] = means[s] - calibration_curves_[s].Invert(kpa);
+    }
+    targets[PATIENT_PRESSURE] = sensors_zero_vals_[PATIENT_PRESSURE].volts();
+  }
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    accept = accept &&
+             std::abs(targets[i] - calibrated_zero_vals_[i].volts()) <=
+                 AUTO_ZERO_MAX_DRIFT.volts();
+  }
+
+  if (!accept) {
+    auto_zero_stats_.rejected++;
+    return;
+  }
+  auto_zero_stats_.accepted++;
+  float max_slew = AUTO_ZERO_MAX_SLEW.volts();
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    float step = std::clamp(targets[i] - sensors_zero_vals_[i].volts(),
+                            -max_slew, max_slew);
+    sensors_zero_vals_[i] = volts(sensors_zero_vals_[i].volts() + step);
+  }
+}
 
-  float portArea = diameter_to_area_m2(DEFAULT_VENTURI_PORT_DIAM);
-  float chokeArea = diameter_to_area_m2(DEFAULT_VENTURI_CHOKE_DIAM);
-  return cubic_m_per_sec(
-      std::copysign(std::sqrt(std::abs(delta.kPa()) * 1000.0f), delta.kPa()) *
-      std::sqrt(2 / DENSITY_OF_AIR_KG_PER_CUBIC_METER) * portArea * chokeArea /
-      std::sqrt(pow2(portArea) - pow2(chokeArea)));
+Sensors::State Sensors::GetState(Time now) const {
+  State state;
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    state.zero_vals[i] = sensors_zero_vals_[i];
+    state.calibrated_zero_vals[i] = calibrated_zero_vals_[i];
+  }
+  state.auto_zero_stats = auto_zero_stats_;
+  state.tv_integrator = tv_integrator_.GetState(now);
+  return state;
 }
 
-void TVIntegrator::AddFlow(Time now, VolumetricFlow flow) {
-  // TODO: This calculation should be much more sophisticated.  Some possible
-  // improvements.
-  //
-  //  - Periodically re-zero the volume (e.g. what happens if the tubes are
-  //    disconnected from the patient?)
-  //
-  //  - Measure time with better than millisecond granularity.
-  Duration delta = now - last_flow_measurement_time_;
-  if (delta >= VOLUME_INTEGRAL_INTERVAL) {
-    volume_ =
-        volume_ + ml(delta.minutes() * (last_flow_ + flow).ml_per_min() / 2.0f);
-    last_flow_measurement_time_ = now;
-    last_flow_ = flow;
+void Sensors::RestoreState(Time now, const State &state) {
+  for (int i = 0; i < NUM_SENSORS; i++) {
+    sensors_zero_vals_[i] = state.zero_vals[i];
+    calibrated_zero_vals_[i] = state.calibrated_zero_vals[i];
   }
+  auto_zero_stats_ = state.auto_zero_stats;
+  tv_integrator_.RestoreState(now, state.tv_integrator);
+}
+
+// Converts a sensor's reading to a pressure in kPa.
+//
+// @TODO: Add alarms if sensor value is out of expected range?
+Pressure Sensors::ReadPressureSensor(Sensor s,
+                                     const AnalogReadings &readings) {
+  return kPa(calibration_curves_[s].Evaluate(
+      (readings[PinFor(s)] - sensors_zero_vals_[s]).volts()));
+}
+
+Pressure Sensors::FilterPressure(Sensor s, Pressure p) {
+  if (!filters_primed_[s]) {
+    filters_primed_[s] = true;
+    return kPa(filters_[s].Reset(p.kPa()));
+  }
+  return kPa(filters_[s].Filter(p.kPa()));
 }
 
 SensorReadings Sensors::GetSensorReadings() {
   // Flow rate is inhalation flow minus exhalation flow. Positive value is flow
   // into lungs, and negative is flow out of lungs.
-  auto patient_pressure = ReadPressureSensor(PATIENT_PRESSURE);
-  auto inflow_delta = ReadPressureSensor(INFLOW_PRESSURE_DIFF);
-  auto outflow_delta = ReadPressureSensor(OUTFLOW_PRESSURE_DIFF);
+  AnalogReadings readings = Hal.analogReadAll();
+  Time now = Hal.now();
+  for (Sensor s :
+       {PATIENT_PRESSURE, INFLOW_PRESSURE_DIFF, OUTFLOW_PRESSURE_DIFF}) {
+    last_readings_[s] = readings[PinFor(s)];
+    health_monitors_[s].AddSample(now, readings[PinFor(s)]);
+  }
+  auto patient_pressure = FilterPressure(
+      PATIENT_PRESSURE, ReadPressureSensor(PATIENT_PRESSURE, readings));
+  auto inflow_delta = FilterPressure(
+      INFLOW_PRESSURE_DIFF, ReadPressureSensor(INFLOW_PRESSURE_DIFF, readings));
+  auto outflow_delta =
+      FilterPressure(OUTFLOW_PRESSURE_DIFF,
+                     ReadPressureSensor(OUTFLOW_PRESSURE_DIFF, readings));
+  // Only run the estimator when it's in use: it costs more than the rest of
+  // this put together.
   VolumetricFlow flow =
-      PressureDeltaToFlow(inflow_delta) - PressureDeltaToFlow(outflow_delta);
-  tv_integrator_.AddFlow(Hal.now(), flow);
+      flow_source_ == FlowSource::KALMAN
+          ? flow_estimator_.Update(now, inflow_delta, outflow_delta,
+                                   patient_pressure)
+          : INFLOW_VENTURI.Flow(inflow_delta) -
+                OUTFLOW_VENTURI.Flow(outflow_delta);
+  tv_integrator_.AddFlow(now, flow);
   return {
       .patient_pressure_cm_h2o = patient_pressure.cmH2O(),
       .volume_ml = tv_integrator_.GetTV().ml(),
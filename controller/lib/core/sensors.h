@@ -22,26 +22,24 @@ Arduino Nano and the MPXV5004GP and MPXV7002DP pressure sensors.
 #ifndef SENSORS_H
 #define SENSORS_H
 
+#include "breath_tv_integrator.h"
+#include "calibration_curve.h"
+#include "filter.h"
+#include "flow_estimator.h"
 #include "hal.h"
 #include "network_protocol.pb.h"
+#include "sensor_health.h"
 #include "units.h"
-
-class TVIntegrator {
-public:
-  void AddFlow(Time now, VolumetricFlow flow);
-  Volume GetTV() const { return volume_; }
-
-private:
-  Time last_flow_measurement_time_ = Hal.now();
-  VolumetricFlow last_flow_ = cubic_m_per_sec(0);
-  Volume volume_ = ml(0);
-};
+#include "venturi.h"
+#include <stdint.h>
 
 // Provides calibrated sensor readings, including tidal volume (TV)
-// integrated from flow.
+// integrated from flow.  The volume is re-zeroed at the start of every breath
+// and corrected for offsets in the flow sensors, see BreathTVIntegrator.
 class Sensors {
 public:
-  Sensors();
+  // `rate` is the rate at which the control loop calls GetSensorReadings().
+  explicit Sensors(LoopRate rate = DEFAULT_LOOP_RATE);
 
   // Perform some initial sensor calibration.  This function should
   // be called on system startup before any other sensor functions
@@ -52,24 +50,165 @@ public:
   // volume) from the sensors
   SensorReadings GetSensorReadings();
 
+  // Each sensor's readings go through their own chain of filters after
+  // they're converted to pressure, and before we compute flow from them.
+  using FilterChain = BiquadChain<2>;
+
+  // Breathing waveforms have little content above ~10Hz (rise times are
+  // ~100ms), so by default we low-pass the differential sensors somewhat
+  // above that, or at 0.3x the loop rate if that's lower.  The second stage
+  // passes through; it's there for e.g. a notch at a blower harmonic.
+  //
+  // The patient pressure passes straight through by default.  It's the
+  // pressure PID's input, where the low-pass's lag (about 7ms at 30Hz) would
+  // eat into the phase margin the PID's tuning leaves.
+  static constexpr float DEFAULT_LOW_PASS_HZ = 30;
+  static constexpr FilterChain DefaultFilterChain(AnalogPin pin,
+                                                  LoopRate rate) {
+    if (pin == AnalogPin::PATIENT_PRESSURE) {
+      return FilterChain();
+    }
+    float sample_rate_hz = 1 / LoopPeriod(rate).seconds();
+    float cutoff_hz = DEFAULT_LOW_PASS_HZ < 0.3f * sample_rate_hz
+                          ? DEFAULT_LOW_PASS_HZ
+                          : 0.3f * sample_rate_hz;
+    return FilterChain(LowPassBiquad(sample_rate_hz, cutoff_hz),
+                       PassThroughBiquad());
+  }
+
+  // Replaces the filters for the sensor on `pin`.  The new chain starts out
+  // settled at the next reading, so changing filters doesn't cause a jump.
+  void SetFilterChain(AnalogPin pin, const FilterChain &chain);
+
+  // Each sensor's calibration curve maps its voltage, relative to the
+  // voltage it read at zero pressure (see Calibrate()), to kPa.
+  using PressureCurve = CalibrationCurve<17>;
+
+  // The MPXV5004DP outputs 1-5V, and each additional 1V of output corresponds
+  // to an additional 1kPa of pressure difference.
+  // https://www.nxp.com/docs/en/data-sheet/MPXV5004G.pdf.
+  //
+  // Our PCB scales the output to 0-3.3V, which is the range captured by the
+  // ADC.  Therefore, if we multiply the received voltage by 5/3.3, we get a
+  // pressure in kPa.
+  static constexpr float Mpxv5004KPa(float volts_above_zero) {
+    return 5.f / 3.3f * volts_above_zero;
+  }
+
+  // The datasheet's transfer function, tabulated at compile time.  The curve
+  // covers every difference between two voltages the ADC can read.
+  static constexpr PressureCurve DefaultCalibrationCurve() {
+    return PressureCurve::FromFunction(-3.3f, 3.3f, Mpxv5004KPa);
+  }
+
+  // Replaces the calibration curve for the sensor on `pin`, e.g. with one
+  // measured against a reference manometer.  The zero reading still applies.
+  void SetCalibrationCurve(AnalogPin pin, const PressureCurve &curve);
+
+  // The reverse of calibration: the raw voltage at which the sensor on `pin`
+  // reads `p`, given its current zero and calibration curve.  E.g. for
+  // setting a threshold on the raw A/D readings, see HalApi::adcCapture().
+  Voltage VoltageAt(AnalogPin pin, Pressure p) const;
+
+  // Calibrate() zeroes the sensors only once, at boot, and their offsets drift
+  // with temperature.  So whenever we know what the sensors should read, we
+  // re-measure the zeros and track them.  That's in one of two states of the
+  // pneumatics:
+  //
+  //  - AT_REST: The blower is off and the exhale valve open, e.g. ventilation
+  //    is off.  Every sensor should read zero.
+  //  - EXPIRATORY_HOLD: Expiration in pressure control, i.e. the blower holds
+  //    PEEP with the exhale valve open.  Neither venturi reads zero, since
+  //    the blower's flow goes through both of them on its way out of the
+  //    exhale valve.  But once the patient has breathed out, no air flows to
+  //    or from them, so both venturis read the same pressure difference.
+  //    We can't tell which of their zeros drifted, so we move each by half of
+  //    the mismatch, which zeroes the patient's flow.  The patient pressure
+  //    sensor reads PEEP, not zero, so its zero is left alone.
+  //
+  // Call AutoZero() after each GetSensorReadings(), saying which of these
+  // states the pneumatics are in, if either.  Once they've been in the same
+  // one for AUTO_ZERO_SETTLE_TIME, which lets the blower spin down (or the
+  // patient breathe out), the readings are averaged over windows of
+  // AUTO_ZERO_WINDOW.  A window is accepted only if both of these hold:
+  //
+  //  - No air flowed to or from the patient, e.g. from a patient breathing
+  //    on their own: at rest, each sensor's readings stayed within
+  //    AUTO_ZERO_STABLE_BAND; in an expiratory hold, the mismatch between
+  //    the venturis did.
+  //  - The zero each sensor would get is within AUTO_ZERO_MAX_DRIFT of the
+  //    zero Calibrate() measured.  This keeps a stuck or failed sensor from
+  //    dragging its zero along.
+  //
+  // An accepted window moves each zero towards its new value by at most
+  // AUTO_ZERO_MAX_SLEW, so readings never jump.  A rejected window changes
+  // nothing.  This is O(1) per call.
+  //
+  // BreathTVIntegrator corrects whatever flow offset remains.
+  enum class PneumaticState { ACTIVE, AT_REST, EXPIRATORY_HOLD };
+  void AutoZero(Time now, PneumaticState state);
+
+  inline constexpr static Duration AUTO_ZERO_SETTLE_TIME = seconds(1);
+  inline constexpr static Duration AUTO_ZERO_WINDOW = milliseconds(250);
+  inline constexpr static Voltage AUTO_ZERO_STABLE_BAND = volts(0.02f);
+  inline constexpr static Voltage AUTO_ZERO_MAX_DRIFT = volts(0.1f);
+  inline constexpr static Voltage AUTO_ZERO_MAX_SLEW = volts(0.005f);
+
+  // Number of auto-zero windows accepted and rejected so far.
+  struct AutoZeroStats {
+    uint32_t accepted;
+    uint32_t rejected;
+  };
+  AutoZeroStats GetAutoZeroStats() const { return auto_zero_stats_; }
+
+  // How GetSensorReadings() computes the flow into the patient.  VENTURIS is
+  // the inflow venturi's flow minus the outflow venturi's.  KALMAN fuses the
+  // venturis with the patient pressure, see FlowEstimator; it's less noisy,
+  // but its noise model was tuned on readings taken at 100Hz without the
+  // sensor filters, so it's opt-in for now.  Volume is integrated from
+  // whichever flow is selected.  The estimator only runs while it's
+  // selected, and starts afresh each time it is.
+  enum class FlowSource { VENTURIS, KALMAN };
+  void SetFlowSource(FlowSource source) {
+    if (source == FlowSource::KALMAN && flow_source_ != source) {
+      flow_estimator_.Reset();
+    }
+    flow_source_ = source;
+  }
+
+  // Each sensor's raw readings are watched by a SensorHealthMonitor on every
+  // call to GetSensorReadings().  Returns the SensorFaults active for the
+  // sensor on `pin`.
+  uint32_t GetFaults(AnalogPin pin) const;
+
   // min/max possible reading from MPXV5004GP pressure sensors
   // The canonical list of hardware in the device is: https://bit.ly/3aERr69
   inline constexpr static Pressure P_VAL_MIN = kPa(0.0f);
   inline constexpr static Pressure P_VAL_MAX = kPa(3.92f);
 
+  // The venturis the differential pressure sensors are attached to.  Both are
+  // Ethan's Alpha Venturi - II for now
+  // (https://docs.google.com/spreadsheets/d/1G9Kb-ImlluK8MOx-ce2rlHUBnTOtAFQvKjjs1bEhlpM/edit#gid=963553579),
+  // but they needn't be the same.  The geometry is folded into each one's
+  // coefficient at compile time; see venturi.h.
+  inline constexpr static Venturi DEFAULT_VENTURI =
+      Venturi(millimeters(14), millimeters(5.5f));
+  inline constexpr static Venturi INFLOW_VENTURI = DEFAULT_VENTURI;
+  inline constexpr static Venturi OUTFLOW_VENTURI = DEFAULT_VENTURI;
+  static_assert(INFLOW_VENTURI.Coefficient() > 0);
+  static_assert(OUTFLOW_VENTURI.Coefficient() > 0);
+
   /*
-   * @brief Method implements Bernoulli's equation assuming the Venturi Effect.
-   * https://en.wikipedia.org/wiki/Venturi_effect
-   *
-   * Solves for the volumetric flow rate since A1/A2, rho, and differential
-   * pressure are known. Q = sqrt(2/rho) * (A1*A2) * 1/sqrt(A1^2-A2^2) *
-   * sqrt(p1-p2); based on (p1 - p2) = (rho/2) * (v2^2 - v1^2); where A1 > A2
+   * @brief Method implements Bernoulli's equation assuming the Venturi Effect,
+   * for DEFAULT_VENTURI.  See Venturi::Flow().
    *
    * @return the volumetric flow in [meters^3/s]. Can be negative, indicating
    * direction of flow, depending on how the differential sensor is attached to
    * the venturi.
    */
-  static VolumetricFlow PressureDeltaToFlow(Pressure delta);
+  static VolumetricFlow PressureDeltaToFlow(Pressure delta) {
+    return DEFAULT_VENTURI.Flow(delta);
+  }
 
 private:
   enum Sensor {
@@ -80,14 +219,66 @@ private:
   // Keep this in sync with the Sensor enum!
   inline constexpr static int NUM_SENSORS = 3;
 
+public:
+  // Calibration and volume integration state, for carrying it over a warm
+  // restart.  RestoreState() replaces calling Calibrate(): the zero readings
+  // taken before the restart are still good, and we couldn't retake them
+  // with a patient attached anyway.
+  struct State {
+    Voltage zero_vals[NUM_SENSORS];
+    Voltage calibrated_zero_vals[NUM_SENSORS];
+    AutoZeroStats auto_zero_stats;
+    BreathTVIntegrator::State tv_integrator;
+  };
+
+  State GetState(Time now) const;
+  void RestoreState(Time now, const State &state);
+
+private:
   static AnalogPin PinFor(Sensor s);
-  Pressure ReadPressureSensor(Sensor s);
+  Pressure ReadPressureSensor(Sensor s, const AnalogReadings &readings);
+  Pressure FilterPressure(Sensor s, Pressure p);
+  // Accepts or rejects the current auto-zero window, and starts a new one.
+  void EndAutoZeroWindow();
 
   // Calibrated average sensor values in a zero state.
   Voltage sensors_zero_vals_[NUM_SENSORS];
+  // The zero values Calibrate() measured.  AutoZero() keeps
+  // sensors_zero_vals_ within AUTO_ZERO_MAX_DRIFT of these.
+  Voltage calibrated_zero_vals_[NUM_SENSORS];
+
+  // Raw readings from the last call to GetSensorReadings(), for AutoZero().
+  Voltage last_readings_[NUM_SENSORS];
+
+  // Auto-zero state.  Window statistics are in volts.  The mismatch is how
+  // much more the inflow venturi reads than the outflow one.
+  PneumaticState pneumatic_state_ = PneumaticState::ACTIVE;
+  Time state_start_ = Hal.now();
+  Time window_start_ = Hal.now();
+  int window_samples_ = 0;
+  float window_sum_[NUM_SENSORS] = {};
+  float window_min_[NUM_SENSORS] = {};
+  float window_max_[NUM_SENSORS] = {};
+  float window_mismatch_min_ = 0;
+  float window_mismatch_max_ = 0;
+  AutoZeroStats auto_zero_stats_ = {};
+
+  PressureCurve calibration_curves_[NUM_SENSORS];
+
+  FilterChain filters_[NUM_SENSORS];
+  // Whether each filter has seen a reading yet; the first reading settles
+  // it, rather than filtering a step from 0.
+  bool filters_primed_[NUM_SENSORS] = {};
+
+  SensorHealthMonitor health_monitors_[NUM_SENSORS];
+
+  FlowSource flow_source_ = FlowSource::VENTURIS;
+  // Only updated while FlowSource::KALMAN is selected, and reset each time
+  // it's selected; see SetFlowSource().
+  FlowEstimator flow_estimator_{INFLOW_VENTURI, OUTFLOW_VENTURI};
 
-  // State related to integrating volume from flow.
-  TVIntegrator tv_integrator_;
+  // Tidal volume, integrated from flow one breath at a time.
+  BreathTVIntegrator tv_integrator_;
 };
 
 #endif // SENSORS_H
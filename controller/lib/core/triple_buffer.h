@@ -0,0 +1,89 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef TRIPLE_BUFFER_H_
+#define TRIPLE_BUFFER_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// Wait-free handoff of a value from one writer to one reader, e.g. from the
+// control loop ISR to the background loop or vice versa.
+//
+// The writer fills in WriteBuffer() and then calls Publish() to make it the
+// latest snapshot.  The reader calls Read() to get the most recent snapshot
+// that was published.  Neither side ever waits for the other or needs to
+// disable interrupts, and the reader never sees a half-written value.  If
+// the writer publishes several times between two reads, the reader only sees
+// the last one.
+//
+// This works by keeping three copies of T:
+//
+//  - the back buffer, which only the writer touches,
+//  - the front buffer, which only the reader touches, and
+//  - the middle buffer, which holds the latest published snapshot.
+//
+// Publish() swaps the back and middle buffers, and Read() swaps the middle
+// and front buffers if something new was published.  Both swaps are a single
+// atomic exchange of a byte which encodes the index of the middle buffer and
+// whether it's been published since the reader last took it.
+//
+// This costs three copies of T, but T doesn't need to be copied at all to
+// hand it off.  Note that WriteBuffer() returns whichever buffer the writer
+// was given back from the last Publish(), so the writer must either fill in
+// every field each time, or use Publish(const T &).
+template <class T> class TripleBuffer {
+public:
+  // Writer side: the buffer to fill in before calling Publish().
+  T &WriteBuffer() { return buffers_[back_]; }
+
+  // Writer side: makes WriteBuffer() the latest snapshot.
+  void Publish() {
+    back_ = middle_.exchange(static_cast<uint8_t>(back_ | FRESH),
+                             std::memory_order_acq_rel) &
+            INDEX_MASK;
+  }
+
+  void Publish(const T &val) {
+    WriteBuffer() = val;
+    Publish();
+  }
+
+  // Reader side: returns the latest published snapshot, or a
+  // value-initialized T if nothing has been published yet.
+  //
+  // The returned reference stays valid and unchanged until the next call to
+  // Read().
+  const T &Read() {
+    if (middle_.load(std::memory_order_relaxed) & FRESH) {
+      front_ = middle_.exchange(front_, std::memory_order_acq_rel) &
+               INDEX_MASK;
+    }
+    return buffers_[front_];
+  }
+
+private:
+  static constexpr uint8_t INDEX_MASK = 0x3;
+  static constexpr uint8_t FRESH = 0x4;
+
+  static_assert(std::atomic<uint8_t>::is_always_lock_free);
+
+  T buffers_[3] = {};
+  uint8_t front_ = 0;
+  std::atomic<uint8_t> middle_{1};
+  uint8_t back_ = 2;
+};
+
+#endif // TRIPLE_BUFFER_H_
@@ -0,0 +1,28 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "tv_integrator.h"
+
+void TVIntegrator::AddFlow(Time now, VolumetricFlow flow) {
+  // A sample that's no newer than the last one would make a trapezoid of
+  // zero (or negative) width, so we ignore it.
+  Duration delta = now - last_flow_measurement_time_;
+  if (delta > microseconds(0)) {
+    volume_ = volume_ + cubic_m(delta.seconds() *
+                                (last_flow_ + flow).cubic_m_per_sec() / 2.0f);
+    last_flow_measurement_time_ = now;
+    last_flow_ = flow;
+  }
+}
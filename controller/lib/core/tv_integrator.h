@@ -0,0 +1,64 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef TV_INTEGRATOR_H
+#define TV_INTEGRATOR_H
+
+#include "hal.h"
+#include "units.h"
+
+// Integrates flow into volume with the trapezoidal rule, adding a trapezoid
+// for every sample.  Times have microsecond resolution, so this stays
+// accurate at high flow and at the control loop's faster rates, where a
+// loop period is only a millisecond or two.
+//
+// This accumulates forever, so any offset in the flow makes the volume drift.
+// BreathTVIntegrator builds on it to re-zero every breath and correct for the
+// offset.
+class TVIntegrator {
+public:
+  void AddFlow(Time now, VolumetricFlow flow);
+  Volume GetTV() const { return volume_; }
+
+  // Starts integrating from `volume` (by default zero) again.
+  void ResetVolume(Volume volume = ml(0)) { volume_ = volume; }
+
+  // The integral so far, for carrying it over a warm restart.  The time of
+  // the last measurement is relative to when the state was taken.
+  struct State {
+    Duration since_last_flow;
+    VolumetricFlow last_flow;
+    Volume volume;
+  };
+
+  State GetState(Time now) const {
+    return {.since_last_flow = now - last_flow_measurement_time_,
+            .last_flow = last_flow_,
+            .volume = volume_};
+  }
+
+  void RestoreState(Time now, const State &state) {
+    last_flow_measurement_time_ = now - state.since_last_flow;
+    last_flow_ = state.last_flow;
+    volume_ = state.volume;
+  }
+
+private:
+  Time last_flow_measurement_time_ = Hal.now();
+  VolumetricFlow last_flow_ = cubic_m_per_sec(0);
+  Volume volume_ = ml(0);
+};
+
+#endif // TV_INTEGRATOR_H
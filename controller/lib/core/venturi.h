@@ -0,0 +1,154 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef VENTURI_H
+#define VENTURI_H
+
+#include "calibration_curve.h"
+#include "units.h"
+#include <cmath>
+#include <limits>
+#include <stdint.h>
+#include <string.h>
+
+namespace venturi_detail {
+
+// Newton's method, for computing constants at compile time (std::sqrt isn't
+// constexpr).  Converges quadratically once it's close; the starting guess
+// only has to be on the high side.
+constexpr double Sqrt(double x) {
+  if (x <= 0) {
+    return 0;
+  }
+  double r = x > 1 ? x : 1;
+  for (int i = 0; i < 200; i++) {
+    double next = 0.5 * (r + x / r);
+    if (next >= r) {
+      break;
+    }
+    r = next;
+  }
+  return r;
+}
+
+// sqrt on [1, 4], which is all TableSqrt() needs to look up.
+inline constexpr CalibrationCurve<33> SQRT_1_TO_4 =
+    CalibrationCurve<33>::FromFunction(
+        1, 4, [](float m) { return static_cast<float>(Sqrt(m)); });
+
+} // namespace venturi_detail
+
+// Square root by table lookup and linear interpolation.
+//
+// Write x = m * 2^e with e even, so that m is in [1, 4).  Then
+// sqrt(x) = sqrt(m) * 2^(e/2); the first factor comes from a 33-point table
+// and the second is exact, since it only sets a float's exponent.  Splitting
+// x up is bit manipulation, so there are no branches or divides.
+//
+// Linear interpolation of sqrt with step h = 3/32 is off by at most
+// h^2/8 * max|sqrt''| = h^2/32 on [1, 4], and sqrt(m) >= 1 there, so the
+// relative error is below TABLE_SQRT_MAX_RELATIVE_ERROR for all x.  That's
+// far below the pressure sensors' own error.
+//
+// Returns 0 for x <= 0 and for denormals.
+inline constexpr float TABLE_SQRT_MAX_RELATIVE_ERROR = 3e-4f;
+
+inline float TableSqrt(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  int32_t e = static_cast<int32_t>((bits >> 23) & 0xFF) - 127;
+  // If e is odd, fold a factor of two into m: m in [2, 4).
+  uint32_t odd = static_cast<uint32_t>(e) & 1;
+  uint32_t m_bits = (bits & 0x007FFFFF) | ((127 + odd) << 23);
+  float m;
+  memcpy(&m, &m_bits, sizeof(m));
+  int32_t half_e = (e - static_cast<int32_t>(odd)) / 2;
+  uint32_t scale_bits = static_cast<uint32_t>(half_e + 127) << 23;
+  float scale;
+  memcpy(&scale, &scale_bits, sizeof(scale));
+  float r = venturi_detail::SQRT_1_TO_4.Evaluate(m) * scale;
+  return x >= std::numeric_limits<float>::min() ? r : 0;
+}
+
+// How Venturi::Flow() takes its square root.
+//
+// The STM32's FPU has a square root instruction (VSQRT, 14 cycles), so EXACT
+// is the default.  TABLE is for targets without one, where sqrtf is a
+// software routine costing hundreds of cycles.
+enum class SqrtMethod { EXACT, TABLE };
+
+// A venturi flow meter: a tube that narrows from a port of one diameter to a
+// choke of a smaller one.  Bernoulli's equation relates the pressure drop
+// between the two to the flow through the tube,
+// https://en.wikipedia.org/wiki/Venturi_effect:
+//
+//   Q = sqrt(2/rho) * A1*A2 / sqrt(A1^2 - A2^2) * sqrt(p1 - p2)
+//
+// where A1 > A2 are the port and choke areas.  Everything but sqrt(p1 - p2)
+// depends only on the geometry, so we fold it into one coefficient when the
+// venturi is constructed, which for a constexpr venturi is at compile time.
+// That leaves one square root and one multiply per reading.
+class Venturi {
+public:
+  //@TODO: Potential Caution: Density of air slightly varies over temperature
+  // and altitude - need mechanism to adjust based on delivery? Density
+  // assumed at 15 deg. Celsius and 1 atm of pressure.
+  // Sourced from https://en.wikipedia.org/wiki/Density_of_air
+  inline constexpr static float DENSITY_OF_AIR_KG_PER_CUBIC_METER = 1.225f;
+
+  // port_diameter must be larger than choke_diameter, and choke_diameter
+  // larger than 0; otherwise the coefficient comes out as 0 and Flow() always
+  // returns 0.  Check constexpr venturis with a static_assert on
+  // Coefficient().
+  constexpr Venturi(Length port_diameter, Length choke_diameter,
+                    SqrtMethod sqrt_method = SqrtMethod::EXACT)
+      : coefficient_(ComputeCoefficient(port_diameter, choke_diameter)),
+        sqrt_method_(sqrt_method) {}
+
+  // Flow for a pressure drop of `delta` from port to choke.  Negative deltas
+  // give negative flows, i.e. flow in the other direction.
+  VolumetricFlow Flow(Pressure delta) const {
+    float pa = delta.kPa() * 1000.0f;
+    float magnitude = std::abs(pa);
+    float root = sqrt_method_ == SqrtMethod::TABLE ? TableSqrt(magnitude)
+                                                   : std::sqrt(magnitude);
+    return cubic_m_per_sec(std::copysign(coefficient_ * root, pa));
+  }
+
+  // Flow in m^3/s per sqrt(Pa) of pressure drop.
+  constexpr float Coefficient() const { return coefficient_; }
+
+private:
+  static constexpr float ComputeCoefficient(Length port_diameter,
+                                            Length choke_diameter) {
+    double port = port_diameter.meters();
+    double choke = choke_diameter.meters();
+    if (!(port > choke && choke > 0)) {
+      return 0;
+    }
+    constexpr double PI = 3.14159265358979323846;
+    double port_area = PI / 4 * port * port;
+    double choke_area = PI / 4 * choke * choke;
+    return static_cast<float>(
+        venturi_detail::Sqrt(2 / double{DENSITY_OF_AIR_KG_PER_CUBIC_METER}) *
+        port_area * choke_area /
+        venturi_detail::Sqrt(port_area * port_area - choke_area * choke_area));
+  }
+
+  float coefficient_;
+  SqrtMethod sqrt_method_;
+};
+
+#endif // VENTURI_H
@@ -0,0 +1,118 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef WARM_RESTART_H_
+#define WARM_RESTART_H_
+
+#include "checksum.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// Place a global in RAM which isn't cleared or initialized at boot, so it
+// survives a reset (but not a power cycle).  See the .noinit section in the
+// linker script.
+//
+// The variable must not have a constructor which does anything, or it will
+// be overwritten at startup anyway.  In test mode this does nothing; tests
+// simulate a reset by keeping the variable around.
+#if defined(BARE_STM32)
+#define NO_INIT_RAM __attribute__((section(".noinit")))
+#else
+#define NO_INIT_RAM
+#endif
+
+// A snapshot of some state T which survives a reset, for a warm restart.
+//
+// Declare one as a NO_INIT_RAM global, Save() the state regularly, and after
+// a reset Restore() it.  Restore() only succeeds if a snapshot was saved by
+// the same firmware before the reset and wasn't damaged: after a power cycle
+// the RAM holds garbage, which the checksum rejects.
+//
+// We keep two copies and alternate between them, so if we reset halfway
+// through a Save(), the previous snapshot is still good.
+//
+// This class is deliberately trivial (no constructor, no member initializers)
+// so that the compiler doesn't initialize it at startup.
+template <class T> class WarmRestartSnapshot {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Snapshots are copied as raw bytes");
+
+public:
+  void Save(const T &state) {
+    Slot &slot = slots_[(sequence_ + 1) % 2];
+    // Invalidate the slot first, so that it doesn't look good if we're
+    // interrupted halfway through.
+    slot.crc = ~slot.crc;
+    slot.sequence = sequence_ + 1;
+    memcpy(slot.state, &state, sizeof(T));
+    slot.crc = Crc(slot);
+    sequence_++;
+  }
+
+  // Copies the most recent good snapshot into `state` and returns true, or
+  // returns false if there isn't one.
+  bool Restore(T *state) {
+    const Slot *best = nullptr;
+    for (const Slot &slot : slots_) {
+      if (slot.crc == Crc(slot) &&
+          (best == nullptr ||
+           static_cast<int32_t>(slot.sequence - best->sequence) > 0)) {
+        best = &slot;
+      }
+    }
+    if (best == nullptr) {
+      return false;
+    }
+    memcpy(state, best->state, sizeof(T));
+    sequence_ = best->sequence;
+    return true;
+  }
+
+  // Discards any saved snapshot, e.g. if the state it holds is known to be
+  // bad.
+  void Invalidate() {
+    for (Slot &slot : slots_) {
+      slot.crc = ~Crc(slot);
+    }
+  }
+
+private:
+  struct Slot {
+    uint32_t sequence;
+    alignas(T) char state[sizeof(T)];
+    uint32_t crc;
+  };
+
+  // The checksum covers the sequence number and the state.  We also mix in
+  // the size of T, so a snapshot from firmware with a different layout is
+  // (usually) rejected.
+  //
+  // The control loop saves a snapshot every pressure loop period, so this
+  // uses the word-wise checksum: soft_crc32() would take ~100us for a
+  // snapshot this size.
+  static uint32_t Crc(const Slot &slot) {
+    static_assert(offsetof(Slot, crc) % sizeof(uint32_t) == 0);
+    return checksum_words32(&slot, static_cast<uint32_t>(offsetof(Slot, crc) /
+                                                         sizeof(uint32_t))) ^
+           static_cast<uint32_t>(sizeof(T));
+  }
+
+  Slot slots_[2];
+  uint32_t sequence_;
+};
+
+#endif // WARM_RESTART_H_
@@ -0,0 +1,270 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+// Digital filters for sensor readings: biquads (second-order IIR sections),
+// chains of biquads, and FIR filters.
+//
+// Coefficients are designed by constexpr functions, so for a fixed sample
+// rate they're computed by the compiler, e.g.
+//
+//   constexpr BiquadCoeffs LOW_PASS =
+//       LowPassBiquad(/*sample_rate_hz=*/100, /*cutoff_hz=*/20);
+//   Biquad filter(LOW_PASS);
+//   ...
+//   float y = filter.Filter(x);
+//
+// All state lives in the filter objects; there's no heap, and Filter() costs a
+// handful of multiply-adds per stage or tap, so it's fine to call from the
+// control loop.  Filtering is done in single precision, which is what the
+// Cortex-M4's FPU does, while the design math is done in double precision at
+// compile time.
+
+namespace filter_design {
+
+constexpr double PI = 3.14159265358979323846;
+
+// std::sin and std::cos aren't constexpr, so we have our own.  These are only
+// used to design filters, i.e. for angles of a few radians, where a Taylor
+// series converges quickly.
+constexpr double Sin(double x) {
+  // Reduce x to [-pi, pi].
+  while (x > PI) {
+    x -= 2 * PI;
+  }
+  while (x < -PI) {
+    x += 2 * PI;
+  }
+  double term = x;
+  double sum = x;
+  for (int n = 1; n < 15; n++) {
+    term *= -x * x / ((2 * n) * (2 * n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double Cos(double x) { return Sin(x + PI / 2); }
+
+} // namespace filter_design
+
+// Coefficients of a biquad, normalized so that a0 == 1:
+//
+//   y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+struct BiquadCoeffs {
+  float b0, b1, b2, a1, a2;
+
+  // Gain at 0Hz, i.e. the ratio of output to input once a constant input
+  // has settled.
+  constexpr float DcGain() const { return (b0 + b1 + b2) / (1 + a1 + a2); }
+};
+
+// Passes its input through unchanged.
+constexpr BiquadCoeffs PassThroughBiquad() {
+  return {.b0 = 1, .b1 = 0, .b2 = 0, .a1 = 0, .a2 = 0};
+}
+
+// The designs below follow Robert Bristow-Johnson's "Audio EQ Cookbook",
+// https://www.w3.org/TR/audio-eq-cookbook/.  `q` controls the shape of the
+// response around the cutoff or center frequency.  The default for the
+// low-pass, 1/sqrt(2), gives a Butterworth response: flat in the passband,
+// with no overshoot to speak of.  Frequencies must be below
+// sample_rate_hz / 2.
+namespace filter_design {
+
+struct CookbookParams {
+  double cos_w0;
+  double alpha;
+};
+
+constexpr CookbookParams Cookbook(float sample_rate_hz, float freq_hz,
+                                  float q) {
+  double w0 = 2 * PI * static_cast<double>(freq_hz) /
+              static_cast<double>(sample_rate_hz);
+  return {.cos_w0 = Cos(w0), .alpha = Sin(w0) / (2 * static_cast<double>(q))};
+}
+
+constexpr BiquadCoeffs Normalize(double b0, double b1, double b2, double a0,
+                                 double a1, double a2) {
+  return {.b0 = static_cast<float>(b0 / a0),
+          .b1 = static_cast<float>(b1 / a0),
+          .b2 = static_cast<float>(b2 / a0),
+          .a1 = static_cast<float>(a1 / a0),
+          .a2 = static_cast<float>(a2 / a0)};
+}
+
+} // namespace filter_design
+
+// Second order low-pass filter.  Unity gain at 0Hz, falling off at 12dB per
+// octave above cutoff_hz.
+constexpr BiquadCoeffs LowPassBiquad(float sample_rate_hz, float cutoff_hz,
+                                     float q = 0.70710678f) {
+  auto [cos_w0, alpha] =
+      filter_design::Cookbook(sample_rate_hz, cutoff_hz, q);
+  return filter_design::Normalize((1 - cos_w0) / 2, 1 - cos_w0,
+                                  (1 - cos_w0) / 2, 1 + alpha, -2 * cos_w0,
+                                  1 - alpha);
+}
+
+// Notch (band-stop) filter, which removes center_hz and passes everything
+// else with unity gain, e.g. to take out vibration from the blower.  The
+// width of the notch is center_hz / q.
+constexpr BiquadCoeffs NotchBiquad(float sample_rate_hz, float center_hz,
+                                   float q) {
+  auto [cos_w0, alpha] =
+      filter_design::Cookbook(sample_rate_hz, center_hz, q);
+  return filter_design::Normalize(1, -2 * cos_w0, 1, 1 + alpha, -2 * cos_w0,
+                                  1 - alpha);
+}
+
+// A biquad in transposed direct form II, which needs only two words of state
+// and behaves well in single precision.
+class Biquad {
+public:
+  constexpr explicit Biquad(const BiquadCoeffs &coeffs = PassThroughBiquad())
+      : c_(coeffs) {}
+
+  float Filter(float x) {
+    float y = c_.b0 * x + z1_;
+    z1_ = c_.b1 * x - c_.a1 * y + z2_;
+    z2_ = c_.b2 * x - c_.a2 * y;
+    return y;
+  }
+
+  // Sets the state as if the input had been `x` forever, so that there's no
+  // transient when we start filtering a signal which isn't near 0.  Returns
+  // the output for that input.
+  float Reset(float x) {
+    float y = c_.DcGain() * x;
+    z2_ = c_.b2 * x - c_.a2 * y;
+    z1_ = c_.b1 * x - c_.a1 * y + z2_;
+    return y;
+  }
+
+  const BiquadCoeffs &Coeffs() const { return c_; }
+
+private:
+  BiquadCoeffs c_;
+  float z1_ = 0;
+  float z2_ = 0;
+};
+
+// Biquads applied one after the other, for filters of order higher than two
+// or to combine e.g. a low-pass and a notch.
+template <int STAGES> class BiquadChain {
+public:
+  // Defaults to passing the input through unchanged.
+  constexpr BiquadChain() = default;
+
+  template <class... Coeffs>
+  constexpr explicit BiquadChain(const Coeffs &...coeffs)
+      : stages_{Biquad(coeffs)...} {
+    static_assert(sizeof...(coeffs) == STAGES,
+                  "Need coefficients for every stage");
+  }
+
+  float Filter(float x) {
+    for (Biquad &stage : stages_) {
+      x = stage.Filter(x);
+    }
+    return x;
+  }
+
+  // See Biquad::Reset().
+  float Reset(float x) {
+    for (Biquad &stage : stages_) {
+      x = stage.Reset(x);
+    }
+    return x;
+  }
+
+private:
+  Biquad stages_[STAGES];
+};
+
+template <int TAPS> struct FirCoeffs {
+  float h[TAPS];
+};
+
+// Linear-phase low-pass FIR filter: a windowed sinc, with a Hamming window,
+// normalized to unity gain at 0Hz.  The delay is (TAPS - 1) / 2 samples at
+// all frequencies, which is the price for not distorting the signal's shape.
+template <int TAPS>
+constexpr FirCoeffs<TAPS> LowPassFir(float sample_rate_hz, float cutoff_hz) {
+  using filter_design::Cos;
+  using filter_design::PI;
+  using filter_design::Sin;
+  static_assert(TAPS > 0);
+
+  double fc = static_cast<double>(cutoff_hz) /
+              static_cast<double>(sample_rate_hz);
+  double h[TAPS] = {};
+  double sum = 0;
+  for (int i = 0; i < TAPS; i++) {
+    double n = i - (TAPS - 1) / 2.0;
+    double sinc = n == 0 ? 2 * fc : Sin(2 * PI * fc * n) / (PI * n);
+    double window = TAPS == 1 ? 1 : 0.54 - 0.46 * Cos(2 * PI * i / (TAPS - 1));
+    h[i] = sinc * window;
+    sum += h[i];
+  }
+
+  FirCoeffs<TAPS> coeffs = {};
+  for (int i = 0; i < TAPS; i++) {
+    coeffs.h[i] = static_cast<float>(h[i] / sum);
+  }
+  return coeffs;
+}
+
+template <int TAPS> class FirFilter {
+public:
+  constexpr explicit FirFilter(const FirCoeffs<TAPS> &coeffs)
+      : coeffs_(coeffs) {}
+
+  float Filter(float x) {
+    // y[n] = sum of h[k] x[n-k].  history_ is a ring buffer with the oldest
+    // sample at next_, so it pairs up with h[TAPS - 1].  Rather than checking
+    // for wraparound on every tap, walk the ring in two pieces.
+    history_[next_] = x;
+    next_ = next_ + 1 == TAPS ? 0 : next_ + 1;
+    float y = 0;
+    int tap = TAPS - 1;
+    for (int i = next_; i < TAPS; i++) {
+      y += coeffs_.h[tap--] * history_[i];
+    }
+    for (int i = 0; i < next_; i++) {
+      y += coeffs_.h[tap--] * history_[i];
+    }
+    return y;
+  }
+
+  // Sets the state as if the input had been `x` forever.
+  float Reset(float x) {
+    float gain = 0;
+    for (int i = 0; i < TAPS; i++) {
+      history_[i] = x;
+      gain += coeffs_.h[i];
+    }
+    return gain * x;
+  }
+
+private:
+  FirCoeffs<TAPS> coeffs_;
+  float history_[TAPS] = {};
+  int next_ = 0;
+};
+
+#endif // FILTER_H_
@@ -41,16 +41,36 @@ limitations under the License.
 // The way we get around this here and also increase the length of
 // time that we can oversample is to use DMA to continuously store
 // all the A/D readings to a circular buffer.  Each reading that is
-// stored there will be the sum of N readings of that channel.  When
-// we read the data we will sum up all the readings for a particular
-// channel stored to the buffer and scale it appropriately.
-// This allows us to efficiently average the A/D inputs for relatively
-// long periods.
+// stored there will be the sum of N readings of that channel.  Each
+// time the DMA fills half of the buffer it interrupts us, and we add
+// the readings in that half to a running sum for each channel (see
+// AdcRunningSum).  Reading an input then just scales its running sum,
+// however long a period we're averaging over.  Each input has its own
+// window (see AdcWindows in hal.h), all kept up to date by the same pass
+// over the readings.
+//
+// That's AdcMode::CONTINUOUS.  The catch is that the window we average over
+// has no particular phase relative to the control loop: when the loop reads
+// the inputs, the newest readings can be anything up to half a buffer old,
+// and the window can straddle the previous loop iteration.  In
+// AdcMode::LOOP_TRIGGERED, the loop timer (timer 15) instead starts a burst
+// of conversions once per loop period, just long enough to fill the window
+// and timed to end shortly before the loop runs (see adc_trigger.h).  The
+// DMA interrupt stops the A/D at the end of each burst and arms it for the
+// next trigger, so the loop always reads a window of readings taken in the
+// last couple of milliseconds, and the DMA leaves the bus alone in between.
+//
+// The DMA interrupt also copies every scan into adc_capture, a ring buffer
+// which can freeze a window of the raw readings around a trigger, like an
+// oscilloscope (see adc_capture.h).
 //
 ////////////////////////////////////////////////////////////////////
 
 #if defined(BARE_STM32)
 
+#include "adc_running_sum.h"
+#include "adc_trigger.h"
+#include "algorithm.h"
 #include "hal.h"
 #include "hal_stm32.h"
 
@@ -73,8 +93,19 @@ limitations under the License.
  *
  *****************************************************************/
 
-// How long a period (in seconds) we want to average the A/D readings.
-static constexpr float sample_history_time_sec = 0.001f;
+// How long a period we average each input's readings over is a fraction of
+// the control loop period, set per input (see AdcWindows in hal.h).  We want
+// windows long enough to filter out noise, but short enough that the control
+// loop sees fresh data.  At the default 100Hz loop, the patient pressure is
+// averaged over 1ms and the differential pressures over 4ms.
+//
+// The windows are set when the loop timer starts, see SetADCWindows().
+
+// The longest averaging window (in seconds) we'll use, i.e. the longest
+// fraction of the slowest loop rate.  This determines how much history we
+// keep.
+static constexpr float max_sample_history_time_sec =
+    LoopPeriod(LoopRate::HZ_100).seconds() * MAX_ADC_WINDOW_LOOP_FRACTION;
 
 // Total number of A/D inputs we're sampling
 static constexpr int adc_channels = 3;
@@ -98,28 +129,101 @@ static constexpr int adc_samp_time = 92;
 // Time of an A/D conversion in CPU clock cycles.  This is the sample time + 13
 static constexpr int adc_conversion_time = adc_samp_time + 13;
 
-// Calculate how long our history buffer needs to be based on the above.
-static constexpr int adc_samp_history =
-    static_cast<int>(sample_history_time_sec * CPU_FREQ / adc_conversion_time /
-                     oversample_count / adc_channels);
+// Number of scans of all the channels in each half of the DMA buffer.  The
+// DMA interrupts us each time it fills a half, so this trades interrupt rate
+// against how finely we can size the averaging window: with 2 scans we get an
+// interrupt every 2 * 3 * 16 * 105 cycles, or about 126us.
+static constexpr int adc_scans_per_half = 2;
+
+// CPU cycles to convert one half of the DMA buffer.
+static constexpr uint32_t cycles_per_half =
+    adc_scans_per_half * adc_channels * oversample_count * adc_conversion_time;
+
+// In AdcMode::LOOP_TRIGGERED, how long before the control loop runs each
+// burst of conversions must end.  This covers the A/D starting up after the
+// trigger and the DMA interrupt summing the last half, with room to spare
+// for other interrupts delaying it.
+static constexpr uint32_t trigger_margin_usec = 10;
+
+// Calculate how many readings of each channel cover a window of the given
+// length, based on the above.
+static constexpr int SampHistoryFor(float window_sec) {
+  return static_cast<int>(window_sec * CPU_FREQ / adc_conversion_time /
+                          oversample_count / adc_channels);
+}
+
+// The averaging window is a whole number of halves of the DMA buffer.  Round
+// to the nearest, but even at the fastest loop rate we want at least one
+// half.
+static constexpr int HalvesFor(float window_sec) {
+  return std::max(1, (SampHistoryFor(window_sec) + adc_scans_per_half / 2) /
+                         adc_scans_per_half);
+}
+static constexpr int max_adc_halves = HalvesFor(max_sample_history_time_sec);
+
+// Running sums of the readings of each channel.  Since these are kept up to
+// date by the DMA interrupt, the window isn't limited by how long it takes
+// to add up the readings, only by the memory for the history, which is
+// adc_channels words per half.
+static AdcRunningSum<adc_channels, adc_scans_per_half, max_adc_halves>
+    adc_sums;
+
+// This buffer will hold the readings from the A/D.
+static volatile uint16_t adc_buff[decltype(adc_sums)::BUFFER_SIZE];
+
+// These scalers convert the sum of a channel's A/D readings (a total of
+// adc_sums.WindowReadings(channel)) into a voltage.  The A/D is scaled so a
+// value of 0 corresponds to 0 volts, and max_adc_reading corresponds to 3.3V
+static constexpr float AdcScaler(int samp_history) {
+  return 3.3f / (static_cast<float>(max_adc_reading) *
+                 static_cast<float>(samp_history));
+}
+static float adc_scalers[adc_channels] = {
+    AdcScaler(max_adc_halves * adc_scans_per_half),
+    AdcScaler(max_adc_halves * adc_scans_per_half),
+    AdcScaler(max_adc_halves * adc_scans_per_half),
+};
+
+// Each channel's window, in halves of adc_buff, for `windows` at a loop
+// period of `loop_period`.
+using ChannelHalves = int[adc_channels];
+static void WindowHalves(const AdcWindows &windows, Duration loop_period,
+                         ChannelHalves &halves) {
+  for (int c = 0; c < adc_channels; c++) {
+    float fraction =
+        std::min(windows.loop_fraction[c], MAX_ADC_WINDOW_LOOP_FRACTION);
+    halves[c] = HalvesFor(loop_period.seconds() * fraction);
+  }
+}
+
+// Starts the running sums over with the given windows.  Interrupts must be
+// disabled, so that the DMA interrupt doesn't see a half reset history.
+static void ResetWindows(const ChannelHalves &halves) {
+  adc_sums.Reset(halves);
+  for (int c = 0; c < adc_channels; c++) {
+    adc_scalers[c] = AdcScaler(adc_sums.WindowReadings(c));
+  }
+}
 
-// This scaler converts the sum of the A/D readings (a total of
-// adc_samp_history) into a voltage.  The A/D is scaled so a value of 0
-// corresponds to 0 volts, and max_adc_reading corresponds to 3.3V
-static constexpr float adc_scaler = 3.3f / (max_adc_reading * adc_samp_history);
+// Raw scans, for HalApi::adcCapture().  hal.h describes the readings for
+// whoever reads the capture, so check that that matches what we do here.
+static AdcCaptureBuffer adc_capture;
+static_assert(adc_channels * oversample_count * adc_conversion_time ==
+              ADC_SCAN_PERIOD.microseconds() * CPU_FREQ_MHZ);
+static_assert(max_adc_reading == 65536);
 
-// This buffer will hold the readings from the A/D
-static volatile uint16_t adc_buff[adc_samp_history * adc_channels];
+// In AdcMode::LOOP_TRIGGERED, the number of halves of adc_buff in each burst
+// and the number left to go in the current one.  burst_halves is 0 in
+// AdcMode::CONTINUOUS.
+static int burst_halves = 0;
+static int burst_halves_left = 0;
 
-// NOTE - we need the sample history to be small for two reasons:
-// - We sum to a 32-bit floating point number and will lose precision
-//   if we add in too many samples
-// - We want the A/D reading to be fast, so summing up a really large
-//   array might be too slow.
-//
-// If you get hit with this assertion you may beed to rethink the
-// way this function works.
-static_assert(adc_samp_history < 100);
+// A/D control register bits.
+static constexpr uint32_t ADC_CTRL_ADSTART = 0x4;
+static constexpr uint32_t ADC_CTRL_ADSTP = 0x10;
+
+// A/D external trigger 14 is timer 15's trigger output (TRGO).
+static constexpr uint32_t ADC_EXTSEL_TIMER15_TRGO = 14;
 
 void HalApi::InitADC() {
 
@@ -201,11 +305,12 @@ void HalApi::InitADC() {
 
   dma->channel[C1].pAddr = &adc->adc[0].data;
   dma->channel[C1].mAddr = adc_buff;
-  dma->channel[C1].count = adc_samp_history * adc_channels;
+  dma->channel[C1].count = decltype(adc_sums)::BUFFER_SIZE;
 
+  // Interrupt as each half of the buffer fills, see DMA1_CH1_ISR().
   dma->channel[C1].config.enable = 0;
-  dma->channel[C1].config.tcie = 0;
-  dma->channel[C1].config.htie = 0;
+  dma->channel[C1].config.tcie = 1;
+  dma->channel[C1].config.htie = 1;
   dma->channel[C1].config.teie = 0;
   dma->channel[C1].config.dir =
       static_cast<REG>(DmaChannelDir::PERIPHERAL_TO_MEM);
@@ -216,11 +321,136 @@ void HalApi::InitADC() {
   dma->channel[C1].config.msize = 1;
   dma->channel[C1].config.priority = 0;
   dma->channel[C1].config.enable = 1;
+  EnableInterrupt(InterruptVector::DMA1_CH1, IntPriority::STANDARD);
 
   // Start the A/D converter
   adc->adc[0].ctrl |= 4;
 }
 
+// Resizes the averaging windows to match the control loop period.
+//
+// Called from startLoopTimer() before the loop starts, so nothing else is
+// reading the A/D concurrently.  The DMA keeps running; we just start the
+// running sums over.
+void HalApi::SetADCWindows(Duration loop_period) {
+  ChannelHalves halves;
+  WindowHalves(adc_windows_, loop_period, halves);
+
+  BlockInterrupts block;
+  ResetWindows(halves);
+}
+
+// Stops the A/D, waiting for any conversion it's in the middle of to be
+// aborted.
+static void StopADC() {
+  ADC_Regs *adc = ADC_BASE;
+  adc->adc[0].ctrl |= ADC_CTRL_ADSTP;
+  while (adc->adc[0].ctrl & ADC_CTRL_ADSTART) {
+  }
+}
+
+// In AdcMode::LOOP_TRIGGERED: points the DMA back at the start of adc_buff
+// and arms the A/D, which then waits for the loop timer to start the next
+// burst.  The A/D must be stopped.
+static void ArmBurst() {
+  DMA_Regs *dma = DMA1_BASE;
+  int C1 = static_cast<int>(DMA_Chan::C1);
+  dma->channel[C1].config.enable = 0;
+  dma->channel[C1].count = decltype(adc_sums)::BUFFER_SIZE;
+  // Clears all of the channel's flags, in case the A/D managed to start the
+  // next half before we stopped it.
+  DMA_ClearInt(dma, DMA_Chan::C1, DmaInterrupt::GLOBAL);
+  dma->channel[C1].config.enable = 1;
+  burst_halves_left = burst_halves;
+
+  ADC_Regs *adc = ADC_BASE;
+  // Clear the overrun flag and arm.
+  adc->adc[0].stat = 0x10;
+  adc->adc[0].ctrl |= ADC_CTRL_ADSTART;
+}
+
+// Switches the A/D from continuous conversions to bursts started by the loop
+// timer, see adc_trigger.h.  `loop_ticks` and `prescale` are the timer's
+// settings for `loop_period`.
+//
+// Each burst is as long as the longest window.  Channels with shorter
+// windows average over the end of it, which is the freshest part.
+//
+// Called from startLoopTimer() after SetADCWindows() and before the timer
+// starts counting.
+void HalApi::TriggerADCFromLoopTimer(Duration loop_period, uint32_t loop_ticks,
+                                     uint32_t prescale) {
+  ChannelHalves halves;
+  WindowHalves(adc_windows_, loop_period, halves);
+  int longest = *std::max_element(halves, halves + adc_channels);
+  AdcTriggerTiming timing = AlignAdcWindow(
+      loop_ticks, prescale, cycles_per_half, longest, max_adc_halves,
+      trigger_margin_usec * CYCLES_PER_MICROSECOND);
+  // If the burst had to be shortened to fit, so do the windows; anything
+  // longer would reach back into the previous burst.
+  for (int &h : halves) {
+    h = std::min(h, timing.halves);
+  }
+
+  StopADC();
+
+  // Timer 15's compare channel 1 marks the start of the burst.  We only
+  // need its compare event, so the channel stays in its reset configuration
+  // (output compare, frozen), and the timer sends a pulse on its trigger
+  // output for each match (master mode 011, "compare pulse").
+  TimerRegs *tmr = TIMER15_BASE;
+  tmr->compare[0] = timing.compare;
+  tmr->ctrl[1] = 3 << 4;
+
+  // A rising edge on the trigger starts the A/D, which carries on converting
+  // (cfg1.cont is still set) until the DMA interrupt stops it.
+  ADC_Regs *adc = ADC_BASE;
+  adc->adc[0].cfg1.extsel = ADC_EXTSEL_TIMER15_TRGO;
+  adc->adc[0].cfg1.exten = 1;
+
+  BlockInterrupts block;
+  ResetWindows(halves);
+  burst_halves = timing.halves;
+  ArmBurst();
+}
+
+// In AdcMode::LOOP_TRIGGERED, called after each half of adc_buff is summed.
+// At the end of the burst, the longest window is exactly the burst's readings;
+// stop the A/D before it starts overwriting them, and arm it for the next.
+static void OnBurstHalfComplete() {
+  if (burst_halves == 0 || --burst_halves_left > 0) {
+    return;
+  }
+  StopADC();
+  ArmBurst();
+}
+
+// DMA1 channel 1 interrupt: the DMA has filled half of adc_buff and moved on
+// to the other half.  The half transfer flag means it's finished the first
+// half, transfer complete means the second.
+//
+// We run at a higher priority than the control loop and only take a few
+// dozen cycles, so we should always be done long before the DMA finishes
+// the next half.  If we're ever late enough to see both flags at once,
+// the first half is already being overwritten and that reading is slightly
+// off, but the sums stay consistent.
+void DMA1_CH1_ISR() {
+  DMA_Regs *dma = DMA1_BASE;
+  if (dma->intStat.htif1) {
+    DMA_ClearInt(dma, DMA_Chan::C1, DmaInterrupt::HALF_COMPLETE);
+    adc_sums.OnHalfComplete(&adc_buff[0]);
+    adc_capture.OnReadings(&adc_buff[0], adc_scans_per_half);
+    OnBurstHalfComplete();
+  }
+  if (dma->intStat.tcif1) {
+    DMA_ClearInt(dma, DMA_Chan::C1, DmaInterrupt::XFER_COMPLETE);
+    adc_sums.OnHalfComplete(&adc_buff[decltype(adc_sums)::HALF_SIZE]);
+    adc_capture.OnReadings(&adc_buff[decltype(adc_sums)::HALF_SIZE],
+                           adc_scans_per_half);
+    OnBurstHalfComplete();
+  }
+}
+
 // Read the specified analog input.
 Voltage HalApi::analogRead(AnalogPin pin) {
   int offset = [&] {
@@ -236,15 +466,24 @@ Voltage HalApi::analogRead(AnalogPin pin) {
     __builtin_unreachable();
   }();
 
-  // We just run through the buffer and add up all the readings for
-  // this channel.  The DMA is still writing to this buffer in the
-  // background, but that shouldn't cause any problems because memory
-  // accesses for 16-bit values are atomic.
-  float sum = 0;
-  for (int i = 0; i < adc_samp_history; i++)
-    sum += adc_buff[i * adc_channels + offset];
+  // The DMA interrupt keeps the sum up to date, so this takes the same
+  // time however long the window is.
+  return volts(static_cast<float>(adc_sums.Sum(offset)) * adc_scalers[offset]);
+}
+
+// The A/D converts the inputs in the same order as the AnalogPin enum (see
+// the conversion sequence in InitADC()), so channel i of adc_sums is pin i.
+static_assert(adc_channels == NUM_ANALOG_PINS);
+
+AdcCaptureBuffer &HalApi::adcCapture() { return adc_capture; }
 
-  return volts(sum * adc_scaler);
+AnalogReadings HalApi::analogReadAll() {
+  AnalogReadings readings;
+  for (int i = 0; i < adc_channels; i++) {
+    readings.voltage[i] =
+        volts(static_cast<float>(adc_sums.Sum(i)) * adc_scalers[i]);
+  }
+  return readings;
 }
 
 #endif
@@ -0,0 +1,178 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef ADC_CAPTURE_H
+#define ADC_CAPTURE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// What made an AdcCapture freeze.  Keep this in sync with the ScopeTrigger
+// enum in network_protocol.proto.
+enum class CaptureCause : uint8_t {
+  NONE,
+  REQUEST,   // Someone asked for a capture, e.g. the GUI
+  ALARM,     // An alarm went off
+  THRESHOLD, // A channel's readings rose through the threshold
+};
+
+// An oscilloscope-style capture of the raw A/D readings.
+//
+// The control loop only sees the A/D readings averaged over a window, and the
+// GUI only sees the control loop's readings every 30ms or so.  Fast
+// transients, e.g. a valve slamming shut or a sensor glitching, get averaged
+// away.  This keeps every scan (one reading of each channel) the DMA delivers
+// in a ring buffer of the last SCANS scans.  When something triggers it, it
+// carries on recording for POST_TRIGGER_SCANS more scans and then freezes, so
+// that the ring holds a window around the trigger.  Someone can then read
+// the window at their leisure, and Release() the capture to arm it again.
+//
+// Most of the window is before the trigger, since the things that trigger a
+// capture are usually noticed a while after they happen; e.g. alarms are
+// checked every 100ms.
+//
+// OnReadings() is meant to be called from the DMA interrupt, which is the only
+// place the ring is written.  Trigger() and SetThreshold() may be called from
+// any context.  Everything else should be called from a single context (e.g.
+// the background loop); the readings are only stable while Frozen().
+template <int CHANNELS, int SCANS> class AdcCapture {
+public:
+  static constexpr int PRE_TRIGGER_SCANS = SCANS * 3 / 4;
+  static constexpr int POST_TRIGGER_SCANS = SCANS - PRE_TRIGGER_SCANS - 1;
+  static_assert(PRE_TRIGGER_SCANS > 0 && POST_TRIGGER_SCANS >= 0);
+
+  // Asks for a capture around the next scan.  Ignored if there's already a
+  // trigger pending, or if the capture has triggered and isn't released yet.
+  //
+  // If fewer than PRE_TRIGGER_SCANS scans have come in since the capture was
+  // armed, the trigger waits until they have, so that every capture has its
+  // full window.
+  void Trigger(CaptureCause cause) {
+    if (state_.load() != State::ARMED) {
+      return;
+    }
+    CaptureCause expected = CaptureCause::NONE;
+    pending_.compare_exchange_strong(expected, cause);
+  }
+
+  // Triggers a capture when the readings of `channel` rise through `level`,
+  // i.e. when one scan reads less than `level` and the next reads `level` or
+  // more.  Only one channel can have a threshold at a time.
+  void SetThreshold(int channel, uint16_t level) {
+    threshold_ = static_cast<uint32_t>(channel + 1) << 16 | level;
+  }
+  void ClearThreshold() { threshold_ = 0; }
+
+  // Adds `scans` scans of readings, CHANNELS readings each, interleaved in
+  // the order the A/D converts them.  Readings that arrive while the capture
+  // is frozen are dropped.
+  void OnReadings(const volatile uint16_t *readings, int scans) {
+    for (int s = 0; s < scans; s++, readings += CHANNELS) {
+      State state = state_.load(std::memory_order_relaxed);
+      if (state == State::FROZEN) {
+        return;
+      }
+      int prev = last_;
+      last_ = last_ + 1 == SCANS ? 0 : last_ + 1;
+      for (int c = 0; c < CHANNELS; c++) {
+        ring_[last_][c] = readings[c];
+      }
+      if (filled_ < SCANS) {
+        filled_++;
+      }
+
+      if (state == State::ARMED) {
+        CaptureCause cause = pending_.load(std::memory_order_relaxed);
+        if (cause == CaptureCause::NONE && filled_ > 1 &&
+            CrossedThreshold(ring_[prev], ring_[last_])) {
+          cause = CaptureCause::THRESHOLD;
+        }
+        if (cause == CaptureCause::NONE || filled_ <= PRE_TRIGGER_SCANS) {
+          continue;
+        }
+        cause_ = cause;
+        post_trigger_left_ = POST_TRIGGER_SCANS;
+        state_.store(State::TRIGGERED, std::memory_order_relaxed);
+      } else if (post_trigger_left_ > 0) {
+        post_trigger_left_--;
+      }
+      if (post_trigger_left_ == 0) {
+        // Publishes the ring to Reading().
+        state_.store(State::FROZEN, std::memory_order_release);
+      }
+    }
+  }
+
+  // Has the capture triggered and finished recording its window?
+  bool Frozen() const {
+    return state_.load(std::memory_order_acquire) == State::FROZEN;
+  }
+
+  // What triggered the capture.  Only meaningful while Frozen().
+  CaptureCause Cause() const { return cause_; }
+
+  // Reading of `channel` in the `scan`th scan of the window, where scan 0 is
+  // the oldest and scan TriggerScan() is the one that triggered it.  Only
+  // meaningful while Frozen().
+  uint16_t Reading(int scan, int channel) const {
+    int i = last_ + 1 + scan;
+    return ring_[i >= SCANS ? i - SCANS : i][channel];
+  }
+  static constexpr int TriggerScan() { return PRE_TRIGGER_SCANS; }
+
+  // Arms the capture again, discarding the window.  The next trigger can fire
+  // once PRE_TRIGGER_SCANS new scans have come in.
+  void Release() {
+    if (!Frozen()) {
+      return;
+    }
+    filled_ = 0;
+    pending_ = CaptureCause::NONE;
+    // Hands the ring back to OnReadings().
+    state_.store(State::ARMED, std::memory_order_release);
+  }
+
+private:
+  enum class State : uint8_t { ARMED, TRIGGERED, FROZEN };
+
+  bool CrossedThreshold(const uint16_t *prev, const uint16_t *cur) const {
+    uint32_t threshold = threshold_.load(std::memory_order_relaxed);
+    if (threshold == 0) {
+      return false;
+    }
+    int channel = static_cast<int>(threshold >> 16) - 1;
+    uint16_t level = static_cast<uint16_t>(threshold);
+    return prev[channel] < level && cur[channel] >= level;
+  }
+
+  std::atomic<State> state_{State::ARMED};
+  std::atomic<CaptureCause> pending_{CaptureCause::NONE};
+  // Channel + 1 in the top half, level in the bottom; 0 if there's no
+  // threshold.
+  std::atomic<uint32_t> threshold_{0};
+  static_assert(std::atomic<State>::is_always_lock_free);
+  static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+  CaptureCause cause_ = CaptureCause::NONE;
+  // Scans left to record after the trigger.
+  int post_trigger_left_ = 0;
+  // Index in ring_ of the newest scan, and the number of scans recorded since
+  // the capture was armed (up to SCANS).
+  int last_ = SCANS - 1;
+  int filled_ = 0;
+  uint16_t ring_[SCANS][CHANNELS] = {};
+};
+
+#endif // ADC_CAPTURE_H
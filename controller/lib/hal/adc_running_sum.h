@@ -0,0 +1,166 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef ADC_RUNNING_SUM_H
+#define ADC_RUNNING_SUM_H
+
+#include <stdint.h>
+
+// Keeps a running sum of the most recent A/D readings of each channel, so
+// that reading an average takes the same time however long the averaging
+// window is.
+//
+// The A/D converts CHANNELS inputs in turn, over and over, and DMA copies
+// the readings into a circular buffer which holds 2 * SCANS_PER_HALF scans
+// (a scan being one reading of each channel).  The DMA controller interrupts
+// when it finishes filling each half of the buffer, and while it carries on
+// with the other half we call OnHalfComplete() with the half that's just been
+// filled.  That sums up the readings of each channel in the half, adds them
+// to the running sum and subtracts the sum of the half which just dropped
+// out of the window.
+//
+// The window is a whole number of halves, up to MAX_HALVES.  It isn't limited
+// by the size of the DMA buffer: we only need to remember the per-half sums,
+// which is CHANNELS words per half.  Sums are kept as integers, so unlike
+// adding up floats, long windows don't lose precision either.
+//
+// Each channel can have its own window.  We always keep MAX_HALVES halves of
+// per-half sums, and each channel subtracts the half that just dropped out of
+// its own window.  So a short window, for low latency, and a long one, for
+// less noise, cost the same: one pass over the readings, then a subtraction
+// per channel.
+//
+// The readings in the half of the buffer the DMA is currently writing aren't
+// included, so compared to summing over the whole buffer the average is up to
+// half a buffer older.  In exchange it never mixes readings from two
+// different passes over the buffer.
+template <int CHANNELS, int SCANS_PER_HALF, int MAX_HALVES>
+class AdcRunningSum {
+public:
+  // Number of readings in (each half of) the DMA buffer.
+  static constexpr int HALF_SIZE = SCANS_PER_HALF * CHANNELS;
+  static constexpr int BUFFER_SIZE = 2 * HALF_SIZE;
+
+  // Sums of 16-bit readings have to fit in 32 bits.
+  static_assert(MAX_HALVES * SCANS_PER_HALF <= 0x10000,
+                "Window too long for 32-bit sums");
+
+  // Every channel starts out with the longest window.
+  AdcRunningSum() { Reset(MAX_HALVES); }
+
+  // Clears the history and starts summing each channel over the last
+  // `halves` halves of the DMA buffer, clamped to [1, MAX_HALVES].
+  //
+  // Until that many halves have completed, the missing readings count as
+  // zero.  Must not run concurrently with OnHalfComplete().
+  void Reset(int halves) {
+    int all[CHANNELS];
+    for (int c = 0; c < CHANNELS; c++) {
+      all[c] = halves;
+    }
+    Reset(all);
+  }
+
+  // Likewise, but with a window of `halves[c]` halves for channel c.
+  void Reset(const int (&halves)[CHANNELS]) {
+    longest_halves_ = 1;
+    for (int c = 0; c < CHANNELS; c++) {
+      int h = halves[c];
+      if (h < 1) {
+        h = 1;
+      } else if (h > MAX_HALVES) {
+        h = MAX_HALVES;
+      }
+      window_halves_[c] = h;
+      longest_halves_ = h > longest_halves_ ? h : longest_halves_;
+    }
+    next_ = 0;
+    for (int h = 0; h < MAX_HALVES; h++) {
+      for (int c = 0; c < CHANNELS; c++) {
+        half_sums_[h][c] = 0;
+      }
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+      sums_[c] = 0;
+    }
+  }
+
+  // Called from the DMA half transfer or transfer complete interrupt with the
+  // half of the buffer which was just filled.
+  void OnHalfComplete(const volatile uint16_t *half) {
+    // The DMA is done with this half, so there's no need to read it through
+    // a volatile pointer; that lets the compiler combine and unroll loads.
+    const uint16_t *readings = const_cast<const uint16_t *>(half);
+
+    // One pass over the interleaved readings, accumulating every channel at
+    // once, rather than one strided pass per channel.  Unrolling the inner
+    // loop keeps the sums in registers, and lets the compiler vectorize the
+    // outer one where it can.  (The pragma wants a literal; 8 covers any
+    // number of channels we'd have.)
+    uint32_t sums[CHANNELS] = {};
+    for (int i = 0; i < HALF_SIZE; i += CHANNELS) {
+#pragma GCC unroll 8
+      for (int c = 0; c < CHANNELS; c++) {
+        sums[c] += readings[i + c];
+      }
+    }
+
+    // half_sums_[next_] is the oldest half we remember.  It's about to be
+    // overwritten, so read what drops out of each window first: that's
+    // the half window_halves_[c] halves ago, which for the longest possible
+    // window is next_ itself.
+#pragma GCC unroll 8
+    for (int c = 0; c < CHANNELS; c++) {
+      int oldest = next_ - window_halves_[c];
+      if (oldest < 0) {
+        oldest += MAX_HALVES;
+      }
+      sums_[c] = sums_[c] + sums[c] - half_sums_[oldest][c];
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+      half_sums_[next_][c] = sums[c];
+    }
+    next_ = next_ + 1 == MAX_HALVES ? 0 : next_ + 1;
+  }
+
+  // Sum of the last WindowReadings(channel) readings of `channel`.
+  //
+  // This is a single 32-bit load, so it's safe to call from an interrupt
+  // which OnHalfComplete() may preempt.
+  uint32_t Sum(int channel) const { return sums_[channel]; }
+
+  // Number of readings of `channel` in its window.
+  int WindowReadings(int channel) const {
+    return window_halves_[channel] * SCANS_PER_HALF;
+  }
+
+  // Number of readings in the longest channel's window.
+  int WindowReadings() const { return longest_halves_ * SCANS_PER_HALF; }
+
+private:
+  int window_halves_[CHANNELS];
+  int longest_halves_;
+
+  // Index into half_sums_ of the oldest half we remember, which is the one
+  // the next OnHalfComplete() replaces.
+  int next_ = 0;
+
+  // Per-channel sums of the last MAX_HALVES halves, as a ring buffer.
+  uint32_t half_sums_[MAX_HALVES][CHANNELS] = {};
+
+  volatile uint32_t sums_[CHANNELS] = {};
+};
+
+#endif // ADC_RUNNING_SUM_H
@@ -0,0 +1,87 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef ADC_TRIGGER_H
+#define ADC_TRIGGER_H
+
+#include <stdint.h>
+
+// Where to put a burst of A/D conversions within each period of the loop
+// timer, when the loop timer triggers them (AdcMode::LOOP_TRIGGERED).
+//
+// The loop timer counts from 0 up to its reload value, and the control loop
+// runs when it wraps.  A compare channel on the same timer starts the burst,
+// which converts a whole number of halves of the DMA buffer and then stops.
+// We want the burst to end as late as possible, so that the control loop's
+// readings are fresh, but not so late that the last half hasn't been summed
+// by the time the loop reads it.
+struct AdcTriggerTiming {
+  // Length of the burst, in halves of the DMA buffer.  This is also the
+  // averaging window.
+  int halves;
+  // Loop timer count at which to start the burst.
+  uint32_t compare;
+  // CPU cycles from the end of the burst to the start of the next loop
+  // period.  At least the margin asked for, unless even one half doesn't fit.
+  uint32_t slack_cycles;
+};
+
+// Aligns a burst of `desired_halves` halves (clamped to [1, max_halves]) to
+// end at least `margin_cycles` before the loop timer wraps.
+//
+// `loop_ticks` is the loop timer's period in ticks (i.e. its reload value
+// + 1), each of which is `prescale` CPU cycles.  Converting one half of the
+// DMA buffer takes `cycles_per_half` CPU cycles.  If the burst doesn't fit in
+// the period, it's shortened to the longest that does, but never to less than
+// one half; that starts at the beginning of the period.
+constexpr AdcTriggerTiming AlignAdcWindow(uint32_t loop_ticks,
+                                          uint32_t prescale,
+                                          uint32_t cycles_per_half,
+                                          int desired_halves, int max_halves,
+                                          uint32_t margin_cycles) {
+  int halves = desired_halves;
+  if (halves > max_halves) {
+    halves = max_halves;
+  }
+  if (halves < 1) {
+    halves = 1;
+  }
+
+  uint32_t period_cycles = loop_ticks * prescale;
+  uint32_t available =
+      period_cycles > margin_cycles ? period_cycles - margin_cycles : 0;
+  if (static_cast<uint32_t>(halves) * cycles_per_half > available) {
+    halves = static_cast<int>(available / cycles_per_half);
+    if (halves < 1) {
+      halves = 1;
+    }
+  }
+
+  uint32_t burst_cycles = static_cast<uint32_t>(halves) * cycles_per_half;
+  uint32_t start_cycles =
+      available > burst_cycles ? available - burst_cycles : 0;
+  // Round the start down to a whole tick, so the burst ends early rather
+  // than late.
+  uint32_t compare = start_cycles / prescale;
+  uint32_t end_cycles = compare * prescale + burst_cycles;
+  return {
+      .halves = halves,
+      .compare = compare,
+      .slack_cycles = period_cycles > end_cycles ? period_cycles - end_cycles
+                                                 : 0,
+  };
+}
+
+#endif // ADC_TRIGGER_H
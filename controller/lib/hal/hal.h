@@ -32,7 +32,10 @@ limitations under the License.
 // observe whether mocked methods are called.  So far that hasn't been
 // necessary.
 
+#include "adc_capture.h"
 #include "algorithm.h"
+#include "loop_monitor.h"
+#include "stage_timing.h"
 #include "units.h"
 #include <stdint.h>
 
@@ -43,6 +46,7 @@ limitations under the License.
 #endif
 
 #include "checksum.h"
+#include <chrono>
 #include <cstring>
 #include <deque>
 #include <map>
@@ -54,6 +58,8 @@ limitations under the License.
 #error "When running without TEST_MODE, expecting BARE_STM32 to be defined"
 #endif
 
+#include "hal_stm32_regs.h"
+
 #endif // TEST_MODE
 
 // ---------------------------------------------------------------
@@ -88,6 +94,19 @@ enum class AnalogPin {
   OUTFLOW_PRESSURE_DIFF,
 };
 
+// Keep this in sync with the AnalogPin enum!
+constexpr int NUM_ANALOG_PINS = 3;
+
+// The voltages on all of the analog inputs, as returned by
+// HalApi::analogReadAll().
+struct AnalogReadings {
+  Voltage voltage[NUM_ANALOG_PINS];
+
+  Voltage operator[](AnalogPin pin) const {
+    return voltage[static_cast<int>(pin)];
+  }
+};
+
 // Pulse-width modulated outputs from the controller.  These can be set to
 // values in [0-255].
 //
@@ -126,6 +145,113 @@ enum class IntPriority {
 
 enum class InterruptVector;
 
+// Rates at which we can run the high priority control loop.  The rate is
+// chosen once at boot; everything that depends on it (A/D averaging, volume
+// integration, the control loop's rate groups) derives its timing from
+// LoopPeriod().
+enum class LoopRate {
+  HZ_100,
+  HZ_250,
+  HZ_500,
+  HZ_1000,
+};
+
+inline constexpr LoopRate DEFAULT_LOOP_RATE = LoopRate::HZ_100;
+
+constexpr Duration LoopPeriod(LoopRate rate) {
+  switch (rate) {
+  case LoopRate::HZ_100:
+    return milliseconds(10);
+  case LoopRate::HZ_250:
+    return milliseconds(4);
+  case LoopRate::HZ_500:
+    return milliseconds(2);
+  case LoopRate::HZ_1000:
+    return milliseconds(1);
+  }
+  // All cases covered above (and GCC checks this).
+  __builtin_unreachable();
+}
+
+// How the A/D samples the analog inputs, see adc.cpp.
+//
+// CONTINUOUS: the A/D converts all the time, and each reading averages over
+// the most recent window, whatever its phase relative to the control loop.
+//
+// LOOP_TRIGGERED: the loop timer starts a burst of conversions once per loop
+// period, timed so that the burst ends just before the control loop runs.
+// Each loop iteration then reads a window that's entirely fresh, which cuts
+// up to a window's worth of sensor-to-actuator latency, and the DMA is only
+// on the bus during the burst.
+enum class AdcMode {
+  CONTINUOUS,
+  LOOP_TRIGGERED,
+};
+
+inline constexpr AdcMode DEFAULT_ADC_MODE = AdcMode::CONTINUOUS;
+
+// How long the A/D averages each analog input over, as a fraction of the
+// control loop period, indexed by AnalogPin.  Longer windows are less noisy,
+// shorter ones are more up to date: a window's readings are on average half
+// a window old.  All the windows come from the same stream of readings, so
+// they cost the same; see adc_running_sum.h.
+//
+// The patient pressure feeds the pressure loop, so it wants low latency.  The
+// differential pressures feed the venturis, whose flow goes as the square
+// root of the pressure, so near zero flow they need heavy averaging.
+struct AdcWindows {
+  float loop_fraction[NUM_ANALOG_PINS];
+};
+inline constexpr AdcWindows DEFAULT_ADC_WINDOWS = {{
+    0.1f, // PATIENT_PRESSURE
+    0.4f, // INFLOW_PRESSURE_DIFF
+    0.4f, // OUTFLOW_PRESSURE_DIFF
+}};
+// Windows are clamped to this, so that the A/D's history fits in a fixed
+// amount of RAM.
+inline constexpr float MAX_ADC_WINDOW_LOOP_FRACTION = 0.5f;
+
+// Oscilloscope-style capture of every A/D scan, see HalApi::adcCapture().
+//
+// A scan takes 3 channels * 16 oversamples * 105 cycles at 80MHz, i.e. 63us
+// (see adc.cpp), so the capture holds about 129ms, 97ms of it before the
+// trigger.  That's 12KB of RAM.
+inline constexpr int ADC_CAPTURE_SCANS = 2048;
+inline constexpr Duration ADC_SCAN_PERIOD = microseconds(63);
+// Each reading is the sum of 16 12-bit conversions, so full scale (3.3V) is
+// 65536 counts.
+inline constexpr Voltage ADC_VOLTS_PER_COUNT = volts(3.3f / 65536);
+using AdcCaptureBuffer = AdcCapture<NUM_ANALOG_PINS, ADC_CAPTURE_SCANS>;
+
+// Why the controller last reset.  See HalApi::resetCause().
+enum class ResetCause {
+  POWER_ON, // Power was applied, or dipped low enough to reset us
+  WATCHDOG, // The watchdog wasn't petted in time
+  SOFTWARE, // reset_device() was called
+  OTHER,    // e.g. someone pressed the reset button
+};
+
+// Stages of the high priority control loop whose execution time we track
+// individually.  See HalApi::loopStageStats() and LoopStageTimer.
+enum class LoopStage {
+  SENSORS,    // Reading and calibrating the sensors
+  CONTROLLER, // Running the blower FSM and PID
+  ACTUATORS,  // Sending the outputs to the hardware
+  WATCHDOG,   // Petting the watchdog
+  SNAPSHOT,   // Saving the state for a warm restart
+};
+// Keep this in sync with the LoopStage enum!
+inline constexpr int NUM_LOOP_STAGES = 5;
+
+// Number of HalApi::cycleCount() ticks in one microsecond.
+#if defined(BARE_STM32)
+// The CPU runs at 80MHz, see hal_stm32.h.
+inline constexpr uint32_t CYCLES_PER_MICROSECOND = 80;
+#else
+// In test mode a "cycle" is one nanosecond.
+inline constexpr uint32_t CYCLES_PER_MICROSECOND = 1000;
+#endif
+
 // Singleton class which implements a hardware abstraction layer.
 //
 // Access this via the `Hal` global variable, e.g. `Hal.millis()`.
@@ -138,17 +264,57 @@ public:
   void init();
 
   // Amount of time that has passed since the board started running the
-  // program.
+  // program, with microsecond resolution.
+  //
+  // On STM32 this combines the millisecond count kept by the system timer
+  // interrupt with the timer's own counter, see hal_stm32.cpp.
   //
   // Faked when testing.  Time doesn't advance unless you call delay().
   Time now();
 
+  // Free-running counter used to time short sections of code, e.g. the stages
+  // of the control loop.  It wraps around, so only the (unsigned) difference
+  // between two readings is meaningful.  CYCLES_PER_MICROSECOND gives its
+  // rate.
+  //
+  // On STM32 this reads the Cortex-M4 DWT cycle counter.  In test mode it's
+  // *not* faked: it reads std::chrono::steady_clock with nanosecond ticks, so
+  // that we can profile code on native too.
+  uint32_t cycleCount();
+
+  // Records that one execution of the given control loop stage took `cycles`
+  // ticks of cycleCount().  Normally called via LoopStageTimer.
+  void recordLoopStage(LoopStage stage, uint32_t cycles) {
+    loop_stage_stats_[static_cast<int>(stage)].Record(cycles);
+  }
+
+  // Returns a consistent copy of the timing statistics for the given control
+  // loop stage.
+  StageTimingStats loopStageStats(LoopStage stage);
+
   // Sleeps for some number of milliseconds.
   //
   // Faked when testing.  Does not sleep, but does advance the time returned by
   // millis().
   void delay(Duration d);
 
+  // Puts the CPU to sleep until something happens: an interrupt arrives, or
+  // we reach `wake_by`, whichever is first.  Call this when there's nothing
+  // to do until `wake_by` unless an interrupt gives us something.
+  //
+  // On STM32 this is a WFI instruction.  The system timer interrupts every
+  // millisecond, so we never sleep longer than that.  Interrupts that wake us
+  // are serviced before this returns.
+  //
+  // Faked when testing.  Nothing happens asynchronously in tests, so this
+  // just jumps the fake time forward to `wake_by`.
+  void idle(Time wake_by);
+
+  // Total time spent asleep in idle(), not counting interrupt handlers which
+  // ran in the meantime.  Compare this with the elapsed time to see how much
+  // headroom the CPU has.
+  Duration idleTime();
+
   // Caveat for people new to Arduino: analogRead and analogWrite are completely
   // separate from each other and do not even refer to the same pins.
   // analogRead() reads the value of an analog input pin. analogWrite() writes
@@ -161,10 +327,24 @@ public:
   // In test mode, will return the last value set via test_setAnalogPin.
   Voltage analogRead(AnalogPin pin);
 
+  // Reads all of the analog inputs in one go.  The control loop wants all of
+  // them every cycle, and this is cheaper than calling analogRead() for each.
+  AnalogReadings analogReadAll();
+
 #ifdef TEST_MODE
   void test_setAnalogPin(AnalogPin pin, Voltage value);
 #endif
 
+  // The capture of the raw A/D readings, at the A/D's full rate.  The DMA
+  // interrupt feeds it every scan, in the order of the AnalogPin enum;
+  // trigger it, and read and release it, from anywhere else.
+  //
+  // In AdcMode::LOOP_TRIGGERED the A/D only converts in bursts, so the
+  // capture has gaps: each loop period contributes just its burst.
+  //
+  // In test mode nothing feeds it; tests can call OnReadings() themselves.
+  AdcCaptureBuffer &adcCapture();
+
   // Causes `pin` to output a square wave with the given duty cycle (range
   // [0, 1]).
   //
@@ -255,9 +435,48 @@ public:
   // Performs the device soft-reset
   [[noreturn]] void reset_device();
 
-  // Start the loop timer
+  // Why we (last) started up.  On STM32 this comes from the reset flags in
+  // RCC_CSR, which init() reads and then clears so that the next reset
+  // starts fresh.
+  ResetCause resetCause();
+
+#ifdef TEST_MODE
+  void test_setResetCause(ResetCause cause) { reset_cause_ = cause; }
+#endif
+
+  // Start the loop timer, which calls callback(arg) every `period` from a
+  // low priority interrupt.
+  //
+  // This also sets the A/D averaging windows to match the period and, in
+  // AdcMode::LOOP_TRIGGERED, locks the A/D's conversions to the timer; see
+  // adc.cpp.
   void startLoopTimer(const Duration &period, void (*callback)(void *),
-                      void *arg);
+                      void *arg, AdcMode adc_mode = DEFAULT_ADC_MODE);
+
+  // Sets how long the A/D averages each analog input over, instead of
+  // DEFAULT_ADC_WINDOWS.  Takes effect at the next startLoopTimer(), so call
+  // it first, e.g. at boot.
+  void setAdcWindows(const AdcWindows &windows) { adc_windows_ = windows; }
+
+  // Returns a consistent copy of the jitter/overrun statistics for the loop
+  // timer started with startLoopTimer().
+  LoopMonitor loopMonitor();
+
+#ifdef TEST_MODE
+  // Fake loop timer driver: runs one tick of the loop timer "interrupt" at the
+  // current (fake) time, i.e. calls the startLoopTimer() callback, with the
+  // same monitoring the real timer interrupt does.  The callback can call
+  // delay() to simulate taking time to run.
+  void test_fireLoopTimer();
+
+  // Runs fn(arg) as though it were an interrupt handler of priority `pri`:
+  // for the duration of the call InInterruptHandler() is true and
+  // interruptCanPreempt() only allows more important interrupts.
+  //
+  // Throws if an interrupt of this priority couldn't preempt the current
+  // code, i.e. if the real interrupt would have been held off.
+  void test_runInterrupt(IntPriority pri, void (*fn)(void *), void *arg);
+#endif
 
   // Pets the watchdog, this makes the watchdog not reset the
   // system for configured amount of time
@@ -281,6 +500,28 @@ public:
   // Return true if we are currently executing in an interrupt handler
   bool InInterruptHandler();
 
+  // Priority-aware interrupt masking.
+  //
+  // raiseInterruptMask() masks every interrupt of priority `pri` or lower
+  // (i.e. with a priority number >= pri) and leaves more important interrupts
+  // enabled.  On STM32 this uses the BASEPRI register.  It never lowers an
+  // existing mask.  It returns the previous mask, which you should pass to
+  // restoreInterruptMask() to undo the change.
+  //
+  // Where possible, prefer using the MaskInterrupts RAII class.
+  //
+  // Unlike disableInterrupts(), this lets you protect data shared with e.g.
+  // the control loop ISR without delaying the hardware interrupts.  Note that
+  // a priority-P mask also blocks everything less important than P.
+  uint32_t raiseInterruptMask(IntPriority pri);
+  void restoreInterruptMask(uint32_t mask);
+
+  // Returns true if an interrupt of priority `pri` would be serviced right
+  // now, i.e. it isn't blocked by disableInterrupts(), by the interrupt mask,
+  // or by an interrupt handler of the same or higher priority which is
+  // currently running.
+  bool interruptCanPreempt(IntPriority pri);
+
   // Calculate CRC32 for data buffer
   uint32_t crc32(uint8_t *data, uint32_t length);
 
@@ -301,7 +542,11 @@ private:
 
   void InitGPIO();
   void InitADC();
+  void SetADCWindows(Duration loop_period);
+  void TriggerADCFromLoopTimer(Duration loop_period, uint32_t loop_ticks,
+                               uint32_t prescale);
   void InitSysTimer();
+  void InitCycleCounter();
   void BusyWaitUsec(uint16_t usec);
   void InitPwmOut();
   void InitUARTs();
@@ -313,10 +558,24 @@ private:
   void setDigitalPinMode(PwmPin pin, PinMode mode);
   void setDigitalPinMode(BinaryPin pin, PinMode mode);
 
+  // Updated from the control loop ISR, so only read these with interrupts
+  // disabled.
+  StageTimingStats loop_stage_stats_[NUM_LOOP_STAGES];
+
+  AdcWindows adc_windows_ = DEFAULT_ADC_WINDOWS;
+
 #ifdef TEST_MODE
   Time time_ = millisSinceStartup(0);
+  Duration idle_time_ = milliseconds(0);
+  ResetCause reset_cause_ = ResetCause::POWER_ON;
   bool interruptsEnabled_ = true;
 
+  // Models the BASEPRI register and the priority of the running interrupt
+  // handler, both encoded the way the hardware does it: priority << 4, with
+  // 0 meaning no mask / not in a handler.
+  uint32_t interrupt_mask_ = 0;
+  uint32_t handler_priority_ = 0;
+
   // The default pin mode on Arduino is INPUT, which happens to be the first
   // enumerator in PinMode and so the default in these maps!
   //
@@ -326,11 +585,21 @@ private:
   std::map<BinaryPin, PinMode> binary_pin_modes_;
 
   std::map<AnalogPin, Voltage> analog_pin_values_;
+  AdcCaptureBuffer adc_capture_;
   std::map<BinaryPin, VoltageLevel> binary_pin_values_;
   std::map<PwmPin, float> pwm_pin_values_;
 
   std::deque<std::vector<char>> serialIncomingData_;
   std::vector<char> serialOutgoingData_;
+
+  void (*loop_callback_)(void *) = nullptr;
+  void *loop_arg_ = nullptr;
+  LoopMonitor loop_monitor_;
+
+  // Current fake time in microseconds, used as the LoopMonitor timestamp.
+  uint32_t loopMonitorTicks() {
+    return static_cast<uint32_t>(time_.microsSinceStartup());
+  }
 #endif
 };
 
@@ -370,6 +639,63 @@ private:
   bool active_;
 };
 
+// RAII class that masks interrupts of a given priority and below.  For
+// example:
+//
+// {
+//   MaskInterrupts mask(IntPriority::LOW);
+//   // The control loop can't run until the close brace, but UART and other
+//   // hardware interrupts are still serviced.
+// }
+//
+// Like BlockInterrupts, this is reentrant: nesting masks never lowers the
+// mask, and each one restores what was there before it.
+class [[nodiscard]] MaskInterrupts {
+public:
+  explicit MaskInterrupts(IntPriority pri)
+      : prev_(Hal.raiseInterruptMask(pri)) {}
+
+  MaskInterrupts(const MaskInterrupts &) = delete;
+  MaskInterrupts(MaskInterrupts &&) = delete;
+  MaskInterrupts &operator=(const MaskInterrupts &) = delete;
+  MaskInterrupts &operator=(MaskInterrupts &&) = delete;
+
+  ~MaskInterrupts() { Hal.restoreInterruptMask(prev_); }
+
+private:
+  const uint32_t prev_;
+};
+
+// RAII class that times a stage of the control loop.  For example:
+//
+// {
+//   LoopStageTimer timer(LoopStage::SENSORS);
+//   // Everything until the close brace is accounted to LoopStage::SENSORS.
+// }
+class [[nodiscard]] LoopStageTimer {
+public:
+  explicit LoopStageTimer(LoopStage stage)
+      : stage_(stage), start_(Hal.cycleCount()) {}
+
+  LoopStageTimer(const LoopStageTimer &) = delete;
+  LoopStageTimer(LoopStageTimer &&) = delete;
+  LoopStageTimer &operator=(const LoopStageTimer &) = delete;
+  LoopStageTimer &operator=(LoopStageTimer &&) = delete;
+
+  ~LoopStageTimer() {
+    Hal.recordLoopStage(stage_, Hal.cycleCount() - start_);
+  }
+
+private:
+  const LoopStage stage_;
+  const uint32_t start_;
+};
+
+inline StageTimingStats HalApi::loopStageStats(LoopStage stage) {
+  MaskInterrupts mask(IntPriority::LOW);
+  return loop_stage_stats_[static_cast<int>(stage)];
+}
+
 #if defined(BARE_STM32)
 
 inline void HalApi::disableInterrupts() {
@@ -388,18 +714,61 @@ inline bool HalApi::InInterruptHandler() {
   return ret > 0;
 }
 
+// BASEPRI uses the same encoding as the NVIC priority registers, see
+// EnableInterrupt().  A BASEPRI of 0 means "mask nothing", so we can't mask
+// at priority 0 -- but we never use that priority.
+inline uint32_t HalApi::raiseInterruptMask(IntPriority pri) {
+  uint32_t prev;
+  asm volatile("mrs %[output], basepri" : [output] "=r"(prev));
+  uint32_t mask = static_cast<uint32_t>(pri) << 4;
+  asm volatile("msr basepri_max, %[input]" ::[input] "r"(mask) : "memory");
+  return prev;
+}
+inline void HalApi::restoreInterruptMask(uint32_t mask) {
+  asm volatile("msr basepri, %[input]" ::[input] "r"(mask) : "memory");
+}
+
+// The DWT cycle counter is enabled in InitCycleCounter(), see hal_stm32.cpp.
+inline uint32_t HalApi::cycleCount() { return DWT_BASE->cycleCount; }
+
 #else
-inline void HalApi::init() {}
+// Like the real thing, makes the pins the controller drives outputs.
+inline void HalApi::init() {
+  setDigitalPinMode(PwmPin::BLOWER, PinMode::OUTPUT);
+  setDigitalPinMode(BinaryPin::SOLENOID, PinMode::OUTPUT);
+}
 inline void HalApi::watchdog_handler() {}
 
 inline Time HalApi::now() { return time_; }
+inline uint32_t HalApi::cycleCount() {
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
 inline void HalApi::delay(Duration d) { time_ = time_ + d; }
+inline void HalApi::idle(Time wake_by) {
+  if (wake_by > time_) {
+    idle_time_ = idle_time_ + (wake_by - time_);
+    time_ = wake_by;
+  }
+}
+inline Duration HalApi::idleTime() { return idle_time_; }
+inline ResetCause HalApi::resetCause() { return reset_cause_; }
 inline Voltage HalApi::analogRead(AnalogPin pin) {
   return analog_pin_values_.at(pin);
 }
+inline AnalogReadings HalApi::analogReadAll() {
+  AnalogReadings readings;
+  for (int i = 0; i < NUM_ANALOG_PINS; i++) {
+    readings.voltage[i] = analogRead(static_cast<AnalogPin>(i));
+  }
+  return readings;
+}
 inline void HalApi::test_setAnalogPin(AnalogPin pin, Voltage value) {
   analog_pin_values_[pin] = value;
 }
+inline AdcCaptureBuffer &HalApi::adcCapture() { return adc_capture_; }
 inline void HalApi::setDigitalPinMode(PwmPin pin, PinMode mode) {
   pwm_pin_modes_[pin] = mode;
 }
@@ -467,7 +836,35 @@ inline void HalApi::test_serialPutIncomingData(const char *data, uint16_t len) {
 inline void HalApi::disableInterrupts() { interruptsEnabled_ = false; }
 inline void HalApi::enableInterrupts() { interruptsEnabled_ = true; }
 inline bool HalApi::interruptsEnabled() { return interruptsEnabled_; }
-inline bool HalApi::InInterruptHandler() { return false; }
+inline bool HalApi::InInterruptHandler() { return handler_priority_ != 0; }
+
+inline uint32_t HalApi::raiseInterruptMask(IntPriority pri) {
+  uint32_t prev = interrupt_mask_;
+  uint32_t mask = static_cast<uint32_t>(pri) << 4;
+  // Same as BASEPRI_MAX: only ever raise the mask.
+  if (interrupt_mask_ == 0 || mask < interrupt_mask_) {
+    interrupt_mask_ = mask;
+  }
+  return prev;
+}
+inline void HalApi::restoreInterruptMask(uint32_t mask) {
+  interrupt_mask_ = mask;
+}
+inline bool HalApi::interruptCanPreempt(IntPriority pri) {
+  uint32_t p = static_cast<uint32_t>(pri) << 4;
+  return interruptsEnabled_ && (interrupt_mask_ == 0 || p < interrupt_mask_) &&
+         (handler_priority_ == 0 || p < handler_priority_);
+}
+inline void HalApi::test_runInterrupt(IntPriority pri, void (*fn)(void *),
+                                      void *arg) {
+  if (!interruptCanPreempt(pri)) {
+    throw "Interrupt can't preempt the current code";
+  }
+  uint32_t prev = handler_priority_;
+  handler_priority_ = static_cast<uint32_t>(pri) << 4;
+  fn(arg);
+  handler_priority_ = prev;
+}
 
 inline uint32_t HalApi::crc32(uint8_t *data, uint32_t length) {
   return soft_crc32(reinterpret_cast<char *>(data), length);
@@ -480,8 +877,31 @@ inline uint16_t HalApi::debugWrite(const char *buf, uint16_t len) {
 }
 inline uint16_t HalApi::debugRead(char *buf, uint16_t len) { return 0; }
 
+// There's no A/D in test mode, so adc_mode doesn't matter.
 inline void HalApi::startLoopTimer(const Duration &period,
-                                   void (*callback)(void *), void *arg) {}
+                                   void (*callback)(void *), void *arg,
+                                   AdcMode adc_mode) {
+  loop_callback_ = callback;
+  loop_arg_ = arg;
+  loop_monitor_.Start(static_cast<uint32_t>(period.microseconds()),
+                      /*ticks_per_microsecond=*/1);
+}
+inline LoopMonitor HalApi::loopMonitor() { return loop_monitor_; }
+inline void HalApi::test_fireLoopTimer() {
+  if (loop_callback_ == nullptr) {
+    throw "Loop timer was not started";
+  }
+  // The loop timer interrupt runs at low priority, see hal_stm32.cpp.
+  test_runInterrupt(
+      IntPriority::LOW,
+      [](void *arg) {
+        HalApi *hal = static_cast<HalApi *>(arg);
+        hal->loop_monitor_.OnEntry(hal->loopMonitorTicks());
+        hal->loop_callback_(hal->loop_arg_);
+        hal->loop_monitor_.OnExit(hal->loopMonitorTicks());
+      },
+      this);
+}
 
 #endif
 
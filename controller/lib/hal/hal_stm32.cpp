@@ -49,6 +49,7 @@ static volatile int64_t msCount;
 static void Timer6ISR();
 static void Timer15ISR();
 void UART3_ISR();
+void DMA1_CH1_ISR();
 void DMA1_CH2_ISR();
 void DMA1_CH3_ISR();
 
@@ -128,13 +129,46 @@ void HalApi::EarlyInit() {
   rcc->indClkCfg = 0x30000000;
 }
 
+// Why we last reset.  Set once by init().
+static ResetCause reset_cause = ResetCause::POWER_ON;
+
+// Works out why we reset from the flags in RCC_CSR, then clears them.  The
+// flags accumulate until they're cleared (and a power-on clears them all),
+// so without this we couldn't tell the second reset from the first.
+//
+// Note that the reset pin flag is set by every reset, because the other
+// reset sources drive the pin too, so it has to be checked last.
+//
+// See section 6.4.29 of the reference manual for details on RCC_CSR.
+static ResetCause ReadResetCause() {
+  RCC_Regs *rcc = RCC_BASE;
+  uint32_t flags = rcc->status;
+  rcc->status |= 1 << 23; // RMVF: clear the reset flags
+
+  if (flags & (1 << 27)) { // BORRSTF
+    return ResetCause::POWER_ON;
+  }
+  if (flags & ((1 << 29) | (1 << 30))) { // IWDGRSTF, WWDGRSTF
+    return ResetCause::WATCHDOG;
+  }
+  if (flags & (1 << 28)) { // SFTRSTF
+    return ResetCause::SOFTWARE;
+  }
+  return ResetCause::OTHER;
+}
+
+ResetCause HalApi::resetCause() { return reset_cause; }
+
 /*
  * One time init of HAL.
  */
 void HalApi::init() {
+  reset_cause = ReadResetCause();
+
   // Init various components needed by the system.
   InitGPIO();
   InitSysTimer();
+  InitCycleCounter();
   InitADC();
   InitPwmOut();
   InitUARTs();
@@ -288,12 +322,76 @@ static void Timer6ISR() {
 }
 
 void HalApi::delay(Duration d) {
-  int64_t start = msCount;
-  while (msCount - start < d.milliseconds()) {
+  Time start = now();
+  while (now() - start < d) {
+  }
+}
+
+// The time is msCount milliseconds plus however far timer 6 has counted
+// towards the next interrupt, in 100ns ticks.
+//
+// We read the two with interrupts disabled so that msCount can't change
+// under us.  But the timer keeps counting, and it may have wrapped without
+// Timer6ISR having run yet to count it -- either just now, or a while ago if
+// we're called with interrupts disabled or from an interrupt handler of the
+// same or higher priority.  In that case the update flag in the status
+// register is set, and we count the pending millisecond ourselves.  We reread
+// the counter after seeing the flag, because our first reading may be from
+// just before the wrap.
+Time HalApi::now() {
+  BlockInterrupts block;
+  TimerRegs *tmr = TIMER6_BASE;
+  uint64_t ms = static_cast<uint64_t>(msCount);
+  uint32_t ticks = tmr->counter;
+  if (tmr->status & 1) {
+    ms++;
+    ticks = tmr->counter;
   }
+  return microsSinceStartup(ms * 1000 + ticks / 10);
 }
 
-Time HalApi::now() { return millisSinceStartup(msCount); }
+// Cycles spent asleep in idle().  Only touched from idle() and idleTime(),
+// which are called from the background loop.
+static uint64_t idle_cycles;
+
+void HalApi::idle(Time wake_by) {
+  if (now() >= wake_by)
+    return;
+
+  // We sleep with interrupts disabled.  WFI still wakes up when an interrupt
+  // becomes pending, but the handler doesn't run until we re-enable
+  // interrupts at the end of this block.  That lets us measure how long we
+  // were asleep without counting the time spent in the interrupt handler.
+  BlockInterrupts block;
+  uint32_t start = cycleCount();
+  asm volatile("wfi" ::: "memory");
+  idle_cycles += cycleCount() - start;
+}
+
+Duration HalApi::idleTime() {
+  return microseconds(
+      static_cast<int64_t>(idle_cycles / CYCLES_PER_MICROSECOND));
+}
+
+/******************************************************************
+ * Cycle counter
+ *
+ * The Cortex-M4 data watchpoint and trace (DWT) unit includes a 32-bit
+ * counter that increments on every CPU clock.  We use it to profile
+ * short sections of code, see HalApi::cycleCount().  At 80MHz it
+ * wraps roughly every 53 seconds.
+ *****************************************************************/
+static_assert(CYCLES_PER_MICROSECOND == CPU_FREQ_MHZ);
+
+void HalApi::InitCycleCounter() {
+  // The DWT is part of the debug logic, so it has to be enabled via the
+  // TRCENA bit in the DEMCR register before it can be used.
+  DEBUG_CTRL_BASE->exceptMonCtrl |= 0x01000000;
+  DWT_BASE->cycleCount = 0;
+
+  // Set CYCCNTENA to start the counter.
+  DWT_BASE->ctrl |= 1;
+}
 
 /******************************************************************
  * Loop timer
@@ -305,8 +403,13 @@ Time HalApi::now() { return millisSinceStartup(msCount); }
  *****************************************************************/
 static void (*controller_callback)(void *);
 static void *controller_arg;
+
+// Tracks jitter and overruns of the loop timer interrupt.  Timestamps are
+// taken from the CPU cycle counter.
+static LoopMonitor loop_monitor;
+
 void HalApi::startLoopTimer(const Duration &period, void (*callback)(void *),
-                            void *arg) {
+                            void *arg, AdcMode adc_mode) {
   controller_callback = callback;
   controller_arg = arg;
 
@@ -321,6 +424,11 @@ void HalApi::startLoopTimer(const Duration &period, void (*callback)(void *),
     reload /= prescale;
   }
 
+  // Note that reload * prescale may be slightly less than the requested
+  // period.  Monitor the period we actually get.
+  loop_monitor.Start(static_cast<uint32_t>(reload * prescale),
+                     CYCLES_PER_MICROSECOND);
+
   // Enable the clock to the timer
   EnableClock(TIMER15_BASE);
 
@@ -329,6 +437,15 @@ void HalApi::startLoopTimer(const Duration &period, void (*callback)(void *),
   tmr->reload = reload - 1;
   tmr->prescale = prescale - 1;
   tmr->event = 1;
+
+  // Set up the A/D before the timer starts counting, since in
+  // LOOP_TRIGGERED mode the timer drives it.
+  SetADCWindows(period);
+  if (adc_mode == AdcMode::LOOP_TRIGGERED) {
+    TriggerADCFromLoopTimer(period, static_cast<uint32_t>(reload),
+                            static_cast<uint32_t>(prescale));
+  }
+
   tmr->ctrl[0] = 1;
   tmr->intEna = 1;
 
@@ -342,6 +459,8 @@ void HalApi::startLoopTimer(const Duration &period, void (*callback)(void *),
 }
 
 static void Timer15ISR() {
+  loop_monitor.OnEntry(Hal.cycleCount());
+
   TIMER15_BASE->status = 0;
 
   // Call the function
@@ -349,6 +468,13 @@ static void Timer15ISR() {
 
   // Start sending any queued commands to the stepper motor
   StepMotor::StartQueuedCommands();
+
+  loop_monitor.OnExit(Hal.cycleCount());
+}
+
+LoopMonitor HalApi::loopMonitor() {
+  MaskInterrupts mask(IntPriority::LOW);
+  return loop_monitor;
 }
 
 /******************************************************************
@@ -838,7 +964,7 @@ __attribute__((section(".isr_vector"))) void (*const vectors[101])() = {
     BadISR,        //  24 - 0x060
     BadISR,        //  25 - 0x064
     BadISR,        //  26 - 0x068
-    BadISR,        //  27 - 0x06C
+    DMA1_CH1_ISR,  //  27 - 0x06C DMA1 CH1 (A/D)
 #ifdef UART_VIA_DMA
     DMA1_CH2_ISR, //  28 - 0x070 DMA1 CH2
     DMA1_CH3_ISR, //  29 - 0x074 DMA1 CH3
@@ -935,4 +1061,25 @@ void HalApi::EnableInterrupt(InterruptVector vec, IntPriority pri) {
   nvic->priority[id] = static_cast<BREG>(p << 4);
 }
 
+bool HalApi::interruptCanPreempt(IntPriority pri) {
+  if (!interruptsEnabled())
+    return false;
+
+  uint32_t p = static_cast<uint32_t>(pri) << 4;
+  uint32_t basepri;
+  asm volatile("mrs %[output], basepri" : [output] "=r"(basepri));
+  if (basepri != 0 && p >= basepri)
+    return false;
+
+  // If we're in an interrupt handler, only a more important interrupt can
+  // preempt it.  Exception numbers 16 and up are the peripheral interrupts
+  // whose priorities we set in EnableInterrupt().  We don't expect to be
+  // asking from the lower numbered system exceptions (faults, etc).
+  uint32_t ipsr;
+  asm volatile("mrs %[output], ipsr" : [output] "=r"(ipsr));
+  if (ipsr >= 16)
+    return p < NVIC_BASE->priority[ipsr - 16];
+  return ipsr == 0;
+}
+
 #endif
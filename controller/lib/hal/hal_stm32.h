@@ -42,6 +42,7 @@ the programmer's manual for the processor available here:
 // These can be found in the NVIC chapter (chapter 12) of the
 // processor reference manual
 enum class InterruptVector {
+  DMA1_CH1 = 0x6C,
   DMA1_CH2 = 0x70,
   DMA1_CH3 = 0x074,
   TIMER15 = 0xA0,
@@ -75,6 +75,25 @@ struct SysCtrl_Reg {
 inline SysCtrl_Reg *const SYSCTL_BASE =
     reinterpret_cast<SysCtrl_Reg *>(0xE000E000);
 
+// Core debug registers.  These are documented in the ARMv7-M architecture
+// reference manual, section C1.6.
+struct DebugCtrl_Regs {
+  REG haltCtrl;      // 0xE000EDF0 Halting control and status (DHCSR)
+  REG coreRegSel;    // 0xE000EDF4 Core register selector (DCRSR)
+  REG coreRegDat;    // 0xE000EDF8 Core register data (DCRDR)
+  REG exceptMonCtrl; // 0xE000EDFC Exception and monitor control (DEMCR)
+};
+inline DebugCtrl_Regs *const DEBUG_CTRL_BASE =
+    reinterpret_cast<DebugCtrl_Regs *>(0xE000EDF0);
+
+// Data watchpoint and trace unit.  We only use its cycle counter.
+// See the ARMv7-M architecture reference manual, section C1.8.
+struct DWT_Regs {
+  REG ctrl;       // 0xE0001000 Control register (DWT_CTRL)
+  REG cycleCount; // 0xE0001004 Cycle count register (DWT_CYCCNT)
+};
+inline DWT_Regs *const DWT_BASE = reinterpret_cast<DWT_Regs *>(0xE0001000);
+
 // Interrupt controller
 struct IntCtrl_Regs {
   REG setEna[32];
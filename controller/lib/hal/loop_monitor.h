@@ -0,0 +1,138 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef LOOP_MONITOR_H
+#define LOOP_MONITOR_H
+
+#include "stage_timing.h"
+#include <stdint.h>
+
+// Watches the timer interrupt which runs the high priority control loop.
+//
+// The HAL calls OnEntry() as soon as the loop timer interrupt fires and
+// OnExit() just before it returns, i.e. after the control loop callback and
+// anything else the HAL does in that interrupt.  From those timestamps we
+// track:
+//
+//  - jitter: how far each entry deviates from the schedule given by the loop
+//    period.  This is kept as a StageTimingStats, so we get min/max/mean and a
+//    log2 histogram.
+//
+//  - overruns: ticks where the interrupt was still running when the next tick
+//    was due.  If this happens the next tick is late, or if we're more than a
+//    whole period late, lost entirely.
+//
+// If more than ALARM_THRESHOLD overruns happen within ALARM_WINDOW consecutive
+// ticks, AlarmActive() becomes true.  It stays true until a full window passes
+// without exceeding the threshold.
+//
+// Timestamps are in arbitrary "ticks" of a free-running 32-bit counter, which
+// is allowed to wrap.  On STM32 that's the CPU cycle counter; in test mode
+// it's the fake clock, in microseconds.
+class LoopMonitor {
+public:
+  static constexpr uint32_t ALARM_WINDOW = 100;
+  static constexpr uint32_t ALARM_THRESHOLD = 5;
+
+  // (Re)starts monitoring a loop which is scheduled every `period_ticks`.
+  // This should be the period the timer was actually programmed with, which
+  // may differ slightly from the period that was requested because of timer
+  // prescaler rounding; otherwise the error accumulates as apparent jitter.
+  void Start(uint32_t period_ticks, uint32_t ticks_per_microsecond) {
+    *this = LoopMonitor();
+    period_ = period_ticks;
+    ticks_per_microsecond_ = ticks_per_microsecond;
+  }
+
+  void OnEntry(uint32_t now) {
+    if (ticks_ == 0) {
+      // We don't know the phase of the timer relative to our clock, so take
+      // the first entry as the reference point.
+      scheduled_ = now;
+    } else {
+      scheduled_ += period_;
+
+      // If we're late by a whole period or more, one or more timer ticks were
+      // lost: the interrupt controller only remembers one pending interrupt,
+      // so ticks which fire while we're still pending get merged.  Skip the
+      // schedule ahead accordingly.
+      uint32_t late = now - scheduled_;
+      if (static_cast<int32_t>(late) > 0 && late >= period_) {
+        uint32_t lost = late / period_;
+        missed_ticks_ += lost;
+        scheduled_ += lost * period_;
+      }
+    }
+
+    int32_t deviation = static_cast<int32_t>(now - scheduled_);
+    jitter_.Record(
+        static_cast<uint32_t>(deviation < 0 ? -deviation : deviation));
+    ticks_++;
+  }
+
+  void OnExit(uint32_t now) {
+    // Did we run past the point where the next tick was due?
+    if (now - scheduled_ >= period_) {
+      overruns_++;
+      window_overruns_++;
+    }
+
+    if (++window_ticks_ >= ALARM_WINDOW) {
+      alarm_ = window_overruns_ > ALARM_THRESHOLD;
+      window_ticks_ = 0;
+      window_overruns_ = 0;
+    } else if (window_overruns_ > ALARM_THRESHOLD) {
+      alarm_ = true;
+    }
+  }
+
+  // Number of times OnEntry() was called since Start().
+  uint32_t Ticks() const { return ticks_; }
+
+  // Number of times the loop was still running when the next tick was due.
+  uint32_t Overruns() const { return overruns_; }
+
+  // Number of ticks which were skipped entirely because the loop was more
+  // than one period late.
+  uint32_t MissedTicks() const { return missed_ticks_; }
+
+  // Deviation of each entry from the schedule, in ticks.
+  const StageTimingStats &Jitter() const { return jitter_; }
+
+  float MaxJitterMicroseconds() const {
+    return static_cast<float>(jitter_.Max()) /
+           static_cast<float>(ticks_per_microsecond_);
+  }
+
+  bool AlarmActive() const { return alarm_; }
+
+private:
+  uint32_t period_ = 1;
+  uint32_t ticks_per_microsecond_ = 1;
+
+  // Timestamp at which the most recent tick was due.
+  uint32_t scheduled_ = 0;
+
+  uint32_t ticks_ = 0;
+  uint32_t overruns_ = 0;
+  uint32_t missed_ticks_ = 0;
+  StageTimingStats jitter_;
+
+  uint32_t window_ticks_ = 0;
+  uint32_t window_overruns_ = 0;
+  bool alarm_ = false;
+};
+
+#endif // LOOP_MONITOR_H
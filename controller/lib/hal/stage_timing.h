@@ -0,0 +1,79 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef STAGE_TIMING_H
+#define STAGE_TIMING_H
+
+#include <stdint.h>
+
+// Execution time statistics for one piece of code, e.g. one stage of the
+// high priority control loop.
+//
+// Times are measured in ticks of HalApi::cycleCount().  Alongside the usual
+// min/max/mean we keep a histogram with power-of-two bucket sizes, which is
+// cheap to update from an ISR and still tells us how heavy the tail is:
+// bucket i counts samples in [2^i, 2^(i+1)), except bucket 0 which also
+// counts samples of 0 cycles.
+//
+// Recording a sample is O(1) and never allocates, so this is safe to use from
+// the control loop.
+class StageTimingStats {
+public:
+  static constexpr int HISTOGRAM_BUCKETS = 32;
+
+  void Record(uint32_t cycles) {
+    count_++;
+    total_ += cycles;
+    if (cycles < min_) {
+      min_ = cycles;
+    }
+    if (cycles > max_) {
+      max_ = cycles;
+    }
+    histogram_[Bucket(cycles)]++;
+  }
+
+  void Reset() { *this = StageTimingStats(); }
+
+  uint32_t Count() const { return count_; }
+
+  // Min/max/mean are 0 if no samples have been recorded.
+  uint32_t Min() const { return count_ == 0 ? 0 : min_; }
+  uint32_t Max() const { return max_; }
+  float Mean() const {
+    return count_ == 0
+               ? 0.0f
+               : static_cast<float>(total_) / static_cast<float>(count_);
+  }
+
+  // Number of samples which fell into the given histogram bucket.
+  uint32_t Histogram(int bucket) const { return histogram_[bucket]; }
+
+  // Index of the histogram bucket which counts `cycles`, i.e. floor(log2)
+  // clamped to 0.  This compiles down to a single CLZ instruction on the
+  // Cortex-M4.
+  static int Bucket(uint32_t cycles) {
+    return 31 - __builtin_clz(cycles | 1);
+  }
+
+private:
+  uint32_t count_ = 0;
+  uint32_t min_ = UINT32_MAX;
+  uint32_t max_ = 0;
+  uint64_t total_ = 0;
+  uint32_t histogram_[HISTOGRAM_BUCKETS] = {};
+};
+
+#endif // STAGE_TIMING_H
@@ -19,65 +19,21 @@ limitations under the License.
 #include "pid.h"
 #include "algorithm.h"
 
-float PID::Compute(Time now, float input, float setpoint) {
-  if (!initialized_) {
-    last_input_ = input;
-    last_error_ = setpoint - input;
-
-    // last call time defined as now - SampleTime to enable computation on first
-    // call (user should call Compute() immediately after SetMode(Auto))
-    initialized_ = true;
-  }
-
-  float samplesTimeChangeSec = sample_period_.seconds();
-
-  // Compute all the working error variables
-  float error = setpoint - input;
-  float dInput = 0.0;
-
-  float kp, ki, kd;
-  if (direction_ == ControlDirection::DIRECT) {
-    kp = kp_;
-    ki = ki_;
-    kd = kd_;
-  } else {
-    kp = -kp_;
-    ki = -ki_;
-    kd = -kd_;
-  }
-
-  // Compute dInput only if needed.
-  if (p_term_ == ProportionalTerm::ON_MEASUREMENT ||
-      d_term_ == DifferentialTerm::ON_MEASUREMENT) {
-    dInput = (input - last_input_);
-  }
-  output_sum_ += (ki * error * samplesTimeChangeSec);
-
-  if (p_term_ == ProportionalTerm::ON_MEASUREMENT) {
-    output_sum_ -= kp * dInput;
-  }
-
-  output_sum_ = std::clamp(output_sum_, out_min_, out_max_);
-
-  float res = output_sum_;
-  if (p_term_ == ProportionalTerm::ON_ERROR) {
-    res += kp * error;
-  }
-  if (d_term_ == DifferentialTerm::ON_MEASUREMENT) {
-    res -= kd * dInput / samplesTimeChangeSec;
-  } else {
-    res += kd * (error - last_error_) / samplesTimeChangeSec;
-  }
-
-  // Remember some variables for next time
-  last_input_ = input;
-  last_error_ = error;
+PIDCore::PIDCore(float kp, float ki, float kd, ControlDirection direction,
+                 float output_min, float output_max, Duration sample_period)
+    : direction_(direction), sample_period_s_(sample_period.seconds()),
+      out_min_(output_min), out_max_(output_max) {
+  SetTunings(kp, ki, kd);
+}
 
-  last_output_ = std::clamp(res, out_min_, out_max_);
-  return last_output_;
+void PIDCore::SetTunings(float kp, float ki, float kd) {
+  float sign = direction_ == ControlDirection::DIRECT ? 1.f : -1.f;
+  kp_ = sign * kp;
+  ki_dt_ = sign * ki * sample_period_s_;
+  kd_per_dt_ = sign * kd / sample_period_s_;
 }
 
-void PID::Observe(Time now, float input, float setpoint, float actual_output) {
+void PIDCore::Observe(float input, float setpoint, float actual_output) {
   // All the observable variables are updated the same way as in Compute();
   last_input_ = input;
   last_error_ = setpoint - input;
@@ -86,3 +42,18 @@ void PID::Observe(Time now, float input, float setpoint, float actual_output) {
   // Compute() call), avoiding a spike.
   output_sum_ = std::clamp(actual_output, out_min_, out_max_);
 }
+
+template <ProportionalTerm P_TERM>
+static auto ComputeFor(DifferentialTerm d_term) {
+  return d_term == DifferentialTerm::ON_ERROR
+             ? &PIDCore::Compute<P_TERM, DifferentialTerm::ON_ERROR>
+             : &PIDCore::Compute<P_TERM, DifferentialTerm::ON_MEASUREMENT>;
+}
+
+PID::PID(float kp, float ki, float kd, ProportionalTerm p_term,
+         DifferentialTerm d_term, ControlDirection direction,
+         float output_min, float output_max, Duration sample_period)
+    : core_(kp, ki, kd, direction, output_min, output_max, sample_period),
+      compute_(p_term == ProportionalTerm::ON_ERROR
+                   ? ComputeFor<ProportionalTerm::ON_ERROR>(d_term)
+                   : ComputeFor<ProportionalTerm::ON_MEASUREMENT>(d_term)) {}
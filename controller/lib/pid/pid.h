@@ -20,6 +20,7 @@ limitations under the License.
 #define PID_H
 #define LIBRARY_VERSION 1.2.1
 
+#include "algorithm.h"
 #include "units.h"
 
 enum class ProportionalTerm {
@@ -37,20 +38,152 @@ enum class ControlDirection {
   REVERSE,
 };
 
+// Everything a PID remembers between steps, so it can carry on where it left
+// off after a warm restart.  The tuning parameters aren't included; they can
+// change with SetTunings(), so whoever sets them keeps them across a warm
+// restart too (the blower loop's are in Controller::State::tuning).
+struct PIDState {
+  bool initialized;
+  float output_sum;
+  float last_input;
+  float last_error;
+  float last_output;
+};
+
+// The tuning and state shared by PID and FixedModePID, and the PID step
+// itself, for each choice of terms.
+//
+// The direction is folded into the gains when they're set, and the integral
+// and derivative gains are pre-scaled by the sample period, so a step is just
+// a handful of multiply-adds.  Callers pick the terms at compile time, so
+// that a step has no branches other than the clamps.
+class PIDCore {
+public:
+  PIDCore(float kp, float ki, float kd, ControlDirection direction,
+          float output_min, float output_max, Duration sample_period);
+
+  // Changes the gains, keeping the state.  The integral term carries on from
+  // where it was, so only the proportional and derivative terms jump.
+  void SetTunings(float kp, float ki, float kd);
+
+  template <ProportionalTerm P_TERM, DifferentialTerm D_TERM>
+  float Compute(float input, float setpoint) {
+    if (!initialized_) {
+      last_input_ = input;
+      last_error_ = setpoint - input;
+      initialized_ = true;
+    }
+
+    float error = setpoint - input;
+    float d_input = input - last_input_;
+
+    output_sum_ += ki_dt_ * error;
+    if constexpr (P_TERM == ProportionalTerm::ON_MEASUREMENT) {
+      output_sum_ -= kp_ * d_input;
+    }
+    output_sum_ = std::clamp(output_sum_, out_min_, out_max_);
+
+    float res = output_sum_;
+    if constexpr (P_TERM == ProportionalTerm::ON_ERROR) {
+      res += kp_ * error;
+    }
+    if constexpr (D_TERM == DifferentialTerm::ON_MEASUREMENT) {
+      res -= kd_per_dt_ * d_input;
+    } else {
+      res += kd_per_dt_ * (error - last_error_);
+    }
+
+    last_input_ = input;
+    last_error_ = error;
+    last_output_ = std::clamp(res, out_min_, out_max_);
+    return last_output_;
+  }
+
+  void Observe(float input, float setpoint, float actual_output);
+
+  PIDState GetState() const {
+    return {.initialized = initialized_,
+            .output_sum = output_sum_,
+            .last_input = last_input_,
+            .last_error = last_error_,
+            .last_output = last_output_};
+  }
+
+  void RestoreState(const PIDState &state) {
+    initialized_ = state.initialized;
+    output_sum_ = state.output_sum;
+    last_input_ = state.last_input;
+    last_error_ = state.last_error;
+    last_output_ = state.last_output;
+  }
+
+private:
+  const ControlDirection direction_;
+  const float sample_period_s_;
+
+  // Signed by the direction.
+  float kp_;
+  // ki * sample period.
+  float ki_dt_;
+  // kd / sample period.
+  float kd_per_dt_;
+
+  const float out_min_;
+  const float out_max_;
+
+  bool initialized_ = false;
+  float output_sum_ = 0;
+  float last_input_ = 0;
+  float last_error_ = 0;
+  float last_output_ = 0;
+};
+
+// A PID whose terms and direction are fixed at compile time, so Compute()
+// compiles to straight-line code.  See PID for what the parameters mean.
+template <ProportionalTerm P_TERM, DifferentialTerm D_TERM,
+          ControlDirection DIRECTION>
+class FixedModePID {
+public:
+  using State = PIDState;
+
+  FixedModePID(float kp, float ki, float kd, float output_min,
+               float output_max, Duration sample_period)
+      : core_(kp, ki, kd, DIRECTION, output_min, output_max, sample_period) {}
+
+  float Compute(Time now, float input, float setpoint) {
+    return core_.Compute<P_TERM, D_TERM>(input, setpoint);
+  }
+  void Observe(Time now, float input, float setpoint, float actual_output) {
+    core_.Observe(input, setpoint, actual_output);
+  }
+  void SetTunings(float kp, float ki, float kd) {
+    core_.SetTunings(kp, ki, kd);
+  }
+
+  State GetState() const { return core_.GetState(); }
+  void RestoreState(const State &state) { core_.RestoreState(state); }
+
+private:
+  PIDCore core_;
+};
+
+// A PID whose terms and direction are chosen at runtime.  This picks the
+// matching PIDCore::Compute() once, at construction, so each step costs one
+// indirect call more than FixedModePID's.
 class PID {
 public:
+  using State = PIDState;
+
   // Constructs the PID using the given parameters.
   PID(float kp, float ki, float kd, ProportionalTerm p_term,
       DifferentialTerm d_term, ControlDirection direction, float output_min,
-      float output_max, Duration sample_period)
-      : kp_(kp), ki_(ki), kd_(kd), p_term_(p_term), d_term_(d_term),
-        direction_(direction), out_min_(output_min), out_max_(output_max),
-        sample_period_(sample_period) {}
+      float output_max, Duration sample_period);
 
-  // Performs one step of the PID calculation.
-  // If this call was ignored due to being within sample time
-  // of the previous call, returns the last returned value.
-  float Compute(Time now, float input, float setpoint);
+  // Performs one step of the PID calculation.  Each call is taken to be one
+  // sample period after the last.
+  float Compute(Time now, float input, float setpoint) {
+    return (core_.*compute_)(input, setpoint);
+  }
 
   // Call this instead of Compute in case on this step of the control loop
   // you intend apply different control logic instead of the PID.
@@ -59,26 +192,20 @@ public:
   // This is a variation on the "manual" mode:
   // http://brettbeauregard.com/blog/2011/04/improving-the-beginner%e2%80%99s-pid-onoff/
   // http://brettbeauregard.com/blog/2011/04/improving-the-beginner%e2%80%99s-pid-initialization/
-  void Observe(Time now, float input, float setpoint, float actual_output);
+  void Observe(Time now, float input, float setpoint, float actual_output) {
+    core_.Observe(input, setpoint, actual_output);
+  }
 
-private:
-  const float kp_; // * (P)roportional Tuning Parameter
-  const float ki_; // * (I)ntegral Tuning Parameter
-  const float kd_; // * (D)erivative Tuning Parameter
-
-  const ProportionalTerm p_term_;
-  const DifferentialTerm d_term_;
-  const ControlDirection direction_;
-
-  const float out_min_;
-  const float out_max_;
+  // Changes the gains, e.g. after autotuning.  See PIDCore::SetTunings().
+  void SetTunings(float kp, float ki, float kd) {
+    core_.SetTunings(kp, ki, kd);
+  }
 
-  const Duration sample_period_;
+  State GetState() const { return core_.GetState(); }
+  void RestoreState(const State &state) { core_.RestoreState(state); }
 
-  bool initialized_ = false;
-  float output_sum_ = 0;
-  float last_input_ = 0;
-  float last_error_ = 0;
-  float last_output_ = 0;
+private:
+  PIDCore core_;
+  float (PIDCore::*compute_)(float input, float setpoint);
 };
 #endif
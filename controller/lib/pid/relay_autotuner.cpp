@@ -0,0 +1,150 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "relay_autotuner.h"
+#include "algorithm.h"
+#include <cmath>
+
+static constexpr float PI = 3.14159265f;
+
+void RelayAutotuner::Start(Time now) {
+  status_ = Status::RUNNING;
+  start_ = now;
+  ramping_ = true;
+  cycles_ = 0;
+}
+
+void RelayAutotuner::SetBias(float bias) {
+  bias_ = std::clamp(bias, config_.output_min, config_.output_max);
+  amplitude_ = std::min({config_.amplitude, bias_ - config_.output_min,
+                         config_.output_max - bias_});
+}
+
+void RelayAutotuner::Abort() {
+  if (status_ == Status::RUNNING) {
+    Fail();
+  }
+}
+
+void RelayAutotuner::Fail() { status_ = Status::FAILED; }
+
+float RelayAutotuner::Step(Time now, float input) {
+  if (status_ != Status::RUNNING) {
+    return config_.output_min;
+  }
+  if (input > config_.input_limit || now - start_ > config_.timeout) {
+    Fail();
+    return config_.output_min;
+  }
+
+  if (ramping_) {
+    float ramp = (now - start_).seconds() / config_.ramp_time.seconds();
+    float output = config_.output_min +
+                   (config_.output_max - config_.output_min) * ramp;
+    if (input < config_.setpoint) {
+      return std::min(output, config_.output_max);
+    }
+    // Start the relay, switching low.
+    ramping_ = false;
+    SetBias(output);
+    if (amplitude_ <= 0) {
+      Fail();
+      return config_.output_min;
+    }
+    high_ = false;
+    high_time_ = seconds(0);
+    last_switch_ = now;
+    input_min_ = input;
+    input_max_ = input;
+    return bias_ - amplitude_;
+  }
+
+  input_min_ = std::min(input_min_, input);
+  input_max_ = std::max(input_max_, input);
+  if (high_ && input > config_.setpoint + config_.hysteresis) {
+    high_ = false;
+    high_time_ = now - last_switch_;
+    last_switch_ = now;
+  } else if (!high_ && input < config_.setpoint - config_.hysteresis) {
+    EndCycle(now);
+    high_ = true;
+    last_switch_ = now;
+    input_min_ = input;
+    input_max_ = input;
+  }
+
+  if (status_ != Status::RUNNING) {
+    return config_.output_min;
+  }
+  return high_ ? bias_ + amplitude_ : bias_ - amplitude_;
+}
+
+void RelayAutotuner::EndCycle(Time now) {
+  Duration low_time = now - last_switch_;
+  float period_s = (high_time_ + low_time).seconds();
+  int cycle = cycles_++;
+
+  if (cycle < SETTLE_CYCLES) {
+    if (cycle > 0) {
+      // The mean output over the cycle is what holds the input at the
+      // setpoint, on average.
+      SetBias(bias_ +
+              amplitude_ * (high_time_ - low_time).seconds() / period_s);
+    }
+    return;
+  }
+
+  int i = cycle - SETTLE_CYCLES;
+  periods_s_[i] = period_s;
+  input_amplitudes_[i] = (input_max_ - input_min_) / 2;
+  if (i + 1 < MEASURED_CYCLES) {
+    return;
+  }
+
+  float mean_period_s = 0;
+  float mean_amplitude = 0;
+  for (int j = 0; j < MEASURED_CYCLES; j++) {
+    mean_period_s += periods_s_[j] / MEASURED_CYCLES;
+    mean_amplitude += input_amplitudes_[j] / MEASURED_CYCLES;
+  }
+  for (int j = 0; j < MEASURED_CYCLES; j++) {
+    if (std::abs(periods_s_[j] - mean_period_s) > MAX_SPREAD * mean_period_s ||
+        std::abs(input_amplitudes_[j] - mean_amplitude) >
+            MAX_SPREAD * mean_amplitude) {
+      Fail();
+      return;
+    }
+  }
+  // With the hysteresis as big as the oscillation, the formula falls apart.
+  float a2 = mean_amplitude * mean_amplitude -
+             config_.hysteresis * config_.hysteresis;
+  if (a2 <= 0) {
+    Fail();
+    return;
+  }
+
+  float gain = 4 * amplitude_ / (PI * std::sqrt(a2));
+  Duration period = seconds(mean_period_s);
+  if (gain < config_.min_ultimate_gain || gain > config_.max_ultimate_gain ||
+      period < config_.min_ultimate_period ||
+      period > config_.max_ultimate_period) {
+    Fail();
+    return;
+  }
+
+  ultimate_gain_ = gain;
+  ultimate_period_ = period;
+  status_ = Status::DONE;
+}
@@ -0,0 +1,158 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef RELAY_AUTOTUNER_H
+#define RELAY_AUTOTUNER_H
+
+#include "units.h"
+
+// How a RelayAutotuner drives the plant.  The units of the setpoint, limit
+// and hysteresis are those of the PID's input, and the rest those of its
+// output.
+struct RelayAutotuneConfig {
+  // The relay switches low when the input rises above setpoint + hysteresis,
+  // and high when it falls below setpoint - hysteresis.  The hysteresis keeps
+  // sensor noise from making it chatter.
+  float setpoint;
+  float hysteresis;
+
+  // The relay's output is bias + amplitude when high and bias - amplitude
+  // when low, where the bias is the output which holds the input at the
+  // setpoint.  We find the bias by ramping the output up from output_min, at
+  // a rate which would take it to output_max in ramp_time, until the input
+  // reaches the setpoint; see RelayAutotuner.
+  float amplitude;
+  float output_min;
+  float output_max;
+  Duration ramp_time;
+
+  // Give up if the input goes over this, or if we haven't finished after
+  // this long.
+  float input_limit;
+  Duration timeout;
+
+  // Fail rather than report an ultimate gain or period outside these.  A
+  // result far from what we expect of the plant means the measurement went
+  // wrong, e.g. an oscillation barely bigger than the hysteresis, which makes
+  // the gain blow up.
+  float min_ultimate_gain;
+  float max_ultimate_gain;
+  Duration min_ultimate_period;
+  Duration max_ultimate_period;
+};
+
+// Measures a plant's ultimate gain Ku and ultimate period Tu, from which we
+// can derive PID gains with e.g. the Ziegler-Nichols rules, by relay feedback
+// (Astrom and Hagglund, "Automatic tuning of simple regulators with
+// specifications on phase and amplitude margins", 1984).
+//
+// In place of the PID, a relay drives the output high when the input is below
+// the setpoint and low when it's above.  Most plants settle into a steady
+// oscillation around the setpoint, at the frequency where the plant lags the
+// output by 180 degrees, i.e. where a proportional controller would go
+// unstable.  For a relay of amplitude d whose input oscillates with amplitude
+// a, the describing function approximation gives
+//
+//   Ku = 4d / (pi * sqrt(a^2 - hysteresis^2)),   Tu = oscillation period.
+//
+// That's only exact for a sinusoidal input, but the plant filters the
+// relay's square wave, so it's close enough for tuning.
+//
+// The relay needs the right bias: too low or too high, and the input never
+// gets back across the setpoint.  The right bias varies a lot from plant to
+// plant, so we start by ramping the output up slowly until the input reaches
+// the setpoint, and take the output at that point as the bias.  The plant
+// lags the ramp, so that's a little high.
+//
+// The first SETTLE_CYCLES cycles (a cycle runs from one switch to high to the
+// next) then let the oscillation settle.  After each of them except the
+// first, which starts partway through, we move the bias to the mean output
+// over the cycle, so that the relay spends as long high as low: a lopsided
+// oscillation skews the period.  Then we measure MEASURED_CYCLES cycles with
+// the bias fixed, and fail if they don't agree, or if the Ku and Tu they
+// give are out of the configured range.
+//
+// Nothing here allocates, so Step() is safe to run from the control loop.
+class RelayAutotuner {
+public:
+  inline constexpr static int SETTLE_CYCLES = 4;
+  inline constexpr static int MEASURED_CYCLES = 4;
+  // The measured cycles' periods and amplitudes must each be within this
+  // fraction of their mean.
+  inline constexpr static float MAX_SPREAD = 0.2f;
+
+  enum class Status {
+    IDLE,
+    RUNNING,
+    DONE,
+    FAILED,
+  };
+
+  explicit RelayAutotuner(const RelayAutotuneConfig &config)
+      : config_(config) {}
+
+  // Starts (or restarts) a run.
+  void Start(Time now);
+
+  // Stops a run, failing it.  Does nothing if there's no run going.
+  void Abort();
+
+  // Performs one step of the run, returning the output to apply.  Call this
+  // periodically while GetStatus() is RUNNING; once the run has finished, it
+  // returns output_min.
+  float Step(Time now, float input);
+
+  Status GetStatus() const { return status_; }
+
+  // Results of the last run, in output units per input unit, and valid once
+  // GetStatus() is DONE.
+  float UltimateGain() const { return ultimate_gain_; }
+  Duration UltimatePeriod() const { return ultimate_period_; }
+
+private:
+  void SetBias(float bias);
+  void EndCycle(Time now);
+  void Fail();
+
+  const RelayAutotuneConfig config_;
+
+  Status status_ = Status::IDLE;
+  Time start_ = microsSinceStartup(0);
+
+  // Are we still ramping up to find the bias?
+  bool ramping_ = true;
+
+  // The relay, and when it last switched.
+  float bias_ = 0;
+  float amplitude_ = 0;
+  bool high_ = false;
+  Time last_switch_ = microsSinceStartup(0);
+  Duration high_time_ = seconds(0);
+
+  // Extremes of the input over the cycle in progress.
+  float input_min_ = 0;
+  float input_max_ = 0;
+
+  // Cycles completed so far, and the measurements of those after the
+  // settling ones.
+  int cycles_ = 0;
+  float periods_s_[MEASURED_CYCLES] = {};
+  float input_amplitudes_[MEASURED_CYCLES] = {};
+
+  float ultimate_gain_ = 0;
+  Duration ultimate_period_ = seconds(0);
+};
+
+#endif // RELAY_AUTOTUNER_H
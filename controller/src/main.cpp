@@ -45,14 +45,15 @@ limitations under the License.
 
 */
 
-#include "actuators.h"
 #include "alarm.h"
 #include "comms.h"
-#include "controller.h"
+#include "control_loop.h"
 #include "debug.h"
 #include "hal.h"
 #include "network_protocol.pb.h"
-#include "sensors.h"
+#include "scheduler.h"
+#include "scope.h"
+#include "warm_restart.h"
 
 // NO_GUI_DEV_MODE is a hacky development mode until we have the GUI working.
 //
@@ -71,8 +72,9 @@ limitations under the License.
 // these params and reflash to simulate the GUI changing its settings.
 //
 // "Sends" data to the "GUI" via a simple serial protocol.  This can be parsed
-// and graphed by e.g. the Arduino IDE (tools -> serial plotter).
-static void DEV_MODE_comms_handler(const ControllerStatus &controller_status,
+// and graphed by e.g. the Arduino IDE (tools -> serial plotter).  Scope
+// captures aren't sent, so the first one stays frozen.
+static bool DEV_MODE_comms_handler(const ControllerStatus &controller_status,
                                    GuiStatus *gui_status) {
   gui_status->desired_params.mode = VentMode_PRESSURE_CONTROL;
   gui_status->desired_params.breaths_per_min = 12;
@@ -83,7 +85,7 @@ static void DEV_MODE_comms_handler(const ControllerStatus &controller_status,
   static Time last_sent = millisSinceStartup(0);
   Time now = Hal.now();
   if (now - last_sent < seconds(0.1f)) {
-    return;
+    return false;
   }
   last_sent = now;
 
@@ -95,90 +97,185 @@ static void DEV_MODE_comms_handler(const ControllerStatus &controller_status,
   debugPrint("%.2f, ", r.flow_ml_per_min / 1000.0f);
   // debugPrint("%.2f, ", r.volume_ml / 10.f);
   debugPrint("\n");
+  return false;
 }
 #endif
 
-static Controller controller;
-static ControllerStatus controller_status;
-static Sensors sensors;
-
-// This function handles all the high priority tasks which need to be called
-// periodically.  The HAL calls this function from a timer interrupt.
-//
-// NOTE - it's important that anything being called from this function executes
-// quickly.  No busy waiting here.
+// The control loop saves its state here, so that it survives a watchdog
+// reset; see background_loop.
+NO_INIT_RAM static WarmRestartSnapshot<ControlLoopSnapshot>
+    warm_restart_snapshot;
+
+// Data shared between the control loop and the background loop.
+static ControlLoopIO control_loop_io;
+
+// Background tasks.  These run from background_loop, in between control loop
+// interrupts, in whatever time the control loop leaves over.  See the task
+// table below for their periods.
+static void comms_task();
+static void alarms_task();
+
+// Index of alarms_task in background_tasks, for Scheduler::Signal().
+static constexpr int ALARMS_TASK = 1;
+
+static constexpr SchedulerTask background_tasks[] = {
+    // Talk to the GUI.  This needs to run often enough that we don't drop
+    // bytes and notice the end of a GuiStatus promptly; see comms.cpp.
+    {.name = "comms",
+     .run = comms_task,
+     .period = milliseconds(1),
+     .deadline = milliseconds(0)},
+    // Report alarms raised by the control loop.  This is signaled by the
+    // control loop's alarms group.
+    {.name = "alarms",
+     .run = alarms_task,
+     .period = milliseconds(0),
+     .deadline = milliseconds(100)},
+};
+
+// When there's nothing to do, sleep until the next task is due or an
+// interrupt comes in.
+static void idle(Time next_release) { Hal.idle(next_release); }
+
+static Scheduler scheduler(background_tasks, idle);
+
+// Called by the control loop when it raises an alarm.
+static void signal_alarms() { scheduler.Signal(ALARMS_TASK); }
+
+// The control loop.  This depends on the loop rate, so background_loop
+// creates it once the rate is known.
+static ControlLoop *control_loop = nullptr;
+
+// The HAL calls this from the loop timer interrupt, at the loop rate, with
+// the ControlLoop as its argument.
 static void high_priority_task(void *arg) {
+  static_cast<ControlLoop *>(arg)->Tick();
+}
+
+// Converts timing statistics in cycleCount() ticks into the form we send to
+// the GUI.
+static StageTiming stage_timing(const StageTimingStats &stats) {
+  return {
+      .mean_us = stats.Mean() / CYCLES_PER_MICROSECOND,
+      .max_us = static_cast<float>(stats.Max()) / CYCLES_PER_MICROSECOND,
+  };
+}
+static StageTiming stage_timing(LoopStage stage) {
+  return stage_timing(Hal.loopStageStats(stage));
+}
+static StageTiming stage_timing(ControlGroup group) {
+  return stage_timing(control_loop->GroupStats(group));
+}
+
+// Last-received status from the GUI.
+static GuiStatus gui_status = GuiStatus_init_zero;
 
-  // Read the sensors
-  controller_status.sensor_readings = sensors.GetSensorReadings();
+// Sends scope captures to the GUI, a piece with each ControllerStatus.
+static ScopeStreamer scope_streamer(Hal.adcCapture());
 
-  // Run our PID loop
-  ActuatorsState actuators_state =
-      controller.Run(Hal.now(), controller_status.active_params,
-                     controller_status.sensor_readings);
+// Asks the control loop to autotune when the GUI requests it.
+static void check_autotune_request() {
+  static AutotuneRequests autotune_requests;
+  if (autotune_requests.OnGuiStatus(gui_status)) {
+    control_loop_io.autotune_requested = true;
+  }
+}
 
-  // TODO update pb library to replace fan_power in ControllerStatus with
-  // actuators_state, and remove fan_setpoint_cm_h2o from ControllerStatus
+static void comms_task() {
+  // Take the latest status published by the control loop.  This is a
+  // consistent snapshot of a single control loop cycle.
+  ControllerStatus local_controller_status =
+      control_loop_io.controller_status.Read();
+  local_controller_status.uptime_ms = Hal.now().millisSinceStartup();
+  local_controller_status.loop_timing = {
+      .sensors = stage_timing(LoopStage::SENSORS),
+      .controller = stage_timing(LoopStage::CONTROLLER),
+      .actuators = stage_timing(LoopStage::ACTUATORS),
+      .watchdog = stage_timing(LoopStage::WATCHDOG),
+      .fast_group = stage_timing(ControlGroup::FAST),
+      .pressure_group = stage_timing(ControlGroup::PRESSURE),
+      .alarms_group = stage_timing(ControlGroup::ALARMS),
+      .snapshot = stage_timing(LoopStage::SNAPSHOT),
+  };
+  local_controller_status.cpu_load_percent = scheduler.CpuLoadPercent();
+  local_controller_status.idle_percent = scheduler.IdlePercent();
+  scope_streamer.FillChunk(&local_controller_status.scope);
 
-  // Update the outputs from the PID
-  actuators_execute(actuators_state);
+#ifndef NO_GUI_DEV_MODE
+  bool sent = comms_handler(local_controller_status, &gui_status);
+#else
+  bool sent = DEV_MODE_comms_handler(local_controller_status, &gui_status);
+#endif
+  if (sent) {
+    scope_streamer.ChunkSent();
+  }
 
-  // Update some status info
-  controller_status.fan_power = actuators_state.fan_power;
-  controller_status.fan_setpoint_cm_h2o = actuators_state.fan_setpoint_cm_h2o;
+  // Hand the GUI's desired params to the control loop.
+  control_loop_io.active_params.Publish(gui_status.desired_params);
+  scope_streamer.OnGuiStatus(gui_status);
+  control_loop_io.scope_trigger_cm_h2o = gui_status.scope_trigger_cm_h2o;
+  check_autotune_request();
+}
 
-  // Pet the watchdog
-  Hal.watchdog_handler();
+static void alarms_task() {
+  if (control_loop_io.overrun_alarm_raised.exchange(false)) {
+    alarm_add("OVERRUN");
+  }
+  uint32_t sensor_faults = control_loop_io.sensor_faults_raised.exchange(0);
+  for (int i = 0; i < NUM_MONITORED_SENSORS; i++) {
+    for (int fault = 0; fault < NUM_SENSOR_FAULTS; fault++) {
+      if (sensor_faults & (1u << (i * NUM_SENSOR_FAULTS + fault))) {
+        alarm_add(SENSOR_FAULT_ALARMS[i][fault]);
+      }
+    }
+  }
 }
 
 // This function is the lower priority background loop which runs continuously
 // after some basic system init.  Pretty much everything not time critical
-// should go here.
-static void background_loop() {
-
-  // Calibrate the sensors.
-  // This needs to be done before the sensors are used.
-  sensors.Calibrate();
-
-  // Current controller status.  Updated when we receive data from the GUI, when
-  // sensors read data, etc.
-  controller_status = ControllerStatus_init_zero;
-
-  // Last-received status from the GUI.
-  GuiStatus gui_status = GuiStatus_init_zero;
+// should go here, as a task in background_tasks.
+//
+// This never returns, so the control loop state below lives forever.
+[[noreturn]] static void background_loop(LoopRate loop_rate) {
+  ControlLoop loop(loop_rate, &control_loop_io, &warm_restart_snapshot,
+                   signal_alarms);
+  control_loop = &loop;
+
+  // If the watchdog reset us, we're probably in the middle of a breath with
+  // a patient attached.  Pick up where the control loop left off, so that
+  // the patient sees at most a loop period or two of disruption, rather than
+  // the blower stopping while we recalibrate (with pressure in the system,
+  // which would throw the calibration off) and start a new breath with the
+  // PID from scratch.
+  ControlLoopSnapshot snapshot;
+  if (Hal.resetCause() == ResetCause::WATCHDOG &&
+      warm_restart_snapshot.Restore(&snapshot) &&
+      snapshot.warm_restarts < ControlLoop::MAX_WARM_RESTARTS) {
+    loop.Restore(snapshot);
+    // Keep using the last params we got from the GUI until it sends new
+    // ones.
+    gui_status.desired_params = snapshot.active_params;
+  } else {
+    loop.Calibrate();
+  }
 
   // After all initialization is done, ask the HAL
   // to start our high priority thread.
-  Hal.startLoopTimer(controller.GetLoopPeriod(), high_priority_task, 0);
+  loop.Start();
+  Hal.startLoopTimer(LoopPeriod(loop_rate), high_priority_task, &loop);
 
+  scheduler.Start();
   while (true) {
-    controller_status.uptime_ms = Hal.now().millisSinceStartup();
-
-    // Copy the current controller status with interrupts
-    // disabled to ensure that the data we send to the
-    // GUI is self consistent.
-    ControllerStatus local_controller_status;
-    {
-      BlockInterrupts block;
-      local_controller_status = controller_status;
-    }
-
-#ifndef NO_GUI_DEV_MODE
-    comms_handler(local_controller_status, &gui_status);
-#else
-    DEV_MODE_comms_handler(local_controller_status, &gui_status);
-#endif
-
-    // Copy the gui_status data into our controller status
-    // with interrupts disabled.  This ensures that the data
-    // is copied atomically
-    {
-      BlockInterrupts block;
-      controller_status.active_params = gui_status.desired_params;
-    }
+    scheduler.RunOnce();
   }
 }
 
+// Picks the control loop rate at boot.
+//
+// TODO: Let the operator choose this, e.g. from a setting stored in flash or
+// sent by the GUI.  For now, change DEFAULT_LOOP_RATE and reflash.
+static LoopRate boot_loop_rate() { return DEFAULT_LOOP_RATE; }
+
 int main() {
   // Initialize Hal first because it initializes the watchdog. See comment on
   // HalApi::init().
@@ -187,5 +284,5 @@ int main() {
   comms_init();
   alarm_init();
 
-  background_loop();
+  background_loop(boot_loop_rate());
 }
@@ -1,6 +1,7 @@
 #include "debug.h"
 #include "hal.h"
 #include "hal_stm32.h"
+#include "pid_benchmark.h"
 #include "uart_dma.h"
 #include <string.h>
 
@@ -43,6 +44,8 @@ int main() {
   Hal.init();
   dmaController.init();
 
+  RunPidBenchmark();
+
   debugPrint("*");
   char s[] = "ping ping ping ping ping ping ping ping ping ping ping ping\n";
   bool dmaStarted = false;
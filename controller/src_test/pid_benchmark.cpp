@@ -0,0 +1,61 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "pid_benchmark.h"
+#include "debug.h"
+#include "hal.h"
+#include "pid.h"
+
+static constexpr int STEPS = 1000;
+
+// Inputs which wander around the setpoint, so the output doesn't saturate.
+// A triangle wave, so we don't need sin().
+static float Input(int i) {
+  int phase = i % 64;
+  return 45 + static_cast<float>(phase < 32 ? phase : 64 - phase) / 3;
+}
+
+// Mean cycles per Compute() over STEPS steps, with interrupts off so that
+// nothing else is counted.  Compute() ignores the time, so we read the clock
+// once, outside the timed loop.
+template <class Pid> static uint32_t CyclesPerStep(Pid &pid) {
+  volatile float sink = 0;
+  const Time now = Hal.now();
+  BlockInterrupts block;
+  uint32_t start = Hal.cycleCount();
+  for (int i = 0; i < STEPS; i++) {
+    sink = pid.Compute(now, Input(i), 50);
+  }
+  uint32_t cycles = Hal.cycleCount() - start;
+  (void)sink;
+  return cycles / STEPS;
+}
+
+template <ProportionalTerm P, DifferentialTerm D, ControlDirection DIR>
+static void Benchmark(const char *mode) {
+  PID runtime(1.5f, 2.5f, 0.05f, P, D, DIR, 0, 255, milliseconds(10));
+  FixedModePID<P, D, DIR> fixed(1.5f, 2.5f, 0.05f, 0, 255, milliseconds(10));
+  // The counts include the loop and computing the input, the same for both.
+  debugPrint("PID %s: runtime modes %u cycles, fixed modes %u cycles\n", mode,
+             static_cast<unsigned>(CyclesPerStep(runtime)),
+             static_cast<unsigned>(CyclesPerStep(fixed)));
+}
+
+void RunPidBenchmark() {
+  Benchmark<ProportionalTerm::ON_ERROR, DifferentialTerm::ON_MEASUREMENT,
+            ControlDirection::DIRECT>("controller");
+  Benchmark<ProportionalTerm::ON_MEASUREMENT, DifferentialTerm::ON_ERROR,
+            ControlDirection::REVERSE>("reversed");
+}
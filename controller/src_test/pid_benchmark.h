@@ -0,0 +1,24 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef PID_BENCHMARK_H
+#define PID_BENCHMARK_H
+
+// Times a step of PID and of FixedModePID on the STM32, in CPU cycles, and
+// prints the results with debugPrint().  The native equivalent is the
+// PidTest.Benchmark test.
+void RunPidBenchmark();
+
+#endif // PID_BENCHMARK_H
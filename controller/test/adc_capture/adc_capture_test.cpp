@@ -0,0 +1,240 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "adc_capture.h"
+#include "hal.h"
+#include "scope.h"
+#include "gtest/gtest.h"
+#include <pb_decode.h>
+#include <pb_encode.h>
+#include <vector>
+
+static constexpr int CHANNELS = 3;
+static constexpr int SCANS = 16;
+using Capture = AdcCapture<CHANNELS, SCANS>;
+static_assert(Capture::PRE_TRIGGER_SCANS == 12);
+static_assert(Capture::POST_TRIGGER_SCANS == 3);
+
+// Feeds `capture` scans numbered first, first + 1, ...: channel c of scan n
+// reads 10 * n + c.  Two scans at a time, like the DMA interrupt.
+template <int SIZE>
+static void Feed(AdcCapture<CHANNELS, SIZE> &capture, int first, int scans) {
+  for (int n = first; n < first + scans; n += 2) {
+    volatile uint16_t half[2 * CHANNELS];
+    for (int s = 0; s < 2; s++) {
+      for (int c = 0; c < CHANNELS; c++) {
+        half[s * CHANNELS + c] = static_cast<uint16_t>(10 * (n + s) + c);
+      }
+    }
+    capture.OnReadings(half, 2);
+  }
+}
+
+// Checks that `capture` is frozen with the window around scan `trigger`.
+template <int SIZE>
+static void ExpectWindow(const AdcCapture<CHANNELS, SIZE> &capture,
+                         int trigger) {
+  ASSERT_TRUE(capture.Frozen());
+  int first = trigger - capture.TriggerScan();
+  for (int s = 0; s < SIZE; s++) {
+    for (int c = 0; c < CHANNELS; c++) {
+      ASSERT_EQ(capture.Reading(s, c), 10 * (first + s) + c)
+          << "scan " << s << " channel " << c;
+    }
+  }
+}
+
+TEST(AdcCapture, FreezesAWindowAroundTheTrigger) {
+  Capture capture;
+  Feed(capture, 0, 40);
+  EXPECT_FALSE(capture.Frozen());
+
+  // The trigger applies to the next scan, 40, and we keep recording until
+  // the post-trigger scans are in.
+  capture.Trigger(CaptureCause::REQUEST);
+  Feed(capture, 40, 2);
+  EXPECT_FALSE(capture.Frozen());
+  Feed(capture, 42, 2);
+  EXPECT_EQ(capture.Cause(), CaptureCause::REQUEST);
+  ExpectWindow(capture, 40);
+
+  // Frozen: new readings don't disturb it, nor do more triggers.
+  capture.Trigger(CaptureCause::ALARM);
+  Feed(capture, 44, 20);
+  EXPECT_EQ(capture.Cause(), CaptureCause::REQUEST);
+  ExpectWindow(capture, 40);
+}
+
+TEST(AdcCapture, WaitsForPreTriggerHistory) {
+  Capture capture;
+  capture.Trigger(CaptureCause::ALARM);
+  Feed(capture, 0, 12);
+  EXPECT_FALSE(capture.Frozen());
+  // Scan 12 is the first with a full pre-trigger history behind it.
+  Feed(capture, 12, 4);
+  EXPECT_EQ(capture.Cause(), CaptureCause::ALARM);
+  ExpectWindow(capture, 12);
+}
+
+TEST(AdcCapture, FirstTriggerWins) {
+  Capture capture;
+  Feed(capture, 0, 20);
+  capture.Trigger(CaptureCause::ALARM);
+  capture.Trigger(CaptureCause::REQUEST);
+  Feed(capture, 20, 4);
+  EXPECT_EQ(capture.Cause(), CaptureCause::ALARM);
+  ExpectWindow(capture, 20);
+}
+
+TEST(AdcCapture, ReleaseRearms) {
+  Capture capture;
+  Feed(capture, 0, 20);
+  capture.Trigger(CaptureCause::REQUEST);
+  Feed(capture, 20, 4);
+  ASSERT_TRUE(capture.Frozen());
+
+  capture.Release();
+  EXPECT_FALSE(capture.Frozen());
+  // Readings from before the release don't count towards the pre-trigger
+  // history, since there's a gap after them.
+  capture.Trigger(CaptureCause::ALARM);
+  Feed(capture, 100, 12);
+  EXPECT_FALSE(capture.Frozen());
+  Feed(capture, 112, 4);
+  EXPECT_EQ(capture.Cause(), CaptureCause::ALARM);
+  ExpectWindow(capture, 112);
+}
+
+TEST(AdcCapture, TriggersOnRisingThreshold) {
+  Capture capture;
+  // Channel 1 reads 10n + 1, so it reaches 301 at scan 30.
+  capture.SetThreshold(1, 301);
+  Feed(capture, 0, 28);
+  EXPECT_FALSE(capture.Frozen());
+  Feed(capture, 28, 4);
+  EXPECT_FALSE(capture.Frozen());
+  Feed(capture, 32, 2);
+  EXPECT_EQ(capture.Cause(), CaptureCause::THRESHOLD);
+  ExpectWindow(capture, 30);
+}
+
+TEST(AdcCapture, ThresholdIgnoresFallingAndCleared) {
+  Capture capture;
+  capture.SetThreshold(0, 100);
+  // Readings start above the threshold and fall through it: no trigger.
+  for (int n = 0; n < 25; n++) {
+    volatile uint16_t scan[CHANNELS] = {static_cast<uint16_t>(500 - 20 * n),
+                                        0, 0};
+    capture.OnReadings(scan, 1);
+  }
+  EXPECT_FALSE(capture.Frozen());
+
+  capture.ClearThreshold();
+  for (int n = 0; n < 40; n++) {
+    volatile uint16_t scan[CHANNELS] = {static_cast<uint16_t>(10 * n), 0, 0};
+    capture.OnReadings(scan, 1);
+  }
+  EXPECT_FALSE(capture.Frozen());
+}
+
+// The capture HalApi provides, with the scope streamer: captures end up in a
+// series of ControllerStatus protos which the GUI can put back together.
+TEST(ScopeStreamer, StreamsTheWholeCapture) {
+  AdcCaptureBuffer &capture = Hal.adcCapture();
+  ScopeStreamer streamer(capture);
+
+  // Nothing to send yet.
+  ScopeChunk chunk;
+  streamer.FillChunk(&chunk);
+  EXPECT_EQ(chunk.capture_id, 0u);
+  EXPECT_EQ(chunk.data.size, 0);
+
+  // The GUI asks for a capture by changing its request id.
+  GuiStatus gui_status = GuiStatus_init_zero;
+  gui_status.scope_request_id = 7;
+  streamer.OnGuiStatus(gui_status);
+  Feed(capture, 0, ADC_CAPTURE_SCANS);
+  ASSERT_TRUE(capture.Frozen());
+
+  std::vector<uint16_t> received;
+  uint32_t trigger_scan = 0;
+  while (true) {
+    ControllerStatus status = ControllerStatus_init_zero;
+    streamer.FillChunk(&status.scope);
+    if (status.scope.capture_id == 0) {
+      break;
+    }
+    // Round trip through the wire format.
+    uint8_t buf[ControllerStatus_size];
+    pb_ostream_t out = pb_ostream_from_buffer(buf, sizeof(buf));
+    ASSERT_TRUE(pb_encode(&out, ControllerStatus_fields, &status));
+    ControllerStatus sent = ControllerStatus_init_zero;
+    pb_istream_t in = pb_istream_from_buffer(buf, out.bytes_written);
+    ASSERT_TRUE(pb_decode(&in, ControllerStatus_fields, &sent));
+
+    const ScopeChunk &c = sent.scope;
+    EXPECT_EQ(c.capture_id, 1u);
+    EXPECT_EQ(c.trigger, ScopeTrigger_SCOPE_REQUEST);
+    EXPECT_EQ(c.total_scans, static_cast<uint32_t>(ADC_CAPTURE_SCANS));
+    EXPECT_FLOAT_EQ(c.scan_period_us, 63);
+    EXPECT_FLOAT_EQ(c.volts_per_count, 3.3f / 65536);
+    ASSERT_EQ(c.first_scan * CHANNELS, received.size());
+    trigger_scan = c.trigger_scan;
+    for (pb_size_t b = 0; b < c.data.size; b += 2) {
+      received.push_back(
+          static_cast<uint16_t>(c.data.bytes[b] | c.data.bytes[b + 1] << 8));
+    }
+
+    // Until comms actually sends the chunk, we keep offering the same one.
+    ScopeChunk again;
+    streamer.FillChunk(&again);
+    EXPECT_EQ(again.first_scan, c.first_scan);
+    streamer.ChunkSent();
+  }
+
+  // We got the whole window, and the capture is armed again.
+  ASSERT_EQ(received.size(),
+            static_cast<size_t>(ADC_CAPTURE_SCANS * CHANNELS));
+  EXPECT_EQ(trigger_scan,
+            static_cast<uint32_t>(AdcCaptureBuffer::TriggerScan()));
+  int first = ADC_CAPTURE_SCANS - 1 - AdcCaptureBuffer::POST_TRIGGER_SCANS -
+              AdcCaptureBuffer::TriggerScan();
+  for (int s = 0; s < ADC_CAPTURE_SCANS; s++) {
+    for (int c = 0; c < CHANNELS; c++) {
+      ASSERT_EQ(received[s * CHANNELS + c],
+                static_cast<uint16_t>(10 * (first + s) + c));
+    }
+  }
+  EXPECT_FALSE(capture.Frozen());
+
+  // The same request id doesn't trigger again; a new one does, and gets a new
+  // capture id.
+  streamer.OnGuiStatus(gui_status);
+  Feed(capture, 0, ADC_CAPTURE_SCANS);
+  EXPECT_FALSE(capture.Frozen());
+  gui_status.scope_request_id = 8;
+  streamer.OnGuiStatus(gui_status);
+  Feed(capture, 0, ADC_CAPTURE_SCANS);
+  ASSERT_TRUE(capture.Frozen());
+  streamer.FillChunk(&chunk);
+  EXPECT_EQ(chunk.capture_id, 2u);
+}
+
+TEST(ScopeStreamer, Counts) {
+  EXPECT_EQ(ScopeStreamer::Counts(volts(0)), 0);
+  EXPECT_EQ(ScopeStreamer::Counts(volts(1.65f)), 32768);
+  EXPECT_EQ(ScopeStreamer::Counts(volts(3.3f)), 65535);
+  EXPECT_EQ(ScopeStreamer::Counts(volts(-1)), 0);
+}
@@ -0,0 +1,359 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "adc_running_sum.h"
+#include "benchmark.h"
+#include "gtest/gtest.h"
+#include <iterator>
+#include <random>
+#include <vector>
+
+static constexpr int CHANNELS = 3;
+static constexpr int SCANS_PER_HALF = 2;
+
+// Model of the A/D and DMA as set up in InitADC(): the A/D converts the
+// channels in turn, the DMA writes each reading to the next slot of a
+// circular buffer, and the DMA controller "interrupts" when it fills either
+// half of the buffer.
+template <class Sums> class DmaModel {
+public:
+  explicit DmaModel(Sums *sums) : sums_(sums) {}
+
+  void Convert(uint16_t reading) {
+    buffer_[pos_++] = reading;
+    if (pos_ == Sums::HALF_SIZE) {
+      // Half transfer interrupt.
+      sums_->OnHalfComplete(&buffer_[0]);
+    } else if (pos_ == Sums::BUFFER_SIZE) {
+      // Transfer complete interrupt; in circular mode the DMA starts over.
+      pos_ = 0;
+      sums_->OnHalfComplete(&buffer_[Sums::HALF_SIZE]);
+    }
+  }
+
+  // Has the DMA just finished a half of the buffer?
+  bool AtInterrupt() const { return pos_ % Sums::HALF_SIZE == 0; }
+
+  // What analogRead() used to compute: the sum of all the readings of
+  // `channel` in the buffer.
+  uint32_t BufferSum(int channel) const {
+    uint32_t sum = 0;
+    for (int i = channel; i < Sums::BUFFER_SIZE; i += CHANNELS) {
+      sum += buffer_[i];
+    }
+    return sum;
+  }
+
+private:
+  Sums *sums_;
+  volatile uint16_t buffer_[Sums::BUFFER_SIZE] = {};
+  int pos_ = 0;
+};
+
+// Random readings which span the whole 16-bit range of the oversampled A/D.
+class Readings {
+public:
+  uint16_t Next() { return static_cast<uint16_t>(dist_(rng_)); }
+
+private:
+  std::mt19937 rng_{42};
+  std::uniform_int_distribution<int> dist_{0, 0xFFFF};
+};
+
+// With a window of two halves, the running sums cover exactly what's in the
+// DMA buffer after each interrupt, so they must match summing up the buffer
+// the way analogRead() used to.
+TEST(AdcRunningSum, MatchesSummingTheBuffer) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 2>;
+  Sums sums;
+  sums.Reset(2);
+  DmaModel<Sums> dma(&sums);
+  Readings readings;
+
+  int checked = 0;
+  for (int i = 0; i < 1000 * CHANNELS; i++) {
+    dma.Convert(readings.Next());
+    if (dma.AtInterrupt() && i >= Sums::BUFFER_SIZE) {
+      for (int c = 0; c < CHANNELS; c++) {
+        EXPECT_EQ(sums.Sum(c), dma.BufferSum(c)) << "reading " << i;
+      }
+      checked++;
+    }
+  }
+  EXPECT_GT(checked, 400);
+}
+
+// Windows much longer than the DMA buffer sum up the last
+// WindowReadings() readings of each channel.
+TEST(AdcRunningSum, LongWindowMatchesHistory) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 64>;
+  Sums sums;
+  sums.Reset(50);
+  ASSERT_EQ(sums.WindowReadings(), 100);
+  DmaModel<Sums> dma(&sums);
+  Readings readings;
+
+  std::vector<uint16_t> history[CHANNELS];
+  for (int i = 0; i < 1000 * CHANNELS; i++) {
+    uint16_t r = readings.Next();
+    history[i % CHANNELS].push_back(r);
+    dma.Convert(r);
+    if (!dma.AtInterrupt()) {
+      continue;
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+      // Until the window fills up, the missing readings count as zero.
+      uint32_t expected = 0;
+      int n = static_cast<int>(history[c].size());
+      for (int j = std::max(0, n - sums.WindowReadings()); j < n; j++) {
+        expected += history[c][j];
+      }
+      EXPECT_EQ(sums.Sum(c), expected) << "reading " << i;
+    }
+  }
+}
+
+// Readings in the half the DMA is still writing aren't counted until it's
+// done with it.
+TEST(AdcRunningSum, WaitsForHalfToComplete) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 4>;
+  Sums sums;
+  sums.Reset(4);
+  DmaModel<Sums> dma(&sums);
+
+  for (int i = 0; i < Sums::HALF_SIZE - 1; i++) {
+    dma.Convert(100);
+    for (int c = 0; c < CHANNELS; c++) {
+      EXPECT_EQ(sums.Sum(c), 0u);
+    }
+  }
+  dma.Convert(100);
+  for (int c = 0; c < CHANNELS; c++) {
+    EXPECT_EQ(sums.Sum(c), 100u * SCANS_PER_HALF);
+  }
+}
+
+TEST(AdcRunningSum, ResetClampsWindowAndClearsHistory) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 8>;
+  Sums sums;
+  EXPECT_EQ(sums.WindowReadings(), 8 * SCANS_PER_HALF);
+
+  DmaModel<Sums> dma(&sums);
+  for (int i = 0; i < Sums::BUFFER_SIZE; i++) {
+    dma.Convert(1000);
+  }
+  EXPECT_GT(sums.Sum(0), 0u);
+
+  sums.Reset(0);
+  EXPECT_EQ(sums.WindowReadings(), SCANS_PER_HALF);
+  for (int c = 0; c < CHANNELS; c++) {
+    EXPECT_EQ(sums.Sum(c), 0u);
+  }
+
+  sums.Reset(1000);
+  EXPECT_EQ(sums.WindowReadings(), 8 * SCANS_PER_HALF);
+}
+
+// Integer sums don't lose precision or overflow even with the longest
+// window the template allows.
+TEST(AdcRunningSum, FullScaleLongestWindow) {
+  constexpr int MAX_HALVES = 0x10000 / SCANS_PER_HALF;
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, MAX_HALVES>;
+  static Sums sums;
+  sums.Reset(MAX_HALVES);
+  DmaModel<Sums> dma(&sums);
+
+  for (int i = 0; i < 2 * MAX_HALVES * Sums::HALF_SIZE; i++) {
+    dma.Convert(0xFFFF);
+  }
+  for (int c = 0; c < CHANNELS; c++) {
+    EXPECT_EQ(sums.Sum(c), 0xFFFFu * static_cast<uint32_t>(
+                                         sums.WindowReadings()));
+  }
+}
+
+// How OnHalfComplete() used to sum up a half of the buffer: one strided pass
+// per channel.
+template <int SCANS>
+static void SumStrided(const volatile uint16_t *half, uint32_t *sums) {
+  for (int c = 0; c < CHANNELS; c++) {
+    uint32_t sum = 0;
+    for (int s = 0; s < SCANS; s++) {
+      sum += half[s * CHANNELS + c];
+    }
+    sums[c] += sum;
+  }
+}
+
+// Compares summing a half of the DMA buffer with a single pass over the
+// interleaved readings against a strided pass per channel.  The buffer is
+// larger than the one we use on the STM32, so that the difference isn't
+// lost in the overhead of the call.
+TEST(AdcRunningSum, SinglePassBenchmark) {
+  constexpr int SCANS = 64;
+  using Sums = AdcRunningSum<CHANNELS, SCANS, 4>;
+  Sums sums;
+  volatile uint16_t half[Sums::HALF_SIZE];
+  Readings readings;
+  for (auto &r : half) {
+    r = readings.Next();
+  }
+
+  uint32_t strided[CHANNELS] = {};
+  double strided_ns = RunBenchmark("ADC half, strided per channel", 100000,
+                                   [&] { SumStrided<SCANS>(half, strided); });
+  double single_ns = RunBenchmark("ADC half, single pass", 100000,
+                                  [&] { sums.OnHalfComplete(half); });
+  DoNotOptimize(strided);
+  DoNotOptimize(sums.Sum(0));
+
+  // Both ways of summing agree.
+  uint32_t expected[CHANNELS] = {};
+  SumStrided<SCANS>(half, expected);
+  sums.Reset(1);
+  sums.OnHalfComplete(half);
+  for (int c = 0; c < CHANNELS; c++) {
+    EXPECT_EQ(sums.Sum(c), expected[c]);
+  }
+
+  // The sanitizers check every array access, which keeps the compiler from
+  // unrolling the single pass and swamps the difference, so we only compare
+  // timings in the native-bench env.
+  if (!SANITIZED) {
+    EXPECT_LT(single_ns, strided_ns);
+  }
+}
+
+// Each channel sums up the last WindowReadings(c) readings of its own, from
+// the same stream of halves.
+TEST(AdcRunningSum, PerChannelWindowsMatchHistory) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 40>;
+  Sums sums;
+  // Including the longest window, whose oldest half is the one that's about
+  // to be overwritten.
+  sums.Reset({3, 40, 17});
+  ASSERT_EQ(sums.WindowReadings(0), 3 * SCANS_PER_HALF);
+  ASSERT_EQ(sums.WindowReadings(1), 40 * SCANS_PER_HALF);
+  ASSERT_EQ(sums.WindowReadings(2), 17 * SCANS_PER_HALF);
+  ASSERT_EQ(sums.WindowReadings(), 40 * SCANS_PER_HALF);
+  DmaModel<Sums> dma(&sums);
+  Readings readings;
+
+  std::vector<uint16_t> history[CHANNELS];
+  for (int i = 0; i < 1000 * CHANNELS; i++) {
+    uint16_t r = readings.Next();
+    history[i % CHANNELS].push_back(r);
+    dma.Convert(r);
+    if (!dma.AtInterrupt()) {
+      continue;
+    }
+    for (int c = 0; c < CHANNELS; c++) {
+      uint32_t expected = 0;
+      int n = static_cast<int>(history[c].size());
+      for (int j = std::max(0, n - sums.WindowReadings(c)); j < n; j++) {
+        expected += history[c][j];
+      }
+      EXPECT_EQ(sums.Sum(c), expected) << "reading " << i << " channel " << c;
+    }
+  }
+}
+
+// Averaging windows to compare in the benchmark below, in halves of the DMA
+// buffer at the STM32's settings.  A half takes 126us to convert, so at the
+// default 100Hz loop these are about a tenth of the loop period for every
+// channel, four tenths for every channel, and what adc.cpp does by default:
+// a tenth for the patient pressure and four for the venturis.
+struct WindowConfig {
+  const char *name;
+  int halves[CHANNELS];
+};
+static constexpr WindowConfig WINDOW_CONFIGS[] = {
+    {"all short", {8, 8, 8}},
+    {"all long", {32, 32, 32}},
+    {"per channel", {8, 32, 32}},
+};
+static constexpr double HALF_PERIOD_US = 2 * CHANNELS * 16 * 105 / 80.0;
+
+// How long after a step in its input channel `c` takes to get halfway there,
+// in halves: the delay the averaging adds to that channel.
+template <class Sums> static int StepDelayHalves(Sums &sums, int c) {
+  DmaModel<Sums> dma(&sums);
+  // Settle at 0, then step to 1000.
+  for (int i = 0; i < 2 * 40 * Sums::HALF_SIZE; i++) {
+    dma.Convert(0);
+  }
+  for (int halves = 1;; halves++) {
+    for (int i = 0; i < Sums::HALF_SIZE; i++) {
+      dma.Convert(1000);
+    }
+    if (sums.Sum(c) * 2 >= 1000u * sums.WindowReadings(c)) {
+      return halves;
+    }
+  }
+}
+
+// Per-channel windows cost what a single window does, to update (in the DMA
+// interrupt) and to read; only the latency differs, channel by channel.
+//
+// The update is timed on a larger half than the STM32's, as in
+// SinglePassBenchmark: at 2 scans per half it takes a few ns, and which
+// configuration comes out ahead is down to noise.
+TEST(AdcRunningSum, PerChannelWindowBenchmark) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, 40>;
+  using LargeSums = AdcRunningSum<CHANNELS, 64, 40>;
+  volatile uint16_t half[LargeSums::HALF_SIZE];
+  Readings readings;
+  for (auto &r : half) {
+    r = readings.Next();
+  }
+
+  double update_ns[std::size(WINDOW_CONFIGS)];
+  for (size_t i = 0; i < std::size(WINDOW_CONFIGS); i++) {
+    const WindowConfig &config = WINDOW_CONFIGS[i];
+    char name[64];
+    {
+      LargeSums sums;
+      sums.Reset(config.halves);
+      snprintf(name, sizeof(name), "ADC 64-scan half, %s", config.name);
+      update_ns[i] =
+          RunBenchmark(name, 100000, [&] { sums.OnHalfComplete(half); });
+    }
+
+    Sums sums;
+    sums.Reset(config.halves);
+    snprintf(name, sizeof(name), "ADC read all, %s", config.name);
+    RunBenchmark(name, 100000, [&] {
+      for (int c = 0; c < CHANNELS; c++) {
+        DoNotOptimize(sums.Sum(c));
+      }
+    });
+
+    for (int c = 0; c < CHANNELS; c++) {
+      sums.Reset(config.halves);
+      int delay = StepDelayHalves(sums, c);
+      // A window of N halves gets halfway through a step after N / 2 of
+      // them, rounded up.
+      EXPECT_EQ(delay, (config.halves[c] + 1) / 2) << config.name << " " << c;
+      printf("[ LATENCY  ] %-27s channel %d %10.0f us to 50%%\n", config.name,
+             c, delay * HALF_PERIOD_US);
+    }
+  }
+
+  // The per-channel update isn't much more work than either single window.
+  // As above, this is only checked in the native-bench env.
+  if (!SANITIZED) {
+    EXPECT_LT(update_ns[2], 2 * std::max(update_ns[0], update_ns[1]));
+  }
+}
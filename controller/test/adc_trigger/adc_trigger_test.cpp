@@ -0,0 +1,150 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "adc_trigger.h"
+#include "adc_running_sum.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <random>
+
+// The STM32's settings, see adc.cpp and hal_stm32.cpp.
+static constexpr uint32_t CPU_FREQ = 80'000'000;
+static constexpr int CHANNELS = 3;
+static constexpr int SCANS_PER_HALF = 2;
+static constexpr uint32_t CYCLES_PER_HALF =
+    SCANS_PER_HALF * CHANNELS * 16 * 105;
+static constexpr int MAX_HALVES = 8;
+static constexpr uint32_t MARGIN_CYCLES = 10 * 80;
+
+// The loop timer's settings for a period, as startLoopTimer() picks them.
+struct LoopTimer {
+  uint32_t ticks;
+  uint32_t prescale;
+};
+static LoopTimer LoopTimerFor(Duration period) {
+  int32_t reload = static_cast<int32_t>(CPU_FREQ * period.seconds());
+  int prescale = 1;
+  if (reload > 65536) {
+    prescale = static_cast<int>(reload / 65536.0) + 1;
+    reload /= prescale;
+  }
+  return {static_cast<uint32_t>(reload), static_cast<uint32_t>(prescale)};
+}
+
+TEST(AdcTrigger, EndsJustBeforeTheLoopAtEveryRate) {
+  for (LoopRate rate : {LoopRate::HZ_100, LoopRate::HZ_250, LoopRate::HZ_500,
+                        LoopRate::HZ_1000}) {
+    LoopTimer timer = LoopTimerFor(LoopPeriod(rate));
+    // A window of a tenth of the loop period, as in adc.cpp.
+    int desired = static_cast<int>(
+        CPU_FREQ * LoopPeriod(rate).seconds() / 10 / CYCLES_PER_HALF + 0.5f);
+    desired = std::max(desired, 1);
+    AdcTriggerTiming t = AlignAdcWindow(timer.ticks, timer.prescale,
+                                        CYCLES_PER_HALF, desired, MAX_HALVES,
+                                        MARGIN_CYCLES);
+    SCOPED_TRACE(LoopPeriod(rate).microseconds());
+
+    EXPECT_EQ(t.halves, desired);
+    EXPECT_LT(t.compare, timer.ticks);
+    uint32_t start = t.compare * timer.prescale;
+    uint32_t end = start + t.halves * CYCLES_PER_HALF;
+    // The burst ends at least the margin before the loop runs, and less than
+    // a timer tick later than that.
+    EXPECT_EQ(end + t.slack_cycles, timer.ticks * timer.prescale);
+    EXPECT_GE(t.slack_cycles, MARGIN_CYCLES);
+    EXPECT_LT(t.slack_cycles, MARGIN_CYCLES + timer.prescale);
+  }
+}
+
+TEST(AdcTrigger, ClampsHalves) {
+  LoopTimer timer = LoopTimerFor(milliseconds(10));
+  EXPECT_EQ(AlignAdcWindow(timer.ticks, timer.prescale, CYCLES_PER_HALF, 0,
+                           MAX_HALVES, MARGIN_CYCLES)
+                .halves,
+            1);
+  EXPECT_EQ(AlignAdcWindow(timer.ticks, timer.prescale, CYCLES_PER_HALF, 100,
+                           MAX_HALVES, MARGIN_CYCLES)
+                .halves,
+            MAX_HALVES);
+}
+
+TEST(AdcTrigger, ShortensBurstsThatDontFit) {
+  // A 500us period has room for 3 halves and the margin, not 8.
+  LoopTimer timer = LoopTimerFor(microseconds(500));
+  AdcTriggerTiming t = AlignAdcWindow(timer.ticks, timer.prescale,
+                                      CYCLES_PER_HALF, 8, MAX_HALVES,
+                                      MARGIN_CYCLES);
+  EXPECT_EQ(t.halves, 3);
+  EXPECT_GE(t.slack_cycles, MARGIN_CYCLES);
+
+  // A 100us period doesn't even have room for one half; we still take one,
+  // starting as soon as the loop timer wraps, and the margin suffers.
+  timer = LoopTimerFor(microseconds(100));
+  t = AlignAdcWindow(timer.ticks, timer.prescale, CYCLES_PER_HALF, 8,
+                     MAX_HALVES, MARGIN_CYCLES);
+  EXPECT_EQ(t.halves, 1);
+  EXPECT_EQ(t.compare, 0u);
+  EXPECT_LT(t.slack_cycles, MARGIN_CYCLES);
+}
+
+TEST(AdcTrigger, IsConstexpr) {
+  constexpr AdcTriggerTiming t =
+      AlignAdcWindow(80000, 1, CYCLES_PER_HALF, 2, MAX_HALVES, MARGIN_CYCLES);
+  static_assert(t.halves == 2);
+  static_assert(t.compare == 80000 - MARGIN_CYCLES - 2 * CYCLES_PER_HALF);
+  static_assert(t.slack_cycles == MARGIN_CYCLES);
+}
+
+// Model of the A/D and DMA in LOOP_TRIGGERED mode, as adc.cpp sets them up:
+// each loop period, a burst of conversions fills `halves` halves of the DMA
+// buffer, starting from the beginning of the buffer, and then the A/D stops.
+// What the control loop reads at the end of the period must be exactly the
+// burst's readings, with nothing left over from earlier periods.
+TEST(AdcTrigger, LoopReadsOnlyTheLatestBurst) {
+  using Sums = AdcRunningSum<CHANNELS, SCANS_PER_HALF, MAX_HALVES>;
+  LoopTimer timer = LoopTimerFor(milliseconds(4));
+  AdcTriggerTiming t = AlignAdcWindow(timer.ticks, timer.prescale,
+                                      CYCLES_PER_HALF, 3, MAX_HALVES,
+                                      MARGIN_CYCLES);
+  ASSERT_EQ(t.halves, 3);
+
+  Sums sums;
+  sums.Reset(t.halves);
+  volatile uint16_t buffer[Sums::BUFFER_SIZE] = {};
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> dist(0, 0xFFFF);
+
+  for (int period = 0; period < 100; period++) {
+    uint32_t burst_sums[CHANNELS] = {};
+    int pos = 0;
+    for (int i = 0; i < t.halves * Sums::HALF_SIZE; i++) {
+      uint16_t reading = static_cast<uint16_t>(dist(rng));
+      burst_sums[i % CHANNELS] += reading;
+      buffer[pos++] = reading;
+      if (pos == Sums::HALF_SIZE) {
+        sums.OnHalfComplete(&buffer[0]);
+      } else if (pos == Sums::BUFFER_SIZE) {
+        pos = 0;
+        sums.OnHalfComplete(&buffer[Sums::HALF_SIZE]);
+      }
+    }
+    // The loop timer fires: everything in the window is from this burst.
+    ASSERT_EQ(sums.WindowReadings(), t.halves * SCANS_PER_HALF);
+    for (int c = 0; c < CHANNELS; c++) {
+      EXPECT_EQ(sums.Sum(c), burst_sums[c]) << "period " << period;
+    }
+  }
+}
@@ -28,6 +28,7 @@ TEST(BlowerFsmTest, InitiallyOff) {
   BlowerSystemState s = fsm.DesiredState(Hal.now(), p);
   EXPECT_FLOAT_EQ(s.setpoint_pressure.cmH2O(), 0);
   EXPECT_EQ(s.expire_valve_state, ValveState::OPEN);
+  EXPECT_EQ(s.phase, BreathPhase::OFF);
 }
 
 TEST(BlowerFsmTest, StaysOff) {
@@ -59,6 +60,11 @@ void testSequence(
     EXPECT_EQ(s.blower_enabled, blower_enabled);
     EXPECT_EQ(s.setpoint_pressure.cmH2O(), expected_pressure.cmH2O());
     EXPECT_EQ(s.expire_valve_state, expected_valve_state);
+    // In pressure control, the valve tells us the phase.
+    EXPECT_EQ(s.phase, !blower_enabled ? BreathPhase::OFF
+                       : expected_valve_state == ValveState::CLOSED
+                           ? BreathPhase::INSPIRATION
+                           : BreathPhase::EXPIRATION);
   }
 }
 
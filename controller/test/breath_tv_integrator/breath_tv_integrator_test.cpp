@@ -0,0 +1,348 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "breath_tv_integrator.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "sample_data.h"
+#include "tv_integrator.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static constexpr Duration SAMPLE_PERIOD = milliseconds(10);
+
+// A synthetic breath: a half-sine of inspiratory flow, followed by a longer
+// half-sine of expiratory flow with the same volume.
+static constexpr float INSPIRATION_SEC = 1;
+static constexpr float EXPIRATION_SEC = 2;
+static constexpr float TIDAL_VOLUME_ML = 500;
+
+static VolumetricFlow BreathFlow(float t_sec) {
+  auto half_sine = [](float t, float period, float volume_ml) {
+    // Integral of sin(pi t / period) over one period is 2 * period / pi.
+    float peak_ml_per_sec =
+        volume_ml * static_cast<float>(M_PI) / (2 * period);
+    return peak_ml_per_sec *
+           std::sin(static_cast<float>(M_PI) * t / period) * 60;
+  };
+  float t = std::fmod(t_sec, INSPIRATION_SEC + EXPIRATION_SEC);
+  if (t < INSPIRATION_SEC) {
+    return ml_per_min(half_sine(t, INSPIRATION_SEC, TIDAL_VOLUME_ML));
+  }
+  return ml_per_min(
+      -half_sine(t - INSPIRATION_SEC, EXPIRATION_SEC, TIDAL_VOLUME_ML));
+}
+
+TEST(BreathTVIntegrator, CorrectsOffsetAndRezeroesEachBreath) {
+  constexpr int BREATHS = 40;
+  VolumetricFlow offset = ml_per_min(1000);
+
+  BreathTVIntegrator breath_tv;
+  TVIntegrator plain_tv;
+  Time start = Hal.now();
+  int samples =
+      static_cast<int>(BREATHS * (INSPIRATION_SEC + EXPIRATION_SEC) /
+                       SAMPLE_PERIOD.seconds());
+  float last_peak_ml = 0;
+  float peak_ml = 0;
+  uint32_t breaths = 0;
+  for (int i = 1; i <= samples; i++) {
+    Time now = start + i * SAMPLE_PERIOD;
+    VolumetricFlow flow =
+        BreathFlow(static_cast<float>(i) * SAMPLE_PERIOD.seconds()) + offset;
+    breath_tv.AddFlow(now, flow);
+    plain_tv.AddFlow(now, flow);
+    if (breath_tv.GetBreathCount() != breaths) {
+      breaths = breath_tv.GetBreathCount();
+      last_peak_ml = peak_ml;
+      peak_ml = 0;
+    }
+    peak_ml = std::max(peak_ml, breath_tv.GetTV().ml());
+  }
+
+  EXPECT_EQ(breath_tv.GetBreathCount(), static_cast<uint32_t>(BREATHS));
+  EXPECT_NEAR(breath_tv.GetFlowOffset().ml_per_min(), offset.ml_per_min(),
+              10);
+  EXPECT_NEAR(breath_tv.GetLastResidual().ml(), 0, 2);
+  // The flow detector notices a breath a little after the flow crosses zero,
+  // but the volume it breathed in meanwhile is counted in the breath.
+  EXPECT_NEAR(last_peak_ml, TIDAL_VOLUME_ML, 0.002f * TIDAL_VOLUME_ML);
+
+  // Without correction, the offset integrates to 1l/min * 2min = 2l.
+  EXPECT_GT(plain_tv.GetTV().ml(), 1900);
+}
+
+// Breaths of different sizes and speeds, as a patient breathing on their own
+// takes.  We notice a fast breath sooner after it starts than a slow one, so
+// if the volume breathed in before we notice went into the last breath's
+// residual, it wouldn't cancel out from one breath to the next, and would
+// bias the offset.
+static VolumetricFlow IrregularBreathFlow(float t_sec) {
+  auto half_sine = [](float t, float period, float volume_ml) {
+    float peak_ml_per_sec =
+        volume_ml * static_cast<float>(M_PI) / (2 * period);
+    return peak_ml_per_sec *
+           std::sin(static_cast<float>(M_PI) * t / period) * 60;
+  };
+  // 500ml in over 1s and out over 2s, then 250ml in over 0.4s and out over
+  // 1.6s, then a 1.5s pause.
+  float t = std::fmod(t_sec, 6.5f);
+  if (t < 1) {
+    return ml_per_min(half_sine(t, 1, 500));
+  }
+  if (t < 3) {
+    return ml_per_min(-half_sine(t - 1, 2, 500));
+  }
+  if (t < 3.4f) {
+    return ml_per_min(half_sine(t - 3, 0.4f, 250));
+  }
+  if (t < 5) {
+    return ml_per_min(-half_sine(t - 3.4f, 1.6f, 250));
+  }
+  return ml_per_min(0);
+}
+
+TEST(BreathTVIntegrator, ConvergesToInjectedOffsetOnIrregularBreaths) {
+  for (float offset_ml_per_min : {-2000.f, 0.f, 1500.f}) {
+    BreathTVIntegrator breath_tv;
+    Time start = Hal.now();
+    float peak_ml = 0;
+    float peaks_ml[2] = {};
+    uint32_t breaths = 0;
+    for (int i = 1; i <= 20000; i++) {
+      float t = static_cast<float>(i) * SAMPLE_PERIOD.seconds();
+      // A little noise, as the sensors have.
+      float noise_ml_per_min = 200 * std::sin(static_cast<float>(i) * 2.4f);
+      breath_tv.AddFlow(start + i * SAMPLE_PERIOD,
+                        IrregularBreathFlow(t) +
+                            ml_per_min(offset_ml_per_min + noise_ml_per_min));
+      if (breath_tv.GetBreathCount() != breaths) {
+        peaks_ml[breaths % 2] = peak_ml;
+        breaths = breath_tv.GetBreathCount();
+        peak_ml = 0;
+      }
+      peak_ml = std::max(peak_ml, breath_tv.GetTV().ml());
+    }
+    EXPECT_NEAR(breath_tv.GetFlowOffset().ml_per_min(), offset_ml_per_min,
+                2.5f);
+    // The breaths alternate, and the first was the big one.
+    EXPECT_NEAR(peaks_ml[1], 500, 1);
+    EXPECT_NEAR(peaks_ml[0], 250, 1);
+  }
+}
+
+// With no breathing at all, we still re-zero every MAX_BREATH_DURATION and
+// learn the offset.
+TEST(BreathTVIntegrator, LearnsOffsetWithoutBreaths) {
+  VolumetricFlow offset = ml_per_min(2000);
+  BreathTVIntegrator breath_tv;
+  Time start = Hal.now();
+  float max_volume_ml = 0;
+  for (int i = 1; i <= 30000; i++) {
+    breath_tv.AddFlow(start + i * SAMPLE_PERIOD, offset);
+    max_volume_ml = std::max(max_volume_ml, std::abs(breath_tv.GetTV().ml()));
+  }
+  EXPECT_EQ(breath_tv.GetBreathCount(), 0u);
+  EXPECT_NEAR(breath_tv.GetFlowOffset().ml_per_min(), 2000, 10);
+  // At most one MAX_BREATH_DURATION's worth of the offset.
+  EXPECT_LE(max_volume_ml,
+            offset.ml_per_min() *
+                BreathTVIntegrator::MAX_BREATH_DURATION.minutes());
+}
+
+// A big leak (or disconnect) looks like an offset, but we only hide so much of
+// it.
+TEST(BreathTVIntegrator, OffsetIsBounded) {
+  BreathTVIntegrator breath_tv;
+  Time start = Hal.now();
+  for (int i = 1; i <= 30000; i++) {
+    breath_tv.AddFlow(start + i * SAMPLE_PERIOD, ml_per_min(20000));
+  }
+  EXPECT_FLOAT_EQ(
+      breath_tv.GetFlowOffset().ml_per_min(),
+      VolumetricFlow(BreathTVIntegrator::MAX_FLOW_OFFSET).ml_per_min());
+}
+
+TEST(BreathTVIntegrator, StateRoundTrip) {
+  BreathTVIntegrator a;
+  Time start = Hal.now();
+  int i = 1;
+  for (; i <= 1000; i++) {
+    a.AddFlow(start + i * SAMPLE_PERIOD,
+              BreathFlow(static_cast<float>(i) * SAMPLE_PERIOD.seconds()) +
+                  ml_per_min(500));
+  }
+
+  // Restore into an integrator created at a different time, as after a
+  // restart.
+  Time now = start + i * SAMPLE_PERIOD;
+  BreathTVIntegrator::State state = a.GetState(now);
+  BreathTVIntegrator b;
+  b.RestoreState(now, state);
+
+  for (; i <= 2000; i++) {
+    VolumetricFlow flow =
+        BreathFlow(static_cast<float>(i) * SAMPLE_PERIOD.seconds()) +
+        ml_per_min(500);
+    a.AddFlow(start + i * SAMPLE_PERIOD, flow);
+    b.AddFlow(start + i * SAMPLE_PERIOD, flow);
+    ASSERT_FLOAT_EQ(a.GetTV().ml(), b.GetTV().ml()) << i;
+  }
+  EXPECT_EQ(a.GetBreathCount(), b.GetBreathCount());
+}
+
+// Replays the flow from a recording through both integrators.
+struct Replay {
+  std::vector<uint32_t> breath_start_rows;
+  std::vector<float> residuals_ml;
+  float max_abs_volume_ml = 0;
+  float plain_final_volume_ml = 0;
+  float final_offset_ml_per_min = 0;
+
+  // Adds `offset` to the recorded flow, as a sensor offset would.
+  explicit Replay(const std::vector<SampleDataRow> &rows,
+                  VolumetricFlow offset = ml_per_min(0)) {
+    BreathTVIntegrator breath_tv;
+    TVIntegrator plain_tv;
+    Time start = Hal.now();
+    for (uint32_t i = 0; i < rows.size(); i++) {
+      Time now = start + static_cast<int>(i + 1) * SAMPLE_PERIOD;
+      VolumetricFlow flow = ml_per_min(rows[i].flow_ml_per_min) + offset;
+      uint32_t breaths = breath_tv.GetBreathCount();
+      breath_tv.AddFlow(now, flow);
+      plain_tv.AddFlow(now, flow);
+      if (breath_tv.GetBreathCount() != breaths) {
+        breath_start_rows.push_back(i);
+        residuals_ml.push_back(breath_tv.GetLastResidual().ml());
+      }
+      max_abs_volume_ml =
+          std::max(max_abs_volume_ml, std::abs(breath_tv.GetTV().ml()));
+    }
+    plain_final_volume_ml = plain_tv.GetTV().ml();
+    final_offset_ml_per_min = breath_tv.GetFlowOffset().ml_per_min();
+  }
+};
+
+// Rows where the fan setpoint goes from PEEP up to PIP, i.e. where the
+// controller started a breath.
+static std::vector<uint32_t>
+InspirationStarts(const std::vector<SampleDataRow> &rows) {
+  std::vector<uint32_t> starts;
+  for (uint32_t i = 1; i < rows.size(); i++) {
+    if (rows[i].fan_setpoint_cm_h2o > rows[i - 1].fan_setpoint_cm_h2o) {
+      starts.push_back(i);
+    }
+  }
+  return starts;
+}
+
+static float MeanAbsOfLast(const std::vector<float> &v, size_t n) {
+  float sum = 0;
+  for (size_t i = v.size() - n; i < v.size(); i++) {
+    sum += std::abs(v[i]);
+  }
+  return sum / static_cast<float>(n);
+}
+
+class BreathTVIntegratorReplay : public testing::TestWithParam<const char *> {
+};
+
+TEST_P(BreathTVIntegratorReplay, TracksBreathsWithoutDrift) {
+  std::vector<SampleDataRow> rows = LoadSampleData(GetParam());
+  ASSERT_FALSE(rows.empty()) << "Couldn't read " << GetParam();
+  Replay replay(rows);
+
+  // We find every breath the controller started, within 100ms of when the
+  // fan setpoint went up.
+  std::vector<uint32_t> expected = InspirationStarts(rows);
+  ASSERT_EQ(replay.breath_start_rows.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_NEAR(replay.breath_start_rows[i], expected[i], 10) << i;
+  }
+
+  // The sensors' offset adds up to tens of ml per breath, hundreds over the
+  // recording.
+  printf("%s: plain integrator ends at %.0f ml, estimated offset %.0f "
+         "ml/min\n",
+         GetParam(), replay.plain_final_volume_ml,
+         replay.final_offset_ml_per_min);
+  EXPECT_GT(std::abs(replay.plain_final_volume_ml), 300);
+
+  // Once the offset estimate has settled, what's left at the end of each
+  // breath is only noise.
+  EXPECT_LT(MeanAbsOfLast(replay.residuals_ml, 10), 25);
+  // And the volume never runs away; the largest is at the peak of a breath.
+  EXPECT_LT(replay.max_abs_volume_ml, 700);
+
+  // We don't know the recording's true offset, but adding one to it moves
+  // our estimate by as much, and doesn't upset the breath detection.
+  for (float injected : {-1000.f, 1000.f}) {
+    Replay offset_replay(rows, ml_per_min(injected));
+    EXPECT_EQ(offset_replay.breath_start_rows.size(), expected.size());
+    EXPECT_NEAR(offset_replay.final_offset_ml_per_min,
+                replay.final_offset_ml_per_min + injected, 25)
+        << injected;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(SampleData, BreathTVIntegratorReplay,
+                         testing::Values(
+                             "2020-05-14-pip15-peep5-rr12-ie23.csv",
+                             "2020-05-14-pip25-peep10-rr12-ie23.csv"));
+
+// With the blower off, there are no breaths, just sensor noise and offset.
+// The plain integrator runs off by liters; we stay within a few hundred ml.
+TEST(BreathTVIntegrator, ReplayVentOff) {
+  std::vector<SampleDataRow> rows =
+      LoadSampleData("2020-05-14-vent-off.csv");
+  ASSERT_FALSE(rows.empty());
+  Replay replay(rows);
+
+  float mean_flow = 0;
+  for (const SampleDataRow &row : rows) {
+    mean_flow += row.flow_ml_per_min;
+  }
+  mean_flow /= static_cast<float>(rows.size());
+
+  EXPECT_GT(replay.plain_final_volume_ml, 2000);
+  EXPECT_LT(replay.max_abs_volume_ml, 300);
+  EXPECT_NEAR(replay.final_offset_ml_per_min, mean_flow, 250);
+}
+
+TEST(BreathTVIntegrator, Benchmark) {
+  // One breath's worth of flow, precomputed so that we time only AddFlow().
+  constexpr int SAMPLES_PER_BREATH = 300;
+  VolumetricFlow flows[SAMPLES_PER_BREATH];
+  for (int i = 0; i < SAMPLES_PER_BREATH; i++) {
+    flows[i] = BreathFlow(static_cast<float>(i) * SAMPLE_PERIOD.seconds());
+  }
+
+  BreathTVIntegrator breath_tv;
+  TVIntegrator plain_tv;
+  Time t = Hal.now();
+  int i = 0;
+  RunBenchmark("TVIntegrator::AddFlow", 100000, [&] {
+    t += SAMPLE_PERIOD;
+    plain_tv.AddFlow(t, flows[i++ % SAMPLES_PER_BREATH]);
+    DoNotOptimize(plain_tv.GetTV());
+  });
+  RunBenchmark("BreathTVIntegrator::AddFlow", 100000, [&] {
+    t += SAMPLE_PERIOD;
+    breath_tv.AddFlow(t, flows[i++ % SAMPLES_PER_BREATH]);
+    DoNotOptimize(breath_tv.GetTV());
+  });
+}
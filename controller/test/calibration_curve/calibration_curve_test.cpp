@@ -0,0 +1,154 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "calibration_curve.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <cmath>
+
+constexpr float Abs(float x) { return x < 0 ? -x : x; }
+
+// The default curve really is computed at compile time.
+static constexpr Sensors::PressureCurve DEFAULT_CURVE =
+    Sensors::DefaultCalibrationCurve();
+static_assert(Abs(DEFAULT_CURVE.Evaluate(0)) < 1e-6f);
+static_assert(Abs(DEFAULT_CURVE.Evaluate(1.65f) - 2.5f) < 1e-5f);
+
+TEST(CalibrationCurve, DefaultMatchesDatasheet) {
+  // Including a little past the ends of the table, where we extrapolate.
+  for (float v = -3.5f; v <= 3.5f; v += 0.001f) {
+    EXPECT_NEAR(DEFAULT_CURVE.Evaluate(v), Sensors::Mpxv5004KPa(v), 1e-5f)
+        << v;
+  }
+}
+
+TEST(CalibrationCurve, ExactAtGridPoints) {
+  constexpr auto curve = CalibrationCurve<9>::FromFunction(
+      -1, 3, [](float x) { return x * x * x; });
+  for (int i = 0; i < 9; i++) {
+    float x = curve.X(i);
+    EXPECT_FLOAT_EQ(curve.Evaluate(x), x * x * x);
+  }
+}
+
+TEST(CalibrationCurve, InterpolationErrorIsBounded) {
+  // Linear interpolation of f with step h is off by at most h^2/8 * max|f''|.
+  constexpr int N = 17;
+  constexpr float X_MIN = 0;
+  constexpr float X_MAX = 2;
+  constexpr auto curve = CalibrationCurve<N>::FromFunction(
+      X_MIN, X_MAX, [](float x) { return x * x; });
+  float h = (X_MAX - X_MIN) / (N - 1);
+  float bound = h * h / 8 * 2;
+  for (float x = X_MIN; x <= X_MAX; x += 0.0005f) {
+    EXPECT_LE(std::abs(curve.Evaluate(x) - x * x), bound * 1.01f) << x;
+  }
+}
+
+TEST(CalibrationCurve, Extrapolates) {
+  constexpr auto curve = CalibrationCurve<3>::FromFunction(
+      0, 2, [](float x) { return x < 1 ? x : 3 * x - 2; });
+  // Below the table, along the first segment (slope 1).
+  EXPECT_FLOAT_EQ(curve.Evaluate(-1), -1);
+  // Above it, along the last (slope 3).
+  EXPECT_FLOAT_EQ(curve.Evaluate(3), 7);
+  // Far out inputs don't overflow the segment index.
+  EXPECT_FLOAT_EQ(curve.Evaluate(1e30f), 3e30f - 2);
+}
+
+TEST(CalibrationCurve, Inverts) {
+  constexpr auto curve = CalibrationCurve<3>::FromFunction(
+      0, 2, [](float x) { return x < 1 ? x : 3 * x - 2; });
+  for (float x = -1; x <= 3; x += 0.01f) {
+    EXPECT_NEAR(curve.Invert(curve.Evaluate(x)), x, 1e-5f) << x;
+  }
+  static_assert(Abs(DEFAULT_CURVE.Invert(2.5f) - 1.65f) < 1e-5f);
+}
+
+TEST(CalibrationCurve, FromPoints) {
+  // Unevenly spaced points measured against a reference.
+  const float volts[] = {-0.5f, 0.1f, 0.2f, 1.0f, 3.0f};
+  const float kpa[] = {-0.7f, 0.2f, 0.3f, 1.5f, 4.5f};
+  auto curve = CalibrationCurve<33>::FromPoints(-1, 3, volts, kpa, 5);
+
+  // On the grid the curve goes through the measured points...
+  for (int i = 0; i < 5; i++) {
+    EXPECT_NEAR(curve.Evaluate(volts[i]), kpa[i], 0.02f) << volts[i];
+  }
+  // ...and extends the end segments beyond them.
+  EXPECT_NEAR(curve.Evaluate(-1), -0.7f - 0.5f * 1.5f, 1e-5f);
+  // Points that are on the grid come out exact.
+  EXPECT_NEAR(curve.Evaluate(1), 1.5f, 1e-6f);
+  EXPECT_NEAR(curve.Evaluate(3), 4.5f, 1e-6f);
+}
+
+// See sensors_test.cpp.
+static Voltage MPXV5004_PressureToVoltage(Pressure pressure) {
+  return volts(3.3f * (0.2f * pressure.kPa() + 0.2f));
+}
+
+TEST(CalibrationCurve, SensorsUseOverride) {
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, MPXV5004_PressureToVoltage(kPa(0)));
+  }
+  Sensors sensors;
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    sensors.SetFilterChain(pin, Sensors::FilterChain(PassThroughBiquad(),
+                                                     PassThroughBiquad()));
+  }
+  sensors.Calibrate();
+
+  // Say the patient pressure sensor turns out to read 10% high above 1kPa.
+  sensors.SetCalibrationCurve(
+      AnalogPin::PATIENT_PRESSURE,
+      Sensors::PressureCurve::FromFunction(-3.3f, 3.3f, [](float v) {
+        float p = Sensors::Mpxv5004KPa(v);
+        return p < 1 ? p : 1 + (p - 1) / 1.1f;
+      }));
+
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        MPXV5004_PressureToVoltage(kPa(0.5f)));
+  EXPECT_NEAR(sensors.GetSensorReadings().patient_pressure_cm_h2o,
+              kPa(0.5f).cmH2O(), 0.05f);
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        MPXV5004_PressureToVoltage(kPa(3.2f)));
+  EXPECT_NEAR(sensors.GetSensorReadings().patient_pressure_cm_h2o,
+              kPa(3).cmH2O(), 0.05f);
+}
+
+// Cost per read of the table vs. the single linear formula it replaced.
+TEST(CalibrationCurve, Benchmark) {
+  constexpr int READINGS = 1024;
+  float volts[READINGS];
+  for (int i = 0; i < READINGS; i++) {
+    volts[i] = 3.3f * static_cast<float>((i * 37) % READINGS) / READINGS;
+  }
+  float zero = 0.66f;
+  int i = 0;
+  RunBenchmark("linear TRANSFER_FN_COEFF", 1000000, [&] {
+    DoNotOptimize(5.f / 3.3f * (volts[i++ % READINGS] - zero));
+  });
+  Sensors::PressureCurve curve = DEFAULT_CURVE;
+  DoNotOptimize(curve);
+  RunBenchmark("CalibrationCurve<17>::Evaluate", 1000000, [&] {
+    DoNotOptimize(curve.Evaluate(volts[i++ % READINGS] - zero));
+  });
+}
@@ -28,6 +28,30 @@ TEST(Checksum32, KnownValues) {
   EXPECT_EQ((uint32_t)0x321FBEF4, soft_crc32("abcdefgh", 8));
 }
 
+TEST(ChecksumWords32, KnownValues) {
+  EXPECT_EQ(checksum_words32(nullptr, 0), 0x811C9DC5u);
+  const uint32_t zero[] = {0};
+  EXPECT_EQ(checksum_words32(zero, 1), 0x050C5D1Fu);
+  const uint32_t abcdefgh[] = {0x64636261, 0x68676665};
+  EXPECT_EQ(checksum_words32(abcdefgh, 2), 0x3AD69DEBu);
+}
+
+TEST(ChecksumWords32, SingleBitFlipsAndSwaps) {
+  uint32_t data[16];
+  for (uint32_t i = 0; i < 16; i++) {
+    data[i] = i * 0x01010101;
+  }
+  uint32_t original = checksum_words32(data, 16);
+  for (int bit = 0; bit < 16 * 32; bit++) {
+    data[bit / 32] ^= 1u << (bit % 32);
+    EXPECT_NE(checksum_words32(data, 16), original) << "bit " << bit;
+    data[bit / 32] ^= 1u << (bit % 32);
+  }
+  // Unlike a plain sum, the order of the words matters.
+  std::swap(data[3], data[7]);
+  EXPECT_NE(checksum_words32(data, 16), original);
+}
+
 TEST(Checksum, CheckBytes) {
   uint16_t csum = checksum_fletcher16("abcde", 5);
 
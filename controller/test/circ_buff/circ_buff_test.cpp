@@ -17,6 +17,7 @@ limitations under the License.
 #include "gtest/gtest.h"
 #include <cstdlib>
 #include <optional>
+#include <thread>
 
 // Just getting my feet wet with gtest
 TEST(CircBuff, Counts) {
@@ -88,6 +89,47 @@ TEST(CircBuff, DataIO) {
   ASSERT_EQ(buff.Get(), std::nullopt);
 }
 
+TEST(CircBuff, Flush) {
+  CircBuff<uint8_t, 8> buff;
+  for (uint8_t i = 0; i < 5; i++) {
+    ASSERT_TRUE(buff.Put(i));
+  }
+  buff.Flush();
+  EXPECT_EQ(buff.FullCt(), 0);
+  EXPECT_EQ(buff.FreeCt(), 7);
+  EXPECT_EQ(buff.Get(), std::nullopt);
+
+  // The buffer still works after flushing part way round.
+  ASSERT_TRUE(buff.Put(42));
+  EXPECT_EQ(buff.Get(), 42);
+}
+
+// The buffer is lock-free, so one thread can Put() while another Get()s --
+// just like an ISR and the main loop.  Every element should come out exactly
+// once and in order.
+TEST(CircBuff, ProducerConsumerThreads) {
+  static constexpr uint32_t COUNT = 200000;
+  CircBuff<uint32_t, 16> buff;
+
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < COUNT;) {
+      if (buff.Put(i)) {
+        i++;
+      }
+    }
+  });
+
+  uint32_t expected = 0;
+  while (expected < COUNT) {
+    if (std::optional<uint32_t> val = buff.Get(); val) {
+      ASSERT_EQ(*val, expected);
+      expected++;
+    }
+  }
+  producer.join();
+  EXPECT_EQ(buff.FullCt(), 0);
+}
+
 // TODO - some other good tests to add when there's time:
 //
 // - Test that when Put() and Get() fail, they have no effect
@@ -35,11 +35,14 @@ TEST(CommTests, SendControllerStatus) {
   s.sensor_readings.flow_ml_per_min = 1000;
 
   // Run comms_handler until it stops sending data.  10 iterations should be
-  // more than enough.
+  // more than enough.  It only starts sending once, since the fake time
+  // doesn't advance.
+  int sends = 0;
   for (int i = 0; i < 10; i++) {
     GuiStatus gui_status_ignored = GuiStatus_init_zero;
-    comms_handler(s, &gui_status_ignored);
+    sends += comms_handler(s, &gui_status_ignored);
   }
+  EXPECT_EQ(sends, 1);
   char tx_buffer[ControllerStatus_size];
   uint16_t len = Hal.test_serialGetOutgoingData(tx_buffer, sizeof(tx_buffer));
   ASSERT_GT(len, 0);
@@ -0,0 +1,175 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "control_loop.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+
+static GuiStatus Status(uint64_t uptime_ms, uint32_t autotune_request_id) {
+  GuiStatus status = GuiStatus_init_zero;
+  status.uptime_ms = uptime_ms;
+  status.autotune_request_id = autotune_request_id;
+  return status;
+}
+
+TEST(AutotuneRequests, IncreasingIdIsARequest) {
+  AutotuneRequests requests;
+  EXPECT_FALSE(requests.OnGuiStatus(Status(1000, 0)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(1100, 1)));
+  // Only once.
+  EXPECT_FALSE(requests.OnGuiStatus(Status(1200, 1)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(1300, 5)));
+  // Going back isn't a request, and nor is returning to an id we've seen.
+  EXPECT_FALSE(requests.OnGuiStatus(Status(1400, 2)));
+  EXPECT_FALSE(requests.OnGuiStatus(Status(1500, 5)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(1600, 6)));
+}
+
+TEST(AutotuneRequests, NothingBeforeWeHearFromTheGui) {
+  AutotuneRequests requests;
+  EXPECT_FALSE(requests.OnGuiStatus(GuiStatus_init_zero));
+  // After we reboot, the GUI carries on sending its last request's id.
+  EXPECT_FALSE(requests.OnGuiStatus(Status(5000, 3)));
+  EXPECT_FALSE(requests.OnGuiStatus(Status(5100, 3)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(5200, 4)));
+}
+
+TEST(AutotuneRequests, GuiRestart) {
+  AutotuneRequests requests;
+  EXPECT_FALSE(requests.OnGuiStatus(Status(5000, 3)));
+  // The restarted GUI's first id is only a baseline, whatever it is.
+  EXPECT_FALSE(requests.OnGuiStatus(Status(100, 7)));
+  EXPECT_FALSE(requests.OnGuiStatus(Status(200, 7)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(300, 8)));
+  EXPECT_FALSE(requests.OnGuiStatus(Status(50, 1)));
+  EXPECT_TRUE(requests.OnGuiStatus(Status(150, 2)));
+}
+
+static Voltage PressureToVoltage(Pressure p) {
+  return volts(3.3f * (0.2f * p.kPa() + 0.2f));
+}
+
+// Runs `loop` for `duration`, with the pressure sensors reading around
+// `patient_pressure`.  They read a little differently each tick, like real
+// sensors, so that the health monitors don't think they're stuck.
+static void RunLoop(ControlLoop *loop, Duration duration,
+                    Voltage patient_pressure) {
+  for (Duration t = milliseconds(0); t < duration;
+       t = t + LoopPeriod(DEFAULT_LOOP_RATE)) {
+    Hal.delay(LoopPeriod(DEFAULT_LOOP_RATE));
+    Voltage noise = volts(t.microseconds() % 20000 < 10000 ? 1e-3f : 0);
+    Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                          patient_pressure + noise);
+    Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(0)) + noise);
+    Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(0)) + noise);
+    loop->Tick();
+  }
+}
+
+TEST(ControlLoop, SensorFaultAbortsAutotune) {
+  // Sets up the actuators' pins.
+  Hal.init();
+  ControlLoopIO io;
+  WarmRestartSnapshot<ControlLoopSnapshot> snapshot{};
+  ControlLoop loop(DEFAULT_LOOP_RATE, &io, &snapshot, [] {});
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, PressureToVoltage(kPa(0)));
+  }
+  loop.Calibrate();
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_OFF;
+  io.active_params.Publish(params);
+  loop.Start();
+
+  io.autotune_requested = true;
+  RunLoop(&loop, seconds(2), PressureToVoltage(kPa(0)));
+  EXPECT_EQ(io.controller_status.Read().pressure_tuning.autotune_state,
+            AutotuneState_AUTOTUNE_RUNNING);
+
+  // The patient pressure sensor comes loose.
+  RunLoop(&loop, milliseconds(200), volts(0));
+  EXPECT_EQ(io.controller_status.Read().pressure_tuning.autotune_state,
+            AutotuneState_AUTOTUNE_FAILED);
+}
+
+// Runs `loop` in pressure control for `duration`, with the patient pressure a
+// little under the setpoint so that the blower stays on.  In expiration the
+// blower's flow goes through both venturis, as once the patient has breathed
+// out; in inspiration more goes in than out.  The inflow sensor reads
+// `inflow_drift` more than it should.  Returns the last flow the loop read.
+static float RunBreaths(ControlLoop *loop, ControlLoopIO *io,
+                        Duration duration, Voltage inflow_drift,
+                        const VentParams &params) {
+  for (Duration t = milliseconds(0); t < duration;
+       t = t + LoopPeriod(DEFAULT_LOOP_RATE)) {
+    Hal.delay(LoopPeriod(DEFAULT_LOOP_RATE));
+    const ControllerStatus &status = io->controller_status.Read();
+    bool expiring = status.fan_setpoint_cm_h2o ==
+                    static_cast<float>(params.peep_cm_h2o);
+    Voltage noise = volts(t.microseconds() % 20000 < 10000 ? 1e-3f : 0);
+    Hal.test_setAnalogPin(
+        AnalogPin::PATIENT_PRESSURE,
+        PressureToVoltage(cmH2O(status.fan_setpoint_cm_h2o - 1)) + noise);
+    Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(expiring ? 0.3f : 0.5f)) +
+                              inflow_drift + noise);
+    Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(0.3f)) + noise);
+    loop->Tick();
+  }
+  return io->controller_status.Read().sensor_readings.flow_ml_per_min;
+}
+
+TEST(ControlLoop, ReZeroesVenturisDuringVentilation) {
+  Hal.init();
+  ControlLoopIO io;
+  WarmRestartSnapshot<ControlLoopSnapshot> snapshot{};
+  ControlLoop loop(DEFAULT_LOOP_RATE, &io, &snapshot, [] {});
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, PressureToVoltage(kPa(0)));
+  }
+  loop.Calibrate();
+  // 5s breaths: 1.67s of inspiration, then 3.33s of expiration.
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_PRESSURE_CONTROL;
+  params.breaths_per_min = 12;
+  params.inspiratory_expiratory_ratio = 0.5f;
+  params.peep_cm_h2o = 5;
+  params.pip_cm_h2o = 15;
+  io.active_params.Publish(params);
+  loop.Start();
+
+  // The inflow sensor's offset has drifted by 20mV, so early in expiration it
+  // looks like the patient is breathing out faster than they are.  The
+  // blower never turns off, so the sensors are never at rest.
+  Voltage drift = volts(-0.02f);
+  float flow = RunBreaths(&loop, &io, milliseconds(2200), drift, params);
+  EXPECT_LT(flow, -1000);
+  EXPECT_GT(io.controller_status.Read().fan_power, 0);
+
+  // By the end of expiration, the venturis have been re-zeroed.
+  flow = RunBreaths(&loop, &io, milliseconds(2700), drift, params);
+  EXPECT_NEAR(flow, 0, 50);
+
+  // And they stay that way, breath after breath.
+  flow = RunBreaths(&loop, &io, seconds(10), drift, params);
+  EXPECT_NEAR(flow, 0, 50);
+}
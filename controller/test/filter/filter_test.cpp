@@ -0,0 +1,195 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "filter.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <random>
+
+static constexpr float SAMPLE_RATE_HZ = 100;
+
+constexpr float Abs(float x) { return x < 0 ? -x : x; }
+
+// The coefficients really are computed at compile time.
+static constexpr BiquadCoeffs LOW_PASS = LowPassBiquad(SAMPLE_RATE_HZ, 10);
+static constexpr BiquadCoeffs NOTCH = NotchBiquad(SAMPLE_RATE_HZ, 25, 2);
+static constexpr FirCoeffs<15> FIR = LowPassFir<15>(SAMPLE_RATE_HZ, 10);
+static_assert(Abs(LOW_PASS.DcGain() - 1) < 1e-5f);
+static_assert(Abs(NOTCH.DcGain() - 1) < 1e-5f);
+static_assert(Abs(FIR.h[0] - FIR.h[14]) < 1e-7f, "FIR should be symmetric");
+
+TEST(Filter, ConstexprSinCos) {
+  for (double x = -10; x < 10; x += 0.01) {
+    EXPECT_NEAR(filter_design::Sin(x), std::sin(x), 1e-12) << x;
+    EXPECT_NEAR(filter_design::Cos(x), std::cos(x), 1e-12) << x;
+  }
+}
+
+// Feeds a filter a sine wave at `freq_hz` and returns the peak amplitude of
+// the output once it's settled, relative to the input's.
+template <class Filter> float Gain(Filter filter, float freq_hz) {
+  constexpr int SETTLE = 1000;
+  constexpr int MEASURE = 1000;
+  float peak = 0;
+  for (int i = 0; i < SETTLE + MEASURE; i++) {
+    float t = static_cast<float>(i) / SAMPLE_RATE_HZ;
+    float x = std::sin(2 * static_cast<float>(M_PI) * freq_hz * t);
+    float y = filter.Filter(x);
+    if (i >= SETTLE) {
+      peak = std::max(peak, std::abs(y));
+    }
+  }
+  return peak;
+}
+
+TEST(Filter, LowPassResponse) {
+  Biquad filter(LOW_PASS);
+  EXPECT_NEAR(Gain(filter, 1), 1, 0.01);
+  // Butterworth: -3dB at cutoff, then -12dB/octave.
+  EXPECT_NEAR(Gain(filter, 10), M_SQRT1_2, 0.01);
+  EXPECT_LT(Gain(filter, 40), 0.07);
+}
+
+TEST(Filter, NotchResponse) {
+  Biquad filter(NOTCH);
+  EXPECT_LT(Gain(filter, 25), 0.01);
+  EXPECT_NEAR(Gain(filter, 2), 1, 0.01);
+  EXPECT_NEAR(Gain(filter, 48), 1, 0.02);
+}
+
+TEST(Filter, ChainMultipliesResponses) {
+  BiquadChain<2> chain(LOW_PASS, NOTCH);
+  EXPECT_NEAR(Gain(chain, 1), 1, 0.01);
+  EXPECT_NEAR(Gain(chain, 10), Gain(Biquad(LOW_PASS), 10) *
+                                   Gain(Biquad(NOTCH), 10),
+              0.01);
+  EXPECT_LT(Gain(chain, 25), 0.001);
+
+  // A default chain passes everything through.
+  BiquadChain<2> pass;
+  for (float x : {0.0f, 1.0f, -3.5f, 1e6f}) {
+    EXPECT_EQ(pass.Filter(x), x);
+  }
+}
+
+TEST(Filter, FirResponse) {
+  FirFilter<15> filter(FIR);
+  EXPECT_NEAR(Gain(filter, 1), 1, 0.02);
+  EXPECT_LT(Gain(filter, 30), 0.05);
+
+  // Linear phase: a ramp comes out delayed by (TAPS - 1) / 2 samples.
+  FirFilter<15> ramp(FIR);
+  for (int i = 0; i < 100; i++) {
+    float y = ramp.Filter(static_cast<float>(i));
+    if (i >= 15) {
+      EXPECT_NEAR(y, static_cast<float>(i - 7), 1e-3) << i;
+    }
+  }
+}
+
+// Reset() settles a filter at its input, so a constant input passes straight
+// through without a transient.
+TEST(Filter, ResetAvoidsTransient) {
+  Biquad biquad(LOW_PASS);
+  BiquadChain<2> chain(LOW_PASS, NOTCH);
+  FirFilter<15> fir(FIR);
+  EXPECT_NEAR(biquad.Reset(2.5f), 2.5f, 1e-5);
+  EXPECT_NEAR(chain.Reset(2.5f), 2.5f, 1e-5);
+  EXPECT_NEAR(fir.Reset(2.5f), 2.5f, 1e-5);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_NEAR(biquad.Filter(2.5f), 2.5f, 1e-5);
+    EXPECT_NEAR(chain.Filter(2.5f), 2.5f, 1e-5);
+    EXPECT_NEAR(fir.Filter(2.5f), 2.5f, 1e-5);
+  }
+}
+
+static Voltage PressureToVoltage(Pressure p) {
+  return volts(3.3f * (0.2f * p.kPa() + 0.2f));
+}
+
+// Sensors' default filters take out noise without biasing the reading.
+TEST(Filter, SensorsFilterNoise) {
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, PressureToVoltage(kPa(0)));
+  }
+  Sensors filtered(LoopRate::HZ_1000);
+  Sensors raw(LoopRate::HZ_1000);
+  raw.SetFilterChain(AnalogPin::INFLOW_PRESSURE_DIFF, Sensors::FilterChain());
+  filtered.Calibrate();
+  raw.Calibrate();
+
+  std::mt19937 rng(1);
+  std::normal_distribution<float> noise(0, 0.05f);
+  constexpr float PRESSURE_KPA = 1;
+  constexpr int N = 2000;
+  double raw_sq = 0, filtered_sq = 0, filtered_sum = 0;
+  for (int i = 0; i < N; i++) {
+    Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(PRESSURE_KPA + noise(rng))));
+    float r =
+        cmH2O(raw.GetSensorReadings().inflow_pressure_diff_cm_h2o).kPa();
+    float f =
+        cmH2O(filtered.GetSensorReadings().inflow_pressure_diff_cm_h2o).kPa();
+    if (i < 100) {
+      continue;
+    }
+    raw_sq += (r - PRESSURE_KPA) * (r - PRESSURE_KPA);
+    filtered_sq += (f - PRESSURE_KPA) * (f - PRESSURE_KPA);
+    filtered_sum += f;
+  }
+  // White noise keeps the fraction of its power below the cutoff,
+  // 30Hz / 500Hz.
+  EXPECT_LT(filtered_sq, 0.15 * raw_sq);
+  EXPECT_NEAR(filtered_sum / (N - 100), PRESSURE_KPA, 0.01);
+}
+
+// The patient pressure feeds the pressure PID, so by default it isn't
+// filtered: a step shows up in full at the next reading.
+TEST(Filter, SensorsDontDelayPatientPressure) {
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, PressureToVoltage(kPa(0)));
+  }
+  Sensors sensors(LoopRate::HZ_100);
+  sensors.Calibrate();
+  sensors.GetSensorReadings();
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        PressureToVoltage(kPa(1)));
+  Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                        PressureToVoltage(kPa(1)));
+  SensorReadings readings = sensors.GetSensorReadings();
+  EXPECT_NEAR(readings.patient_pressure_cm_h2o, kPa(1).cmH2O(), 0.01f);
+  // Unlike the differential sensors.
+  EXPECT_LT(readings.inflow_pressure_diff_cm_h2o, 0.9f * kPa(1).cmH2O());
+}
+
+// Cost of filtering one sample.
+TEST(Filter, Benchmark) {
+  float x = 0;
+  Biquad biquad(LOW_PASS);
+  BiquadChain<2> chain(LOW_PASS, NOTCH);
+  FirFilter<15> fir(FIR);
+  RunBenchmark("Biquad", 100000, [&] { DoNotOptimize(biquad.Filter(x++)); });
+  RunBenchmark("BiquadChain<2>", 100000,
+               [&] { DoNotOptimize(chain.Filter(x++)); });
+  RunBenchmark("FirFilter<15>", 100000,
+               [&] { DoNotOptimize(fir.Filter(x++)); });
+}
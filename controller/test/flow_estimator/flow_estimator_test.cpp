@@ -0,0 +1,384 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "flow_estimator.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "kalman_filter.h"
+#include "sample_data.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+static constexpr Venturi VENTURI = Sensors::DEFAULT_VENTURI;
+
+TEST(KalmanFilter, AveragesRepeatedMeasurements) {
+  // With no process noise, N measurements of a constant with variance r
+  // average to it, with variance r / N.
+  KalmanFilter<1> filter({{0}}, {{{1e6f}}});
+  float values[] = {1.f, 3.f, 2.f, 4.f, 0.f};
+  for (float v : values) {
+    filter.Predict({{{1}}}, {{{0}}});
+    filter.Update({{1}}, v, 2);
+  }
+  EXPECT_NEAR(filter.State().v[0], 2, 1e-4f);
+  EXPECT_NEAR(filter.Covariance().m[0][0], 2.f / 5, 1e-4f);
+}
+
+TEST(KalmanFilter, TwoStatePredictAndUpdate) {
+  // Position and velocity, checked against the textbook equations.
+  KalmanFilter<2> filter({{0, 1}}, {{{1, 0}, {0, 1}}});
+  filter.Predict({{{1, 0.5f}, {0, 1}}}, {{{0.1f, 0}, {0, 0.1f}}});
+  EXPECT_FLOAT_EQ(filter.State().v[0], 0.5f);
+  EXPECT_FLOAT_EQ(filter.State().v[1], 1);
+  // F P F' + Q = [[1.25, 0.5], [0.5, 1]] + 0.1 I
+  EXPECT_FLOAT_EQ(filter.Covariance().m[0][0], 1.35f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[0][1], 0.5f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[1][0], 0.5f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[1][1], 1.1f);
+
+  // Measure the position as 1.5 with variance 1.35: gain = P h' / s =
+  // [0.5, 0.5 / 2.7].
+  filter.Update({{1, 0}}, 1.5f, 1.35f);
+  EXPECT_FLOAT_EQ(filter.State().v[0], 1);
+  EXPECT_FLOAT_EQ(filter.State().v[1], 1 + 0.5f / 2.7f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[0][0], 0.675f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[1][1], 1.1f - 0.25f / 2.7f);
+}
+
+// A measurement far more precise than the prior is where rounding errors in
+// the covariance update hurt most: P - k h P cancels to zero or below, after
+// which the filter stops listening to its measurements, or diverges.
+TEST(KalmanFilter, PreciseMeasurementKeepsCovariancePositive) {
+  KalmanFilter<2> filter({{0, 0}}, {{{1000, 0}, {0, 1000}}});
+  filter.Update({{1, 0}}, 1, 1e-6f);
+  // The variance is now that of the measurement.
+  EXPECT_NEAR(filter.Covariance().m[0][0], 1e-6f, 1e-8f);
+  EXPECT_FLOAT_EQ(filter.Covariance().m[1][1], 1000);
+
+  for (int i = 0; i < 1000; i++) {
+    filter.Predict({{{1, 0}, {0.4f, 1}}}, {{{0, 0}, {0, 0}}});
+    filter.Update({{1, 0}}, 1, 1e-6f);
+    filter.Update({{0, 1}}, 0, 1e-6f);
+  }
+  const auto &p = filter.Covariance().m;
+  EXPECT_GT(p[0][0], 0);
+  EXPECT_GT(p[1][1], 0);
+  EXPECT_GT(p[0][0] * p[1][1] - p[0][1] * p[1][0], 0);
+}
+
+TEST(FlowEstimator, VenturiVarianceFallsWithFlow) {
+  float near_zero = FlowEstimator::VenturiFlowVariance(VENTURI, kPa(0));
+  float low = FlowEstimator::VenturiFlowVariance(VENTURI, cmH2O(0.5f));
+  float high = FlowEstimator::VenturiFlowVariance(VENTURI, cmH2O(5));
+  EXPECT_GT(near_zero, low);
+  EXPECT_GT(low, high);
+  EXPECT_FLOAT_EQ(low / high, 10);
+  // Symmetric in the direction of flow.
+  EXPECT_FLOAT_EQ(FlowEstimator::VenturiFlowVariance(VENTURI, cmH2O(-5)),
+                  high);
+}
+
+// The pressure drop across VENTURI for a flow of `flow`.
+static Pressure VenturiDelta(VolumetricFlow flow) {
+  float q = flow.cubic_m_per_sec() / VENTURI.Coefficient();
+  return kPa(std::copysign(q * q, q) / 1000);
+}
+
+// A simulated ventilator in pressure control, connected to a lung with the
+// default compliance, with noisy sensors.  We know the true flow here, so we
+// can measure the error of each estimate.
+TEST(FlowEstimator, BeatsVenturisOnSimulatedLung) {
+  constexpr Duration DT = milliseconds(10);
+  constexpr float C_L_PER_CM_H2O =
+      FlowEstimator::DEFAULT_COMPLIANCE_ML_PER_CM_H2O / 1000;
+  constexpr float PEEP = 5;
+  constexpr float PIP = 20;
+  // Through both venturis while the exhale valve is open.
+  constexpr float BIAS_FLOW_L_PER_SEC = 0.3f;
+
+  std::mt19937 rng(42);
+  std::normal_distribution<float> noise(0, 0.1f); // cmH2O
+
+  FlowEstimator estimator(VENTURI, VENTURI);
+  Time now = Hal.now();
+  float pressure = PEEP;
+  // Squared errors over the whole breath, and over the last 0.5s of
+  // inspiration where the flow is small.
+  double venturi_error2 = 0;
+  double estimator_error2 = 0;
+  double venturi_pause_error2 = 0;
+  double estimator_pause_error2 = 0;
+  int n = 0;
+  int pause_n = 0;
+  // Inspired volumes, in liters.
+  double true_volume = 0;
+  double venturi_volume = 0;
+  double estimated_volume = 0;
+  for (int i = 0; i < 2000; i++) {
+    // 5s breaths with 1.5s inspiration.  The pressure follows the setpoint
+    // with a 300ms time constant, limited by the blower, and the flow fills
+    // the lung.
+    int breath_sample = i % 500;
+    bool inspiring = breath_sample < 150;
+    float setpoint = inspiring ? PIP : PEEP;
+    float next_pressure =
+        pressure + (setpoint - pressure) * (1 - std::exp(-DT.seconds() / 0.3f));
+    float flow = C_L_PER_CM_H2O * (next_pressure - pressure) / DT.seconds();
+    pressure = next_pressure;
+    float bias = inspiring ? 0 : BIAS_FLOW_L_PER_SEC;
+
+    Pressure inflow_delta =
+        cmH2O(VenturiDelta(liters_per_sec(flow + bias)).cmH2O() + noise(rng));
+    Pressure outflow_delta =
+        cmH2O(VenturiDelta(liters_per_sec(bias)).cmH2O() + noise(rng));
+    Pressure patient_pressure = cmH2O(pressure + noise(rng));
+
+    now = now + DT;
+    float estimated = estimator
+                          .Update(now, inflow_delta, outflow_delta,
+                                  patient_pressure)
+                          .liters_per_sec();
+    float venturis =
+        (VENTURI.Flow(inflow_delta) - VENTURI.Flow(outflow_delta))
+            .liters_per_sec();
+
+    // Skip the first breath, while the filter settles.
+    if (i < 500) {
+      continue;
+    }
+    double e2 = (estimated - flow) * (estimated - flow);
+    double v2 = (venturis - flow) * (venturis - flow);
+    estimator_error2 += e2;
+    venturi_error2 += v2;
+    n++;
+    if (inspiring && breath_sample >= 100) {
+      estimator_pause_error2 += e2;
+      venturi_pause_error2 += v2;
+      pause_n++;
+    }
+    if (inspiring) {
+      true_volume += flow * DT.seconds();
+      venturi_volume += venturis * DT.seconds();
+      estimated_volume += estimated * DT.seconds();
+    }
+  }
+
+  double estimator_rms = std::sqrt(estimator_error2 / n);
+  double venturi_rms = std::sqrt(venturi_error2 / n);
+  EXPECT_LT(estimator_rms, 0.9 * venturi_rms)
+      << "estimator " << estimator_rms << " l/s, venturis " << venturi_rms
+      << " l/s";
+  estimator_rms = std::sqrt(estimator_pause_error2 / pause_n);
+  venturi_rms = std::sqrt(venturi_pause_error2 / pause_n);
+  EXPECT_LT(estimator_rms, 0.6 * venturi_rms)
+      << "estimator " << estimator_rms << " l/s, venturis " << venturi_rms
+      << " l/s";
+
+  // The volume is as accurate as the venturis'.  Both are off by a few
+  // percent, from the noise.
+  EXPECT_NEAR(estimated_volume, true_volume, 0.05 * true_volume);
+  EXPECT_LE(std::abs(estimated_volume - true_volume),
+            std::abs(venturi_volume - true_volume) + 0.01 * true_volume);
+}
+
+// Replays a recording, where we don't know the true flow.  Instead we compare
+// the estimate with the venturis' difference, and with that difference run
+// through a one-pole low-pass filter, which is the obvious cheap alternative.
+struct Replay {
+  std::vector<float> venturi_flow;
+  std::vector<float> low_pass_flow;
+  std::vector<float> estimated_flow;
+  // Indices of the samples where the setpoint steps up to PIP.
+  std::vector<size_t> breath_starts;
+};
+
+static constexpr float LOW_PASS_ALPHA = 0.45f;
+
+static Replay ReplayRecording(const std::vector<SampleDataRow> &rows) {
+  Replay r;
+  FlowEstimator estimator(Sensors::INFLOW_VENTURI, Sensors::OUTFLOW_VENTURI);
+  Time now = Hal.now();
+  float low_pass = 0;
+  for (size_t i = 0; i < rows.size(); i++) {
+    const SampleDataRow &row = rows[i];
+    Pressure inflow = cmH2O(row.inflow_pressure_diff_cm_h2o);
+    Pressure outflow = cmH2O(row.outflow_pressure_diff_cm_h2o);
+    now = now + milliseconds(SAMPLE_DATA_PERIOD_MS);
+    VolumetricFlow venturis = Sensors::INFLOW_VENTURI.Flow(inflow) -
+                              Sensors::OUTFLOW_VENTURI.Flow(outflow);
+    VolumetricFlow estimated = estimator.Update(
+        now, inflow, outflow, cmH2O(row.patient_pressure_cm_h2o));
+    low_pass = i == 0 ? venturis.ml_per_min()
+                      : low_pass + LOW_PASS_ALPHA *
+                                       (venturis.ml_per_min() - low_pass);
+    r.venturi_flow.push_back(venturis.ml_per_min());
+    r.low_pass_flow.push_back(low_pass);
+    r.estimated_flow.push_back(estimated.ml_per_min());
+    if (i > 0 && row.fan_setpoint_cm_h2o > rows[i - 1].fan_setpoint_cm_h2o) {
+      r.breath_starts.push_back(i);
+    }
+  }
+  return r;
+}
+
+// Index of the sample after `start` where the setpoint drops.
+static size_t InspirationEnd(const std::vector<SampleDataRow> &rows,
+                             size_t start) {
+  size_t i = start;
+  while (i + 1 < rows.size() &&
+         rows[i + 1].fan_setpoint_cm_h2o == rows[start].fan_setpoint_cm_h2o) {
+    i++;
+  }
+  return i + 1;
+}
+
+// RMS sample-to-sample change in `flow` during inspiratory pauses, i.e. from
+// 300ms after each breath starts until the setpoint drops.
+static float PauseNoise(const std::vector<SampleDataRow> &rows,
+                        const std::vector<size_t> &breath_starts,
+                        const std::vector<float> &flow) {
+  double sum = 0;
+  int n = 0;
+  for (size_t start : breath_starts) {
+    for (size_t i = start + 30; i + 1 < InspirationEnd(rows, start); i++) {
+      double d = flow[i + 1] - flow[i];
+      sum += d * d;
+      n++;
+    }
+  }
+  return static_cast<float>(std::sqrt(sum / n));
+}
+
+// Number of samples after `start` until `flow` first gets to `level`.
+static size_t SamplesToReach(const std::vector<float> &flow, size_t start,
+                             float level) {
+  size_t i = start;
+  while (i < flow.size() && flow[i] < level) {
+    i++;
+  }
+  return i - start;
+}
+
+class FlowEstimatorReplay : public testing::TestWithParam<const char *> {};
+
+TEST_P(FlowEstimatorReplay, LessNoiseLessLatency) {
+  std::vector<SampleDataRow> rows = LoadSampleData(GetParam());
+  ASSERT_GT(rows.size(), 1000u);
+  Replay r = ReplayRecording(rows);
+  ASSERT_GT(r.breath_starts.size(), 10u);
+
+  float venturi_noise = PauseNoise(rows, r.breath_starts, r.venturi_flow);
+  float low_pass_noise = PauseNoise(rows, r.breath_starts, r.low_pass_flow);
+  float estimated_noise = PauseNoise(rows, r.breath_starts, r.estimated_flow);
+  EXPECT_LT(estimated_noise, 0.4f * venturi_noise)
+      << "estimated " << estimated_noise << " ml/min, venturis "
+      << venturi_noise << " ml/min";
+  EXPECT_LT(estimated_noise, low_pass_noise)
+      << "estimated " << estimated_noise << " ml/min, low-pass "
+      << low_pass_noise << " ml/min";
+
+  // At the start of each breath the flow jumps.  The estimate gets halfway to
+  // the venturis' peak within two samples of them, and overall no later than
+  // the low-pass filter does, despite being smoother.
+  size_t estimated_delay = 0;
+  size_t low_pass_delay = 0;
+  for (size_t start : r.breath_starts) {
+    float peak = *std::max_element(r.venturi_flow.begin() + start,
+                                   r.venturi_flow.begin() + start + 20);
+    size_t venturi_at = SamplesToReach(r.venturi_flow, start, peak / 2);
+    size_t estimated_at = SamplesToReach(r.estimated_flow, start, peak / 2);
+    size_t low_pass_at = SamplesToReach(r.low_pass_flow, start, peak / 2);
+    EXPECT_LE(estimated_at, venturi_at + 2) << "breath at sample " << start;
+    estimated_delay += estimated_at - std::min(estimated_at, venturi_at);
+    low_pass_delay += low_pass_at - std::min(low_pass_at, venturi_at);
+  }
+  EXPECT_LE(estimated_delay, low_pass_delay);
+
+  // Each breath's inspired volume is about the same.  We don't know the true
+  // volume, and in the pip15 recording the venturis disagree with themselves
+  // by more than this: they measure 30% more air out than in.
+  for (size_t start : r.breath_starts) {
+    double venturi_volume = 0;
+    double estimated_volume = 0;
+    for (size_t i = start; i < InspirationEnd(rows, start); i++) {
+      venturi_volume += r.venturi_flow[i];
+      estimated_volume += r.estimated_flow[i];
+    }
+    EXPECT_NEAR(estimated_volume, venturi_volume, 0.15 * venturi_volume)
+        << "breath at sample " << start;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Recordings, FlowEstimatorReplay,
+    testing::Values("2020-05-14-pip15-peep5-rr12-ie23.csv",
+                    "2020-05-14-pip25-peep10-rr12-ie23.csv"));
+
+TEST(FlowEstimator, SensorsCanUseIt) {
+  auto set_pins = [](Pressure inflow, Pressure outflow) {
+    auto volts_for = [](Pressure p) {
+      return volts(3.3f * (0.2f * p.kPa() + 0.2f));
+    };
+    Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE, volts_for(kPa(0)));
+    Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF, volts_for(inflow));
+    Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                          volts_for(outflow));
+  };
+  set_pins(kPa(0), kPa(0));
+  Sensors sensors;
+  sensors.Calibrate();
+  sensors.SetFlowSource(Sensors::FlowSource::KALMAN);
+
+  // A steady flow: the estimate settles on what the venturis say.
+  set_pins(kPa(0.5f), kPa(0.1f));
+  SensorReadings readings;
+  for (int i = 0; i < 500; i++) {
+    Hal.delay(milliseconds(10));
+    readings = sensors.GetSensorReadings();
+  }
+  VolumetricFlow expected =
+      Sensors::INFLOW_VENTURI.Flow(kPa(0.5f)) -
+      Sensors::OUTFLOW_VENTURI.Flow(kPa(0.1f));
+  EXPECT_NEAR(readings.flow_ml_per_min, expected.ml_per_min(),
+              0.01f * expected.ml_per_min());
+}
+
+TEST(FlowEstimator, Benchmark) {
+  std::vector<SampleDataRow> rows =
+      LoadSampleData("2020-05-14-pip15-peep5-rr12-ie23.csv");
+  ASSERT_FALSE(rows.empty());
+  size_t i = 0;
+  RunBenchmark("venturi difference", 10000, [&] {
+    const SampleDataRow &row = rows[i++ % rows.size()];
+    DoNotOptimize(
+        Sensors::INFLOW_VENTURI.Flow(cmH2O(row.inflow_pressure_diff_cm_h2o)) -
+        Sensors::OUTFLOW_VENTURI.Flow(
+            cmH2O(row.outflow_pressure_diff_cm_h2o)));
+  });
+  FlowEstimator estimator(Sensors::INFLOW_VENTURI, Sensors::OUTFLOW_VENTURI);
+  Time now = Hal.now();
+  RunBenchmark("FlowEstimator::Update", 10000, [&] {
+    const SampleDataRow &row = rows[i++ % rows.size()];
+    now = now + milliseconds(SAMPLE_DATA_PERIOD_MS);
+    DoNotOptimize(estimator.Update(now,
+                                   cmH2O(row.inflow_pressure_diff_cm_h2o),
+                                   cmH2O(row.outflow_pressure_diff_cm_h2o),
+                                   cmH2O(row.patient_pressure_cm_h2o)));
+  });
+}
@@ -0,0 +1,124 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "hal.h"
+#include "gtest/gtest.h"
+
+TEST(InterruptMask, NothingMasked) {
+  EXPECT_FALSE(Hal.InInterruptHandler());
+  EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+  EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+  EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::LOW));
+}
+
+TEST(InterruptMask, BlockInterruptsBlocksEverything) {
+  BlockInterrupts block;
+  EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+  EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+  EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::LOW));
+}
+
+// Masking the control loop leaves the hardware interrupts enabled.
+TEST(InterruptMask, MaskLow) {
+  {
+    MaskInterrupts mask(IntPriority::LOW);
+    EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+    EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+    EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::LOW));
+  }
+  EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::LOW));
+}
+
+TEST(InterruptMask, Nesting) {
+  {
+    MaskInterrupts outer(IntPriority::STANDARD);
+    EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+    {
+      // A weaker mask doesn't unmask anything.
+      MaskInterrupts inner(IntPriority::LOW);
+      EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+      EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+      {
+        MaskInterrupts innermost(IntPriority::CRITICAL);
+        EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+      }
+      EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+    }
+    EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+  }
+  EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+}
+
+// Inside an interrupt handler, only more important interrupts can preempt.
+TEST(InterruptMask, InterruptHandler) {
+  static bool ran;
+  ran = false;
+  Hal.test_runInterrupt(
+      IntPriority::STANDARD,
+      [](void *) {
+        ran = true;
+        EXPECT_TRUE(Hal.InInterruptHandler());
+        EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::CRITICAL));
+        EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+        EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::LOW));
+      },
+      nullptr);
+  EXPECT_TRUE(ran);
+  EXPECT_FALSE(Hal.InInterruptHandler());
+}
+
+// A masked interrupt can't run.
+TEST(InterruptMask, MaskedInterruptThrows) {
+  MaskInterrupts mask(IntPriority::LOW);
+  EXPECT_ANY_THROW(
+      Hal.test_runInterrupt(IntPriority::LOW, [](void *) {}, nullptr));
+  EXPECT_NO_THROW(
+      Hal.test_runInterrupt(IntPriority::STANDARD, [](void *) {}, nullptr));
+}
+
+// This is the situation in main.cpp's background loop: while it copies data
+// shared with the control loop, UART interrupts can still come in, but the
+// control loop timer interrupt is held off.
+TEST(InterruptMask, ControlLoopHeldOffByBackgroundCopy) {
+  static bool loop_ran;
+  loop_ran = false;
+  Hal.startLoopTimer(milliseconds(10), [](void *) { loop_ran = true; },
+                     nullptr);
+  {
+    MaskInterrupts mask(IntPriority::LOW);
+    EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+    EXPECT_ANY_THROW(Hal.test_fireLoopTimer());
+    EXPECT_FALSE(loop_ran);
+  }
+  Hal.test_fireLoopTimer();
+  EXPECT_TRUE(loop_ran);
+}
+
+// The control loop itself runs at low priority, so hardware interrupts can
+// preempt it.
+TEST(InterruptMask, ControlLoopPreemptible) {
+  static bool checked;
+  checked = false;
+  Hal.startLoopTimer(
+      milliseconds(10),
+      [](void *) {
+        checked = true;
+        EXPECT_TRUE(Hal.interruptCanPreempt(IntPriority::STANDARD));
+        EXPECT_FALSE(Hal.interruptCanPreempt(IntPriority::LOW));
+      },
+      nullptr);
+  Hal.test_fireLoopTimer();
+  EXPECT_TRUE(checked);
+}
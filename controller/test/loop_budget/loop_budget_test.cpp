@@ -0,0 +1,130 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Benchmarks ControlLoop::Tick(), i.e. what high_priority_task runs on each
+// loop timer interrupt, at every supported loop rate.
+//
+// Not every rate group runs on every tick, so the mean tick understates the
+// worst one.  We budget for a tick on which every group runs: the part of a
+// tick outside the groups (publishing the status, driving the actuators,
+// petting the watchdog), plus each group's mean time, from the same stats
+// the controller sends to the GUI.
+//
+// We can't run on the STM32 here, so we estimate: the host is assumed to be
+// at most TARGET_SLOWDOWN times faster than the 80MHz Cortex-M4, and the
+// control loop gets at most LOOP_BUDGET_FRACTION of each period, leaving the
+// rest for hardware interrupts and the background loop.  Like the other
+// benchmarks, this is only checked in the native-bench env; the sanitizers
+// slow some code down far more than others.  The real numbers are measured
+// on the device and reported in ControllerStatus.loop_timing.
+
+#include "benchmark.h"
+#include "control_loop.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+#include <string>
+
+static constexpr double TARGET_SLOWDOWN = 50;
+static constexpr double LOOP_BUDGET_FRACTION = 0.5;
+
+static constexpr struct {
+  ControlGroup group;
+  const char *name;
+} GROUPS[] = {
+    {ControlGroup::FAST, "fast group"},
+    {ControlGroup::PRESSURE, "pressure group"},
+    {ControlGroup::ALARMS, "alarms group"},
+    {ControlGroup::SNAPSHOT, "snapshot group"},
+};
+
+static Voltage PressureToVoltage(Pressure p) {
+  return volts(3.3f * (0.2f * p.kPa() + 0.2f));
+}
+
+class LoopBudget : public ::testing::TestWithParam<LoopRate> {};
+
+TEST_P(LoopBudget, FitsInPeriod) {
+  LoopRate rate = GetParam();
+  Duration period = LoopPeriod(rate);
+
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, PressureToVoltage(kPa(0)));
+  }
+  // Sets up the actuators' pins.
+  Hal.init();
+
+  ControlLoopIO io;
+  WarmRestartSnapshot<ControlLoopSnapshot> snapshot{};
+  ControlLoop loop(rate, &io, &snapshot, [] {});
+  loop.Calibrate();
+
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_PRESSURE_CONTROL;
+  params.breaths_per_min = 12;
+  params.peep_cm_h2o = 5;
+  params.pip_cm_h2o = 15;
+  params.inspiratory_expiratory_ratio = 0.66f;
+  io.active_params.Publish(params);
+  loop.Start();
+
+  // Sweep the sensors through a range of pressures so the controller sees
+  // something like a breath.
+  int i = 0;
+  std::string name = "control loop tick @ " +
+                     std::to_string(1000000 / period.microseconds()) + "Hz";
+  double tick_ns = RunBenchmark(name.c_str(), 10000, [&] {
+    Hal.delay(period);
+    float p_kpa = static_cast<float>(i++ % 200) / 100.0f;
+    Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                          PressureToVoltage(kPa(p_kpa)));
+    Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                          PressureToVoltage(kPa(p_kpa / 10)));
+    loop.Tick();
+  });
+
+  // In test mode cycleCount() ticks are nanoseconds.
+  double outside_groups_ns = tick_ns;
+  double worst_tick_ns = 0;
+  for (const auto &[group, group_name] : GROUPS) {
+    double group_ns = loop.GroupStats(group).Mean();
+    int divider = loop.GroupDivider(group);
+    outside_groups_ns -= group_ns / divider;
+    worst_tick_ns += group_ns;
+    printf("[ BENCH    ]   %-38s %10.1f ns/run, every %d ticks\n", group_name,
+           group_ns, divider);
+  }
+  worst_tick_ns += std::max(outside_groups_ns, 0.0);
+  printf("[ BENCH    ]   %-38s %10.1f ns\n", "worst tick", worst_tick_ns);
+
+  double budget_ns = LOOP_BUDGET_FRACTION * period.seconds() * 1e9;
+  if (!SANITIZED) {
+    EXPECT_LT(worst_tick_ns * TARGET_SLOWDOWN, budget_ns);
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(AllRates, LoopBudget,
+                         ::testing::Values(LoopRate::HZ_100, LoopRate::HZ_250,
+                                           LoopRate::HZ_500,
+                                           LoopRate::HZ_1000));
+
+// The rest of the system derives its timing from the loop period.
+TEST(LoopRate, Periods) {
+  EXPECT_EQ(LoopPeriod(LoopRate::HZ_100), milliseconds(10));
+  EXPECT_EQ(LoopPeriod(LoopRate::HZ_250), milliseconds(4));
+  EXPECT_EQ(LoopPeriod(LoopRate::HZ_500), milliseconds(2));
+  EXPECT_EQ(LoopPeriod(LoopRate::HZ_1000), milliseconds(1));
+}
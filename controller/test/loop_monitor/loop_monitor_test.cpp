@@ -0,0 +1,177 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "hal.h"
+#include "loop_monitor.h"
+#include "gtest/gtest.h"
+
+static constexpr uint32_t PERIOD = 1000;
+
+// Runs one tick which enters at `entry` and takes `run_time` ticks.
+static void Tick(LoopMonitor *m, uint32_t entry, uint32_t run_time = 10) {
+  m->OnEntry(entry);
+  m->OnExit(entry + run_time);
+}
+
+TEST(LoopMonitor, OnTime) {
+  LoopMonitor m;
+  m.Start(PERIOD, 1);
+  for (uint32_t i = 0; i < 10; i++) {
+    Tick(&m, 5000 + i * PERIOD);
+  }
+  EXPECT_EQ(m.Ticks(), 10u);
+  EXPECT_EQ(m.Overruns(), 0u);
+  EXPECT_EQ(m.MissedTicks(), 0u);
+  EXPECT_EQ(m.Jitter().Max(), 0u);
+  EXPECT_FALSE(m.AlarmActive());
+}
+
+TEST(LoopMonitor, Jitter) {
+  LoopMonitor m;
+  m.Start(PERIOD, 10);
+  Tick(&m, 0);
+  Tick(&m, PERIOD + 30);      // 30 late
+  Tick(&m, 2 * PERIOD - 20);  // 20 early
+  Tick(&m, 3 * PERIOD + 300); // 300 late
+
+  const StageTimingStats &jitter = m.Jitter();
+  EXPECT_EQ(jitter.Count(), 4u);
+  EXPECT_EQ(jitter.Max(), 300u);
+  EXPECT_EQ(jitter.Histogram(StageTimingStats::Bucket(0)), 1u);
+  EXPECT_EQ(jitter.Histogram(StageTimingStats::Bucket(20)), 2u);
+  EXPECT_EQ(jitter.Histogram(StageTimingStats::Bucket(300)), 1u);
+  EXPECT_FLOAT_EQ(m.MaxJitterMicroseconds(), 30.0f);
+
+  // Lateness doesn't accumulate: we're measured against the schedule, not
+  // the previous entry.
+  Tick(&m, 4 * PERIOD);
+  EXPECT_EQ(m.Jitter().Max(), 300u);
+  EXPECT_EQ(m.MissedTicks(), 0u);
+}
+
+TEST(LoopMonitor, Overrun) {
+  LoopMonitor m;
+  m.Start(PERIOD, 1);
+  Tick(&m, 0, PERIOD - 1);
+  EXPECT_EQ(m.Overruns(), 0u);
+  Tick(&m, PERIOD, PERIOD);
+  EXPECT_EQ(m.Overruns(), 1u);
+
+  // The next tick is late because of the overrun, and runs past its own
+  // deadline as well.
+  Tick(&m, 2 * PERIOD + 5, PERIOD - 2);
+  EXPECT_EQ(m.Overruns(), 2u);
+  EXPECT_EQ(m.MissedTicks(), 0u);
+}
+
+TEST(LoopMonitor, MissedTicks) {
+  LoopMonitor m;
+  m.Start(PERIOD, 1);
+  Tick(&m, 0, 3 * PERIOD + 100);
+  EXPECT_EQ(m.Overruns(), 1u);
+
+  // Ticks at PERIOD and 2 * PERIOD are lost, the tick at 3 * PERIOD runs
+  // late.
+  Tick(&m, 3 * PERIOD + 110);
+  EXPECT_EQ(m.MissedTicks(), 2u);
+  EXPECT_EQ(m.Jitter().Max(), 110u);
+
+  // After that we're back on schedule.
+  Tick(&m, 4 * PERIOD);
+  EXPECT_EQ(m.MissedTicks(), 2u);
+  EXPECT_EQ(m.Ticks(), 3u);
+}
+
+TEST(LoopMonitor, CounterWraps) {
+  LoopMonitor m;
+  m.Start(PERIOD, 1);
+  uint32_t start = UINT32_MAX - PERIOD / 2;
+  for (uint32_t i = 0; i < 5; i++) {
+    Tick(&m, start + i * PERIOD + i % 2);
+  }
+  EXPECT_EQ(m.Overruns(), 0u);
+  EXPECT_EQ(m.MissedTicks(), 0u);
+  EXPECT_EQ(m.Jitter().Max(), 1u);
+}
+
+TEST(LoopMonitor, Alarm) {
+  LoopMonitor m;
+  m.Start(PERIOD, 1);
+  uint32_t t = 0;
+
+  // Exactly ALARM_THRESHOLD overruns in a window is tolerated.
+  for (uint32_t i = 0; i < LoopMonitor::ALARM_WINDOW; i++, t += PERIOD) {
+    Tick(&m, t, i < LoopMonitor::ALARM_THRESHOLD ? PERIOD : 10);
+  }
+  EXPECT_EQ(m.Overruns(), LoopMonitor::ALARM_THRESHOLD);
+  EXPECT_FALSE(m.AlarmActive());
+
+  // One more than that trips the alarm as soon as it happens.
+  for (uint32_t i = 0; i <= LoopMonitor::ALARM_THRESHOLD; i++, t += PERIOD) {
+    EXPECT_FALSE(m.AlarmActive());
+    Tick(&m, t, PERIOD);
+  }
+  EXPECT_TRUE(m.AlarmActive());
+
+  // The alarm stays latched until the end of the next clean window.
+  uint32_t ticks_in_window = LoopMonitor::ALARM_THRESHOLD + 1;
+  for (; ticks_in_window < LoopMonitor::ALARM_WINDOW; ticks_in_window++) {
+    Tick(&m, t, 10);
+    t += PERIOD;
+  }
+  EXPECT_TRUE(m.AlarmActive());
+  for (uint32_t i = 0; i < LoopMonitor::ALARM_WINDOW - 1; i++, t += PERIOD) {
+    Tick(&m, t, 10);
+    EXPECT_TRUE(m.AlarmActive());
+  }
+  Tick(&m, t, 10);
+  EXPECT_FALSE(m.AlarmActive());
+}
+
+// Drive the monitor through the HAL's fake loop timer.
+static Duration callback_run_time = milliseconds(1);
+static int callback_count = 0;
+static void LoopCallback(void *arg) {
+  EXPECT_EQ(arg, &callback_count);
+  callback_count++;
+  Hal.delay(callback_run_time);
+}
+
+TEST(LoopMonitor, FakeLoopTimer) {
+  Hal.startLoopTimer(milliseconds(10), LoopCallback, &callback_count);
+  for (int i = 0; i < 5; i++) {
+    Time start = Hal.now();
+    Hal.test_fireLoopTimer();
+    Hal.delay(milliseconds(10) - (Hal.now() - start));
+  }
+  EXPECT_EQ(callback_count, 5);
+  EXPECT_EQ(Hal.loopMonitor().Ticks(), 5u);
+  EXPECT_EQ(Hal.loopMonitor().Overruns(), 0u);
+  EXPECT_EQ(Hal.loopMonitor().Jitter().Max(), 0u);
+
+  // Now take 2.5 times the loop period.  The tick due 10ms in is lost, the
+  // one due 20ms in stays pending and runs 5ms late.
+  callback_run_time = milliseconds(25);
+  Hal.test_fireLoopTimer();
+  EXPECT_EQ(Hal.loopMonitor().Overruns(), 1u);
+  callback_run_time = milliseconds(1);
+  Hal.test_fireLoopTimer();
+  EXPECT_EQ(Hal.loopMonitor().MissedTicks(), 1u);
+  EXPECT_FLOAT_EQ(Hal.loopMonitor().MaxJitterMicroseconds(), 5000.0f);
+
+  // Restarting the timer resets the statistics.
+  Hal.startLoopTimer(milliseconds(10), LoopCallback, &callback_count);
+  EXPECT_EQ(Hal.loopMonitor().Ticks(), 0u);
+}
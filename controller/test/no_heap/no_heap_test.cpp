@@ -0,0 +1,203 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// The control loop and comms run without a heap: the STM32 build has none,
+// and allocating in an interrupt handler isn't safe anyway.  These tests run
+// each function on the hot path over a few simulated breaths and check that
+// none of them ever allocates, so that e.g. a std::function or a growing
+// container is caught as soon as it's introduced.
+//
+// The fake HAL keeps its state in std containers, so a few tests have to
+// warm it up first; the counts only cover the code under test.
+
+#include "alloc_counter.h"
+#include "benchmark.h"
+#include "blower_fsm.h"
+#include "comms.h"
+#include "controller.h"
+#include "hal.h"
+#include "network_protocol.pb.h"
+#include "pid.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <pb_encode.h>
+#include <vector>
+
+static constexpr Duration LOOP_PERIOD = milliseconds(10);
+
+// Long enough for a handful of breaths at 15 breaths/min.
+static constexpr int LOOP_ITERATIONS = 2000;
+
+static Voltage PressureToVoltage(Pressure p) {
+  return volts(3.3f * (0.2f * p.kPa() + 0.2f));
+}
+
+static VentParams PressureControlParams() {
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_PRESSURE_CONTROL;
+  params.breaths_per_min = 15;
+  params.peep_cm_h2o = 5;
+  params.pip_cm_h2o = 15;
+  params.inspiratory_expiratory_ratio = 0.66f;
+  return params;
+}
+
+static void SetPressures(int i) {
+  float p_kpa = static_cast<float>(i % 200) / 100.0f;
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        PressureToVoltage(kPa(p_kpa)));
+  Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                        PressureToVoltage(kPa(p_kpa / 10)));
+  Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                        PressureToVoltage(kPa(p_kpa / 20)));
+}
+
+// Make sure we're actually able to see allocations; otherwise the other
+// tests would pass trivially.
+TEST(NoHeap, CounterSeesAllocations) {
+  EXPECT_EQ(CountAllocations([] {}), 0);
+  EXPECT_GE(CountAllocations([] {
+              std::vector<int> v(100);
+              DoNotOptimize(v.data());
+            }),
+            1);
+  EXPECT_GE(CountAllocations([] {
+              auto *p = new int(42);
+              DoNotOptimize(p);
+              delete p;
+            }),
+            1);
+  EXPECT_GE(CountAllocations([] {
+              void *p = malloc(16);
+              DoNotOptimize(p);
+              free(p);
+            }),
+            1);
+}
+
+TEST(NoHeap, PidCompute) {
+  PID pid(/*kp=*/1, /*ki=*/1, /*kd=*/1, ProportionalTerm::ON_ERROR,
+          DifferentialTerm::ON_MEASUREMENT, ControlDirection::DIRECT,
+          /*output_min=*/0, /*output_max=*/1, LOOP_PERIOD);
+  int64_t allocations = 0;
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    Hal.delay(LOOP_PERIOD);
+    float input = static_cast<float>(i % 100) / 100.0f;
+    allocations +=
+        CountAllocations([&] { pid.Compute(Hal.now(), input, 0.5f); });
+  }
+  EXPECT_EQ(allocations, 0);
+}
+
+TEST(NoHeap, BlowerFsmDesiredState) {
+  BlowerFsm fsm;
+  VentParams off = VentParams_init_zero;
+  off.mode = VentMode_OFF;
+  VentParams pc = PressureControlParams();
+
+  // Switch modes along the way, so we construct every kind of FSM.
+  int64_t allocations = 0;
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    Hal.delay(LOOP_PERIOD);
+    const VentParams &params = (i / 500) % 2 == 0 ? pc : off;
+    allocations += CountAllocations([&] {
+      BlowerSystemState s = fsm.DesiredState(Hal.now(), params);
+      DoNotOptimize(s);
+    });
+  }
+  EXPECT_EQ(allocations, 0);
+}
+
+TEST(NoHeap, SensorsGetSensorReadings) {
+  SetPressures(0);
+  Sensors sensors;
+  sensors.Calibrate();
+
+  int64_t allocations = 0;
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    Hal.delay(LOOP_PERIOD);
+    SetPressures(i);
+    allocations += CountAllocations([&] {
+      SensorReadings readings = sensors.GetSensorReadings();
+      DoNotOptimize(readings);
+    });
+  }
+  EXPECT_EQ(allocations, 0);
+}
+
+TEST(NoHeap, ControllerRun) {
+  SetPressures(0);
+  Controller controller(LOOP_PERIOD);
+  Sensors sensors;
+  sensors.Calibrate();
+  VentParams params = PressureControlParams();
+
+  int64_t allocations = 0;
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    Hal.delay(LOOP_PERIOD);
+    SetPressures(i);
+    SensorReadings readings = sensors.GetSensorReadings();
+    allocations += CountAllocations([&] {
+      ActuatorsState state = controller.Run(Hal.now(), params, readings);
+      DoNotOptimize(state);
+    });
+  }
+  EXPECT_EQ(allocations, 0);
+}
+
+TEST(NoHeap, CommsHandler) {
+  ControllerStatus status = ControllerStatus_init_zero;
+  status.active_params = PressureControlParams();
+  status.sensor_readings.patient_pressure_cm_h2o = 11;
+  status.sensor_readings.volume_ml = 800;
+  status.sensor_readings.flow_ml_per_min = 1000;
+
+  GuiStatus gui_status = GuiStatus_init_zero;
+  gui_status.desired_params = PressureControlParams();
+  char rx_buffer[GuiStatus_size];
+  pb_ostream_t stream = pb_ostream_from_buffer(
+      reinterpret_cast<unsigned char *>(rx_buffer), sizeof(rx_buffer));
+  ASSERT_TRUE(pb_encode(&stream, GuiStatus_fields, &gui_status));
+  uint16_t rx_len = static_cast<uint16_t>(stream.bytes_written);
+
+  // The fake serial port buffers outgoing bytes in a std::vector.  Let it
+  // grow to the size of a whole message before we start counting.
+  char tx_buffer[ControllerStatus_size];
+  for (int i = 0; i < 100; i++) {
+    GuiStatus ignored = GuiStatus_init_zero;
+    comms_handler(status, &ignored);
+    Hal.delay(LOOP_PERIOD);
+  }
+  while (Hal.test_serialGetOutgoingData(tx_buffer, sizeof(tx_buffer)) > 0) {
+  }
+
+  int64_t allocations = 0;
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    // Receive a GuiStatus every so often.  Queuing it up allocates in the
+    // fake HAL, so it's not counted.
+    if (i % 10 == 0) {
+      Hal.test_serialPutIncomingData(rx_buffer, rx_len);
+    }
+    status.uptime_ms = static_cast<uint32_t>(i);
+    GuiStatus received = GuiStatus_init_zero;
+    allocations += CountAllocations([&] { comms_handler(status, &received); });
+    Hal.delay(LOOP_PERIOD);
+
+    // Drain what was sent, as the GUI would.
+    while (Hal.test_serialGetOutgoingData(tx_buffer, sizeof(tx_buffer)) > 0) {
+    }
+  }
+  EXPECT_EQ(allocations, 0);
+}
@@ -22,8 +22,11 @@ limitations under the License.
  */
 
 #include "pid.h"
+#include "benchmark.h"
 #include "types.h"
 #include "gtest/gtest.h"
+#include <cmath>
+#include <random>
 
 // The PWM is a 0-255 integer, which means we can accept error of 1 in output
 inline constexpr float OUTPUT_TOLERANCE = 1;
@@ -211,3 +214,170 @@ TEST(PidTest, Observe) {
   EXPECT_OUTPUT(pid.Compute(ticks(t++), input, setpoint),
                 128 + 10 + integral * Ki);
 }
+
+// The PID as it was before its terms could be fixed at compile time: it
+// branches on them, and on the direction, every step.
+class ReferencePID {
+public:
+  ReferencePID(float kp, float ki, float kd, ProportionalTerm p_term,
+               DifferentialTerm d_term, ControlDirection direction,
+               float output_min, float output_max, Duration sample_period)
+      : kp_(kp), ki_(ki), kd_(kd), p_term_(p_term), d_term_(d_term),
+        direction_(direction), out_min_(output_min), out_max_(output_max),
+        sample_period_(sample_period) {}
+
+  float Compute(Time now, float input, float setpoint) {
+    if (!initialized_) {
+      last_input_ = input;
+      last_error_ = setpoint - input;
+      initialized_ = true;
+    }
+    float dt = sample_period_.seconds();
+    float error = setpoint - input;
+    float d_input = 0;
+    float kp = kp_, ki = ki_, kd = kd_;
+    if (direction_ == ControlDirection::REVERSE) {
+      kp = -kp_;
+      ki = -ki_;
+      kd = -kd_;
+    }
+    if (p_term_ == ProportionalTerm::ON_MEASUREMENT ||
+        d_term_ == DifferentialTerm::ON_MEASUREMENT) {
+      d_input = input - last_input_;
+    }
+    output_sum_ += ki * error * dt;
+    if (p_term_ == ProportionalTerm::ON_MEASUREMENT) {
+      output_sum_ -= kp * d_input;
+    }
+    output_sum_ = std::clamp(output_sum_, out_min_, out_max_);
+    float res = output_sum_;
+    if (p_term_ == ProportionalTerm::ON_ERROR) {
+      res += kp * error;
+    }
+    if (d_term_ == DifferentialTerm::ON_MEASUREMENT) {
+      res -= kd * d_input / dt;
+    } else {
+      res += kd * (error - last_error_) / dt;
+    }
+    last_input_ = input;
+    last_error_ = error;
+    return std::clamp(res, out_min_, out_max_);
+  }
+
+private:
+  const float kp_, ki_, kd_;
+  const ProportionalTerm p_term_;
+  const DifferentialTerm d_term_;
+  const ControlDirection direction_;
+  const float out_min_, out_max_;
+  const Duration sample_period_;
+  bool initialized_ = false;
+  float output_sum_ = 0;
+  float last_input_ = 0;
+  float last_error_ = 0;
+};
+
+// Runs `pid` and a ReferencePID with the same settings through a random walk
+// of inputs and setpoints, and checks they agree.  The gains are scaled by
+// the sample period once rather than every step, so they can differ in the
+// last bits.
+template <class Pid>
+static void ExpectMatchesReference(Pid &pid, ProportionalTerm p_term,
+                                   DifferentialTerm d_term,
+                                   ControlDirection direction) {
+  ReferencePID reference(1.5f, 2.5f, 0.05f, p_term, d_term, direction,
+                         MIN_OUTPUT, MAX_OUTPUT, sample_period);
+  std::mt19937 rng(42);
+  std::normal_distribution<float> step(0, 2);
+  float input = 50;
+  float setpoint = 60;
+  for (int t = 0; t < 1000; t++) {
+    input += step(rng);
+    if (t % 100 == 0) {
+      setpoint = 30 + std::abs(step(rng)) * 20;
+    }
+    float expected = reference.Compute(ticks(t), input, setpoint);
+    ASSERT_NEAR(pid.Compute(ticks(t), input, setpoint), expected, 1e-3f)
+        << "step " << t;
+  }
+}
+
+template <ProportionalTerm P, DifferentialTerm D, ControlDirection DIR>
+static void ExpectBothMatchReference() {
+  SCOPED_TRACE(testing::Message()
+               << "p_term " << static_cast<int>(P) << " d_term "
+               << static_cast<int>(D) << " direction "
+               << static_cast<int>(DIR));
+  PID runtime(1.5f, 2.5f, 0.05f, P, D, DIR, MIN_OUTPUT, MAX_OUTPUT,
+              sample_period);
+  ExpectMatchesReference(runtime, P, D, DIR);
+  FixedModePID<P, D, DIR> fixed(1.5f, 2.5f, 0.05f, MIN_OUTPUT, MAX_OUTPUT,
+                                sample_period);
+  ExpectMatchesReference(fixed, P, D, DIR);
+}
+
+TEST(PidTest, EveryModeMatchesReference) {
+  using P = ProportionalTerm;
+  using D = DifferentialTerm;
+  using Dir = ControlDirection;
+  ExpectBothMatchReference<P::ON_ERROR, D::ON_ERROR, Dir::DIRECT>();
+  ExpectBothMatchReference<P::ON_ERROR, D::ON_MEASUREMENT, Dir::DIRECT>();
+  ExpectBothMatchReference<P::ON_MEASUREMENT, D::ON_ERROR, Dir::DIRECT>();
+  ExpectBothMatchReference<P::ON_MEASUREMENT, D::ON_MEASUREMENT,
+                           Dir::DIRECT>();
+  ExpectBothMatchReference<P::ON_ERROR, D::ON_ERROR, Dir::REVERSE>();
+  ExpectBothMatchReference<P::ON_ERROR, D::ON_MEASUREMENT, Dir::REVERSE>();
+  ExpectBothMatchReference<P::ON_MEASUREMENT, D::ON_ERROR, Dir::REVERSE>();
+  ExpectBothMatchReference<P::ON_MEASUREMENT, D::ON_MEASUREMENT,
+                           Dir::REVERSE>();
+}
+
+// Cost of a step of each kind of PID, in the control loop's configuration and
+// in a reversed one.  On the STM32, the stm32-test environment prints the
+// same comparison in cycles, see src_test/pid_benchmark.cpp.
+template <ProportionalTerm P, DifferentialTerm D, ControlDirection DIR>
+static void BenchmarkPids(const char *mode) {
+  ReferencePID reference(1.5f, 2.5f, 0.05f, P, D, DIR, MIN_OUTPUT, MAX_OUTPUT,
+                         sample_period);
+  PID runtime(1.5f, 2.5f, 0.05f, P, D, DIR, MIN_OUTPUT, MAX_OUTPUT,
+              sample_period);
+  FixedModePID<P, D, DIR> fixed(1.5f, 2.5f, 0.05f, MIN_OUTPUT, MAX_OUTPUT,
+                                sample_period);
+
+  // Inputs which wander around the setpoint, so the output doesn't saturate.
+  constexpr int N = 256;
+  float inputs[N];
+  for (int i = 0; i < N; i++) {
+    inputs[i] = 50 + 5 * std::sin(static_cast<float>(i) / 10);
+  }
+
+  char name[64];
+  int i = 0;
+  snprintf(name, sizeof(name), "PID, branching (%s)", mode);
+  double reference_ns = RunBenchmark(name, 1000000, [&] {
+    DoNotOptimize(reference.Compute(ticks(0), inputs[i++ % N], 50));
+  });
+  snprintf(name, sizeof(name), "PID, runtime modes (%s)", mode);
+  double runtime_ns = RunBenchmark(name, 1000000, [&] {
+    DoNotOptimize(runtime.Compute(ticks(0), inputs[i++ % N], 50));
+  });
+  snprintf(name, sizeof(name), "PID, fixed modes (%s)", mode);
+  double fixed_ns = RunBenchmark(name, 1000000, [&] {
+    DoNotOptimize(fixed.Compute(ticks(0), inputs[i++ % N], 50));
+  });
+
+  // Host timings of a few nanoseconds are noisy, so only check for gross
+  // regressions: neither new PID should be much slower than the old one.
+  // Like the other timing checks, only in the native-bench env.
+  if (!SANITIZED) {
+    EXPECT_LT(fixed_ns, 2 * reference_ns);
+    EXPECT_LT(runtime_ns, 2 * reference_ns);
+  }
+}
+
+TEST(PidTest, Benchmark) {
+  BenchmarkPids<ProportionalTerm::ON_ERROR, DifferentialTerm::ON_MEASUREMENT,
+                ControlDirection::DIRECT>("controller");
+  BenchmarkPids<ProportionalTerm::ON_MEASUREMENT, DifferentialTerm::ON_ERROR,
+                ControlDirection::REVERSE>("reversed");
+}
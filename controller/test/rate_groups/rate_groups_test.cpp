@@ -0,0 +1,183 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "rate_groups.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace {
+
+// Each group appends its index and the current tick to the log it's given.
+struct Log {
+  int tick = 0;
+  std::vector<std::pair<int, int>> runs;
+
+  int Count(int group) const {
+    int n = 0;
+    for (auto &r : runs) {
+      n += r.first == group;
+    }
+    return n;
+  }
+};
+
+template <int N> void Record(void *arg) {
+  Log &log = *static_cast<Log *>(arg);
+  log.runs.push_back({N, log.tick});
+}
+
+constexpr RateGroup groups[] = {
+    {.name = "fast", .run = Record<0>, .period = milliseconds(1)},
+    {.name = "pressure", .run = Record<1>, .period = milliseconds(10)},
+    {.name = "alarms", .run = Record<2>, .period = milliseconds(100)},
+};
+
+void RunTicks(RateGroups &rg, Log &log, int ticks) {
+  for (int i = 0; i < ticks; i++) {
+    rg.Tick(&log);
+    log.tick++;
+  }
+}
+
+} // anonymous namespace
+
+TEST(RateGroups, DividerAndPeriod) {
+  static_assert(RateGroupDivider(milliseconds(100), milliseconds(1)) == 100);
+  static_assert(RateGroupDivider(milliseconds(1), milliseconds(10)) == 1);
+  // Rounds down: better to run a bit fast than a bit slow.
+  static_assert(RateGroupDivider(milliseconds(10), milliseconds(4)) == 2);
+  static_assert(RateGroupPeriod(milliseconds(10), milliseconds(4)) ==
+                milliseconds(8));
+  static_assert(RateGroupPeriod(milliseconds(10), milliseconds(2)) ==
+                milliseconds(10));
+  // Sub-millisecond loop periods work too.
+  static_assert(RateGroupDivider(milliseconds(1), microseconds(250)) == 4);
+  static_assert(RateGroupDivider(milliseconds(10), microseconds(300)) == 33);
+  static_assert(RateGroupDivider(microseconds(100), microseconds(250)) == 1);
+}
+
+TEST(RateGroups, Dividers) {
+  RateGroups rg(groups);
+
+  rg.Start(milliseconds(1));
+  EXPECT_EQ(rg.Divider(0), 1);
+  EXPECT_EQ(rg.Divider(1), 10);
+  EXPECT_EQ(rg.Divider(2), 100);
+
+  rg.Start(milliseconds(4));
+  EXPECT_EQ(rg.Divider(0), 1);
+  // 10ms isn't a multiple of 4ms, so we run faster rather than slower.
+  EXPECT_EQ(rg.Divider(1), 2);
+  EXPECT_EQ(rg.Divider(2), 25);
+
+  rg.Start(milliseconds(10));
+  EXPECT_EQ(rg.Divider(0), 1);
+  EXPECT_EQ(rg.Divider(1), 1);
+  EXPECT_EQ(rg.Divider(2), 10);
+}
+
+TEST(RateGroups, RunCounts) {
+  for (LoopRate rate : {LoopRate::HZ_100, LoopRate::HZ_500,
+                        LoopRate::HZ_1000}) {
+    Duration period = LoopPeriod(rate);
+    SCOPED_TRACE(period.milliseconds());
+
+    RateGroups rg(groups);
+    rg.Start(period);
+    Log log;
+    // One second's worth of ticks.
+    int ticks = static_cast<int>(1000 / period.milliseconds());
+    RunTicks(rg, log, ticks);
+
+    EXPECT_EQ(log.Count(0), ticks);
+    EXPECT_EQ(log.Count(1), 100);
+    EXPECT_EQ(log.Count(2), 10);
+  }
+}
+
+TEST(RateGroups, EvenlySpacedAndStaggered) {
+  RateGroups rg(groups);
+  rg.Start(milliseconds(1));
+  Log log;
+  RunTicks(rg, log, 1000);
+
+  std::vector<int> pressure_ticks, alarm_ticks;
+  for (auto &r : log.runs) {
+    if (r.first == 1) {
+      pressure_ticks.push_back(r.second);
+    } else if (r.first == 2) {
+      alarm_ticks.push_back(r.second);
+    }
+  }
+  for (size_t i = 1; i < pressure_ticks.size(); i++) {
+    EXPECT_EQ(pressure_ticks[i] - pressure_ticks[i - 1], 10);
+  }
+  for (size_t i = 1; i < alarm_ticks.size(); i++) {
+    EXPECT_EQ(alarm_ticks[i] - alarm_ticks[i - 1], 100);
+  }
+
+  // The slow groups never run on the same tick.
+  for (int t : alarm_ticks) {
+    EXPECT_NE(t % 10, pressure_ticks[0] % 10);
+  }
+}
+
+TEST(RateGroups, OrderWithinTick) {
+  RateGroups rg(groups);
+  rg.Start(milliseconds(10));
+  Log log;
+  RunTicks(rg, log, 1);
+  // At 100Hz the fast and pressure groups both run on the first tick, in
+  // table order.
+  ASSERT_EQ(log.runs.size(), 2u);
+  EXPECT_EQ(log.runs[0].first, 0);
+  EXPECT_EQ(log.runs[1].first, 1);
+}
+
+TEST(RateGroups, Stats) {
+  RateGroups rg(groups);
+  rg.Start(milliseconds(1));
+  Log log;
+  RunTicks(rg, log, 200);
+  EXPECT_EQ(rg.Stats(0).Count(), 200u);
+  EXPECT_EQ(rg.Stats(1).Count(), 20u);
+  EXPECT_EQ(rg.Stats(2).Count(), 2u);
+
+  // Restarting clears the stats.
+  rg.Start(milliseconds(1));
+  EXPECT_EQ(rg.Stats(0).Count(), 0u);
+}
+
+TEST(RateGroups, FromLoopTimer) {
+  RateGroups rg(groups);
+  Log log;
+  std::pair<RateGroups *, Log *> arg(&rg, &log);
+  rg.Start(milliseconds(2));
+  Hal.startLoopTimer(
+      milliseconds(2),
+      [](void *arg) {
+        auto *p = static_cast<std::pair<RateGroups *, Log *> *>(arg);
+        p->first->Tick(p->second);
+        p->second->tick++;
+      },
+      &arg);
+  for (int i = 0; i < 50; i++) {
+    Hal.test_fireLoopTimer();
+  }
+  EXPECT_EQ(log.Count(0), 50);
+  EXPECT_EQ(log.Count(1), 10);
+  EXPECT_EQ(log.Count(2), 1);
+}
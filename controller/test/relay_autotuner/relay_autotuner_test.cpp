@@ -0,0 +1,404 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "relay_autotuner.h"
+#include "controller.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+
+namespace {
+
+constexpr Duration LOOP_PERIOD = milliseconds(10);
+constexpr float PI = 3.14159265f;
+
+// A model of the blower, tubing and a test lung.  The blower is a pressure
+// source which follows the fan power with a first-order lag, and fills the
+// lung through the tubing's resistance: another first-order lag.  The exhale
+// valve, when it's open, lets the lung empty through its own resistance.
+// The sensor sees the lung pressure after a transport delay, plus noise.
+struct Plant {
+  // Blower pressure at full power, and time constants.
+  float max_pressure_kpa;
+  float blower_time_constant_s;
+  float lung_time_constant_s;
+  Duration delay;
+  // Exhale resistance relative to the inhale side's.
+  float exhale_resistance_ratio = 1;
+  float noise_cm_h2o = 0.05f;
+
+  float blower_kpa = 0;
+  float lung_kpa = 0;
+  std::deque<float> in_flight;
+  std::mt19937 rng{1};
+
+  // Plant gain in kPa per PID output unit (8-bit fan PWM).
+  float Gain() const { return max_pressure_kpa / 255; }
+
+  // The ultimate gain and period of the PID, sampled every LOOP_PERIOD,
+  // driving this plant with the exhale valve closed.  The sampling adds half
+  // a period of delay.  Found by bisecting for the frequency where the plant
+  // lags by 180 degrees.
+  Controller::Tuning Ultimate() const {
+    float delay_s = delay.seconds() + LOOP_PERIOD.seconds() / 2;
+    auto lag = [&](float w) {
+      return std::atan(w * blower_time_constant_s) +
+             std::atan(w * lung_time_constant_s) + w * delay_s;
+    };
+    float lo = 0.01f;
+    float hi = 1000;
+    for (int i = 0; i < 100; i++) {
+      float mid = std::sqrt(lo * hi);
+      (lag(mid) < PI ? lo : hi) = mid;
+    }
+    float w = lo;
+    float magnitude =
+        Gain() / std::hypot(1.f, w * blower_time_constant_s) /
+        std::hypot(1.f, w * lung_time_constant_s);
+    return {.ku = 1 / magnitude, .tu = seconds(2 * PI / w)};
+  }
+
+  // Advances by LOOP_PERIOD and returns the pressure the sensor reads.
+  float Step(float fan_power, ValveState exhale_valve) {
+    float dt = LOOP_PERIOD.seconds();
+    blower_kpa += (fan_power * max_pressure_kpa - blower_kpa) * dt /
+                  blower_time_constant_s;
+    float flow = blower_kpa - lung_kpa;
+    if (exhale_valve == ValveState::OPEN) {
+      flow -= lung_kpa / exhale_resistance_ratio;
+    }
+    lung_kpa += flow * dt / lung_time_constant_s;
+
+    in_flight.push_back(lung_kpa);
+    size_t delay_steps = static_cast<size_t>(
+        delay.microseconds() / LOOP_PERIOD.microseconds());
+    float seen = in_flight.front();
+    if (in_flight.size() > delay_steps) {
+      in_flight.pop_front();
+    }
+    std::uniform_real_distribution<float> noise(-noise_cm_h2o, noise_cm_h2o);
+    return kPa(seen).cmH2O() + noise(rng);
+  }
+};
+
+// The prototype the default tuning was measured on.  Most of the delay is the
+// sensors' filtering.
+Plant Prototype() {
+  return {.max_pressure_kpa = 4,
+          .blower_time_constant_s = 0.5f,
+          .lung_time_constant_s = 0.2f,
+          .delay = milliseconds(300)};
+}
+
+// A unit with a weaker blower, on which the default tuning is sluggish.
+Plant WeakUnit() {
+  Plant plant = Prototype();
+  plant.max_pressure_kpa = 2.5f;
+  return plant;
+}
+
+// A unit with a more powerful blower, on which the default tuning rings.
+Plant HotUnit() {
+  Plant plant = Prototype();
+  plant.max_pressure_kpa = 8;
+  return plant;
+}
+
+RelayAutotuneConfig TestConfig() {
+  return {.setpoint = cmH2O(15).kPa(),
+          .hysteresis = cmH2O(0.5f).kPa(),
+          .amplitude = 50,
+          .output_min = 0,
+          .output_max = 255,
+          .ramp_time = seconds(20),
+          .input_limit = cmH2O(30).kPa(),
+          .timeout = seconds(60),
+          .min_ultimate_gain = Controller::DEFAULT_TUNING.ku / 3,
+          .max_ultimate_gain = Controller::DEFAULT_TUNING.ku * 3,
+          .min_ultimate_period = milliseconds(500),
+          .max_ultimate_period = seconds(5)};
+}
+
+// A plant whose pressure just clears the relay's hysteresis either side of
+// the setpoint: a square wave following the fan power, after a delay.  The
+// relay oscillates steadily, but the tiny amplitude makes the describing
+// function's gain enormous.
+struct MarginalPlant {
+  // Fan power, in [0, 1], above which the pressure is high.
+  float threshold = 0.4f;
+  // The controller's hysteresis is 0.5cmH2O.
+  float amplitude_cm_h2o = 0.525f;
+  int delay_steps = 40;
+
+  std::deque<float> in_flight;
+
+  float Step(float fan_power, ValveState) {
+    in_flight.push_back(fan_power);
+    float seen = in_flight.front();
+    if (static_cast<int>(in_flight.size()) > delay_steps) {
+      in_flight.pop_front();
+    }
+    float setpoint = Controller::AUTOTUNE_SETPOINT.cmH2O();
+    return seen > threshold ? setpoint + amplitude_cm_h2o
+                            : setpoint - amplitude_cm_h2o;
+  }
+};
+
+// Runs `tuner` against `plant` until it finishes, or for a minute and a half.
+template <typename P> void RunTuner(RelayAutotuner *tuner, P *plant) {
+  Time start = Hal.now();
+  tuner->Start(start);
+  float output = 0;
+  while (tuner->GetStatus() == RelayAutotuner::Status::RUNNING &&
+         Hal.now() - start < seconds(90)) {
+    Hal.delay(LOOP_PERIOD);
+    float pressure = plant->Step(output / 255, ValveState::CLOSED);
+    output = tuner->Step(Hal.now(), cmH2O(pressure).kPa());
+  }
+}
+
+VentParams OffParams() {
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_OFF;
+  return params;
+}
+
+VentParams PressureControlParams() {
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_PRESSURE_CONTROL;
+  params.breaths_per_min = 12;
+  params.peep_cm_h2o = 5;
+  params.pip_cm_h2o = 15;
+  params.inspiratory_expiratory_ratio = 0.66f;
+  return params;
+}
+
+struct Trace {
+  std::vector<float> pressure_cm_h2o;
+  std::vector<float> setpoint_cm_h2o;
+};
+
+// Runs `controller` against `plant` for `duration`, returning the pressures
+// the sensor read and the controller's setpoints.
+template <typename P>
+Trace RunController(Controller *controller, P *plant, const VentParams &params,
+                    Duration duration) {
+  Trace trace;
+  ActuatorsState actuators = {};
+  SensorReadings readings = SensorReadings_init_zero;
+  for (Duration t = milliseconds(0); t < duration; t = t + LOOP_PERIOD) {
+    Hal.delay(LOOP_PERIOD);
+    readings.patient_pressure_cm_h2o =
+        plant->Step(actuators.fan_power, actuators.expire_valve_state);
+    actuators = controller->Run(Hal.now(), params, readings);
+    trace.pressure_cm_h2o.push_back(readings.patient_pressure_cm_h2o);
+    trace.setpoint_cm_h2o.push_back(actuators.fan_setpoint_cm_h2o);
+  }
+  return trace;
+}
+
+// How an inspiration goes: how long the pressure takes to get within 1cmH2O
+// of PIP, and how far past PIP it goes.  We look at the second breath, which
+// starts from PEEP rather than from nothing.
+struct Rise {
+  Duration rise_time;
+  float overshoot_cm_h2o;
+};
+
+Rise SecondInspiration(const Trace &trace) {
+  const int size = static_cast<int>(trace.pressure_cm_h2o.size());
+  // The run starts with the first.
+  int breaths = 1;
+  int start = 0;
+  for (int i = 1; i < size && breaths < 2; i++) {
+    if (trace.setpoint_cm_h2o[i] > trace.setpoint_cm_h2o[i - 1]) {
+      breaths++;
+      start = i;
+    }
+  }
+  EXPECT_EQ(breaths, 2);
+  float pip = trace.setpoint_cm_h2o[start];
+  // The pressure keeps rising for a little while after the inspiration ends.
+  int end = std::min(size, start + 250);
+  Rise rise = {.rise_time = (end - start) * LOOP_PERIOD,
+               .overshoot_cm_h2o = 0};
+  bool risen = false;
+  for (int i = start; i < end; i++) {
+    float p = trace.pressure_cm_h2o[i];
+    if (!risen && p > pip - 1) {
+      risen = true;
+      rise.rise_time = (i - start) * LOOP_PERIOD;
+    }
+    rise.overshoot_cm_h2o = std::max(rise.overshoot_cm_h2o, p - pip);
+  }
+  return rise;
+}
+
+// Autotunes `controller` on `plant`, checking the results, then runs pressure
+// control for a few breaths.
+Trace AutotuneAndVentilate(Controller *controller, Plant plant) {
+  Plant ventilated = plant;
+  controller->StartAutotune(Hal.now());
+  Trace tuning = RunController(controller, &plant, OffParams(), seconds(60));
+  PressureLoopTuning result = controller->GetTuning();
+  EXPECT_EQ(result.autotune_state, AutotuneState_AUTOTUNE_DONE);
+  // In fan power per cmH2O.
+  float expected_gain = plant.Ultimate().ku / 255 * cmH2O(1).kPa();
+  EXPECT_NEAR(result.ultimate_gain, expected_gain, 0.25f * expected_gain);
+  EXPECT_NEAR(result.ultimate_period_s, plant.Ultimate().tu.seconds(),
+              0.15f * plant.Ultimate().tu.seconds());
+  EXPECT_LT(*std::max_element(tuning.pressure_cm_h2o.begin(),
+                              tuning.pressure_cm_h2o.end()),
+            Controller::AUTOTUNE_PRESSURE_LIMIT.cmH2O());
+
+  return RunController(controller, &ventilated, PressureControlParams(),
+                       seconds(10));
+}
+
+} // anonymous namespace
+
+TEST(RelayAutotuner, MeasuresUltimateGainAndPeriod) {
+  for (Plant plant : {Prototype(), WeakUnit(), HotUnit()}) {
+    Controller::Tuning expected = plant.Ultimate();
+    RelayAutotuner tuner(TestConfig());
+    EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::IDLE);
+    RunTuner(&tuner, &plant);
+    ASSERT_EQ(tuner.GetStatus(), RelayAutotuner::Status::DONE);
+    // The describing function is an approximation; it comes out 10-20% low
+    // on these plants.
+    EXPECT_NEAR(tuner.UltimateGain(), expected.ku, 0.25f * expected.ku);
+    EXPECT_NEAR(tuner.UltimatePeriod().seconds(), expected.tu.seconds(),
+                0.15f * expected.tu.seconds());
+  }
+}
+
+TEST(RelayAutotuner, DefaultTuningMatchesPrototype) {
+  Controller::Tuning prototype = Prototype().Ultimate();
+  EXPECT_NEAR(prototype.ku, Controller::DEFAULT_TUNING.ku,
+              0.1f * Controller::DEFAULT_TUNING.ku);
+  EXPECT_NEAR(prototype.tu.seconds(), Controller::DEFAULT_TUNING.tu.seconds(),
+              0.1f * Controller::DEFAULT_TUNING.tu.seconds());
+}
+
+TEST(RelayAutotuner, FailsOnOverpressure) {
+  RelayAutotuneConfig config = TestConfig();
+  config.input_limit = cmH2O(15.2f).kPa();
+  RelayAutotuner tuner(config);
+  Plant plant = Prototype();
+  RunTuner(&tuner, &plant);
+  EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::FAILED);
+  EXPECT_EQ(tuner.Step(Hal.now(), 0), config.output_min);
+}
+
+TEST(RelayAutotuner, TimesOutIfSetpointIsOutOfReach) {
+  RelayAutotuner tuner(TestConfig());
+  // A blower too weak to reach the setpoint.
+  Plant plant = Prototype();
+  plant.max_pressure_kpa = 0.5f;
+  Time start = Hal.now();
+  RunTuner(&tuner, &plant);
+  EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::FAILED);
+  EXPECT_GE(Hal.now() - start, TestConfig().timeout);
+}
+
+TEST(RelayAutotuner, RejectsAMarginalOscillation) {
+  // Without bounds, the run would go through.
+  RelayAutotuneConfig unbounded = TestConfig();
+  unbounded.max_ultimate_gain = INFINITY;
+  RelayAutotuner trusting(unbounded);
+  MarginalPlant plant;
+  RunTuner(&trusting, &plant);
+  ASSERT_EQ(trusting.GetStatus(), RelayAutotuner::Status::DONE);
+  EXPECT_GT(trusting.UltimateGain(), TestConfig().max_ultimate_gain);
+
+  RelayAutotuner tuner(TestConfig());
+  plant = {};
+  RunTuner(&tuner, &plant);
+  EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::FAILED);
+}
+
+TEST(RelayAutotuner, Abort) {
+  RelayAutotuner tuner(TestConfig());
+  tuner.Abort();
+  EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::IDLE);
+  tuner.Start(Hal.now());
+  tuner.Abort();
+  EXPECT_EQ(tuner.GetStatus(), RelayAutotuner::Status::FAILED);
+}
+
+TEST(ControllerAutotune, SpeedsUpASluggishUnit) {
+  Controller untuned(LOOP_PERIOD);
+  EXPECT_EQ(untuned.GetTuning().autotune_state, AutotuneState_AUTOTUNE_IDLE);
+  EXPECT_FLOAT_EQ(untuned.GetTuning().ultimate_period_s, 1.5f);
+  Plant plant = WeakUnit();
+  Rise before = SecondInspiration(
+      RunController(&untuned, &plant, PressureControlParams(), seconds(10)));
+
+  Controller tuned(LOOP_PERIOD);
+  Rise after = SecondInspiration(AutotuneAndVentilate(&tuned, WeakUnit()));
+  EXPECT_LT(after.rise_time.seconds(), 0.85f * before.rise_time.seconds());
+  EXPECT_LT(after.overshoot_cm_h2o, 0.5f);
+}
+
+TEST(ControllerAutotune, CalmsAHotUnit) {
+  Controller untuned(LOOP_PERIOD);
+  Plant plant = HotUnit();
+  Rise before = SecondInspiration(
+      RunController(&untuned, &plant, PressureControlParams(), seconds(10)));
+
+  Controller tuned(LOOP_PERIOD);
+  Rise after = SecondInspiration(AutotuneAndVentilate(&tuned, HotUnit()));
+  EXPECT_GT(before.overshoot_cm_h2o, 1);
+  EXPECT_LT(after.overshoot_cm_h2o, 0.5f);
+  EXPECT_LT(after.rise_time, seconds(2));
+
+  // The tuning survives a warm restart.
+  Controller restarted(LOOP_PERIOD);
+  restarted.RestoreState(Hal.now(), tuned.GetState(Hal.now()));
+  EXPECT_FLOAT_EQ(restarted.GetTuning().ultimate_gain,
+                  tuned.GetTuning().ultimate_gain);
+}
+
+TEST(ControllerAutotune, KeepsTuningOnImplausibleResult) {
+  Controller controller(LOOP_PERIOD);
+  MarginalPlant plant;
+  controller.StartAutotune(Hal.now());
+  RunController(&controller, &plant, OffParams(), seconds(60));
+  EXPECT_EQ(controller.GetTuning().autotune_state,
+            AutotuneState_AUTOTUNE_FAILED);
+  EXPECT_FLOAT_EQ(controller.GetTuning().ultimate_period_s, 1.5f);
+}
+
+TEST(ControllerAutotune, OnlyWhileVentilationIsOff) {
+  Controller controller(LOOP_PERIOD);
+  Plant plant = Prototype();
+  controller.StartAutotune(Hal.now());
+  RunController(&controller, &plant, PressureControlParams(), seconds(1));
+  EXPECT_EQ(controller.GetTuning().autotune_state,
+            AutotuneState_AUTOTUNE_FAILED);
+  EXPECT_FLOAT_EQ(controller.GetTuning().ultimate_period_s, 1.5f);
+
+  // Starting ventilation aborts a run in progress.
+  controller.StartAutotune(Hal.now());
+  RunController(&controller, &plant, OffParams(), seconds(1));
+  EXPECT_EQ(controller.GetTuning().autotune_state,
+            AutotuneState_AUTOTUNE_RUNNING);
+  RunController(&controller, &plant, PressureControlParams(), seconds(1));
+  EXPECT_EQ(controller.GetTuning().autotune_state,
+            AutotuneState_AUTOTUNE_FAILED);
+}
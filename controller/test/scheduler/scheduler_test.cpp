@@ -0,0 +1,286 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "scheduler.h"
+#include "hal.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Log of which tasks ran and when (relative to the start of the test).
+static std::vector<std::string> run_log;
+static Time test_start;
+
+static void Log(const char *name) {
+  run_log.push_back(std::string(name) + "@" +
+                    std::to_string((Hal.now() - test_start).milliseconds()));
+}
+
+// Tasks take however long they spend in Hal.delay().
+static void TaskA() {
+  Log("a");
+  Hal.delay(milliseconds(2));
+}
+static void TaskB() {
+  Log("b");
+  Hal.delay(milliseconds(3));
+}
+static void Event() {
+  Log("e");
+  Hal.delay(milliseconds(1));
+}
+static void Slow() {
+  Log("slow");
+  Hal.delay(milliseconds(15));
+}
+
+// Idle until the next release, but no later than RunFor() was asked to run.
+static Time run_until;
+static void SkipToNextRelease(Time next) {
+  Time wake = std::min(next, run_until);
+  if (wake > Hal.now()) {
+    Hal.delay(wake - Hal.now());
+  }
+}
+
+// Runs the scheduler until `duration` has passed since the start of the test.
+static void RunFor(Scheduler *s, Duration duration) {
+  run_until = test_start + duration;
+  while (Hal.now() < run_until) {
+    s->RunOnce();
+  }
+}
+
+class SchedulerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    run_log.clear();
+    test_start = Hal.now();
+  }
+};
+
+TEST_F(SchedulerTest, Periodic) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+      {"b", TaskB, milliseconds(25), milliseconds(0)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  RunFor(&s, milliseconds(50));
+
+  // Both are released at 0; a's deadline (10ms) is sooner than b's (25ms).
+  EXPECT_EQ(run_log,
+            (std::vector<std::string>{"a@0", "b@2", "a@10", "a@20", "b@25",
+                                      "a@30", "a@40"}));
+  EXPECT_EQ(s.Stats(0).runs, 5u);
+  EXPECT_EQ(s.Stats(1).runs, 2u);
+  EXPECT_EQ(s.Stats(0).deadline_misses, 0u);
+  EXPECT_EQ(s.Stats(1).max_runtime, milliseconds(3));
+  EXPECT_EQ(s.Stats(1).total_runtime, milliseconds(6));
+}
+
+TEST_F(SchedulerTest, EarliestDeadlineFirst) {
+  // b has the longer period but the tighter deadline, so it goes first when
+  // both are released together.
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+      {"b", TaskB, milliseconds(20), milliseconds(5)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  RunFor(&s, milliseconds(20));
+  EXPECT_EQ(run_log, (std::vector<std::string>{"b@0", "a@3", "a@10"}));
+}
+
+TEST_F(SchedulerTest, EventDriven) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+      {"e", Event, milliseconds(0), milliseconds(5)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  RunFor(&s, milliseconds(5));
+  EXPECT_EQ(run_log, (std::vector<std::string>{"a@0"}));
+
+  // Signaling twice before the task runs only runs it once.
+  s.Signal(1);
+  s.Signal(1);
+  RunFor(&s, milliseconds(15));
+  EXPECT_EQ(run_log, (std::vector<std::string>{"a@0", "e@5", "a@10"}));
+  EXPECT_EQ(s.Stats(1).runs, 1u);
+
+  // An event whose deadline is sooner than the periodic task's goes first.
+  Hal.delay(milliseconds(5));
+  s.Signal(1);
+  RunFor(&s, milliseconds(25));
+  EXPECT_EQ(run_log, (std::vector<std::string>{"a@0", "e@5", "a@10", "e@20",
+                                               "a@21"}));
+}
+
+// An event-driven task without a deadline of its own gets
+// DEFAULT_EVENT_DEADLINE, not its zero period, so it doesn't miss it every
+// time it takes any time at all.
+TEST_F(SchedulerTest, EventDefaultDeadline) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+      {"e", Event, milliseconds(0), milliseconds(0)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  s.Signal(1);
+  RunFor(&s, milliseconds(10));
+  // a's deadline (10ms) comes before e's (100ms).
+  EXPECT_EQ(run_log, (std::vector<std::string>{"a@0", "e@2"}));
+  EXPECT_EQ(s.Stats(1).runs, 1u);
+  EXPECT_EQ(s.Stats(1).deadline_misses, 0u);
+}
+
+// An event signaled after RunOnce() last looked (e.g. from an interrupt) is
+// due now, so the idle hook mustn't sleep past it.
+TEST_F(SchedulerTest, NextReleaseIncludesSignaledEvents) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+      {"e", Event, milliseconds(0), milliseconds(5)},
+  };
+  Scheduler s(tasks, [](Time next) { Hal.idle(next); });
+  s.Start();
+  EXPECT_TRUE(s.RunOnce());
+  EXPECT_EQ(s.NextRelease(), test_start + milliseconds(10));
+
+  s.Signal(1);
+  EXPECT_EQ(s.NextRelease(), Hal.now());
+  EXPECT_TRUE(s.RunOnce());
+  EXPECT_EQ(run_log, (std::vector<std::string>{"a@0", "e@2"}));
+  EXPECT_EQ(s.NextRelease(), test_start + milliseconds(10));
+}
+
+TEST_F(SchedulerTest, DeadlineMisses) {
+  static constexpr SchedulerTask tasks[] = {
+      {"slow", Slow, milliseconds(10), milliseconds(0)},
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  RunFor(&s, milliseconds(40));
+
+  // slow misses its own deadline every time, and makes a miss its deadline
+  // too.  slow's release at 10 runs late, at 17.  Its release at 20 has
+  // been and gone by the time that finishes, so it's skipped rather than run
+  // back to back.
+  EXPECT_EQ(run_log, (std::vector<std::string>{"slow@0", "a@15", "slow@17",
+                                               "a@32", "slow@34"}));
+  EXPECT_EQ(s.Stats(0).deadline_misses, 3u);
+  EXPECT_EQ(s.Stats(0).max_runtime, milliseconds(15));
+  EXPECT_EQ(s.Stats(1).deadline_misses, 2u);
+}
+
+TEST_F(SchedulerTest, CpuLoad) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  EXPECT_EQ(s.CpuLoadPercent(), 0);
+  RunFor(&s, Scheduler::LOAD_WINDOW);
+  // 2ms out of every 10ms.
+  EXPECT_FLOAT_EQ(s.CpuLoadPercent(), 20);
+}
+
+// Runtimes shorter than a millisecond still count towards the load.
+TEST_F(SchedulerTest, CpuLoadOfShortTasks) {
+  static constexpr SchedulerTask tasks[] = {
+      {"short", [] { Hal.delay(microseconds(250)); }, milliseconds(1),
+       milliseconds(0)},
+  };
+  Scheduler s(tasks, SkipToNextRelease);
+  s.Start();
+  RunFor(&s, Scheduler::LOAD_WINDOW);
+  EXPECT_EQ(s.Stats(0).max_runtime, microseconds(250));
+  EXPECT_FLOAT_EQ(s.CpuLoadPercent(), 25);
+}
+
+TEST_F(SchedulerTest, IdleHook) {
+  static int idle_calls;
+  static Time idle_next_release;
+  idle_calls = 0;
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+  };
+  Scheduler s(tasks, [](Time next) {
+    idle_calls++;
+    idle_next_release = next;
+  });
+  s.Start();
+  EXPECT_TRUE(s.RunOnce());
+  EXPECT_EQ(idle_calls, 0);
+  EXPECT_FALSE(s.RunOnce());
+  EXPECT_EQ(idle_calls, 1);
+  EXPECT_EQ(idle_next_release, test_start + milliseconds(10));
+  EXPECT_EQ(s.NextRelease(), test_start + milliseconds(10));
+}
+
+// Driven by the fake clock, the same task table always produces the same
+// schedule.
+TEST_F(SchedulerTest, Deterministic) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(7), milliseconds(0)},
+      {"b", TaskB, milliseconds(11), milliseconds(4)},
+      {"slow", Slow, milliseconds(50), milliseconds(0)},
+  };
+  std::vector<std::string> logs[2];
+  for (auto &log : logs) {
+    run_log.clear();
+    test_start = Hal.now();
+    Scheduler s(tasks, SkipToNextRelease);
+    s.Start();
+    RunFor(&s, milliseconds(200));
+    log = run_log;
+  }
+  EXPECT_EQ(logs[0], logs[1]);
+  EXPECT_GT(logs[0].size(), 40u);
+}
+
+TEST(HalIdle, JumpsToWakeTime) {
+  Time start = Hal.now();
+  Duration idle_start = Hal.idleTime();
+  Hal.idle(start + milliseconds(7));
+  EXPECT_EQ(Hal.now(), start + milliseconds(7));
+  EXPECT_EQ(Hal.idleTime() - idle_start, milliseconds(7));
+
+  // Waking up in the past doesn't sleep at all.
+  Hal.idle(start);
+  EXPECT_EQ(Hal.now(), start + milliseconds(7));
+  EXPECT_EQ(Hal.idleTime() - idle_start, milliseconds(7));
+}
+
+// With Hal.idle() as the idle hook, the fake clock jumps straight to the next
+// release, so we only go round the loop a couple of times per task run.
+TEST_F(SchedulerTest, IdleWithHal) {
+  static constexpr SchedulerTask tasks[] = {
+      {"a", TaskA, milliseconds(10), milliseconds(0)},
+  };
+  Scheduler s(tasks, [](Time next) { Hal.idle(next); });
+  s.Start();
+  int iterations = 0;
+  while (Hal.now() - test_start < Scheduler::LOAD_WINDOW) {
+    s.RunOnce();
+    iterations++;
+  }
+  EXPECT_EQ(s.Stats(0).runs, 100u);
+  EXPECT_EQ(iterations, 200);
+  EXPECT_FLOAT_EQ(s.CpuLoadPercent(), 20);
+  EXPECT_FLOAT_EQ(s.IdlePercent(), 80);
+}
@@ -0,0 +1,227 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "sensor_health.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <cmath>
+
+static constexpr Duration SAMPLE_PERIOD = milliseconds(1);
+
+// What the sensors read at 0 kPa, see sensors_test.cpp.
+static constexpr float ZERO_VOLTS = 0.66f;
+
+// A little noise, as a live sensor has.  Deterministic, so the tests are.
+static float Noise(int i) {
+  return 0.001f * std::sin(static_cast<float>(i) * 2.39996f);
+}
+
+static const AnalogPin PINS[] = {AnalogPin::PATIENT_PRESSURE,
+                                 AnalogPin::INFLOW_PRESSURE_DIFF,
+                                 AnalogPin::OUTFLOW_PRESSURE_DIFF};
+
+// Sets every sensor's pin to v(i, pin), then advances time and reads the
+// sensors, for `n` samples.
+template <class Fn> static void ReadSensors(Sensors *sensors, int n, Fn v) {
+  static int i = 0;
+  for (int end = i + n; i < end; i++) {
+    for (AnalogPin pin : PINS) {
+      Hal.test_setAnalogPin(pin, volts(v(i, pin)));
+    }
+    Hal.delay(SAMPLE_PERIOD);
+    sensors->GetSensorReadings();
+  }
+}
+
+static void SetZeroPressure() {
+  for (AnalogPin pin : PINS) {
+    Hal.test_setAnalogPin(pin, volts(ZERO_VOLTS));
+  }
+}
+
+static constexpr int SAMPLES_PER_WINDOW = static_cast<int>(
+    SensorHealthMonitor::WINDOW.microseconds() / SAMPLE_PERIOD.microseconds());
+
+TEST(SensorHealth, HealthySensorsHaveNoFaults) {
+  SetZeroPressure();
+  Sensors sensors;
+  sensors.Calibrate();
+  // Breathing-like pressures, plus noise.
+  ReadSensors(&sensors, 5 * SAMPLES_PER_WINDOW, [](int i, AnalogPin) {
+    return ZERO_VOLTS + 1.0f +
+           std::sin(static_cast<float>(i) * 2 * static_cast<float>(M_PI) /
+                    4000) +
+           Noise(i);
+  });
+  for (AnalogPin pin : PINS) {
+    EXPECT_EQ(sensors.GetFaults(pin), 0u);
+  }
+}
+
+TEST(SensorHealth, Stuck) {
+  SetZeroPressure();
+  Sensors sensors;
+  sensors.Calibrate();
+  ReadSensors(&sensors, 2 * SAMPLES_PER_WINDOW,
+              [](int i, AnalogPin) { return ZERO_VOLTS + Noise(i); });
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::INFLOW_PRESSURE_DIFF), 0u);
+
+  // The inflow sensor's reading freezes.
+  auto inflow_stuck = [](int i, AnalogPin pin) {
+    return pin == AnalogPin::INFLOW_PRESSURE_DIFF ? ZERO_VOLTS + 0.1f
+                                                  : ZERO_VOLTS + Noise(i);
+  };
+  ReadSensors(&sensors, 2 * SAMPLES_PER_WINDOW, inflow_stuck);
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::INFLOW_PRESSURE_DIFF),
+            uint32_t{SENSOR_STUCK});
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::PATIENT_PRESSURE), 0u);
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::OUTFLOW_PRESSURE_DIFF), 0u);
+
+  // It clears once the sensor comes back to life.
+  ReadSensors(&sensors, 2 * SAMPLES_PER_WINDOW,
+              [](int i, AnalogPin) { return ZERO_VOLTS + Noise(i); });
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::INFLOW_PRESSURE_DIFF), 0u);
+}
+
+TEST(SensorHealth, Railed) {
+  SetZeroPressure();
+  Sensors sensors;
+  sensors.Calibrate();
+  ReadSensors(&sensors, 10, [](int i, AnalogPin) { return ZERO_VOLTS; });
+
+  // The patient pressure sensor is disconnected and its input pulled to 0V,
+  // one sample at a time so as not to trip the rate limit.
+  auto patient_at = [](float volts) {
+    return [=](int i, AnalogPin pin) {
+      return pin == AnalogPin::PATIENT_PRESSURE ? volts
+                                                : ZERO_VOLTS + Noise(i);
+    };
+  };
+  for (float v = ZERO_VOLTS; v > 0; v -= 0.1f) {
+    ReadSensors(&sensors, 1, patient_at(v));
+  }
+  // A brief excursion isn't a fault...
+  int rail_samples = static_cast<int>(
+      SensorHealthMonitor::RAIL_TIME.microseconds() /
+      SAMPLE_PERIOD.microseconds());
+  ReadSensors(&sensors, rail_samples - 1, patient_at(0));
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::PATIENT_PRESSURE) & SENSOR_RAILED,
+            0u);
+  // ...but staying there is.
+  ReadSensors(&sensors, 2, patient_at(0));
+  EXPECT_NE(sensors.GetFaults(AnalogPin::PATIENT_PRESSURE) & SENSOR_RAILED,
+            0u);
+
+  // Likewise at the top of the ADC's range.
+  ReadSensors(&sensors, 1, patient_at(1));
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::PATIENT_PRESSURE) & SENSOR_RAILED,
+            0u);
+  for (float v = 1; v < 3.3f; v += 0.1f) {
+    ReadSensors(&sensors, 1, patient_at(v));
+  }
+  ReadSensors(&sensors, rail_samples + 1, patient_at(3.3f));
+  EXPECT_NE(sensors.GetFaults(AnalogPin::PATIENT_PRESSURE) & SENSOR_RAILED,
+            0u);
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::OUTFLOW_PRESSURE_DIFF), 0u);
+}
+
+TEST(SensorHealth, RateOfChange) {
+  SetZeroPressure();
+  Sensors sensors;
+  sensors.Calibrate();
+  auto healthy = [](int i, AnalogPin) { return ZERO_VOLTS + Noise(i); };
+  ReadSensors(&sensors, SAMPLES_PER_WINDOW, healthy);
+
+  // A loose connection on the outflow sensor makes it jump by 1V in 1ms.
+  ReadSensors(&sensors, 1, [](int i, AnalogPin pin) {
+    return pin == AnalogPin::OUTFLOW_PRESSURE_DIFF ? ZERO_VOLTS + 1
+                                                   : ZERO_VOLTS + Noise(i);
+  });
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::OUTFLOW_PRESSURE_DIFF),
+            uint32_t{SENSOR_RATE_EXCEEDED});
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::INFLOW_PRESSURE_DIFF), 0u);
+
+  // The fault holds through the rest of this window and the whole of the
+  // next, since it jumps back too.
+  ReadSensors(&sensors, SAMPLES_PER_WINDOW, healthy);
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::OUTFLOW_PRESSURE_DIFF),
+            uint32_t{SENSOR_RATE_EXCEEDED});
+  ReadSensors(&sensors, 2 * SAMPLES_PER_WINDOW, healthy);
+  EXPECT_EQ(sensors.GetFaults(AnalogPin::OUTFLOW_PRESSURE_DIFF), 0u);
+}
+
+TEST(SensorHealth, RateLimitScalesWithSamplePeriod) {
+  SensorHealthMonitor monitor;
+  Time t = Hal.now();
+  monitor.AddSample(t, volts(1));
+  // 0.2V in 1ms is 200V/s: fine.
+  t = t + milliseconds(1);
+  monitor.AddSample(t, volts(1.2f));
+  EXPECT_EQ(monitor.Faults() & SENSOR_RATE_EXCEEDED, 0u);
+  // 0.2V in 0.5ms is 400V/s: too fast.
+  t = t + microseconds(500);
+  monitor.AddSample(t, volts(1.4f));
+  EXPECT_NE(monitor.Faults() & SENSOR_RATE_EXCEEDED, 0u);
+}
+
+TEST(SensorHealth, RateLimitCatchesJumpsAtSlowLoopRates) {
+  SensorHealthMonitor monitor;
+  Time t = Hal.now();
+  monitor.AddSample(t, volts(1));
+  // At 100Hz, 1V between readings is as fast as the pressure really changes.
+  t = t + milliseconds(10);
+  monitor.AddSample(t, volts(2));
+  EXPECT_EQ(monitor.Faults() & SENSOR_RATE_EXCEEDED, 0u);
+  // 1.6V isn't, even though it's well under 250V/s.
+  t = t + milliseconds(10);
+  monitor.AddSample(t, volts(0.4f));
+  EXPECT_NE(monitor.Faults() & SENSOR_RATE_EXCEEDED, 0u);
+}
+
+// A well-filtered sensor at rest, whose oversampled reading only moves by the
+// smallest step it can, a couple of times a second.  Its standard deviation
+// is a few microvolts.
+TEST(SensorHealth, QuietSensorIsNotStuck) {
+  // One 12-bit A/D count, in a mean of 64 conversions.
+  constexpr float STEP_VOLTS = 3.3f / 4096 / 64;
+  SensorHealthMonitor monitor;
+  Time t = Hal.now();
+  for (int i = 0; i < 5 * SAMPLES_PER_WINDOW; i++) {
+    bool up = i % 400 < 5;
+    monitor.AddSample(t, volts(ZERO_VOLTS + (up ? STEP_VOLTS : 0)));
+    t = t + SAMPLE_PERIOD;
+  }
+  EXPECT_EQ(monitor.Faults(), 0u);
+
+  // But once the reading stops changing at all, it is.
+  for (int i = 0; i < 2 * SAMPLES_PER_WINDOW; i++) {
+    monitor.AddSample(t, volts(ZERO_VOLTS));
+    t = t + SAMPLE_PERIOD;
+  }
+  EXPECT_EQ(monitor.Faults(), uint32_t{SENSOR_STUCK});
+}
+
+TEST(SensorHealth, Benchmark) {
+  SensorHealthMonitor monitor;
+  Time t = Hal.now();
+  int i = 0;
+  RunBenchmark("SensorHealthMonitor::AddSample", 1000000, [&] {
+    t = t + SAMPLE_PERIOD;
+    monitor.AddSample(t, volts(ZERO_VOLTS + Noise(i++ & 1023)));
+  });
+  DoNotOptimize(monitor);
+}
@@ -24,6 +24,7 @@ limitations under the License.
 #include "hal.h"
 #include "sensors.h"
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <assert.h>
 #include <cmath>
 #include <cstdio>
@@ -52,6 +53,18 @@ static Voltage MPXV5004_PressureToVoltage(Pressure pressure) {
   return volts(3.3f * (0.2f * pressure.kPa() + 0.2f));
 }
 
+// These tests check how we convert voltages to pressure, flow and volume, one
+// reading at a time.  The filters would smear each step in the input over
+// several readings, so take them out of the picture; they're tested on their
+// own in test/filter.
+static void DisableFilters(Sensors *sensors) {
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    sensors->SetFilterChain(pin, Sensors::FilterChain());
+  }
+}
+
 // Function that helps change the readings by setting the pressure sensor pins,
 // advancing time and then getting sensors readings
 static SensorReadings update_readings(Duration dt, Pressure patient_pressure,
@@ -86,6 +99,7 @@ TEST(SensorTests, FullScaleReading) {
   Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF, voltage_at_0kPa);
 
   Sensors sensors;
+  DisableFilters(&sensors);
   sensors.Calibrate();
 
   // Now to compare the pressure readings the sensor module is calculating
@@ -135,6 +149,7 @@ TEST(SensorTests, TotalFlowCalculation) {
   Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF, voltage_at_0kPa);
 
   Sensors sensors;
+  DisableFilters(&sensors);
   sensors.Calibrate();
 
   for (auto p_in : pressures) {
@@ -191,13 +206,44 @@ TEST(SensorTests, TVIntegrator) {
   // remove 1 l/s flow over 10 ms ==> 25 ml (rectangle rule)
   EXPECT_NEAR(tidal_volume.GetTV().ml(), 25.0f, COMPARISON_TOLERANCE_VOLUME_ML);
 
-  // oversampling and expect volume to not change except on multiples of 5 ms
-  for (int i = 0; i < 50; i++) {
-    tidal_volume.AddFlow(ticks(t) + milliseconds(i), flow);
-    // remove 1l/s flow over 5 ms only when i is a multiple of 5
-    EXPECT_NEAR(tidal_volume.GetTV().ml(), 25.0f - floor(i / 5) * 5,
-                COMPARISON_TOLERANCE_VOLUME_ML);
+  // oversampling: every sample adds its trapezoid, even at sub-millisecond
+  // intervals.  Remove 1 l/s flow over 250 us ==> 0.25 ml per sample.
+  for (int i = 1; i <= 40; i++) {
+    tidal_volume.AddFlow(ticks(t) + microseconds(250 * i), flow);
+    EXPECT_NEAR(tidal_volume.GetTV().ml(),
+                25.0f - 0.25f * static_cast<float>(i), 0.01f);
+  }
+
+  // A repeated timestamp is ignored, flow and all.
+  Time last = ticks(t) + milliseconds(10);
+  tidal_volume.AddFlow(last, liters_per_sec(1.0f));
+  EXPECT_NEAR(tidal_volume.GetTV().ml(), 15.0f, 0.01f);
+  tidal_volume.AddFlow(last + milliseconds(1), liters_per_sec(1.0f));
+  EXPECT_NEAR(tidal_volume.GetTV().ml(), 15.0f, 0.01f);
+}
+
+// Integrating every sample of a 1kHz loop tracks the exact volume of a
+// sinusoidal flow to well within a milliliter.
+TEST(SensorTests, TVIntegratorAccuracyAtHighRate) {
+  constexpr float PEAK_LITERS_PER_SEC = 1.5f;
+  constexpr float BREATH_SEC = 2.0f;
+  constexpr int SAMPLE_US = 1000;
+
+  Hal.delay(base - Hal.now());
+  TVIntegrator tidal_volume;
+  Time start = Hal.now();
+  tidal_volume.AddFlow(start, liters_per_sec(0));
+  float max_error_ml = 0;
+  for (int us = SAMPLE_US; us <= 1000 * 1000; us += SAMPLE_US) {
+    float t = static_cast<float>(us) / (1000 * 1000);
+    float w = 2 * static_cast<float>(M_PI) / BREATH_SEC;
+    tidal_volume.AddFlow(start + microseconds(us),
+                         liters_per_sec(PEAK_LITERS_PER_SEC * std::sin(w * t)));
+    float expected_ml = 1000 * PEAK_LITERS_PER_SEC * (1 - std::cos(w * t)) / w;
+    max_error_ml = std::max(
+        max_error_ml, std::abs(tidal_volume.GetTV().ml() - expected_ml));
   }
+  EXPECT_LT(max_error_ml, 0.5f);
 }
 
 // This test checks encapsulation of TVIntegrator in getSensorReadings with
@@ -225,8 +271,9 @@ TEST(SensorTests, TidalVolume) {
   // initialization time.
   // Note outside of tests: the sensors TVintegrator's TV has a constant bias:
   // init value = time between sensors' init and first measure * first flow / 2
-  TVIntegrator tidal_volume;
+  BreathTVIntegrator tidal_volume;
   Sensors sensors;
+  DisableFilters(&sensors);
   sensors.Calibrate();
 
   for (uint i = 0; i < sampling_time.size(); i++) {
@@ -256,6 +303,7 @@ TEST(SensorTests, Calibration) {
                         MPXV5004_PressureToVoltage(init_outflow_delta));
 
   Sensors sensors;
+  DisableFilters(&sensors);
   sensors.Calibrate();
 
   // get the sensor readings for the init signals, expect 0
@@ -291,3 +339,159 @@ TEST(SensorTests, Calibration) {
                   .cubic_m_per_sec(),
               COMPARISON_TOLERANCE_FLOW_CUBIC_M_PER_SEC);
 }
+
+// Sets every sensor's pin to the voltage it reads at 0 kPa plus `offset`.
+static void SetZeroPressurePlusOffset(Voltage offset) {
+  for (AnalogPin pin :
+       {AnalogPin::PATIENT_PRESSURE, AnalogPin::INFLOW_PRESSURE_DIFF,
+        AnalogPin::OUTFLOW_PRESSURE_DIFF}) {
+    Hal.test_setAnalogPin(pin, MPXV5004_PressureToVoltage(kPa(0)) + offset);
+  }
+}
+
+using PneumaticState = Sensors::PneumaticState;
+
+// Reads the sensors every millisecond for `duration`, calling AutoZero()
+// after each reading.  Returns the last reading.
+static SensorReadings RunAutoZero(Duration duration, PneumaticState state,
+                                  Sensors *sensors) {
+  SensorReadings readings = {};
+  Time end = Hal.now() + duration;
+  while (Hal.now() < end) {
+    Hal.delay(milliseconds(1));
+    readings = sensors->GetSensorReadings();
+    sensors->AutoZero(Hal.now(), state);
+  }
+  return readings;
+}
+
+TEST(SensorTests, AutoZeroTracksDrift) {
+  SetZeroPressurePlusOffset(volts(0));
+  Sensors sensors;
+  DisableFilters(&sensors);
+  sensors.Calibrate();
+
+  // The sensors' offsets drift by 20mV, i.e. 0.03kPa.
+  Voltage drift = volts(0.02f);
+  SetZeroPressurePlusOffset(drift);
+  float drifted_cm_h2o = sensors.GetSensorReadings().patient_pressure_cm_h2o;
+  EXPECT_NEAR(drifted_cm_h2o, kPa(5.f / 3.3f * drift.volts()).cmH2O(), 0.01f);
+
+  // Nothing changes until the pneumatics have been at rest for a while.
+  SensorReadings readings =
+      RunAutoZero(Sensors::AUTO_ZERO_SETTLE_TIME - milliseconds(10),
+                  PneumaticState::AT_REST, &sensors);
+  EXPECT_FLOAT_EQ(readings.patient_pressure_cm_h2o, drifted_cm_h2o);
+  EXPECT_EQ(sensors.GetAutoZeroStats().accepted, 0u);
+
+  // Then each window moves the zero by at most AUTO_ZERO_MAX_SLEW.
+  float max_step_cm_h2o =
+      kPa(5.f / 3.3f * Sensors::AUTO_ZERO_MAX_SLEW.volts()).cmH2O();
+  float last_cm_h2o = drifted_cm_h2o;
+  for (int i = 0; i < 10; i++) {
+    readings = RunAutoZero(Sensors::AUTO_ZERO_WINDOW, PneumaticState::AT_REST,
+                           &sensors);
+    EXPECT_LE(std::abs(readings.patient_pressure_cm_h2o - last_cm_h2o),
+              max_step_cm_h2o * 1.01f);
+    last_cm_h2o = readings.patient_pressure_cm_h2o;
+  }
+  EXPECT_NEAR(readings.patient_pressure_cm_h2o, 0, 1e-3f);
+  EXPECT_NEAR(readings.inflow_pressure_diff_cm_h2o, 0, 1e-3f);
+  EXPECT_NEAR(readings.outflow_pressure_diff_cm_h2o, 0, 1e-3f);
+  EXPECT_NEAR(readings.flow_ml_per_min, 0, 1);
+  EXPECT_GE(sensors.GetAutoZeroStats().accepted, 4u);
+  EXPECT_EQ(sensors.GetAutoZeroStats().rejected, 0u);
+}
+
+TEST(SensorTests, AutoZeroOnlyAtRest) {
+  SetZeroPressurePlusOffset(volts(0));
+  Sensors sensors;
+  DisableFilters(&sensors);
+  sensors.Calibrate();
+  SetZeroPressurePlusOffset(volts(0.02f));
+
+  // Resting for less than the settle time at a time never re-zeroes.
+  for (int i = 0; i < 5; i++) {
+    RunAutoZero(Sensors::AUTO_ZERO_SETTLE_TIME - milliseconds(10),
+                PneumaticState::AT_REST, &sensors);
+    RunAutoZero(milliseconds(10), PneumaticState::ACTIVE, &sensors);
+  }
+  RunAutoZero(seconds(5), PneumaticState::ACTIVE, &sensors);
+  EXPECT_EQ(sensors.GetAutoZeroStats().accepted, 0u);
+  EXPECT_EQ(sensors.GetAutoZeroStats().rejected, 0u);
+  EXPECT_GT(sensors.GetSensorReadings().patient_pressure_cm_h2o, 0.2f);
+}
+
+TEST(SensorTests, AutoZeroRejectsFlow) {
+  SetZeroPressurePlusOffset(volts(0));
+  Sensors sensors;
+  DisableFilters(&sensors);
+  sensors.Calibrate();
+  RunAutoZero(Sensors::AUTO_ZERO_SETTLE_TIME, PneumaticState::AT_REST,
+              &sensors);
+
+  // A patient breathing on their own while the blower is off: the pressures
+  // move by more than AUTO_ZERO_STABLE_BAND, averaging to an offset.
+  Time start = Hal.now();
+  for (int i = 0; i < 3000; i++) {
+    float t = (Hal.now() - start).seconds();
+    SetZeroPressurePlusOffset(
+        volts(0.01f + 0.03f * std::sin(2 * static_cast<float>(M_PI) * t)));
+    Hal.delay(milliseconds(1));
+    sensors.GetSensorReadings();
+    sensors.AutoZero(Hal.now(), PneumaticState::AT_REST);
+  }
+  EXPECT_EQ(sensors.GetAutoZeroStats().accepted, 0u);
+  EXPECT_GE(sensors.GetAutoZeroStats().rejected, 10u);
+
+  SetZeroPressurePlusOffset(volts(0));
+  EXPECT_NEAR(sensors.GetSensorReadings().patient_pressure_cm_h2o, 0, 1e-3f);
+}
+
+TEST(SensorTests, AutoZeroRejectsLargeDrift) {
+  SetZeroPressurePlusOffset(volts(0));
+  Sensors sensors;
+  DisableFilters(&sensors);
+  sensors.Calibrate();
+
+  // More than AUTO_ZERO_MAX_DRIFT away from the calibrated zero, e.g. a
+  // failed sensor.  We don't follow it.
+  Voltage offset = volts(Sensors::AUTO_ZERO_MAX_DRIFT.volts() + 0.01f);
+  SetZeroPressurePlusOffset(offset);
+  SensorReadings readings =
+      RunAutoZero(seconds(5), PneumaticState::AT_REST, &sensors);
+  EXPECT_EQ(sensors.GetAutoZeroStats().accepted, 0u);
+  EXPECT_GE(sensors.GetAutoZeroStats().rejected, 10u);
+  EXPECT_NEAR(readings.patient_pressure_cm_h2o,
+              kPa(5.f / 3.3f * offset.volts()).cmH2O(), 0.01f);
+}
+
+TEST(SensorTests, AutoZeroInExpiratoryHold) {
+  SetZeroPressurePlusOffset(volts(0));
+  Sensors sensors;
+  DisableFilters(&sensors);
+  sensors.Calibrate();
+
+  // The blower holds PEEP, and its flow goes through both venturis.  The
+  // inflow sensor's offset has drifted, so the patient seems to be breathing
+  // out all the time.
+  Voltage drift = volts(0.02f);
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        MPXV5004_PressureToVoltage(cmH2O(5)));
+  Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                        MPXV5004_PressureToVoltage(kPa(0.3f)) - drift);
+  Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                        MPXV5004_PressureToVoltage(kPa(0.3f)));
+  EXPECT_LT(sensors.GetSensorReadings().flow_ml_per_min, -1000);
+
+  SensorReadings readings =
+      RunAutoZero(seconds(5), PneumaticState::EXPIRATORY_HOLD, &sensors);
+  EXPECT_GE(sensors.GetAutoZeroStats().accepted, 4u);
+  EXPECT_EQ(sensors.GetAutoZeroStats().rejected, 0u);
+  EXPECT_NEAR(readings.flow_ml_per_min, 0, 10);
+  // We can't tell which venturi drifted, so they share the correction.
+  EXPECT_NEAR(readings.inflow_pressure_diff_cm_h2o,
+              readings.outflow_pressure_diff_cm_h2o, 1e-3f);
+  // The patient pressure sensor reads PEEP, not zero, so it's left alone.
+  EXPECT_NEAR(readings.patient_pressure_cm_h2o, 5, 0.01f);
+}
@@ -0,0 +1,95 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "hal.h"
+#include "stage_timing.h"
+#include "gtest/gtest.h"
+#include <thread>
+
+TEST(StageTimingStats, Empty) {
+  StageTimingStats stats;
+  EXPECT_EQ(stats.Count(), 0u);
+  EXPECT_EQ(stats.Min(), 0u);
+  EXPECT_EQ(stats.Max(), 0u);
+  EXPECT_EQ(stats.Mean(), 0.0f);
+  for (int i = 0; i < StageTimingStats::HISTOGRAM_BUCKETS; i++) {
+    EXPECT_EQ(stats.Histogram(i), 0u);
+  }
+}
+
+TEST(StageTimingStats, MinMaxMean) {
+  StageTimingStats stats;
+  stats.Record(100);
+  stats.Record(300);
+  stats.Record(200);
+  EXPECT_EQ(stats.Count(), 3u);
+  EXPECT_EQ(stats.Min(), 100u);
+  EXPECT_EQ(stats.Max(), 300u);
+  EXPECT_FLOAT_EQ(stats.Mean(), 200.0f);
+
+  stats.Reset();
+  EXPECT_EQ(stats.Count(), 0u);
+  EXPECT_EQ(stats.Max(), 0u);
+}
+
+TEST(StageTimingStats, Buckets) {
+  EXPECT_EQ(StageTimingStats::Bucket(0), 0);
+  EXPECT_EQ(StageTimingStats::Bucket(1), 0);
+  EXPECT_EQ(StageTimingStats::Bucket(2), 1);
+  EXPECT_EQ(StageTimingStats::Bucket(3), 1);
+  EXPECT_EQ(StageTimingStats::Bucket(4), 2);
+  EXPECT_EQ(StageTimingStats::Bucket(1023), 9);
+  EXPECT_EQ(StageTimingStats::Bucket(1024), 10);
+  EXPECT_EQ(StageTimingStats::Bucket(UINT32_MAX), 31);
+}
+
+TEST(StageTimingStats, Histogram) {
+  StageTimingStats stats;
+  stats.Record(0);
+  stats.Record(5);
+  stats.Record(6);
+  stats.Record(7);
+  stats.Record(800);
+  EXPECT_EQ(stats.Histogram(0), 1u);
+  EXPECT_EQ(stats.Histogram(2), 3u);
+  EXPECT_EQ(stats.Histogram(9), 1u);
+  EXPECT_EQ(stats.Histogram(1), 0u);
+}
+
+// The running total is 64 bits wide, so a long run of slow loops doesn't
+// overflow the mean.
+TEST(StageTimingStats, NoOverflow) {
+  StageTimingStats stats;
+  for (int i = 0; i < 10; i++) {
+    stats.Record(UINT32_MAX);
+  }
+  EXPECT_FLOAT_EQ(stats.Mean(), static_cast<float>(UINT32_MAX));
+}
+
+TEST(LoopStageTimer, RecordsIntoHal) {
+  uint32_t before = Hal.loopStageStats(LoopStage::ACTUATORS).Count();
+  {
+    LoopStageTimer timer(LoopStage::ACTUATORS);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  StageTimingStats stats = Hal.loopStageStats(LoopStage::ACTUATORS);
+  EXPECT_EQ(stats.Count(), before + 1);
+  // In test mode cycleCount() follows the real clock, so we should have
+  // measured at least the time we slept.
+  EXPECT_GE(stats.Max(), 2000 * CYCLES_PER_MICROSECOND);
+
+  // Other stages are unaffected.
+  EXPECT_EQ(Hal.loopStageStats(LoopStage::WATCHDOG).Count(), 0u);
+}
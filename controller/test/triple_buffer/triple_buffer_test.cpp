@@ -0,0 +1,154 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "triple_buffer.h"
+#include "network_protocol.pb.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <thread>
+
+TEST(TripleBuffer, NothingPublished) {
+  TripleBuffer<int> buf;
+  EXPECT_EQ(buf.Read(), 0);
+  EXPECT_EQ(buf.Read(), 0);
+}
+
+TEST(TripleBuffer, LatestWins) {
+  TripleBuffer<int> buf;
+  buf.Publish(1);
+  EXPECT_EQ(buf.Read(), 1);
+
+  // Reading again without a new publish gives the same snapshot.
+  EXPECT_EQ(buf.Read(), 1);
+
+  buf.Publish(2);
+  buf.Publish(3);
+  buf.Publish(4);
+  EXPECT_EQ(buf.Read(), 4);
+  EXPECT_EQ(buf.Read(), 4);
+}
+
+TEST(TripleBuffer, WriteBuffer) {
+  TripleBuffer<int> buf;
+  buf.WriteBuffer() = 42;
+  // Not visible until it's published.
+  EXPECT_EQ(buf.Read(), 0);
+  buf.Publish();
+  EXPECT_EQ(buf.Read(), 42);
+}
+
+// The reference returned by Read() isn't touched by the writer, no matter how
+// many times it publishes.
+TEST(TripleBuffer, SnapshotIsStable) {
+  TripleBuffer<int> buf;
+  buf.Publish(1);
+  const int &snapshot = buf.Read();
+  for (int i = 2; i < 10; i++) {
+    buf.WriteBuffer() = i;
+    buf.Publish();
+    EXPECT_EQ(snapshot, 1);
+  }
+  EXPECT_EQ(buf.Read(), 9);
+}
+
+// A struct which is only self-consistent if it was written all at once.
+struct Snapshot {
+  uint32_t seq;
+  uint32_t data[64];
+};
+
+static bool Consistent(const Snapshot &s) {
+  for (uint32_t d : s.data) {
+    if (d != s.seq) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One thread plays the part of the control loop ISR, publishing as fast as it
+// can, while the main thread reads.  Every snapshot the reader gets must be
+// consistent, and they must never go backwards.
+TEST(TripleBuffer, StressWriterThread) {
+  static constexpr uint32_t COUNT = 100000;
+  TripleBuffer<Snapshot> buf;
+
+  std::thread writer([&] {
+    for (uint32_t i = 1; i <= COUNT; i++) {
+      Snapshot &s = buf.WriteBuffer();
+      s.seq = i;
+      for (uint32_t &d : s.data) {
+        d = i;
+      }
+      buf.Publish();
+    }
+  });
+
+  uint32_t last = 0;
+  uint32_t distinct = 0;
+  while (last < COUNT) {
+    const Snapshot &s = buf.Read();
+    ASSERT_TRUE(Consistent(s)) << "torn read at seq " << s.seq;
+    ASSERT_GE(s.seq, last);
+    if (s.seq != last) {
+      distinct++;
+    }
+    last = s.seq;
+  }
+  writer.join();
+  EXPECT_GT(distinct, 0u);
+}
+
+// Both directions at once, the way main.cpp uses them: the "ISR" thread reads
+// the params and publishes the status, the "background loop" does the
+// opposite.
+TEST(TripleBuffer, StressBothDirections) {
+  static constexpr uint32_t COUNT = 50000;
+  TripleBuffer<ControllerStatus> status_buf;
+  TripleBuffer<VentParams> params_buf;
+  std::atomic<bool> done = false;
+
+  std::thread isr([&] {
+    while (!done) {
+      ControllerStatus &status = status_buf.WriteBuffer();
+      status.active_params = params_buf.Read();
+      // Derive the other fields from the params, so the reader can check that
+      // they're all from the same cycle.
+      status.fan_power = static_cast<float>(status.active_params.peep_cm_h2o);
+      status.sensor_readings.patient_pressure_cm_h2o =
+          static_cast<float>(status.active_params.peep_cm_h2o);
+      status_buf.Publish();
+    }
+  });
+
+  uint32_t last = 0;
+  for (uint32_t i = 1; i <= COUNT; i++) {
+    VentParams params = VentParams_init_zero;
+    params.peep_cm_h2o = i;
+    params.pip_cm_h2o = i;
+    params_buf.Publish(params);
+
+    const ControllerStatus &status = status_buf.Read();
+    uint32_t peep = status.active_params.peep_cm_h2o;
+    ASSERT_EQ(status.active_params.pip_cm_h2o, peep);
+    ASSERT_EQ(status.fan_power, static_cast<float>(peep));
+    ASSERT_EQ(status.sensor_readings.patient_pressure_cm_h2o,
+              static_cast<float>(peep));
+    ASSERT_GE(peep, last);
+    last = peep;
+  }
+  done = true;
+  isr.join();
+}
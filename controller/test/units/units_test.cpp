@@ -114,9 +114,20 @@ TEST(Units, Duration) {
   EXPECT_FLOAT_EQ((seconds(1) - seconds(2)).seconds(), -1);
   EXPECT_FLOAT_EQ((milliseconds(1) + milliseconds(10)).milliseconds(), 11);
   EXPECT_FLOAT_EQ((seconds(1) - milliseconds(1000)).seconds(), 0);
+  EXPECT_EQ(microseconds(1500).microseconds(), 1500);
+  EXPECT_EQ(microseconds(1500).milliseconds(), 1);
+  EXPECT_EQ(milliseconds(3).microseconds(), 3000);
+  EXPECT_EQ(seconds(0.25f).microseconds(), 250000);
+  // 0.7f is a little less than 0.7, so this needs rounding, not truncation.
+  EXPECT_EQ(seconds(0.7f).microseconds(), 700000);
+  EXPECT_EQ(seconds(-0.7f).microseconds(), -700000);
+  EXPECT_EQ(minutes(10).microseconds(), 600LL * 1000 * 1000);
+  EXPECT_FLOAT_EQ(microseconds(250).seconds(), 0.00025f);
+  EXPECT_EQ((4 * microseconds(250)).microseconds(), 1000);
 
   checkRelationalOperators(seconds);
   checkRelationalOperators(milliseconds);
+  checkRelationalOperators(microseconds);
 }
 
 TEST(Units, Time) {
@@ -129,8 +140,13 @@ TEST(Units, Time) {
   EXPECT_EQ((ms(2000) - milliseconds(1000)).millisSinceStartup(), 1000u);
   EXPECT_EQ((ms(5432) - seconds(3)).millisSinceStartup(), 2432u);
   EXPECT_FLOAT_EQ((ms(1000) - millisSinceStartup(500)).seconds(), 0.5f);
+  EXPECT_EQ(ms(42).microsSinceStartup(), 42000u);
+  EXPECT_EQ(microsSinceStartup(42999).millisSinceStartup(), 42u);
+  EXPECT_EQ((ms(10) + microseconds(1)).microsSinceStartup(), 10001u);
+  EXPECT_EQ((microsSinceStartup(10250) - ms(10)).microseconds(), 250);
   // Negative times are not supported:
   // EXPECT_EQ((ms(500) - ms(1000)).seconds(), ???);
 
   checkRelationalOperators(millisSinceStartup);
+  checkRelationalOperators(microsSinceStartup);
 }
@@ -0,0 +1,127 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "venturi.h"
+#include "benchmark.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <cmath>
+
+// The formula PressureDeltaToFlow used to evaluate on every call.
+static float ReferenceFlowCubicMPerSec(float port_mm, float choke_mm,
+                                       float delta_kpa) {
+  auto pow2 = [](float f) { return f * f; };
+  float port_area = static_cast<float>(M_PI) / 4.0f * pow2(port_mm / 1000);
+  float choke_area = static_cast<float>(M_PI) / 4.0f * pow2(choke_mm / 1000);
+  return std::copysign(std::sqrt(std::abs(delta_kpa) * 1000.0f), delta_kpa) *
+         std::sqrt(2 / 1.225f) * port_area * choke_area /
+         std::sqrt(pow2(port_area) - pow2(choke_area));
+}
+
+static float FlowCubicMPerSec(const Venturi &v, float delta_kpa) {
+  VolumetricFlow flow = v.Flow(kPa(delta_kpa));
+  return flow.cubic_m_per_sec();
+}
+
+TEST(Venturi, CoefficientIsComputedAtCompileTime) {
+  constexpr Venturi v(millimeters(14), millimeters(5.5f));
+  static_assert(v.Coefficient() > 0);
+  EXPECT_NEAR(v.Coefficient(), ReferenceFlowCubicMPerSec(14, 5.5f, 0.001f),
+              1e-6f * v.Coefficient());
+}
+
+TEST(Venturi, InvalidGeometryHasNoFlow) {
+  static_assert(Venturi(millimeters(5), millimeters(5)).Coefficient() == 0);
+  static_assert(Venturi(millimeters(5), millimeters(6)).Coefficient() == 0);
+  static_assert(Venturi(millimeters(5), millimeters(0)).Coefficient() == 0);
+  EXPECT_EQ(
+      FlowCubicMPerSec(Venturi(millimeters(5), millimeters(6)), 1.0f), 0);
+}
+
+// Across everything the MPXV5004DP can read, and beyond.
+TEST(Venturi, MatchesReferenceFormula) {
+  constexpr Venturi v(millimeters(14), millimeters(5.5f));
+  for (float dp = -5; dp <= 5; dp += 0.0005f) {
+    float expected = ReferenceFlowCubicMPerSec(14, 5.5f, dp);
+    EXPECT_NEAR(FlowCubicMPerSec(v, dp), expected,
+                std::abs(expected) * 1e-5f + 1e-9f)
+        << dp;
+  }
+}
+
+TEST(Venturi, PerSensorGeometry) {
+  constexpr Venturi narrow(millimeters(14), millimeters(4));
+  constexpr Venturi wide(millimeters(20), millimeters(8));
+  for (float dp : {-3.0f, -0.01f, 0.0f, 0.2f, 4.0f}) {
+    EXPECT_NEAR(FlowCubicMPerSec(narrow, dp),
+                ReferenceFlowCubicMPerSec(14, 4, dp), 1e-8f);
+    EXPECT_NEAR(FlowCubicMPerSec(wide, dp),
+                ReferenceFlowCubicMPerSec(20, 8, dp), 1e-8f);
+  }
+  // A narrower choke gives a bigger pressure drop for the same flow.
+  EXPECT_LT(narrow.Coefficient(), wide.Coefficient());
+}
+
+TEST(Venturi, TableSqrtErrorIsBounded) {
+  // Steps through every exponent, and many mantissas for each.
+  for (float x = 1e-30f; x < 1e30f; x *= 1.001f) {
+    float expected = std::sqrt(x);
+    EXPECT_LE(std::abs(TableSqrt(x) - expected),
+              expected * TABLE_SQRT_MAX_RELATIVE_ERROR)
+        << x;
+  }
+  // Exact on the table's grid, e.g. at powers of 4.
+  EXPECT_FLOAT_EQ(TableSqrt(1), 1);
+  EXPECT_FLOAT_EQ(TableSqrt(4), 2);
+  EXPECT_FLOAT_EQ(TableSqrt(0.25f), 0.5f);
+  EXPECT_FLOAT_EQ(TableSqrt(1024), 32);
+  EXPECT_EQ(TableSqrt(0), 0);
+  EXPECT_EQ(TableSqrt(-1), 0);
+  EXPECT_EQ(TableSqrt(1e-40f), 0);
+}
+
+TEST(Venturi, TableSqrtFlowErrorIsBounded) {
+  constexpr Venturi v(millimeters(14), millimeters(5.5f), SqrtMethod::TABLE);
+  for (float dp = -5; dp <= 5; dp += 0.0005f) {
+    float expected = ReferenceFlowCubicMPerSec(14, 5.5f, dp);
+    EXPECT_NEAR(FlowCubicMPerSec(v, dp), expected,
+                std::abs(expected) * (TABLE_SQRT_MAX_RELATIVE_ERROR + 1e-5f))
+        << dp;
+  }
+  EXPECT_EQ(FlowCubicMPerSec(v, 0), 0);
+}
+
+TEST(Venturi, Benchmark) {
+  constexpr int READINGS = 1024;
+  float deltas[READINGS];
+  for (int i = 0; i < READINGS; i++) {
+    deltas[i] = 8 * static_cast<float>((i * 37) % READINGS) / READINGS - 4;
+  }
+  int i = 0;
+  RunBenchmark("per-call geometry (old PressureDeltaToFlow)", 1000000, [&] {
+    DoNotOptimize(
+        ReferenceFlowCubicMPerSec(14, 5.5f, deltas[i++ % READINGS]));
+  });
+  Venturi exact = Sensors::INFLOW_VENTURI;
+  DoNotOptimize(exact);
+  RunBenchmark("Venturi::Flow, SqrtMethod::EXACT", 1000000, [&] {
+    DoNotOptimize(exact.Flow(kPa(deltas[i++ % READINGS])));
+  });
+  Venturi table(millimeters(14), millimeters(5.5f), SqrtMethod::TABLE);
+  DoNotOptimize(table);
+  RunBenchmark("Venturi::Flow, SqrtMethod::TABLE", 1000000, [&] {
+    DoNotOptimize(table.Flow(kPa(deltas[i++ % READINGS])));
+  });
+}
@@ -0,0 +1,295 @@
+/* Copyright 2020, RespiraWorks
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "warm_restart.h"
+#include "blower_fsm.h"
+#include "controller.h"
+#include "hal.h"
+#include "sensors.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <optional>
+#include <vector>
+
+namespace {
+
+// Mirrors what main.cpp saves.
+struct Snapshot {
+  Controller::State controller;
+  Sensors::State sensors;
+  ActuatorsState actuators_state;
+};
+
+constexpr Duration LOOP_PERIOD = milliseconds(10);
+
+// See sensors_test.cpp.
+Voltage MPXV5004_PressureToVoltage(Pressure pressure) {
+  return volts(3.3f * (0.2f * pressure.kPa() + 0.2f));
+}
+
+// A crude model of the blower and patient: the pressure follows the blower
+// power with a first-order lag.
+struct Plant {
+  static constexpr float MAX_PRESSURE_KPA = 4;
+  static constexpr float TIME_CONSTANT_SEC = 0.5f;
+
+  Pressure pressure = kPa(0);
+
+  void Step(float fan_power) {
+    float target = fan_power * MAX_PRESSURE_KPA;
+    float p = pressure.kPa();
+    pressure =
+        kPa(p + (target - p) * LOOP_PERIOD.seconds() / TIME_CONSTANT_SEC);
+    Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                          MPXV5004_PressureToVoltage(pressure));
+  }
+};
+
+// One boot of the controller.
+struct Boot {
+  Controller controller{LOOP_PERIOD};
+  Sensors sensors;
+  ActuatorsState actuators_state;
+
+  // Runs one cycle of the control loop against the plant.
+  void Cycle(Plant *plant, const VentParams &params) {
+    Hal.delay(LOOP_PERIOD);
+    plant->Step(actuators_state.fan_power);
+    actuators_state = controller.Run(Hal.now(), params,
+                                      sensors.GetSensorReadings());
+  }
+
+  Snapshot Save() {
+    Time now = Hal.now();
+    return {.controller = controller.GetState(now),
+            .sensors = sensors.GetState(now),
+            .actuators_state = actuators_state};
+  }
+
+  void Restore(const Snapshot &s) {
+    Time now = Hal.now();
+    controller.RestoreState(now, s.controller);
+    sensors.RestoreState(now, s.sensors);
+    actuators_state = s.actuators_state;
+  }
+};
+
+VentParams PressureControlParams() {
+  VentParams params = VentParams_init_zero;
+  params.mode = VentMode_PRESSURE_CONTROL;
+  params.breaths_per_min = 12;
+  params.peep_cm_h2o = 5;
+  params.pip_cm_h2o = 15;
+  params.inspiratory_expiratory_ratio = 0.66f;
+  return params;
+}
+
+// At 12 breaths/min with I:E 0.66, each breath is 5s with 2s of inspiration.
+// Reset 1s into the inspiration of the fourth breath, by which time the PID
+// has settled.
+constexpr int RESET_CYCLE = 1600;
+constexpr int TOTAL_CYCLES = 2000;
+
+struct Trace {
+  std::vector<float> fan_power;
+  std::vector<float> pressure_kpa;
+  std::vector<float> volume_ml;
+};
+
+// Runs the ventilator for TOTAL_CYCLES.  If `reset` is set, the controller
+// resets at cycle RESET_CYCLE and the blower is off until it's back up and
+// running the control loop again.  That takes one cycle, plus the time it
+// takes to calibrate the sensors if it has to cold start.
+//
+// Returns the trace, and sets `*boot_cycle` to the first cycle run by the
+// controller after the reset.
+Trace RunVentilator(bool reset, bool warm, int *boot_cycle = nullptr) {
+  Hal.test_setAnalogPin(AnalogPin::PATIENT_PRESSURE,
+                        MPXV5004_PressureToVoltage(kPa(0)));
+  Hal.test_setAnalogPin(AnalogPin::INFLOW_PRESSURE_DIFF,
+                        MPXV5004_PressureToVoltage(kPa(0)));
+  Hal.test_setAnalogPin(AnalogPin::OUTFLOW_PRESSURE_DIFF,
+                        MPXV5004_PressureToVoltage(kPa(0)));
+
+  VentParams params = PressureControlParams();
+  Plant plant;
+  Trace trace;
+  WarmRestartSnapshot<Snapshot> snapshot{};
+
+  // Advances the plant with the blower off, while the controller isn't
+  // running the loop.
+  auto blower_off = [&](Duration d) {
+    for (Duration t = milliseconds(0); t < d; t = t + LOOP_PERIOD) {
+      plant.Step(0);
+      trace.fan_power.push_back(0);
+      trace.pressure_kpa.push_back(plant.pressure.kPa());
+      trace.volume_ml.push_back(0);
+    }
+  };
+
+  auto boot = std::make_optional<Boot>();
+  boot->sensors.Calibrate();
+  while (static_cast<int>(trace.fan_power.size()) < TOTAL_CYCLES) {
+    if (reset && trace.fan_power.size() == RESET_CYCLE) {
+      boot.reset();
+      Hal.delay(LOOP_PERIOD);
+      blower_off(LOOP_PERIOD);
+
+      boot.emplace();
+      Snapshot s;
+      if (warm && snapshot.Restore(&s)) {
+        boot->Restore(s);
+      } else {
+        // Calibrate() takes time (in Hal.delay()), during which the blower
+        // stays off.
+        Time start = Hal.now();
+        boot->sensors.Calibrate();
+        blower_off(Hal.now() - start);
+      }
+      if (boot_cycle != nullptr) {
+        *boot_cycle = static_cast<int>(trace.fan_power.size());
+      }
+    }
+    boot->Cycle(&plant, params);
+    snapshot.Save(boot->Save());
+    trace.fan_power.push_back(boot->actuators_state.fan_power);
+    trace.pressure_kpa.push_back(plant.pressure.kPa());
+    trace.volume_ml.push_back(boot->sensors.GetSensorReadings().volume_ml);
+  }
+  return trace;
+}
+
+// How long it takes after a reset until the patient pressure is back within
+// 0.5cmH2O of what it would have been without the reset, and stays there for
+// at least a second.
+Duration RecoveryTime(const Trace &ref, const Trace &t) {
+  const float tolerance = cmH2O(0.5f).kPa();
+  constexpr int STAY_CYCLES = 100;
+  for (int i = RESET_CYCLE; i + STAY_CYCLES < TOTAL_CYCLES; i++) {
+    bool ok = true;
+    for (int j = i; j < i + STAY_CYCLES && ok; j++) {
+      ok = std::abs(t.pressure_kpa[j] - ref.pressure_kpa[j]) < tolerance;
+    }
+    if (ok) {
+      return (i - RESET_CYCLE) * LOOP_PERIOD;
+    }
+  }
+  return (TOTAL_CYCLES - RESET_CYCLE) * LOOP_PERIOD;
+}
+
+} // anonymous namespace
+
+// After a warm restart, the controller carries on where it left off.
+TEST(WarmRestart, ResumesWhereItLeftOff) {
+  int boot_cycle;
+  Trace ref = RunVentilator(/*reset=*/false, /*warm=*/true);
+  Trace warm = RunVentilator(/*reset=*/true, /*warm=*/true, &boot_cycle);
+  ASSERT_GT(ref.fan_power[RESET_CYCLE - 1], 0.1f);
+
+  // The restored PID picks up from its last output, rather than from 0.  (It
+  // pushes a little harder to make up for the cycle with the blower off.)
+  EXPECT_GE(warm.fan_power[boot_cycle], ref.fan_power[RESET_CYCLE - 1]);
+
+  // The volume integral carries over too.
+  EXPECT_FLOAT_EQ(warm.volume_ml[boot_cycle], ref.volume_ml[boot_cycle]);
+}
+
+TEST(WarmRestart, RecoveryTime) {
+  Trace ref = RunVentilator(/*reset=*/false, /*warm=*/true);
+  Trace warm = RunVentilator(/*reset=*/true, /*warm=*/true);
+  Trace cold = RunVentilator(/*reset=*/true, /*warm=*/false);
+
+  Duration warm_recovery = RecoveryTime(ref, warm);
+  Duration cold_recovery = RecoveryTime(ref, cold);
+  printf("Recovery after reset mid-breath: warm %dms, cold %dms\n",
+         static_cast<int>(warm_recovery.milliseconds()),
+         static_cast<int>(cold_recovery.milliseconds()));
+
+  // A warm restart only loses the cycle in which we reset.
+  EXPECT_LE(warm_recovery, LOOP_PERIOD);
+
+  // A cold start recalibrates the sensors with pressure in the system and
+  // rebuilds the PID state from scratch, so it's off for much longer (if it
+  // recovers at all before the next breath).
+  EXPECT_GT(cold_recovery, 10 * LOOP_PERIOD);
+}
+
+TEST(WarmRestartSnapshot, EmptyFails) {
+  WarmRestartSnapshot<int> snapshot{};
+  int val = 0;
+  EXPECT_FALSE(snapshot.Restore(&val));
+}
+
+TEST(WarmRestartSnapshot, SaveRestore) {
+  WarmRestartSnapshot<int> snapshot{};
+  for (int i = 1; i <= 5; i++) {
+    snapshot.Save(i);
+    int val = 0;
+    ASSERT_TRUE(snapshot.Restore(&val));
+    EXPECT_EQ(val, i);
+  }
+
+  snapshot.Invalidate();
+  int val = 0;
+  EXPECT_FALSE(snapshot.Restore(&val));
+}
+
+TEST(WarmRestartSnapshot, RejectsGarbage) {
+  // Simulate RAM after a power cycle.
+  WarmRestartSnapshot<int> snapshot;
+  memset(static_cast<void *>(&snapshot), 0xa5, sizeof(snapshot));
+  int val = 0;
+  EXPECT_FALSE(snapshot.Restore(&val));
+}
+
+TEST(WarmRestartSnapshot, FallsBackToPreviousCopy) {
+  WarmRestartSnapshot<int> snapshot{};
+  snapshot.Save(1);
+  snapshot.Save(2);
+
+  // Corrupt the most recent copy, as if we'd reset in the middle of saving
+  // it.  Starting from a zeroed snapshot, Save(2) went into the first slot,
+  // which starts at the beginning of the object.
+  reinterpret_cast<char *>(&snapshot)[0] ^= 1;
+
+  int val = 0;
+  ASSERT_TRUE(snapshot.Restore(&val));
+  EXPECT_EQ(val, 1);
+}
+
+// The clock starts over after a reset, so breath times are saved relative to
+// when the snapshot was taken.
+TEST(WarmRestart, BlowerFsmAcrossClockReset) {
+  VentParams params = PressureControlParams();
+  Time start = millisSinceStartup(100000);
+
+  BlowerFsm before;
+  before.DesiredState(start, params);
+  // 1.5s in, still inhaling.  The inhale lasts 5s * 0.66 / 1.66 = 1.99s.
+  BlowerFsm::State state = before.GetState(start + seconds(1.5f));
+
+  BlowerFsm after;
+  Time boot = millisSinceStartup(10);
+  after.RestoreState(boot, state);
+  EXPECT_EQ(after.DesiredState(boot, params).expire_valve_state,
+            ValveState::CLOSED);
+  // So the inhale ends about 0.49s from now.
+  EXPECT_EQ(
+      after.DesiredState(boot + milliseconds(480), params).expire_valve_state,
+      ValveState::CLOSED);
+  EXPECT_EQ(
+      after.DesiredState(boot + milliseconds(500), params).expire_valve_state,
+      ValveState::OPEN);
+}
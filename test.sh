@@ -26,6 +26,9 @@ cd "$(dirname "$0")"
 # Controller unit tests on native.
 pio test -e native
 
+# Again without sanitizers, for the benchmarks' timing assertions.
+pio test -e native-bench
+
 # Make sure controller builds for target platform.
 pio run -e stm32
 